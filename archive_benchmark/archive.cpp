@@ -0,0 +1,400 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#include <mango/mango.hpp>
+#include "archivecache.hpp"
+#include "entrycache.hpp"
+
+using namespace mango;
+
+// ----------------------------------------------------------------------
+// helpers
+// ----------------------------------------------------------------------
+
+namespace
+{
+
+    // files in the container, in a pseudo-random order so that the opens
+    // are not served in directory order
+    std::vector<std::string> getFilenames(const std::string& container)
+    {
+        Path path(container);
+
+        std::vector<std::string> filenames;
+        for (size_t i = 0; i < path.size(); ++i)
+        {
+            const auto& node = path[i];
+            if (!node.isDirectory())
+            {
+                filenames.push_back(node.name);
+            }
+        }
+
+        uint32 seed = 1;
+        for (size_t i = filenames.size(); i > 1; --i)
+        {
+            seed = seed * 1664525 + 1013904223;
+            std::swap(filenames[i - 1], filenames[seed % i]);
+        }
+
+        return filenames;
+    }
+
+    void print(const char* name, size_t opens, uint64 us)
+    {
+        printf("%-22s %8zu  %10.2f  %12.0f\n", name, opens,
+            opens ? double(us) / opens : 0.0,
+            us ? opens * 1000000.0 / us : 0.0);
+    }
+
+} // namespace
+
+// ----------------------------------------------------------------------
+// open latency
+// ----------------------------------------------------------------------
+
+/*
+    cold:      File("data.zip/name") for every open; the container is
+               mapped and the central directory parsed every time
+    path:      one Path kept by the caller (misc/filesystem.cpp example4)
+    cache:     ArchiveCache::open(); after the first open this is a hash
+               lookup plus the File construction
+    missing:   lookup of a name that is not in the container
+    parallel:  cache opens from every worker at once
+*/
+
+void test_open(const std::string& container, int iterations)
+{
+    const std::vector<std::string> filenames = getFilenames(container);
+    if (filenames.empty())
+    {
+        printf("%s: no files.\n", container.c_str());
+        return;
+    }
+
+    const size_t count = filenames.size();
+    const size_t cold_count = std::min<size_t>(count, 256);
+
+    printf("container: %s (%zu files)\n\n", container.c_str(), count);
+    printf("test                      opens     us/open       opens/s\n");
+
+    Timer timer;
+    uint64 checksum = 0;
+
+    // cold
+    {
+        uint64 time0 = timer.us();
+        for (size_t i = 0; i < cold_count; ++i)
+        {
+            File file(container + filenames[i]);
+            checksum += file.size();
+        }
+        print("cold (File)", cold_count, timer.us() - time0);
+    }
+
+    // caller-managed Path
+    {
+        uint64 time0 = timer.us();
+        Path path(container);
+        for (int j = 0; j < iterations; ++j)
+        {
+            for (const auto& filename : filenames)
+            {
+                File file(path, filename);
+                checksum += file.size();
+            }
+        }
+        print("path (kept by caller)", count * iterations, timer.us() - time0);
+    }
+
+    ArchiveCache cache;
+
+    // first open through the cache pays for the parse
+    {
+        uint64 time0 = timer.us();
+        auto file = cache.open(container, filenames[0]);
+        checksum += file->size();
+        print("cache (first)", 1, timer.us() - time0);
+    }
+
+    // warm
+    {
+        uint64 time0 = timer.us();
+        for (int j = 0; j < iterations; ++j)
+        {
+            for (const auto& filename : filenames)
+            {
+                auto file = cache.open(container + filename);
+                checksum += file->size();
+            }
+        }
+        print("cache (warm)", count * iterations, timer.us() - time0);
+    }
+
+    // missing
+    {
+        int failed = 0;
+        uint64 time0 = timer.us();
+        for (size_t i = 0; i < cold_count; ++i)
+        {
+            try
+            {
+                cache.open(container, filenames[i] + ".missing");
+            }
+            catch (...)
+            {
+                ++failed;
+            }
+        }
+        print("cache (missing)", cold_count, timer.us() - time0);
+        if (failed != int(cold_count))
+        {
+            printf("  ERROR: %d of %zu missing files were found.\n", int(cold_count) - failed, cold_count);
+        }
+    }
+
+    // parallel
+    {
+        const int threads = ThreadPool::getHardwareConcurrency();
+        std::atomic<uint64> sum { 0 };
+
+        ConcurrentQueue q("archive");
+
+        uint64 time0 = timer.us();
+        for (int t = 0; t < threads; ++t)
+        {
+            q.enqueue([&, t] {
+                uint64 s = 0;
+                for (int j = 0; j < iterations; ++j)
+                {
+                    for (size_t i = t; i < count; i += threads)
+                    {
+                        auto file = cache.open(container, filenames[i]);
+                        s += file->size();
+                    }
+                }
+                sum += s;
+            });
+        }
+        q.wait();
+
+        print("cache (parallel)", count * iterations, timer.us() - time0);
+        checksum += sum;
+    }
+
+    ArchiveCache::Statistics stats = cache.statistics();
+    printf("\ncache: %llu hits, %llu misses, %zu containers, %zu KB directory\n",
+        (unsigned long long)stats.hits,
+        (unsigned long long)stats.misses,
+        stats.containers, stats.bytes / 1024);
+    printf("checksum: %llu\n", (unsigned long long)checksum);
+}
+
+// ----------------------------------------------------------------------
+// eviction
+// ----------------------------------------------------------------------
+
+/*
+    Cycle through a set of containers with a budget smaller than their
+    combined directories; the least recently used ones are parsed again.
+*/
+
+void test_eviction(const std::vector<std::string>& containers)
+{
+    size_t total = 0;
+    for (const auto& container : containers)
+    {
+        ArchiveCache probe;
+        total += probe.get(container)->cost();
+    }
+
+    ArchiveCache cache(total / 2);
+    Timer timer;
+
+    uint64 time0 = timer.us();
+    for (int j = 0; j < 4; ++j)
+    {
+        for (const auto& container : containers)
+        {
+            cache.get(container);
+        }
+    }
+    uint64 time1 = timer.us();
+
+    ArchiveCache::Statistics stats = cache.statistics();
+    printf("\neviction: %zu containers, budget %zu KB of %zu KB, %.1f us / get\n",
+        containers.size(), (total / 2) / 1024, total / 1024,
+        double(time1 - time0) / (containers.size() * 4));
+    printf("eviction: %llu hits, %llu misses, %llu evictions\n",
+        (unsigned long long)stats.hits,
+        (unsigned long long)stats.misses,
+        (unsigned long long)stats.evictions);
+}
+
+// ----------------------------------------------------------------------
+// decompressed entries
+// ----------------------------------------------------------------------
+
+/*
+    Open the compressed entries of a container repeatedly. Without the
+    EntryCache every open decompresses the entry again. The second cache
+    has a budget of a quarter of the entries and, when a spill folder is
+    given, writes the evicted entries there.
+*/
+
+namespace
+{
+
+    // touch() from mapping.hpp reads one byte per page
+
+    void print(const char* name, EntryCache& cache, size_t opens, uint64 us)
+    {
+        EntryCache::Statistics stats = cache.statistics();
+        printf("%-22s %8zu  %10.2f  %8llu %8llu %8llu %8llu %8llu  %8zu\n", name, opens,
+            opens ? double(us) / opens : 0.0,
+            (unsigned long long)stats.hits,
+            (unsigned long long)stats.misses,
+            (unsigned long long)stats.evictions,
+            (unsigned long long)stats.spills,
+            (unsigned long long)stats.spill_hits,
+            stats.bytes / 1024);
+    }
+
+} // namespace
+
+void test_entries(const std::string& container, const std::string& spill_folder, int iterations)
+{
+    std::vector<std::string> filenames;
+    size_t total = 0;
+
+    Path path(container);
+    for (size_t i = 0; i < path.size(); ++i)
+    {
+        const auto& node = path[i];
+        if (!node.isDirectory() && node.isCompressed())
+        {
+            filenames.push_back(node.name);
+            total += size_t(node.size);
+        }
+    }
+
+    if (filenames.empty())
+    {
+        printf("\n%s: no compressed entries.\n", container.c_str());
+        return;
+    }
+
+    printf("\nentries: %zu compressed, %zu KB decompressed\n\n", filenames.size(), total / 1024);
+    printf("test                      opens     us/open      hit     miss    evict    spill  spillhit  cache KB\n");
+
+    Timer timer;
+    uint64 checksum = 0;
+
+    // every open decompresses
+    {
+        uint64 time0 = timer.us();
+        for (int j = 0; j < iterations; ++j)
+        {
+            for (const auto& filename : filenames)
+            {
+                File file(path, filename);
+                checksum += touch(file);
+            }
+        }
+        uint64 time1 = timer.us();
+        printf("%-22s %8zu  %10.2f\n", "File", filenames.size() * iterations,
+            double(time1 - time0) / (filenames.size() * iterations));
+    }
+
+    // everything fits
+    {
+        EntryCache cache(total * 2);
+
+        uint64 time0 = timer.us();
+        for (int j = 0; j < iterations; ++j)
+        {
+            for (const auto& filename : filenames)
+            {
+                SharedMemory memory = cache.get(container, filename);
+                checksum += touch(memory);
+            }
+        }
+        print("cache", cache, filenames.size() * iterations, timer.us() - time0);
+    }
+
+    // a quarter fits; the same from every worker at once
+    {
+        EntryCache cache(total / 4);
+        if (!spill_folder.empty())
+        {
+            cache.setSpillFolder(spill_folder);
+        }
+
+        const int threads = ThreadPool::getHardwareConcurrency();
+        const size_t count = filenames.size();
+        std::atomic<uint64> sum { 0 };
+
+        ConcurrentQueue q("entries");
+
+        uint64 time0 = timer.us();
+        for (int t = 0; t < threads; ++t)
+        {
+            q.enqueue([&, t] {
+                uint64 s = 0;
+                for (int j = 0; j < iterations; ++j)
+                {
+                    for (size_t i = t; i < count; i += threads)
+                    {
+                        SharedMemory memory = cache.get(container, filenames[i]);
+                        s += touch(memory);
+                    }
+                }
+                sum += s;
+            });
+        }
+        q.wait();
+
+        print(spill_folder.empty() ? "cache 1/4 (parallel)" : "cache 1/4 + spill", cache,
+            count * iterations, timer.us() - time0);
+        checksum += sum;
+    }
+
+    printf("checksum: %llu\n", (unsigned long long)checksum);
+}
+
+// ----------------------------------------------------------------------
+// main()
+// ----------------------------------------------------------------------
+
+int main(int argc, const char* argv[])
+{
+    std::string spill_folder;
+    std::vector<std::string> containers;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::string(argv[i]) == "--spill" && i + 1 < argc)
+        {
+            spill_folder = argv[++i];
+        }
+        else
+        {
+            containers.push_back(std::string(argv[i]) + "/");
+        }
+    }
+
+    if (containers.empty())
+    {
+        printf("Too few arguments. usage: %s [--spill <folder>] <container.zip> [container.zip ...]\n", argv[0]);
+        return 1;
+    }
+
+    test_open(containers[0], 10);
+    test_entries(containers[0], spill_folder, 4);
+
+    if (containers.size() > 1)
+    {
+        test_eviction(containers);
+    }
+}
@@ -0,0 +1,407 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <mango/mango.hpp>
+#include <chrono>
+#include <future>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <sys/stat.h>
+#include "../mmap_benchmark/mapping.hpp"
+
+/*
+    Process-wide cache of parsed containers.
+
+    misc/filesystem.cpp example4 explains that nothing is cached behind the
+    scenes: every File("data.zip/...") maps and parses the container again
+    unless the caller keeps a Path around. An asset server opening thousands
+    of entries across hundreds of containers can't keep track of all of the
+    Path objects by hand, so this is the Path keeping done for it:
+
+    - the key is the container path ("data.zip/", "data.zip/textures/")
+      plus the modification time of the file on disk. A folder inside a
+      container is opened from the cached parent container, so the file
+      is mapped and its directory parsed once; a container which
+      changed is parsed again. The time is remembered per container and
+      the file is stat()'ed again only when the stamp is older than the
+      revalidation interval, so a warm hit does not touch the filesystem
+    - the directory is indexed with a hash table, so a lookup does not scan
+      the entries linearly and a missing file fails without touching the
+      container
+    - the cache is bounded by an estimate of the memory the parsed
+      directories use and evicts the least recently used container
+    - it is safe to open files from pool workers concurrently; two threads
+      missing the same container at the same time parse it once
+
+    Evicting a container only drops the cache's reference. A File returned
+    by open() holds a reference to its container so the mapping stays
+    alive for as long as the File does. A stored entry is a view into the
+    container mapping; open() marks its range for sequential readahead as
+    the kernel can't tell the entry apart from the rest of the container.
+*/
+
+namespace mango
+{
+
+    class ArchiveCache
+    {
+    public:
+        class Container
+        {
+        protected:
+            std::shared_ptr<const Container> m_parent;
+            std::unique_ptr<Path> m_path;
+            std::unordered_map<std::string, size_t> m_index;
+            size_t m_cost;
+
+            void build()
+            {
+                const Path& path = *m_path;
+                m_index.reserve(path.size());
+
+                for (size_t i = 0; i < path.size(); ++i)
+                {
+                    const FileInfo& info = path[i];
+                    m_index[info.name] = i;
+                    m_cost += sizeof(FileInfo) + info.name.size() * 2 + 32;
+                }
+            }
+
+        public:
+            Container(const std::string& pathname)
+                : m_path(new Path(pathname))
+                , m_cost(sizeof(Container))
+            {
+                build();
+            }
+
+            // a folder of the parent container: "textures/" in "data.zip/".
+            // The parent is referenced so its mapping outlives the folder.
+            Container(std::shared_ptr<const Container> parent, const std::string& name)
+                : m_parent(parent)
+                , m_path(new Path(parent->path(), name))
+                , m_cost(sizeof(Container))
+            {
+                build();
+            }
+
+            const Path& path() const
+            {
+                return *m_path;
+            }
+
+            const FileInfo* find(const std::string& filename) const
+            {
+                auto it = m_index.find(filename);
+                return it != m_index.end() ? &(*m_path)[it->second] : nullptr;
+            }
+
+            size_t cost() const
+            {
+                return m_cost;
+            }
+        };
+
+        using ContainerPtr = std::shared_ptr<const Container>;
+
+        struct Statistics
+        {
+            uint64 hits = 0;
+            uint64 misses = 0;
+            uint64 evictions = 0;
+            uint64 invalidations = 0;
+            size_t bytes = 0;
+            size_t containers = 0;
+        };
+
+    protected:
+        struct Node
+        {
+            std::string key;
+            int64 mtime;
+            uint64 serial; // tells a node apart from a later one at the same key
+            std::shared_future<ContainerPtr> future;
+            size_t cost = 0;
+            std::list<Node*>::iterator lru;
+        };
+
+        std::mutex m_mutex;
+        std::unordered_map<std::string, std::unique_ptr<Node>> m_nodes;
+        std::list<Node*> m_lru; // front is the most recently used
+        size_t m_budget;
+        uint64 m_serial = 0;
+        Statistics m_stats;
+
+        // modification times; kept apart from the nodes so that they
+        // survive eviction and serve the EntryCache keys as well
+        struct Stamp
+        {
+            int64 mtime;
+            uint64 checked;
+        };
+
+        std::unordered_map<std::string, Stamp> m_stamps;
+        uint64 m_interval; // ms
+
+        static uint64 getTicks()
+        {
+            using namespace std::chrono;
+            return uint64(duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count());
+        }
+
+        // the first component of the path that exists in the native filesystem
+        static int64 statModifiedTime(const std::string& pathname)
+        {
+            size_t n = 0;
+            while ((n = pathname.find('/', n + 1)) != std::string::npos)
+            {
+                struct stat s;
+                if (::stat(pathname.substr(0, n).c_str(), &s) == 0 && S_ISREG(s.st_mode))
+                {
+                    return int64(s.st_mtime) * 1000000000 + s.st_mtim.tv_nsec;
+                }
+            }
+            return 0;
+        }
+
+        // "data.zip/textures/" -> "data.zip/" when the pathname is a folder
+        // inside a container file, empty when it is a container or a folder
+        // in the native filesystem
+        std::string getParent(const std::string& pathname)
+        {
+            if (pathname.size() < 2)
+                return std::string();
+
+            size_t n = pathname.find_last_of('/', pathname.size() - 2);
+            if (n == std::string::npos)
+                return std::string();
+
+            // a parent that has a file on disk at or above it is a container
+            std::string parent = pathname.substr(0, n + 1);
+            return getModifiedTime(parent) ? parent : std::string();
+        }
+
+        // called with the mutex held; the most recently used container is
+        // always kept and containers still being parsed are skipped
+        void evict()
+        {
+            auto it = m_lru.end();
+            while (m_stats.bytes > m_budget && --it != m_lru.begin())
+            {
+                Node* node = *it;
+                if (node->future.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+                {
+                    continue;
+                }
+
+                m_stats.bytes -= node->cost;
+                ++m_stats.evictions;
+
+                it = m_lru.erase(it);
+                m_nodes.erase(node->key);
+            }
+            m_stats.containers = m_nodes.size();
+        }
+
+    public:
+        ArchiveCache(size_t budget = 64 * 1024 * 1024, uint64 interval = 1000)
+            : m_budget(budget)
+            , m_interval(interval)
+        {
+        }
+
+        static ArchiveCache& instance()
+        {
+            static ArchiveCache cache;
+            return cache;
+        }
+
+        /*
+            Modification time of the file backing the container. A change on
+            disk is noticed within the revalidation interval (milliseconds);
+            an interval of 0 looks at the file every time.
+        */
+        int64 getModifiedTime(const std::string& pathname)
+        {
+            const uint64 now = getTicks();
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                auto it = m_stamps.find(pathname);
+                if (it != m_stamps.end() && now - it->second.checked < m_interval)
+                {
+                    return it->second.mtime;
+                }
+            }
+
+            const int64 mtime = statModifiedTime(pathname);
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_stamps.size() >= 4096)
+            {
+                // a few stat() calls to rebuild is cheaper than tracking the age
+                m_stamps.clear();
+            }
+            m_stamps[pathname] = Stamp { mtime, now };
+            return mtime;
+        }
+
+        // pathname of the container, with a trailing slash: "data.zip/"
+        ContainerPtr get(const std::string& pathname)
+        {
+            const int64 mtime = getModifiedTime(pathname);
+
+            std::shared_future<ContainerPtr> future;
+            std::promise<ContainerPtr> promise;
+            uint64 created = 0;
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+
+                auto it = m_nodes.find(pathname);
+                if (it != m_nodes.end() && it->second->mtime != mtime)
+                {
+                    // the file on disk has changed
+                    Node* node = it->second.get();
+                    m_lru.erase(node->lru);
+                    m_stats.bytes -= node->cost;
+                    ++m_stats.invalidations;
+                    m_nodes.erase(it);
+                    m_stats.containers = m_nodes.size();
+                    it = m_nodes.end();
+                }
+
+                if (it != m_nodes.end())
+                {
+                    Node* node = it->second.get();
+                    m_lru.splice(m_lru.begin(), m_lru, node->lru);
+                    future = node->future;
+                    ++m_stats.hits;
+                }
+                else
+                {
+                    std::unique_ptr<Node> node(new Node());
+                    node->key = pathname;
+                    node->mtime = mtime;
+                    node->serial = ++m_serial;
+                    node->future = promise.get_future().share();
+                    m_lru.push_front(node.get());
+                    node->lru = m_lru.begin();
+
+                    created = node->serial;
+                    future = node->future;
+                    m_nodes[pathname] = std::move(node);
+                    m_stats.containers = m_nodes.size();
+                    ++m_stats.misses;
+                }
+            }
+
+            if (created)
+            {
+                // parse outside of the lock; concurrent requests for the same
+                // container wait on the future instead of parsing it again
+                ContainerPtr container;
+                try
+                {
+                    const std::string parent = getParent(pathname);
+                    if (parent.empty())
+                    {
+                        container = std::make_shared<Container>(pathname);
+                    }
+                    else
+                    {
+                        container = std::make_shared<Container>(get(parent), pathname.substr(parent.size()));
+                    }
+                    promise.set_value(container);
+                }
+                catch (...)
+                {
+                    promise.set_exception(std::current_exception());
+
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    auto it = m_nodes.find(pathname);
+                    if (it != m_nodes.end() && it->second->serial == created)
+                    {
+                        m_lru.erase(it->second->lru);
+                        m_nodes.erase(it);
+                        m_stats.containers = m_nodes.size();
+                    }
+                    throw;
+                }
+
+                std::lock_guard<std::mutex> lock(m_mutex);
+                auto it = m_nodes.find(pathname);
+                if (it != m_nodes.end() && it->second->serial == created)
+                {
+                    it->second->cost = container->cost();
+                    m_stats.bytes += it->second->cost;
+                    evict();
+                }
+            }
+
+            return future.get();
+        }
+
+        /*
+            Open "container/filename". The filename is looked up from the
+            index first so a missing file does not cost a File construction.
+        */
+        std::shared_ptr<File> open(const std::string& container, const std::string& filename)
+        {
+            struct Holder
+            {
+                ContainerPtr container;
+                File file;
+
+                Holder(ContainerPtr c, const std::string& filename)
+                    : container(c)
+                    , file(c->path(), filename)
+                {
+                }
+            };
+
+            ContainerPtr c = get(container);
+            if (!c->find(filename))
+            {
+                MANGO_EXCEPTION("ArchiveCache: \"" + container + filename + "\" not found.");
+            }
+
+            auto holder = std::make_shared<Holder>(c, filename);
+            advise(holder->file, Access::SEQUENTIAL);
+            return std::shared_ptr<File>(holder, &holder->file);
+        }
+
+        // split "data.zip/foo/test.jpg" into "data.zip/foo/" and "test.jpg"
+        std::shared_ptr<File> open(const std::string& filename)
+        {
+            size_t n = filename.find_last_of('/');
+            if (n == std::string::npos)
+            {
+                auto file = std::make_shared<File>(filename);
+                advise(*file, Access::SEQUENTIAL);
+                return file;
+            }
+            return open(filename.substr(0, n + 1), filename.substr(n + 1));
+        }
+
+        void clear()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_nodes.clear();
+            m_lru.clear();
+            m_stamps.clear();
+            m_stats.bytes = 0;
+            m_stats.containers = 0;
+        }
+
+        Statistics statistics()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_stats;
+        }
+    };
+
+} // namespace mango
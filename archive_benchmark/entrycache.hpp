@@ -0,0 +1,427 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <mango/mango.hpp>
+#include "archivecache.hpp"
+#include <cstdio>
+
+/*
+    Cache of decompressed container entries.
+
+    A stored (uncompressed) entry is a zero-copy view into the container
+    mapping, but a compressed one is decompressed into a VirtualMemory every
+    time it is opened; misc/filesystem.cpp example6 describes how this adds
+    up with containers inside containers. The ArchiveCache keeps the
+    containers, including decompressed inner containers, alive; this cache
+    does the same for the entries:
+
+    - the key is container + entry name + container modification time
+    - the data is held in SharedMemory; concurrent readers share one copy
+      and an evicted entry stays valid for as long as a reader holds it
+    - a global byte budget with LRU eviction over the bytes the cache
+      itself holds a reference to
+    - optional spill folder on a local disk: evicted entries are written
+      there and a later miss reads the file instead of decompressing
+      again. Spilling is best effort; an entry which can't be written is
+      dropped. The file name is a hash of the key, so the file starts with
+      the full key which is compared on read: a file which belongs to
+      another key (or is truncated, or gone) is a miss. The folder has a
+      byte budget of its own; the least recently used files are removed
+      to stay within it.
+    - concurrent misses for the same entry decompress it once
+*/
+
+namespace mango
+{
+
+    class EntryCache
+    {
+    public:
+        struct Statistics
+        {
+            uint64 hits = 0;
+            uint64 misses = 0;
+            uint64 evictions = 0;
+            uint64 spills = 0;         // entries written to the spill folder
+            uint64 spill_hits = 0;     // misses served from the spill folder
+            uint64 decompressed = 0;   // bytes decompressed from containers
+            size_t bytes = 0;          // bytes held by the cache
+            size_t entries = 0;
+            uint64 spill_bytes = 0;    // bytes in the spill folder
+        };
+
+    protected:
+        struct Node
+        {
+            std::string key;
+            std::shared_future<SharedMemory> future;
+            size_t size = 0;
+            std::list<Node*>::iterator lru;
+        };
+
+        struct SpillFile
+        {
+            std::string filename;
+            uint64 size;
+            std::list<std::string>::iterator lru;
+        };
+
+        ArchiveCache& m_archive;
+        std::mutex m_mutex;
+        std::unordered_map<std::string, std::unique_ptr<Node>> m_nodes;
+        std::unordered_map<std::string, SpillFile> m_spilled; // key -> spill file
+        std::list<Node*> m_lru; // front is the most recently used
+        std::list<std::string> m_spill_lru; // keys, front is the most recently used
+        size_t m_budget;
+        std::string m_spill_folder;
+        size_t m_spill_threshold;
+        uint64 m_spill_budget;
+        Statistics m_stats;
+
+        std::string getKey(const std::string& container, const std::string& filename)
+        {
+            const int64 mtime = m_archive.getModifiedTime(container);
+            return container + filename + ":" + std::to_string(mtime);
+        }
+
+        std::string getSpillFilename(const std::string& key) const
+        {
+            char name[32];
+            std::snprintf(name, sizeof(name), "%016llx.entry",
+                (unsigned long long)std::hash<std::string>()(key));
+            return m_spill_folder + name;
+        }
+
+        // called with the mutex held; the evicted nodes are returned so that
+        // the spilling is done outside of the lock
+        std::vector<std::pair<std::string, SharedMemory>> evict()
+        {
+            std::vector<std::pair<std::string, SharedMemory>> evicted;
+
+            // walk from the least recently used end; the most recent entry is
+            // always kept and entries still being loaded are skipped
+            auto it = m_lru.end();
+            while (m_stats.bytes > m_budget && --it != m_lru.begin())
+            {
+                Node* node = *it;
+                if (node->future.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+                {
+                    continue;
+                }
+
+                m_stats.bytes -= node->size;
+                ++m_stats.evictions;
+
+                if (!m_spill_folder.empty() && node->size >= m_spill_threshold &&
+                    node->size + spill_header_size + node->key.size() <= m_spill_budget &&
+                    m_spilled.find(node->key) == m_spilled.end())
+                {
+                    evicted.emplace_back(node->key, node->future.get());
+                }
+
+                it = m_lru.erase(it);
+                m_nodes.erase(node->key);
+            }
+
+            m_stats.entries = m_nodes.size();
+            return evicted;
+        }
+
+        // spill file: key size (32 bits), data size (64 bits), key, data
+        static constexpr size_t spill_header_size = 12;
+
+        // called with the mutex held; the file is removed by the caller
+        // outside of the lock
+        std::string forget(std::unordered_map<std::string, SpillFile>::iterator it)
+        {
+            std::string filename = it->second.filename;
+            m_stats.spill_bytes -= it->second.size;
+            m_spill_lru.erase(it->second.lru);
+            m_spilled.erase(it);
+            return filename;
+        }
+
+        void spill(const std::vector<std::pair<std::string, SharedMemory>>& evicted)
+        {
+            for (const auto& entry : evicted)
+            {
+                const std::string& key = entry.first;
+                const std::string filename = getSpillFilename(key);
+                Memory memory = entry.second;
+
+                uint8 header[spill_header_size];
+                ustore32le(header + 0, uint32(key.size()));
+                ustore64le(header + 4, uint64(memory.size));
+
+                // best effort: a full or read-only disk only costs the spill
+                try
+                {
+                    FileStream file(filename, FileStream::WRITE);
+                    file.write(header, spill_header_size);
+                    file.write(key.data(), key.size());
+                    file.write(memory.address, memory.size);
+                }
+                catch (...)
+                {
+                    std::remove(filename.c_str());
+                    continue;
+                }
+
+                std::vector<std::string> removed;
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+
+                    auto it = m_spilled.find(key);
+                    if (it != m_spilled.end())
+                    {
+                        forget(it);
+                    }
+
+                    const uint64 size = spill_header_size + key.size() + memory.size;
+                    m_spill_lru.push_front(key);
+                    m_spilled[key] = SpillFile { filename, size, m_spill_lru.begin() };
+                    m_stats.spill_bytes += size;
+                    ++m_stats.spills;
+
+                    // the file just written is the most recent; it stays
+                    while (m_stats.spill_bytes > m_spill_budget && m_spill_lru.size() > 1)
+                    {
+                        const std::string oldest = forget(m_spilled.find(m_spill_lru.back()));
+
+                        // two keys can hash to the same file; keep the one just written
+                        if (oldest != filename)
+                        {
+                            removed.push_back(oldest);
+                        }
+                    }
+                }
+
+                for (const std::string& oldest : removed)
+                {
+                    std::remove(oldest.c_str());
+                }
+            }
+        }
+
+        // read the data of a spill file straight into shared; false when the
+        // file is gone, truncated or was overwritten by another key
+        static bool readSpill(const std::string& key, const std::string& filename, SharedMemory& shared)
+        {
+            try
+            {
+                FileStream file(filename, FileStream::READ);
+                const uint64 total = file.size();
+                if (total < spill_header_size)
+                    return false;
+
+                uint8 header[spill_header_size];
+                file.read(header, spill_header_size);
+                const uint32 key_size = uload32le(header + 0);
+                const uint64 size = uload64le(header + 4);
+                if (key_size != key.size() || total - spill_header_size - key_size != size)
+                    return false;
+
+                std::string stored(key_size, '\0');
+                file.read(&stored[0], key_size);
+                if (stored != key)
+                    return false;
+
+                shared = SharedMemory(size_t(size));
+                file.read(Memory(shared).address, size_t(size));
+                return true;
+            }
+            catch (...)
+            {
+                return false;
+            }
+        }
+
+        SharedMemory load(const std::string& key, const std::string& container, const std::string& filename)
+        {
+            std::string spilled;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                auto it = m_spilled.find(key);
+                if (it != m_spilled.end())
+                {
+                    spilled = it->second.filename;
+                    m_spill_lru.splice(m_spill_lru.begin(), m_spill_lru, it->second.lru);
+                }
+            }
+
+            if (!spilled.empty())
+            {
+                SharedMemory shared;
+                const bool hit = readSpill(key, spilled, shared);
+
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (hit)
+                {
+                    ++m_stats.spill_hits;
+                    return shared;
+                }
+
+                // the file is not ours any more; the entry comes from the container
+                auto it = m_spilled.find(key);
+                if (it != m_spilled.end() && it->second.filename == spilled)
+                {
+                    forget(it);
+                }
+            }
+
+            // the File of a compressed entry owns the decompressed memory;
+            // copy it out once so that the cache does not depend on the File
+            std::shared_ptr<File> file = m_archive.open(container, filename);
+            Memory memory = *file;
+            SharedMemory shared(memory.size);
+            std::memcpy(Memory(shared).address, memory.address, memory.size);
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stats.decompressed += memory.size;
+
+            return shared;
+        }
+
+    public:
+        EntryCache(size_t budget = 256 * 1024 * 1024, ArchiveCache& archive = ArchiveCache::instance())
+            : m_archive(archive)
+            , m_budget(budget)
+            , m_spill_threshold(0)
+            , m_spill_budget(0)
+        {
+        }
+
+        ~EntryCache()
+        {
+            for (auto& spilled : m_spilled)
+            {
+                std::remove(spilled.second.filename.c_str());
+            }
+        }
+
+        /*
+            Enable spilling of evicted entries into a folder on a local disk.
+            Entries smaller than "threshold" bytes are not worth the write and
+            are simply dropped. The folder holds at most "budget" bytes; the
+            least recently used files are removed first. The files are
+            removed when the cache is destroyed.
+        */
+        void setSpillFolder(const std::string& folder, size_t threshold = 64 * 1024,
+                            uint64 budget = 1024ull * 1024 * 1024)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_spill_folder = folder;
+            if (!m_spill_folder.empty() && m_spill_folder.back() != '/')
+            {
+                m_spill_folder += '/';
+            }
+            m_spill_threshold = threshold;
+            m_spill_budget = budget;
+        }
+
+        // "container" with a trailing slash: "data.zip/", "data.zip/inner.zip/"
+        SharedMemory get(const std::string& container, const std::string& filename)
+        {
+            const std::string key = getKey(container, filename);
+
+            std::shared_future<SharedMemory> future;
+            std::promise<SharedMemory> promise;
+            Node* created = nullptr;
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+
+                auto it = m_nodes.find(key);
+                if (it != m_nodes.end())
+                {
+                    Node* node = it->second.get();
+                    m_lru.splice(m_lru.begin(), m_lru, node->lru);
+                    future = node->future;
+                    ++m_stats.hits;
+                }
+                else
+                {
+                    std::unique_ptr<Node> node(new Node());
+                    node->key = key;
+                    node->future = promise.get_future().share();
+                    m_lru.push_front(node.get());
+                    node->lru = m_lru.begin();
+
+                    created = node.get();
+                    future = node->future;
+                    m_nodes[key] = std::move(node);
+                    ++m_stats.misses;
+                }
+            }
+
+            if (created)
+            {
+                SharedMemory memory;
+                try
+                {
+                    memory = load(key, container, filename);
+                    promise.set_value(memory);
+                }
+                catch (...)
+                {
+                    promise.set_exception(std::current_exception());
+
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    auto it = m_nodes.find(key);
+                    if (it != m_nodes.end() && it->second.get() == created)
+                    {
+                        m_lru.erase(created->lru);
+                        m_nodes.erase(it);
+                    }
+                    throw;
+                }
+
+                std::vector<std::pair<std::string, SharedMemory>> evicted;
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    auto it = m_nodes.find(key);
+                    if (it != m_nodes.end() && it->second.get() == created)
+                    {
+                        created->size = Memory(memory).size;
+                        m_stats.bytes += created->size;
+                        evicted = evict();
+                    }
+                }
+
+                spill(evicted);
+            }
+
+            return future.get();
+        }
+
+        // split "data.zip/foo/test.jpg" into "data.zip/foo/" and "test.jpg"
+        SharedMemory get(const std::string& filename)
+        {
+            size_t n = filename.find_last_of('/');
+            if (n == std::string::npos)
+            {
+                MANGO_EXCEPTION("EntryCache: \"" + filename + "\" is not in a container.");
+            }
+            return get(filename.substr(0, n + 1), filename.substr(n + 1));
+        }
+
+        void clear()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_nodes.clear();
+            m_lru.clear();
+            m_stats.bytes = 0;
+            m_stats.entries = 0;
+        }
+
+        Statistics statistics()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_stats;
+        }
+    };
+
+} // namespace mango
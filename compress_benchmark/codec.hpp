@@ -0,0 +1,275 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <mango/mango.hpp>
+
+/*
+    Pluggable codec registry.
+
+    Every codec follows the same contract as lz4 in misc/compress.cpp:
+
+        size_t bound(size_t size);
+        size_t compress(Memory dest, Memory source, int level);
+        void decompress(Memory dest, Memory source);
+
+    The caller does all memory management; dest of compress() must be at
+    least bound() bytes and dest of decompress() exactly the original size.
+
+    The backends are enabled with build flags (see makefile):
+
+        MANGO_CODEC_ZSTD        zstd (libzstd)
+        MANGO_CODEC_DEFLATE     deflate (zlib)
+        MANGO_CODEC_LIBDEFLATE  deflate (libdeflate); SIMD accelerated
+                                matchfinding and checksums, same bitstream
+*/
+
+#ifdef MANGO_CODEC_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef MANGO_CODEC_DEFLATE
+#include <zlib.h>
+#endif
+
+#ifdef MANGO_CODEC_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+namespace codec
+{
+
+    using namespace mango;
+
+    struct Codec
+    {
+        const char* name;
+        int min_level;
+        int max_level;
+        size_t (*bound)(size_t size);
+        size_t (*compress)(Memory dest, Memory source, int level);
+        void (*decompress)(Memory dest, Memory source);
+    };
+
+    // -----------------------------------------------------------------
+    // lz4
+    // -----------------------------------------------------------------
+
+    namespace lz4_backend
+    {
+
+        inline size_t bound(size_t size)
+        {
+            return lz4::bound(size);
+        }
+
+        inline size_t compress(Memory dest, Memory source, int level)
+        {
+            return lz4::compress(dest, source, level);
+        }
+
+        inline void decompress(Memory dest, Memory source)
+        {
+            lz4::decompress(dest, source);
+        }
+
+    } // namespace lz4_backend
+
+    // -----------------------------------------------------------------
+    // zstd
+    // -----------------------------------------------------------------
+
+#ifdef MANGO_CODEC_ZSTD
+
+    namespace zstd_backend
+    {
+
+        inline size_t bound(size_t size)
+        {
+            return ZSTD_compressBound(size);
+        }
+
+        inline size_t compress(Memory dest, Memory source, int level)
+        {
+            size_t size = ZSTD_compress(dest.address, dest.size, source.address, source.size, level);
+            if (ZSTD_isError(size))
+            {
+                MANGO_EXCEPTION(std::string("zstd: ") + ZSTD_getErrorName(size));
+            }
+            return size;
+        }
+
+        inline void decompress(Memory dest, Memory source)
+        {
+            size_t size = ZSTD_decompress(dest.address, dest.size, source.address, source.size);
+            if (ZSTD_isError(size) || size != dest.size)
+            {
+                MANGO_EXCEPTION("zstd: decompression failed.");
+            }
+        }
+
+    } // namespace zstd_backend
+
+#endif
+
+    // -----------------------------------------------------------------
+    // deflate (zlib)
+    // -----------------------------------------------------------------
+
+#ifdef MANGO_CODEC_DEFLATE
+
+    namespace deflate_backend
+    {
+
+        inline size_t bound(size_t size)
+        {
+            return compressBound(uLong(size));
+        }
+
+        inline size_t compress(Memory dest, Memory source, int level)
+        {
+            uLongf size = uLongf(dest.size);
+            if (compress2(dest.address, &size, source.address, uLong(source.size), level) != Z_OK)
+            {
+                MANGO_EXCEPTION("deflate: compression failed.");
+            }
+            return size;
+        }
+
+        inline void decompress(Memory dest, Memory source)
+        {
+            uLongf size = uLongf(dest.size);
+            if (uncompress(dest.address, &size, source.address, uLong(source.size)) != Z_OK || size != dest.size)
+            {
+                MANGO_EXCEPTION("deflate: decompression failed.");
+            }
+        }
+
+    } // namespace deflate_backend
+
+#endif
+
+    // -----------------------------------------------------------------
+    // deflate (libdeflate)
+    // -----------------------------------------------------------------
+
+#ifdef MANGO_CODEC_LIBDEFLATE
+
+    namespace libdeflate_backend
+    {
+
+        // The (de)compressors are not thread-safe and expensive to create;
+        // keep one per thread and level.
+        inline libdeflate_compressor* getCompressor(int level)
+        {
+            struct Cache
+            {
+                libdeflate_compressor* compressor[13] = { };
+
+                ~Cache()
+                {
+                    for (auto c : compressor)
+                    {
+                        if (c)
+                            libdeflate_free_compressor(c);
+                    }
+                }
+            };
+
+            thread_local Cache cache;
+            auto& c = cache.compressor[level];
+            if (!c)
+            {
+                c = libdeflate_alloc_compressor(level);
+            }
+            return c;
+        }
+
+        inline libdeflate_decompressor* getDecompressor()
+        {
+            struct Cache
+            {
+                libdeflate_decompressor* decompressor = libdeflate_alloc_decompressor();
+
+                ~Cache()
+                {
+                    libdeflate_free_decompressor(decompressor);
+                }
+            };
+
+            thread_local Cache cache;
+            return cache.decompressor;
+        }
+
+        inline size_t bound(size_t size)
+        {
+            return libdeflate_deflate_compress_bound(nullptr, size);
+        }
+
+        inline size_t compress(Memory dest, Memory source, int level)
+        {
+            size_t size = libdeflate_deflate_compress(getCompressor(level),
+                source.address, source.size, dest.address, dest.size);
+            if (!size)
+            {
+                MANGO_EXCEPTION("libdeflate: compression failed.");
+            }
+            return size;
+        }
+
+        inline void decompress(Memory dest, Memory source)
+        {
+            size_t size = 0;
+            libdeflate_result result = libdeflate_deflate_decompress(getDecompressor(),
+                source.address, source.size, dest.address, dest.size, &size);
+            if (result != LIBDEFLATE_SUCCESS || size != dest.size)
+            {
+                MANGO_EXCEPTION("libdeflate: decompression failed.");
+            }
+        }
+
+    } // namespace libdeflate_backend
+
+#endif
+
+    // -----------------------------------------------------------------
+    // registry
+    // -----------------------------------------------------------------
+
+    inline std::vector<Codec>& getCodecs()
+    {
+        static std::vector<Codec> codecs =
+        {
+            { "lz4", 1, 10, lz4_backend::bound, lz4_backend::compress, lz4_backend::decompress },
+#ifdef MANGO_CODEC_ZSTD
+            { "zstd", 1, 22, zstd_backend::bound, zstd_backend::compress, zstd_backend::decompress },
+#endif
+#ifdef MANGO_CODEC_DEFLATE
+            { "deflate", 1, 9, deflate_backend::bound, deflate_backend::compress, deflate_backend::decompress },
+#endif
+#ifdef MANGO_CODEC_LIBDEFLATE
+            { "libdeflate", 1, 12, libdeflate_backend::bound, libdeflate_backend::compress, libdeflate_backend::decompress },
+#endif
+        };
+        return codecs;
+    }
+
+    // register a codec implemented elsewhere
+    inline void registerCodec(const Codec& codec)
+    {
+        getCodecs().push_back(codec);
+    }
+
+    inline const Codec* getCodec(const std::string& name)
+    {
+        for (const Codec& codec : getCodecs())
+        {
+            if (name == codec.name)
+                return &codec;
+        }
+        return nullptr;
+    }
+
+} // namespace codec
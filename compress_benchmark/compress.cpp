@@ -0,0 +1,322 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#include <mango/mango.hpp>
+#include "lz4frame.hpp"
+#include "lz4stream.hpp"
+#include "codec.hpp"
+#include <map>
+
+using namespace mango;
+
+// ----------------------------------------------------------------------
+// helpers
+// ----------------------------------------------------------------------
+
+namespace
+{
+
+    double gbps(size_t bytes, uint64 us)
+    {
+        return us ? double(bytes) / (us * 1000.0) : 0.0;
+    }
+
+    bool equal(Memory a, Memory b)
+    {
+        return a.size == b.size && !std::memcmp(a.address, b.address, a.size);
+    }
+
+} // namespace
+
+// ----------------------------------------------------------------------
+// block-parallel lz4
+// ----------------------------------------------------------------------
+
+/*
+    Compare plain lz4::compress on the whole buffer with the block-parallel
+    container at different levels and thread counts. The speed is reported
+    in GB/s of uncompressed data for both directions.
+*/
+
+void test_lz4frame(Memory source)
+{
+    const size_t block_size = 1024 * 1024;
+    const int levels[] = { 1, 4, 7, 10 };
+
+    const int hardware = ThreadPool::getHardwareConcurrency();
+    std::vector<int> threads;
+    for (int t = 1; t < hardware; t *= 2)
+        threads.push_back(t);
+    threads.push_back(hardware);
+
+    Buffer decompressed(source.size);
+    Timer timer;
+
+    printf("input: %zu bytes, block size: %zu KB\n\n", source.size, block_size / 1024);
+    printf("level  threads   ratio   compress GB/s   decompress GB/s\n");
+
+    for (int level : levels)
+    {
+        // baseline: single buffer, single core
+        Buffer buffer(lz4::bound(source.size));
+
+        uint64 time0 = timer.us();
+        size_t compressed = lz4::compress(buffer, source, level);
+        uint64 time1 = timer.us();
+        lz4::decompress(decompressed, Memory(buffer.data(), compressed));
+        uint64 time2 = timer.us();
+
+        printf("%5d  %7s  %6.3f  %14.2f  %16.2f\n", level, "lz4",
+            double(source.size) / compressed,
+            gbps(source.size, time1 - time0),
+            gbps(source.size, time2 - time1));
+
+        Buffer frame(lz4frame::bound(source.size, block_size));
+
+        for (int t : threads)
+        {
+            uint64 time0 = timer.us();
+            size_t compressed = lz4frame::compress(frame, source, level, block_size, t);
+            uint64 time1 = timer.us();
+
+            lz4frame::Reader reader(Memory(frame.data(), compressed));
+            reader.decompress(decompressed, t);
+            uint64 time2 = timer.us();
+
+            printf("%5d  %7d  %6.3f  %14.2f  %16.2f %s\n", level, t,
+                double(source.size) / compressed,
+                gbps(source.size, time1 - time0),
+                gbps(source.size, time2 - time1),
+                equal(decompressed, source) ? "" : "(MISMATCH)");
+        }
+    }
+}
+
+/*
+    Random access: decompress 4 KB reads at random offsets. Only the block
+    containing the range is decompressed; the plain lz4 buffer would have to
+    be decompressed as a whole for every read.
+*/
+
+void test_random_access(Memory source)
+{
+    const size_t block_size = 256 * 1024;
+    const size_t read_size = 4096;
+    const int reads = 1000;
+
+    if (source.size < read_size)
+        return;
+
+    Buffer frame(lz4frame::bound(source.size, block_size));
+    size_t compressed = lz4frame::compress(frame, source, 4, block_size);
+    lz4frame::Reader reader(Memory(frame.data(), compressed));
+
+    std::vector<uint8> buffer(read_size);
+    uint32 seed = 1;
+    int errors = 0;
+
+    Timer timer;
+    uint64 time0 = timer.us();
+
+    for (int i = 0; i < reads; ++i)
+    {
+        seed = seed * 1664525 + 1013904223;
+        const uint64 offset = seed % (source.size - read_size);
+        reader.read(buffer.data(), offset, read_size);
+        errors += std::memcmp(buffer.data(), source.address + offset, read_size) != 0;
+    }
+
+    uint64 time1 = timer.us();
+    printf("\nrandom access: %d reads of %zu bytes, %.1f us / read %s\n",
+        reads, read_size, double(time1 - time0) / reads, errors ? "(MISMATCH)" : "");
+}
+
+// ----------------------------------------------------------------------
+// streaming
+// ----------------------------------------------------------------------
+
+/*
+    Compress through a CompressStream into a file and read it back through
+    a DecompressStream in small chunks. The working memory is a few hundred
+    kilobytes no matter how large the file is.
+
+    The same works for a file inside a container; store the .ml4s file
+    without zip compression and the File is a zero-copy mapping into the
+    container, which the DecompressStream then decodes block by block:
+
+        Path path("assets.zip/");
+        File file(path, "huge.ml4s");
+        lz4stream::DecompressStream stream(file);
+        LittleEndianStream s = stream;
+*/
+
+void test_stream(Memory source, const std::string& filename)
+{
+    const size_t chunk_size = 64 * 1024;
+
+    Timer timer;
+    uint64 time0 = timer.us();
+
+    {
+        FileStream output(filename, FileStream::WRITE);
+        lz4stream::CompressStream stream(output, 4);
+
+        for (size_t offset = 0; offset < source.size; offset += chunk_size)
+        {
+            stream.write(source.address + offset, std::min(chunk_size, source.size - offset));
+        }
+
+        stream.close();
+    }
+
+    uint64 time1 = timer.us();
+
+    File file(filename);
+    lz4stream::DecompressStream stream(file);
+
+    std::vector<uint8> buffer(chunk_size);
+    bool match = stream.size() == source.size;
+
+    for (size_t offset = 0; offset < source.size; offset += chunk_size)
+    {
+        const size_t bytes = std::min(chunk_size, source.size - offset);
+        stream.read(buffer.data(), bytes);
+        match = match && !std::memcmp(buffer.data(), source.address + offset, bytes);
+    }
+
+    uint64 time2 = timer.us();
+
+    printf("\nstream: %zu -> %zu bytes, compress %.2f GB/s, decompress %.2f GB/s %s\n",
+        source.size, size_t(file.size()),
+        gbps(source.size, time1 - time0),
+        gbps(source.size, time2 - time1),
+        match ? "" : "(MISMATCH)");
+    printf("stream: working memory %zu KB\n", stream.getWorkingMemory() / 1024);
+}
+
+// ----------------------------------------------------------------------
+// corpus
+// ----------------------------------------------------------------------
+
+/*
+    Run every registered codec at every level over a folder of files and
+    report the results per asset class (file extension). Each file is
+    compressed as one buffer, the way an asset would be stored.
+*/
+
+namespace
+{
+
+    std::string getAssetClass(const std::string& filename)
+    {
+        size_t n = filename.find_last_of('.');
+        return n == std::string::npos ? "(none)" : filename.substr(n);
+    }
+
+    struct CorpusResult
+    {
+        size_t input = 0;
+        size_t output = 0;
+        uint64 compress_us = 0;
+        uint64 decompress_us = 0;
+        int errors = 0;
+    };
+
+} // namespace
+
+void test_corpus(const std::string& folder)
+{
+    Path path(folder);
+
+    // asset class -> files
+    std::map<std::string, std::vector<std::string>> classes;
+    for (size_t i = 0; i < path.size(); ++i)
+    {
+        const auto& node = path[i];
+        if (!node.isDirectory())
+        {
+            classes[getAssetClass(node.name)].push_back(node.name);
+        }
+    }
+
+    Timer timer;
+
+    for (auto& c : classes)
+    {
+        // load the class into memory so that the page faults are not timed
+        std::vector<Buffer> files;
+        size_t total = 0;
+        for (auto& filename : c.second)
+        {
+            File file(path, filename);
+            files.emplace_back(Memory(file));
+            total += file.size();
+        }
+
+        printf("\nclass: %s (%zu files, %zu KB)\n", c.first.c_str(), files.size(), total / 1024);
+        printf("codec        level   ratio   compress GB/s   decompress GB/s\n");
+
+        for (const codec::Codec& codec : codec::getCodecs())
+        {
+            for (int level = codec.min_level; level <= codec.max_level; ++level)
+            {
+                CorpusResult result;
+
+                for (const Buffer& file : files)
+                {
+                    Memory source = file;
+                    Buffer compressed(codec.bound(source.size));
+                    Buffer decompressed(source.size);
+
+                    uint64 time0 = timer.us();
+                    size_t size = codec.compress(compressed, source, level);
+                    uint64 time1 = timer.us();
+                    codec.decompress(decompressed, Memory(compressed.data(), size));
+                    uint64 time2 = timer.us();
+
+                    result.input += source.size;
+                    result.output += size;
+                    result.compress_us += time1 - time0;
+                    result.decompress_us += time2 - time1;
+                    result.errors += !equal(decompressed, source);
+                }
+
+                printf("%-10s  %6d  %6.3f  %14.3f  %16.3f %s\n", codec.name, level,
+                    double(result.input) / std::max<size_t>(1, result.output),
+                    gbps(result.input, result.compress_us),
+                    gbps(result.input, result.decompress_us),
+                    result.errors ? "(MISMATCH)" : "");
+            }
+        }
+    }
+}
+
+// ----------------------------------------------------------------------
+// main()
+// ----------------------------------------------------------------------
+
+int main(int argc, const char* argv[])
+{
+    if (argc < 2)
+    {
+        printf("Too few arguments. usage: %s <filename> | --corpus <folder>\n", argv[0]);
+        return 1;
+    }
+
+    if (argc > 2 && std::string(argv[1]) == "--corpus")
+    {
+        test_corpus(argv[2]);
+        return 0;
+    }
+
+    File file(argv[1]);
+    Memory memory = file;
+
+    // read the file once so that the first test doesn't pay for the page faults
+    Buffer source(memory);
+
+    test_lz4frame(source);
+    test_random_access(source);
+    test_stream(source, std::string(argv[1]) + ".ml4s");
+}
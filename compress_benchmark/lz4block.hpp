@@ -0,0 +1,81 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <mango/mango.hpp>
+
+/*
+    LZ4 block checks shared by lz4frame.hpp and lz4stream.hpp.
+
+    lz4::decompress() does not report how much it produced, so a block
+    whose raw size in the container is wrong would leave part of the
+    output unwritten, or be trusted to stay inside a buffer sized from the
+    header. validate() walks the sequences of the block (tokens, lengths
+    and offsets; the literals are skipped, not read) and tells whether it
+    decodes to exactly "size" bytes with every match inside the output.
+*/
+
+namespace lz4block
+{
+
+    using namespace mango;
+
+    inline bool validate(Memory source, size_t size)
+    {
+        const uint8* p = source.address;
+        const uint8* end = source.address + source.size;
+        size_t decoded = 0;
+
+        // 4 bit length with 255 byte extensions; false on truncated input
+        auto length = [&] (size_t& value) {
+            if (value == 15)
+            {
+                uint8 s;
+                do
+                {
+                    if (p == end)
+                        return false;
+                    s = *p++;
+                    value += s;
+                } while (s == 255);
+            }
+            return true;
+        };
+
+        while (p < end)
+        {
+            const uint8 token = *p++;
+
+            size_t literals = token >> 4;
+            if (!length(literals) || literals > size_t(end - p) || literals > size - decoded)
+                return false;
+
+            p += literals;
+            decoded += literals;
+
+            // the last sequence has literals only
+            if (p == end)
+                break;
+
+            if (end - p < 2)
+                return false;
+
+            const size_t offset = p[0] | (p[1] << 8);
+            p += 2;
+
+            if (!offset || offset > decoded)
+                return false;
+
+            size_t match = token & 15;
+            if (!length(match) || match + 4 > size - decoded)
+                return false;
+
+            decoded += match + 4;
+        }
+
+        return decoded == size;
+    }
+
+} // namespace lz4block
@@ -0,0 +1,367 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <mango/mango.hpp>
+#include <algorithm>
+#include <mutex>
+#include "lz4block.hpp"
+
+/*
+    Block-parallel LZ4 container.
+
+    lz4::compress() works on one contiguous buffer and uses one core. Here the
+    input is cut into independent blocks which are compressed concurrently
+    in the ThreadPool. The container has a block index up front so that
+    blocks can be decompressed in parallel, or individually when only a
+    range of the data is needed.
+
+    Layout (all values little-endian):
+
+        header      magic "ML4F", version, block size, block count, total size
+        index       per block: payload offset, compressed size, flags
+        payload     compressed blocks in order
+
+    A block which does not compress is stored as-is (BLOCK_STORED).
+
+    The blocks are independent; there is no dictionary linking between
+    blocks because the lz4 interface only exposes whole-buffer calls. The
+    compression ratio loss is small with block sizes of 1 MB and above.
+*/
+
+namespace lz4frame
+{
+
+    using namespace mango;
+
+    constexpr uint32 magic = 0x46344c4d; // "ML4F"
+    constexpr uint32 version = 1;
+    constexpr size_t header_size = 24;
+    constexpr size_t index_entry_size = 16;
+
+    enum : uint32
+    {
+        BLOCK_COMPRESSED = 0,
+        BLOCK_STORED = 1,
+    };
+
+    struct Block
+    {
+        uint64 offset;     // from the start of the payload
+        uint32 size;       // compressed size
+        uint32 flags;
+    };
+
+    struct Header
+    {
+        uint32 block_size;
+        uint32 block_count;
+        uint64 total_size;
+    };
+
+    inline size_t getBlockCount(size_t size, size_t block_size)
+    {
+        return (size + block_size - 1) / block_size;
+    }
+
+    // maximum size of the container for the given input
+    inline size_t bound(size_t size, size_t block_size)
+    {
+        const size_t count = getBlockCount(size, block_size);
+        return header_size + count * index_entry_size + count * lz4::bound(block_size);
+    }
+
+    /*
+        Run function(i) for i in [0, count) with at most "threads" tasks in
+        flight. threads = 0 uses one task per block and lets the pool decide.
+        The first exception thrown by a task is rethrown after the wait.
+    */
+    template <typename Function>
+    void parallel(size_t count, int threads, Function call)
+    {
+        ConcurrentQueue q("lz4frame");
+
+        std::mutex mutex;
+        std::exception_ptr exception;
+
+        auto function = [&] (size_t i) {
+            try
+            {
+                call(i);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!exception)
+                    exception = std::current_exception();
+            }
+        };
+
+        if (threads <= 0)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                q.enqueue([&function, i] {
+                    function(i);
+                });
+            }
+        }
+        else
+        {
+            std::atomic<size_t> next { 0 };
+            for (int t = 0; t < threads; ++t)
+            {
+                q.enqueue([&function, &next, count] {
+                    for (size_t i = next++; i < count; i = next++)
+                    {
+                        function(i);
+                    }
+                });
+            }
+        }
+
+        q.wait();
+
+        if (exception)
+        {
+            std::rethrow_exception(exception);
+        }
+    }
+
+    // -----------------------------------------------------------------
+    // compress
+    // -----------------------------------------------------------------
+
+    /*
+        Compress "source" into "dest" which must be at least bound() bytes.
+        Returns the size of the container.
+    */
+    inline size_t compress(Memory dest, Memory source, int level, size_t block_size, int threads = 0)
+    {
+        const size_t count = getBlockCount(source.size, block_size);
+        const size_t slot_size = lz4::bound(block_size);
+        const size_t payload_offset = header_size + count * index_entry_size;
+
+        std::vector<Block> blocks(count);
+
+        // every block compresses into its own worst-case sized slot..
+        parallel(count, threads, [&] (size_t i) {
+            Memory input = source.slice(i * block_size, std::min(block_size, source.size - i * block_size));
+            Memory output = dest.slice(payload_offset + i * slot_size, slot_size);
+
+            size_t size = lz4::compress(output, input, level);
+            if (size >= input.size)
+            {
+                std::memcpy(output.address, input.address, input.size);
+                blocks[i] = { 0, uint32(input.size), BLOCK_STORED };
+            }
+            else
+            {
+                blocks[i] = { 0, uint32(size), BLOCK_COMPRESSED };
+            }
+        });
+
+        // ..which are then packed together. The first block is already in place.
+        uint64 offset = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            uint8* slot = dest.address + payload_offset + i * slot_size;
+            uint8* packed = dest.address + payload_offset + offset;
+            if (slot != packed)
+            {
+                std::memmove(packed, slot, blocks[i].size);
+            }
+
+            blocks[i].offset = offset;
+            offset += blocks[i].size;
+        }
+
+        uint8* p = dest.address;
+        ustore32le(p + 0, magic);
+        ustore32le(p + 4, version);
+        ustore32le(p + 8, uint32(block_size));
+        ustore32le(p + 12, uint32(count));
+        ustore64le(p + 16, source.size);
+        p += header_size;
+
+        for (const Block& block : blocks)
+        {
+            ustore64le(p + 0, block.offset);
+            ustore32le(p + 8, block.size);
+            ustore32le(p + 12, block.flags);
+            p += index_entry_size;
+        }
+
+        return size_t(payload_offset + offset);
+    }
+
+    // -----------------------------------------------------------------
+    // Reader
+    // -----------------------------------------------------------------
+
+    class Reader
+    {
+    protected:
+        Memory m_memory;
+        Header m_header;
+        std::vector<Block> m_blocks;
+        const uint8* m_payload;
+
+        void decompressBlock(size_t index, uint8* dest) const
+        {
+            const Block& block = m_blocks[index];
+            const size_t size = getBlockSize(index);
+            Memory input(m_payload + block.offset, block.size);
+
+            if (block.flags == BLOCK_STORED)
+            {
+                std::memcpy(dest, input.address, size);
+            }
+            else
+            {
+                if (!lz4block::validate(input, size))
+                {
+                    MANGO_EXCEPTION("lz4frame: corrupted block.");
+                }
+
+                lz4::decompress(Memory(dest, size), input);
+            }
+        }
+
+    public:
+        Reader(Memory memory)
+            : m_memory(memory)
+        {
+            const uint8* p = memory.address;
+            if (memory.size < header_size || uload32le(p) != magic)
+            {
+                MANGO_EXCEPTION("lz4frame: incorrect identifier.");
+            }
+
+            if (uload32le(p + 4) != version)
+            {
+                MANGO_EXCEPTION("lz4frame: unsupported version.");
+            }
+
+            m_header.block_size = uload32le(p + 8);
+            m_header.block_count = uload32le(p + 12);
+            m_header.total_size = uload64le(p + 16);
+            p += header_size;
+
+            // the header decides the block sizes: everything else is checked against it
+            if (!m_header.block_size)
+            {
+                MANGO_EXCEPTION("lz4frame: zero block size.");
+            }
+
+            const uint64 expected = m_header.total_size / m_header.block_size + (m_header.total_size % m_header.block_size != 0);
+            if (m_header.block_count != expected)
+            {
+                MANGO_EXCEPTION("lz4frame: block count does not match the total size.");
+            }
+
+            const size_t payload_offset = header_size + m_header.block_count * index_entry_size;
+            if (memory.size < payload_offset)
+            {
+                MANGO_EXCEPTION("lz4frame: truncated block index.");
+            }
+
+            m_blocks.resize(m_header.block_count);
+            const uint64 payload_size = memory.size - payload_offset;
+
+            for (size_t i = 0; i < m_blocks.size(); ++i)
+            {
+                Block& block = m_blocks[i];
+                block.offset = uload64le(p + 0);
+                block.size = uload32le(p + 8);
+                block.flags = uload32le(p + 12);
+                p += index_entry_size;
+
+                if (block.offset > payload_size || block.size > payload_size - block.offset)
+                {
+                    MANGO_EXCEPTION("lz4frame: block out of bounds.");
+                }
+
+                if (block.flags != BLOCK_COMPRESSED && block.flags != BLOCK_STORED)
+                {
+                    MANGO_EXCEPTION("lz4frame: unknown block flags.");
+                }
+
+                if (block.flags == BLOCK_STORED && block.size != getBlockSize(i))
+                {
+                    MANGO_EXCEPTION("lz4frame: stored block size does not match.");
+                }
+            }
+
+            m_payload = memory.address + payload_offset;
+        }
+
+        uint64 size() const
+        {
+            return m_header.total_size;
+        }
+
+        size_t getBlockCount() const
+        {
+            return m_blocks.size();
+        }
+
+        size_t getBlockSize(size_t index) const
+        {
+            const uint64 offset = uint64(index) * m_header.block_size;
+            return size_t(std::min<uint64>(m_header.block_size, m_header.total_size - offset));
+        }
+
+        // decompress everything into "dest" which must be at least size() bytes
+        void decompress(Memory dest, int threads = 0) const
+        {
+            if (dest.size < m_header.total_size)
+            {
+                MANGO_EXCEPTION("lz4frame: destination is too small.");
+            }
+
+            parallel(m_blocks.size(), threads, [&] (size_t i) {
+                decompressBlock(i, dest.address + i * size_t(m_header.block_size));
+            });
+        }
+
+        // decompress "size" bytes starting at "offset"; only the blocks
+        // overlapping the range are touched
+        void read(uint8* dest, uint64 offset, size_t size) const
+        {
+            if (offset + size > m_header.total_size)
+            {
+                MANGO_EXCEPTION("lz4frame: read out of bounds.");
+            }
+
+            const size_t block_size = m_header.block_size;
+            std::vector<uint8> temp;
+
+            while (size > 0)
+            {
+                const size_t index = size_t(offset / block_size);
+                const size_t inner = size_t(offset % block_size);
+                const size_t bytes = std::min(size, getBlockSize(index) - inner);
+
+                if (inner == 0 && bytes == getBlockSize(index))
+                {
+                    // the whole block is requested; decompress in place
+                    decompressBlock(index, dest);
+                }
+                else
+                {
+                    temp.resize(getBlockSize(index));
+                    decompressBlock(index, temp.data());
+                    std::memcpy(dest, temp.data() + inner, bytes);
+                }
+
+                dest += bytes;
+                offset += bytes;
+                size -= bytes;
+            }
+        }
+    };
+
+} // namespace lz4frame
@@ -0,0 +1,649 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <mango/mango.hpp>
+#include <algorithm>
+#include "lz4block.hpp"
+
+/*
+    Streaming LZ4 with bounded buffers.
+
+    lz4::compress() / lz4::decompress() need the whole input and a bound()
+    sized output up front. The streaming codec works on fixed-size blocks
+    instead: the working memory is one input block plus one output block
+    regardless of how large the data is.
+
+    Encoder / Decoder are the low-level push/pull state machines:
+
+        push(data, size)    consume input; returns number of bytes consumed
+        pull(dest, size)    produce output; returns number of bytes produced
+
+    A push consumes nothing while there is output waiting to be pulled, so
+    the caller alternates between the two until everything is consumed.
+
+    CompressStream / DecompressStream wrap them as a Stream so that they can
+    be plugged into anything that reads or writes a Stream, including the
+    endian adapters (see misc/endian.cpp).
+
+    Stream layout (little-endian):
+
+        header      magic "ML4S", block size, total size
+        blocks      raw size, compressed size | stored bit, payload
+        end         raw size 0
+*/
+
+namespace lz4stream
+{
+
+    using namespace mango;
+
+    constexpr uint32 magic = 0x53344c4d; // "ML4S"
+    constexpr size_t header_size = 16;
+    constexpr size_t block_header_size = 8;
+    constexpr uint32 stored_bit = 0x80000000;
+
+    constexpr size_t default_block_size = 256 * 1024;
+    constexpr size_t max_block_size = 64 * 1024 * 1024;
+
+    // -----------------------------------------------------------------
+    // Encoder
+    // -----------------------------------------------------------------
+
+    class Encoder
+    {
+    protected:
+        const size_t m_block_size;
+        const int m_level;
+
+        std::vector<uint8> m_input;
+        size_t m_input_size = 0;
+
+        std::vector<uint8> m_output;
+        size_t m_output_size = 0;
+        size_t m_output_offset = 0;
+
+        uint64 m_total = 0;
+        bool m_header = false;
+        bool m_finished = false;
+
+        // called from the first initializer so that nothing is allocated
+        // for a block size which is rejected
+        static size_t checkBlockSize(size_t block_size)
+        {
+            if (block_size == 0 || block_size > max_block_size)
+            {
+                MANGO_EXCEPTION("lz4stream: block size out of range.");
+            }
+            return block_size;
+        }
+
+        void writeHeader()
+        {
+            uint8* p = m_output.data() + m_output_size;
+            ustore32le(p + 0, magic);
+            ustore32le(p + 4, uint32(m_block_size));
+            ustore64le(p + 8, 0); // patched by CompressStream if the output is seekable
+            m_output_size += header_size;
+            m_header = true;
+        }
+
+        void encodeBlock()
+        {
+            uint8* p = m_output.data() + m_output_size;
+            uint8* payload = p + block_header_size;
+
+            Memory dest(payload, lz4::bound(m_block_size));
+            Memory source(m_input.data(), m_input_size);
+
+            size_t size = lz4::compress(dest, source, m_level);
+            uint32 flags = 0;
+
+            if (size >= m_input_size)
+            {
+                std::memcpy(payload, m_input.data(), m_input_size);
+                size = m_input_size;
+                flags = stored_bit;
+            }
+
+            ustore32le(p + 0, uint32(m_input_size));
+            ustore32le(p + 4, uint32(size) | flags);
+            m_output_size += block_header_size + size;
+
+            m_total += m_input_size;
+            m_input_size = 0;
+        }
+
+        bool pending() const
+        {
+            return m_output_offset < m_output_size;
+        }
+
+        void reset()
+        {
+            m_output_size = 0;
+            m_output_offset = 0;
+        }
+
+    public:
+        Encoder(int level, size_t block_size = default_block_size)
+            : m_block_size(checkBlockSize(block_size))
+            , m_level(level)
+            , m_input(m_block_size)
+            , m_output(header_size + block_header_size * 2 + lz4::bound(m_block_size))
+        {
+        }
+
+        size_t push(const uint8* data, size_t size)
+        {
+            if (pending() || m_finished)
+                return 0;
+
+            reset();
+
+            if (!m_header)
+            {
+                writeHeader();
+            }
+
+            const size_t bytes = std::min(size, m_block_size - m_input_size);
+            std::memcpy(m_input.data() + m_input_size, data, bytes);
+            m_input_size += bytes;
+
+            if (m_input_size == m_block_size)
+            {
+                encodeBlock();
+            }
+
+            return bytes;
+        }
+
+        // flush the last partial block and write the end marker;
+        // returns false if there is output to be pulled first
+        bool finish()
+        {
+            if (pending())
+                return false;
+
+            if (!m_finished)
+            {
+                reset();
+
+                if (!m_header)
+                {
+                    writeHeader();
+                }
+
+                if (m_input_size)
+                {
+                    encodeBlock();
+                }
+
+                ustore32le(m_output.data() + m_output_size, 0);
+                ustore32le(m_output.data() + m_output_size + 4, 0);
+                m_output_size += block_header_size;
+                m_finished = true;
+            }
+
+            return true;
+        }
+
+        size_t pull(uint8* dest, size_t size)
+        {
+            const size_t bytes = std::min(size, m_output_size - m_output_offset);
+            std::memcpy(dest, m_output.data() + m_output_offset, bytes);
+            m_output_offset += bytes;
+            return bytes;
+        }
+
+        uint64 total() const
+        {
+            return m_total;
+        }
+
+        size_t getWorkingMemory() const
+        {
+            return m_input.size() + m_output.size();
+        }
+    };
+
+    // -----------------------------------------------------------------
+    // Decoder
+    // -----------------------------------------------------------------
+
+    class Decoder
+    {
+    protected:
+        enum State
+        {
+            HEADER,
+            BLOCK_HEADER,
+            PAYLOAD,
+            END,
+        };
+
+        State m_state = HEADER;
+        size_t m_block_size = 0;
+        uint64 m_total = 0;
+
+        uint8 m_header[header_size];
+        size_t m_header_size = 0;
+
+        // current block
+        size_t m_raw_size = 0;
+        size_t m_packed_size = 0;
+        bool m_stored = false;
+
+        std::vector<uint8> m_input;
+        size_t m_input_size = 0;
+
+        std::vector<uint8> m_output;
+        size_t m_output_size = 0;
+        size_t m_output_offset = 0;
+
+        // collect "count" bytes into m_header; returns bytes consumed
+        size_t gather(const uint8* data, size_t size, size_t count)
+        {
+            const size_t bytes = std::min(size, count - m_header_size);
+            std::memcpy(m_header + m_header_size, data, bytes);
+            m_header_size += bytes;
+            return bytes;
+        }
+
+        void decodeBlock()
+        {
+            if (m_stored)
+            {
+                std::memcpy(m_output.data(), m_input.data(), m_raw_size);
+            }
+            else
+            {
+                Memory source(m_input.data(), m_packed_size);
+                if (!lz4block::validate(source, m_raw_size))
+                {
+                    MANGO_EXCEPTION("lz4stream: corrupted block.");
+                }
+
+                lz4::decompress(Memory(m_output.data(), m_raw_size), source);
+            }
+
+            m_output_size = m_raw_size;
+            m_output_offset = 0;
+            m_input_size = 0;
+        }
+
+    public:
+        Decoder()
+        {
+        }
+
+        size_t push(const uint8* data, size_t size)
+        {
+            size_t consumed = 0;
+
+            while (consumed < size && m_output_offset == m_output_size && m_state != END)
+            {
+                const uint8* p = data + consumed;
+                const size_t left = size - consumed;
+
+                switch (m_state)
+                {
+                    case HEADER:
+                        consumed += gather(p, left, header_size);
+                        if (m_header_size == header_size)
+                        {
+                            if (uload32le(m_header) != magic)
+                            {
+                                MANGO_EXCEPTION("lz4stream: incorrect identifier.");
+                            }
+
+                            m_block_size = uload32le(m_header + 4);
+                            if (m_block_size == 0 || m_block_size > max_block_size)
+                            {
+                                MANGO_EXCEPTION("lz4stream: block size out of range.");
+                            }
+
+                            m_total = uload64le(m_header + 8);
+                            m_input.resize(lz4::bound(m_block_size));
+                            m_output.resize(m_block_size);
+                            m_header_size = 0;
+                            m_state = BLOCK_HEADER;
+                        }
+                        break;
+
+                    case BLOCK_HEADER:
+                        consumed += gather(p, left, block_header_size);
+                        if (m_header_size == block_header_size)
+                        {
+                            const uint32 packed = uload32le(m_header + 4);
+                            m_raw_size = uload32le(m_header);
+                            m_packed_size = packed & ~stored_bit;
+                            m_stored = (packed & stored_bit) != 0;
+                            m_header_size = 0;
+
+                            if (m_raw_size > m_block_size || m_packed_size > m_input.size() ||
+                                (m_stored && m_packed_size != m_raw_size))
+                            {
+                                MANGO_EXCEPTION("lz4stream: corrupted block header.");
+                            }
+
+                            m_state = m_raw_size ? PAYLOAD : END;
+                        }
+                        break;
+
+                    case PAYLOAD:
+                    {
+                        const size_t bytes = std::min(left, m_packed_size - m_input_size);
+                        std::memcpy(m_input.data() + m_input_size, p, bytes);
+                        m_input_size += bytes;
+                        consumed += bytes;
+
+                        if (m_input_size == m_packed_size)
+                        {
+                            decodeBlock();
+                            m_state = BLOCK_HEADER;
+                        }
+                        break;
+                    }
+
+                    case END:
+                        break;
+                }
+            }
+
+            return consumed;
+        }
+
+        size_t pull(uint8* dest, size_t size)
+        {
+            const size_t bytes = std::min(size, m_output_size - m_output_offset);
+            std::memcpy(dest, m_output.data() + m_output_offset, bytes);
+            m_output_offset += bytes;
+            return bytes;
+        }
+
+        // true when the stream header has been parsed
+        bool ready() const
+        {
+            return m_state != HEADER;
+        }
+
+        // true when the end marker has been seen and all output pulled
+        bool done() const
+        {
+            return m_state == END && m_output_offset == m_output_size;
+        }
+
+        uint64 total() const
+        {
+            return m_total;
+        }
+
+        size_t getWorkingMemory() const
+        {
+            return m_input.size() + m_output.size();
+        }
+    };
+
+    // -----------------------------------------------------------------
+    // CompressStream
+    // -----------------------------------------------------------------
+
+    /*
+        Write-only Stream which compresses into another Stream. The total
+        size in the header is patched when the stream is closed. When the
+        output cannot seek back (pipe, socket) the patch is skipped and the
+        header keeps 0: the decoder does not need the size in advance.
+    */
+
+    class CompressStream : public Stream
+    {
+    protected:
+        Stream& m_output;
+        Encoder m_encoder;
+        uint64 m_start;
+        bool m_closed = false;
+        uint8 m_buffer[64 * 1024];
+
+        void drain()
+        {
+            while (size_t bytes = m_encoder.pull(m_buffer, sizeof(m_buffer)))
+            {
+                m_output.write(m_buffer, bytes);
+            }
+        }
+
+    public:
+        CompressStream(Stream& output, int level, size_t block_size = default_block_size)
+            : m_output(output)
+            , m_encoder(level, block_size)
+            , m_start(output.offset())
+        {
+        }
+
+        ~CompressStream()
+        {
+            close();
+        }
+
+        void close()
+        {
+            if (m_closed)
+                return;
+
+            while (!m_encoder.finish())
+            {
+                drain();
+            }
+            drain();
+
+            // patch the total size only if the seek really lands in the header
+            const uint64 end = m_output.offset();
+            try
+            {
+                m_output.seek(m_start + 8, Stream::BEGIN);
+            }
+            catch (...)
+            {
+            }
+
+            if (m_output.offset() == m_start + 8)
+            {
+                uint8 total[8];
+                ustore64le(total, m_encoder.total());
+                m_output.write(total, 8);
+                m_output.seek(end, Stream::BEGIN);
+            }
+
+            m_closed = true;
+        }
+
+        uint64 size() const override
+        {
+            return m_encoder.total();
+        }
+
+        uint64 offset() const override
+        {
+            return m_encoder.total();
+        }
+
+        void seek(int64 distance, SeekMode mode) override
+        {
+            MANGO_EXCEPTION("CompressStream: seek is not supported.");
+        }
+
+        void read(void* dest, size_t size) override
+        {
+            MANGO_EXCEPTION("CompressStream: stream is write-only.");
+        }
+
+        void write(const void* data, size_t size) override
+        {
+            if (m_closed)
+            {
+                MANGO_EXCEPTION("CompressStream: stream is closed.");
+            }
+
+            const uint8* p = reinterpret_cast<const uint8*>(data);
+            while (size > 0)
+            {
+                size_t bytes = m_encoder.push(p, size);
+                p += bytes;
+                size -= bytes;
+                drain();
+            }
+        }
+    };
+
+    // -----------------------------------------------------------------
+    // DecompressStream
+    // -----------------------------------------------------------------
+
+    /*
+        Read-only Stream which decompresses from another Stream. Seeking
+        forward decodes and discards; seeking backward restarts from the
+        beginning of the input.
+    */
+
+    class DecompressStream : public Stream
+    {
+    protected:
+        Stream& m_input;
+        uint64 m_start;
+        std::unique_ptr<Decoder> m_decoder;
+        uint64 m_offset = 0;
+
+        uint8 m_buffer[64 * 1024];
+        size_t m_buffer_size = 0;
+        size_t m_buffer_offset = 0;
+
+        void restart()
+        {
+            m_input.seek(m_start, Stream::BEGIN);
+            m_decoder.reset(new Decoder());
+            m_offset = 0;
+            m_buffer_size = 0;
+            m_buffer_offset = 0;
+            prime();
+        }
+
+        void fill()
+        {
+            if (m_buffer_offset == m_buffer_size)
+            {
+                const uint64 left = m_input.size() - m_input.offset();
+                m_buffer_size = size_t(std::min<uint64>(left, sizeof(m_buffer)));
+                m_buffer_offset = 0;
+                if (!m_buffer_size)
+                {
+                    MANGO_EXCEPTION("DecompressStream: unexpected end of input.");
+                }
+                m_input.read(m_buffer, m_buffer_size);
+            }
+
+            m_buffer_offset += m_decoder->push(m_buffer + m_buffer_offset, m_buffer_size - m_buffer_offset);
+        }
+
+        // parse the stream header so that size() is known
+        void prime()
+        {
+            while (!m_decoder->ready())
+            {
+                fill();
+            }
+        }
+
+        // returns number of bytes produced; less than size at end of stream.
+        // a null dest decodes and discards.
+        size_t decode(uint8* dest, size_t size)
+        {
+            uint8 scratch[4096];
+            size_t produced = 0;
+
+            while (produced < size && !m_decoder->done())
+            {
+                size_t bytes;
+                if (dest)
+                    bytes = m_decoder->pull(dest + produced, size - produced);
+                else
+                    bytes = m_decoder->pull(scratch, std::min(size - produced, sizeof(scratch)));
+
+                produced += bytes;
+
+                if (!bytes)
+                {
+                    fill();
+                }
+            }
+
+            m_offset += produced;
+            return produced;
+        }
+
+    public:
+        DecompressStream(Stream& input)
+            : m_input(input)
+            , m_start(input.offset())
+            , m_decoder(new Decoder())
+        {
+            prime();
+        }
+
+        uint64 size() const override
+        {
+            return m_decoder->total();
+        }
+
+        uint64 offset() const override
+        {
+            return m_offset;
+        }
+
+        void seek(int64 distance, SeekMode mode) override
+        {
+            uint64 target = 0;
+
+            switch (mode)
+            {
+                case BEGIN:
+                    target = distance;
+                    break;
+                case CURRENT:
+                    target = m_offset + distance;
+                    break;
+                case END:
+                    target = size() + distance;
+                    break;
+            }
+
+            if (target < m_offset)
+            {
+                restart();
+            }
+
+            decode(nullptr, size_t(target - m_offset));
+        }
+
+        void read(void* dest, size_t size) override
+        {
+            if (decode(reinterpret_cast<uint8*>(dest), size) != size)
+            {
+                MANGO_EXCEPTION("DecompressStream: read past end of stream.");
+            }
+        }
+
+        void write(const void* data, size_t size) override
+        {
+            MANGO_EXCEPTION("DecompressStream: stream is read-only.");
+        }
+
+        size_t getWorkingMemory() const
+        {
+            return m_decoder->getWorkingMemory() + sizeof(m_buffer);
+        }
+    };
+
+} // namespace lz4stream
@@ -0,0 +1,172 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#include <mango/mango.hpp>
+#include "walker.hpp"
+
+using namespace mango;
+
+// ----------------------------------------------------------------------
+// serial
+// ----------------------------------------------------------------------
+
+/*
+    Reference: misc/filesystem.cpp example6 with the same filters, one
+    folder at a time.
+*/
+
+struct SerialResult
+{
+    uint64 files = 0;
+    uint64 folders = 0;
+    uint64 bytes = 0;
+    uint64 first_us = 0;
+};
+
+void walk_serial(const Path& parent, const DirectoryWalker::Options& options, int depth,
+                 SerialResult& result, Timer& timer)
+{
+    ++result.folders;
+
+    for (const FileInfo& info : parent)
+    {
+        if (info.isDirectory() || (info.isContainer() && options.containers))
+        {
+            std::string name = info.name;
+            if (name.back() != '/')
+                name += '/';
+
+            bool excluded = false;
+            for (const auto& pattern : options.exclude)
+                excluded = excluded || DirectoryWalker::match(pattern.c_str(), name.substr(0, name.size() - 1).c_str());
+
+            if (depth < options.max_depth && !excluded)
+            {
+                try
+                {
+                    Path path(parent, name);
+                    walk_serial(path, options, depth + 1, result, timer);
+                }
+                catch (...)
+                {
+                }
+            }
+        }
+        else
+        {
+            bool accept = options.include.empty();
+            for (const auto& pattern : options.include)
+                accept = accept || DirectoryWalker::match(pattern.c_str(), info.name.c_str());
+            for (const auto& pattern : options.exclude)
+                accept = accept && !DirectoryWalker::match(pattern.c_str(), info.name.c_str());
+
+            if (accept)
+            {
+                if (!result.files)
+                    result.first_us = timer.us();
+                ++result.files;
+                result.bytes += info.size;
+            }
+        }
+    }
+}
+
+// time to the first file in ms, "-" when nothing matched
+std::string getFirst(uint64 files, uint64 first_us, uint64 time0)
+{
+    if (!files)
+        return "-";
+
+    char text[32];
+    std::snprintf(text, sizeof(text), "%.1f", (first_us - time0) / 1000.0);
+    return text;
+}
+
+// ----------------------------------------------------------------------
+// main()
+// ----------------------------------------------------------------------
+
+int main(int argc, const char* argv[])
+{
+    DirectoryWalker::Options options;
+    std::string folder;
+    bool serial = true;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--include" && i + 1 < argc)
+            options.include.push_back(argv[++i]);
+        else if (arg == "--exclude" && i + 1 < argc)
+            options.exclude.push_back(argv[++i]);
+        else if (arg == "--no-containers")
+            options.containers = false;
+        else if (arg == "--no-serial")
+            serial = false;
+        else
+            folder = arg;
+    }
+
+    if (folder.empty())
+    {
+        printf("Too few arguments. usage: %s [--include <pattern>] [--exclude <pattern>] "
+               "[--no-containers] [--no-serial] <folder>\n", argv[0]);
+        return 1;
+    }
+
+    if (folder.back() != '/')
+        folder += '/';
+
+    printf("walker        files   folders   containers        MB    first ms    total ms      files/s\n");
+
+    if (serial)
+    {
+        // the second walk would be served from the OS directory cache;
+        // run the serial walk first so that it is not the one favoured
+        Timer timer;
+        SerialResult result;
+
+        uint64 time0 = timer.us();
+        Path path(folder);
+        walk_serial(path, options, 0, result, timer);
+        uint64 time1 = timer.us();
+
+        printf("serial   %10llu  %8llu  %11s  %8llu  %10s  %10.1f  %11.0f\n",
+            (unsigned long long)result.files,
+            (unsigned long long)result.folders, "-",
+            (unsigned long long)(result.bytes >> 20),
+            getFirst(result.files, result.first_us, time0).c_str(),
+            (time1 - time0) / 1000.0,
+            result.files * 1000000.0 / std::max<uint64>(1, time1 - time0));
+    }
+
+    {
+        Timer timer;
+        DirectoryWalker walker(options);
+        std::atomic<uint64> first { 0 };
+
+        uint64 time0 = timer.us();
+        walker.walk(folder, [&] (const std::string& pathname, const FileInfo& info) {
+            // streaming: the callback runs on the worker that listed the folder
+            uint64 expected = 0;
+            first.compare_exchange_strong(expected, timer.us());
+        });
+        uint64 time1 = timer.us();
+
+        const DirectoryWalker::Statistics& stats = walker.statistics();
+        printf("parallel %10llu  %8llu  %11llu  %8llu  %10s  %10.1f  %11.0f\n",
+            (unsigned long long)stats.files,
+            (unsigned long long)stats.folders,
+            (unsigned long long)stats.containers,
+            (unsigned long long)(stats.bytes >> 20),
+            getFirst(stats.files, first, time0).c_str(),
+            (time1 - time0) / 1000.0,
+            stats.files * 1000000.0 / std::max<uint64>(1, time1 - time0));
+
+        if (stats.errors)
+        {
+            printf("\n%llu folders could not be listed.\n", (unsigned long long)stats.errors);
+        }
+    }
+}
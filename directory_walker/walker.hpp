@@ -0,0 +1,244 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <mango/mango.hpp>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+/*
+    Parallel recursive directory walker.
+
+    misc/filesystem.cpp example5/example6 recurse through the Path objects
+    serially; every folder is listed only after the previous one is done.
+    On a network mount the listing is almost all latency so the walk time
+    is the number of folders times the round trip.
+
+    Here every folder is listed in its own task. A listed folder enqueues
+    its sub-folders and passes its files to the callback right away, so the
+    results stream out while the walk is still going. Sub-folders are opened
+    relative to the parent Path (example6) which keeps the container
+    mappings alive; a container found during the walk is recursed into like
+    any other folder when Options::containers is set.
+
+    The callback is called concurrently from the pool workers and must be
+    thread-safe. A Channel (jpeg_multithread/channel.hpp) is a good sink
+    when the consumer wants to run in its own stage.
+
+    The pool has a worker per hardware thread. The tasks block in the
+    listing, so on a high-latency mount a larger pool finishes faster; the
+    walk itself does not care how many workers there are.
+*/
+
+namespace mango
+{
+
+    class DirectoryWalker
+    {
+    public:
+        struct Options
+        {
+            // wildcard patterns ('*', '?') matched against the file name;
+            // an empty include list accepts every file
+            std::vector<std::string> include;
+
+            // matched against file and folder names; a matching folder is
+            // not descended into
+            std::vector<std::string> exclude;
+
+            bool containers = true;
+            int max_depth = 64;
+        };
+
+        struct Statistics
+        {
+            std::atomic<uint64> files { 0 };
+            std::atomic<uint64> folders { 0 };
+            std::atomic<uint64> containers { 0 };
+            std::atomic<uint64> bytes { 0 };
+            std::atomic<uint64> errors { 0 };
+        };
+
+        // pathname of the folder the file is in, with a trailing slash, and the file
+        using Callback = std::function<void(const std::string& folder, const FileInfo& info)>;
+
+        static bool match(const char* pattern, const char* name)
+        {
+            const char* star = nullptr;
+            const char* resume = nullptr;
+
+            while (*name)
+            {
+                if (*pattern == '?' || *pattern == *name)
+                {
+                    ++pattern;
+                    ++name;
+                }
+                else if (*pattern == '*')
+                {
+                    star = pattern++;
+                    resume = name;
+                }
+                else if (star)
+                {
+                    pattern = star + 1;
+                    name = ++resume;
+                }
+                else
+                {
+                    return false;
+                }
+            }
+
+            while (*pattern == '*')
+                ++pattern;
+
+            return *pattern == 0;
+        }
+
+    protected:
+        Options m_options;
+        Callback m_callback;
+        Statistics m_stats;
+        ConcurrentQueue m_queue;
+        std::atomic<int> m_pending { 0 };
+        std::mutex m_mutex;
+        std::exception_ptr m_exception;
+
+        static bool match(const std::vector<std::string>& patterns, const std::string& name)
+        {
+            for (const auto& pattern : patterns)
+            {
+                if (match(pattern.c_str(), name.c_str()))
+                    return true;
+            }
+            return false;
+        }
+
+        static std::string getFolderName(const std::string& name)
+        {
+            return !name.empty() && name.back() == '/' ? name : name + "/";
+        }
+
+        bool accept(const std::string& name) const
+        {
+            if (match(m_options.exclude, name))
+                return false;
+
+            return m_options.include.empty() || match(m_options.include, name);
+        }
+
+        void enqueue(std::shared_ptr<Path> parent, const std::string& pathname, const std::string& name, int depth)
+        {
+            ++m_pending;
+            m_queue.enqueue([this, parent, pathname, name, depth] {
+                // an exception from the callback must not skip the decrement
+                // or walk() would wait for this task forever
+                try
+                {
+                    list(parent, pathname, name, depth);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    if (!m_exception)
+                        m_exception = std::current_exception();
+                }
+                --m_pending;
+            });
+        }
+
+        void list(std::shared_ptr<Path> parent, const std::string& pathname, const std::string& name, int depth)
+        {
+            std::shared_ptr<Path> path;
+
+            try
+            {
+                path = parent ? std::make_shared<Path>(*parent, name)
+                              : std::make_shared<Path>(pathname);
+            }
+            catch (...)
+            {
+                // unreadable folder or damaged container; the walk goes on
+                ++m_stats.errors;
+                return;
+            }
+
+            ++m_stats.folders;
+
+            for (const FileInfo& info : *path)
+            {
+                if (info.isDirectory() || (info.isContainer() && m_options.containers))
+                {
+                    const std::string folder = getFolderName(info.name);
+                    const std::string trimmed = folder.substr(0, folder.size() - 1);
+
+                    if (depth < m_options.max_depth && !match(m_options.exclude, trimmed))
+                    {
+                        if (info.isContainer())
+                        {
+                            ++m_stats.containers;
+                        }
+
+                        enqueue(path, pathname + folder, folder, depth + 1);
+                    }
+                }
+                else if (accept(info.name))
+                {
+                    ++m_stats.files;
+                    m_stats.bytes += info.size;
+                    m_callback(pathname, info);
+                }
+            }
+        }
+
+    public:
+        DirectoryWalker()
+            : m_queue("directory walker")
+        {
+        }
+
+        DirectoryWalker(const Options& options)
+            : m_options(options)
+            , m_queue("directory walker")
+        {
+        }
+
+        /*
+            Walk "pathname" recursively and call "callback" for every file
+            that passes the filters. Returns when the whole tree is done.
+            The first exception thrown by the callback is rethrown here
+            after the walk has finished.
+        */
+        void walk(const std::string& pathname, Callback callback)
+        {
+            m_callback = callback;
+            enqueue(nullptr, getFolderName(pathname), std::string(), 0);
+
+            // tasks enqueue more tasks; wait until the last one has finished
+            do
+            {
+                m_queue.wait();
+            } while (m_pending > 0);
+
+            m_callback = nullptr;
+
+            std::exception_ptr exception;
+            std::swap(exception, m_exception);
+            if (exception)
+            {
+                std::rethrow_exception(exception);
+            }
+        }
+
+        const Statistics& statistics() const
+        {
+            return m_stats;
+        }
+    };
+
+} // namespace mango
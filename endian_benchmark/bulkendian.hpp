@@ -0,0 +1,314 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <mango/mango.hpp>
+
+#if defined(__SSSE3__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define MANGO_BULK_NEON
+#endif
+
+/*
+    Bulk endian conversion.
+
+    LittleEndianPointer / BigEndianPointer (misc/endian.cpp) convert one
+    value per call. That is the right tool for headers but a multi-gigabyte
+    array of big-endian samples wants the whole array converted at once:
+    here the bytes are reversed 16 or 32 bytes at a time with a byte
+    shuffle.
+
+        SSSE3   _mm_shuffle_epi8        (the makefile's -mavx includes it)
+        AVX2    _mm256_shuffle_epi8     (build with -mavx2)
+        NEON    vrev16q/vrev32q/vrev64q
+
+    The instruction set is selected at compile time like everything else
+    in MANGO; there is a scalar loop for the tail and for other targets.
+
+    load_be / load_le convert from the storage byte order into native
+    values, store_be / store_le the other way. Any type of 2, 4 or 8 bytes
+    works: integers, float, double and half. dest and source may be the
+    same array.
+
+    decode_be / decode_le read an array of packed records into one array
+    per field (structure of arrays), e.g. SomeHeader from misc/endian.cpp:
+
+        struct SomeHeader
+        {
+            uint16be a;
+            uint16be b;
+            uint32be c;
+        };
+
+        bulk::Field fields[] =
+        {
+            { 0, 2, a },    // offset, size, uint16* a
+            { 2, 2, b },
+            { 4, 4, c },
+        };
+        bulk::decode_be(fields, 3, p, sizeof(SomeHeader), count);
+*/
+
+namespace mango
+{
+namespace bulk
+{
+
+    namespace detail
+    {
+
+        template <int Size>
+        struct Swap;
+
+        template <>
+        struct Swap<2>
+        {
+            using Scalar = uint16;
+#if defined(__SSSE3__) || defined(__AVX2__)
+            static __m128i mask128()
+            {
+                return _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+            }
+#endif
+#ifdef MANGO_BULK_NEON
+            static uint8x16_t rev(uint8x16_t v)
+            {
+                return vrev16q_u8(v);
+            }
+#endif
+        };
+
+        template <>
+        struct Swap<4>
+        {
+            using Scalar = uint32;
+#if defined(__SSSE3__) || defined(__AVX2__)
+            static __m128i mask128()
+            {
+                return _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+            }
+#endif
+#ifdef MANGO_BULK_NEON
+            static uint8x16_t rev(uint8x16_t v)
+            {
+                return vrev32q_u8(v);
+            }
+#endif
+        };
+
+        template <>
+        struct Swap<8>
+        {
+            using Scalar = uint64;
+#if defined(__SSSE3__) || defined(__AVX2__)
+            static __m128i mask128()
+            {
+                return _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+            }
+#endif
+#ifdef MANGO_BULK_NEON
+            static uint8x16_t rev(uint8x16_t v)
+            {
+                return vrev64q_u8(v);
+            }
+#endif
+        };
+
+        // reverse the bytes of "count" values of Size bytes
+        template <int Size>
+        void swap(uint8* dest, const uint8* source, size_t count)
+        {
+            using S = Swap<Size>;
+
+            const size_t bytes = count * Size;
+            size_t i = 0;
+
+#if defined(__AVX2__)
+            const __m256i mask256 = _mm256_broadcastsi128_si256(S::mask128());
+            for ( ; i + 64 <= bytes; i += 64)
+            {
+                __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i + 0));
+                __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i + 32));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i + 0), _mm256_shuffle_epi8(v0, mask256));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i + 32), _mm256_shuffle_epi8(v1, mask256));
+            }
+#endif
+
+#if defined(__SSSE3__) || defined(__AVX2__)
+            const __m128i mask = S::mask128();
+            for ( ; i + 16 <= bytes; i += 16)
+            {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), _mm_shuffle_epi8(v, mask));
+            }
+#elif defined(MANGO_BULK_NEON)
+            for ( ; i + 32 <= bytes; i += 32)
+            {
+                uint8x16_t v0 = vld1q_u8(source + i + 0);
+                uint8x16_t v1 = vld1q_u8(source + i + 16);
+                vst1q_u8(dest + i + 0, S::rev(v0));
+                vst1q_u8(dest + i + 16, S::rev(v1));
+            }
+#endif
+
+            for ( ; i < bytes; i += Size)
+            {
+                typename S::Scalar value;
+                std::memcpy(&value, source + i, Size);
+                value = byteswap(value);
+                std::memcpy(dest + i, &value, Size);
+            }
+        }
+
+        inline void copy(uint8* dest, const uint8* source, size_t bytes)
+        {
+            if (dest != source)
+            {
+                std::memmove(dest, source, bytes);
+            }
+        }
+
+        template <int Size>
+        void convert(void* dest, const void* source, size_t count, bool big_endian)
+        {
+            uint8* d = reinterpret_cast<uint8*>(dest);
+            const uint8* s = reinterpret_cast<const uint8*>(source);
+
+#ifdef MANGO_LITTLE_ENDIAN
+            const bool native = !big_endian;
+#else
+            const bool native = big_endian;
+#endif
+
+            if (native)
+                copy(d, s, count * Size);
+            else
+                swap<Size>(d, s, count);
+        }
+
+        // gather one field of Size bytes from every record
+        template <int Size>
+        void gather(uint8* dest, const uint8* source, size_t stride, size_t count)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                std::memcpy(dest, source, Size);
+                dest += Size;
+                source += stride;
+            }
+        }
+
+    } // namespace detail
+
+    // -----------------------------------------------------------------
+    // arrays
+    // -----------------------------------------------------------------
+
+    template <typename T>
+    void load_be(T* dest, const void* source, size_t count)
+    {
+        static_assert(sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8, "Unsupported size.");
+        detail::convert<sizeof(T)>(dest, source, count, true);
+    }
+
+    template <typename T>
+    void load_le(T* dest, const void* source, size_t count)
+    {
+        static_assert(sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8, "Unsupported size.");
+        detail::convert<sizeof(T)>(dest, source, count, false);
+    }
+
+    template <typename T>
+    void store_be(void* dest, const T* source, size_t count)
+    {
+        static_assert(sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8, "Unsupported size.");
+        detail::convert<sizeof(T)>(dest, source, count, true);
+    }
+
+    template <typename T>
+    void store_le(void* dest, const T* source, size_t count)
+    {
+        static_assert(sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8, "Unsupported size.");
+        detail::convert<sizeof(T)>(dest, source, count, false);
+    }
+
+    // -----------------------------------------------------------------
+    // records
+    // -----------------------------------------------------------------
+
+    struct Field
+    {
+        size_t offset;  // from the start of the record
+        size_t size;    // 1, 2, 4 or 8 bytes
+        void* dest;     // array of "count" values
+    };
+
+    namespace detail
+    {
+
+        /*
+            The records are processed in chunks which stay in the L1 cache:
+            every field is first gathered into its output array and then
+            converted there in place with the vector swap. Converting each
+            field value while gathering would be a scalar byteswap per value.
+        */
+        inline void decode(const Field* fields, size_t field_count, const uint8* source,
+                           size_t stride, size_t count, bool big_endian)
+        {
+            const size_t chunk = 2048;
+
+            for (size_t base = 0; base < count; base += chunk)
+            {
+                const size_t n = std::min(chunk, count - base);
+                const uint8* records = source + base * stride;
+
+                for (size_t f = 0; f < field_count; ++f)
+                {
+                    const Field& field = fields[f];
+                    uint8* dest = reinterpret_cast<uint8*>(field.dest) + base * field.size;
+                    const uint8* src = records + field.offset;
+
+                    switch (field.size)
+                    {
+                        case 1:
+                            gather<1>(dest, src, stride, n);
+                            break;
+                        case 2:
+                            gather<2>(dest, src, stride, n);
+                            convert<2>(dest, dest, n, big_endian);
+                            break;
+                        case 4:
+                            gather<4>(dest, src, stride, n);
+                            convert<4>(dest, dest, n, big_endian);
+                            break;
+                        case 8:
+                            gather<8>(dest, src, stride, n);
+                            convert<8>(dest, dest, n, big_endian);
+                            break;
+                        default:
+                            MANGO_EXCEPTION("bulk::decode: unsupported field size.");
+                    }
+                }
+            }
+        }
+
+    } // namespace detail
+
+    inline void decode_be(const Field* fields, size_t field_count, const void* source, size_t stride, size_t count)
+    {
+        detail::decode(fields, field_count, reinterpret_cast<const uint8*>(source), stride, count, true);
+    }
+
+    inline void decode_le(const Field* fields, size_t field_count, const void* source, size_t stride, size_t count)
+    {
+        detail::decode(fields, field_count, reinterpret_cast<const uint8*>(source), stride, count, false);
+    }
+
+} // namespace bulk
+} // namespace mango
@@ -0,0 +1,324 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#include <mango/mango.hpp>
+#include "bulkendian.hpp"
+#include "endianreader.hpp"
+
+using namespace mango;
+
+// ----------------------------------------------------------------------
+// helpers
+// ----------------------------------------------------------------------
+
+namespace
+{
+
+    double gbps(size_t bytes, uint64 us)
+    {
+        return us ? double(bytes) / (us * 1000.0) : 0.0;
+    }
+
+    void print(const char* name, size_t bytes, uint64 scalar_us, uint64 bulk_us, bool match)
+    {
+        printf("%-14s %10.2f  %10.2f  %8.2fx %s\n", name,
+            gbps(bytes, scalar_us),
+            gbps(bytes, bulk_us),
+            bulk_us ? double(scalar_us) / bulk_us : 0.0,
+            match ? "" : "(MISMATCH)");
+    }
+
+} // namespace
+
+// ----------------------------------------------------------------------
+// arrays
+// ----------------------------------------------------------------------
+
+/*
+    Scalar reference: the BigEndianPointer loop from misc/endian.cpp, one
+    value per read. The bulk version converts the whole array.
+*/
+
+template <typename T, typename Read>
+void test_array(const char* name, Memory source, Read read)
+{
+    const size_t count = source.size / sizeof(T);
+    std::vector<T> scalar(count);
+    std::vector<T> bulk(count);
+
+    Timer timer;
+
+    uint64 time0 = timer.us();
+    BigEndianPointer p = source.address;
+    for (size_t i = 0; i < count; ++i)
+    {
+        scalar[i] = read(p);
+    }
+    uint64 time1 = timer.us();
+    bulk::load_be(bulk.data(), source.address, count);
+    uint64 time2 = timer.us();
+
+    const bool match = !std::memcmp(scalar.data(), bulk.data(), count * sizeof(T));
+    print(name, count * sizeof(T), time1 - time0, time2 - time1, match);
+}
+
+// ----------------------------------------------------------------------
+// records
+// ----------------------------------------------------------------------
+
+struct SomeHeader
+{
+    uint16be a;
+    uint16be b;
+    uint32be c;
+};
+
+void test_records(Memory source)
+{
+    const size_t count = source.size / sizeof(SomeHeader);
+
+    std::vector<uint16> a0(count), a1(count);
+    std::vector<uint16> b0(count), b1(count);
+    std::vector<uint32> c0(count), c1(count);
+
+    Timer timer;
+
+    // scalar: convert-on-read fields of the reinterpreted records
+    uint64 time0 = timer.us();
+    const SomeHeader* header = reinterpret_cast<const SomeHeader*>(source.address);
+    for (size_t i = 0; i < count; ++i)
+    {
+        a0[i] = header[i].a;
+        b0[i] = header[i].b;
+        c0[i] = header[i].c;
+    }
+    uint64 time1 = timer.us();
+
+    const bulk::Field fields[] =
+    {
+        { 0, 2, a1.data() },
+        { 2, 2, b1.data() },
+        { 4, 4, c1.data() },
+    };
+    bulk::decode_be(fields, 3, source.address, sizeof(SomeHeader), count);
+    uint64 time2 = timer.us();
+
+    const bool match = a0 == a1 && b0 == b1 && c0 == c1;
+    print("SomeHeader SoA", count * sizeof(SomeHeader), time1 - time0, time2 - time1, match);
+}
+
+// ----------------------------------------------------------------------
+// streams
+// ----------------------------------------------------------------------
+
+/*
+    Parse a file of little-endian records
+
+        uint32  id
+        uint16  flags
+        float   value
+        uint64  time
+
+    through the LittleEndianStream adapter and through the buffered
+    LittleEndianReader, from a File and from a MemoryStream over the same
+    data (no file system calls at all).
+*/
+
+namespace
+{
+
+    const size_t record_size = 18;
+
+    struct Records
+    {
+        std::vector<uint32> id;
+        std::vector<uint16> flags;
+        std::vector<float> value;
+        std::vector<uint64> time;
+
+        Records(size_t count)
+            : id(count), flags(count), value(count), time(count)
+        {
+        }
+
+        uint64 checksum() const
+        {
+            uint64 sum = 0;
+            for (size_t i = 0; i < id.size(); ++i)
+            {
+                uint32 v;
+                std::memcpy(&v, &value[i], 4);
+                sum += id[i] + flags[i] + v + time[i];
+            }
+            return sum;
+        }
+    };
+
+    template <typename Open>
+    void test_reader(const char* name, size_t count, Open open)
+    {
+        Timer timer;
+        uint64 sums[4] = { 0, 0, 0, 0 };
+        uint64 times[4];
+
+        // LittleEndianStream: a Stream::read per value
+        {
+            auto stream = open();
+            uint64 time0 = timer.us();
+            LittleEndianStream s = *stream;
+            uint64 sum = 0;
+            for (size_t i = 0; i < count; ++i)
+            {
+                uint32 id = s.read32();
+                uint16 flags = s.read16();
+                float value = s.read32f();
+                uint64 time = s.read64();
+                uint32 v;
+                std::memcpy(&v, &value, 4);
+                sum += id + flags + v + time;
+            }
+            times[0] = timer.us() - time0;
+            sums[0] = sum;
+        }
+
+        // LittleEndianReader: checked read per value
+        {
+            auto stream = open();
+            uint64 time0 = timer.us();
+            LittleEndianReader s(*stream);
+            uint64 sum = 0;
+            for (size_t i = 0; i < count; ++i)
+            {
+                uint32 id = s.read32();
+                uint16 flags = s.read16();
+                float value = s.read32f();
+                uint64 time = s.read64();
+                uint32 v;
+                std::memcpy(&v, &value, 4);
+                sum += id + flags + v + time;
+            }
+            times[1] = timer.us() - time0;
+            sums[1] = sum;
+        }
+
+        // LittleEndianReader: one check per record
+        {
+            auto stream = open();
+            uint64 time0 = timer.us();
+            LittleEndianReader s(*stream);
+            uint64 sum = 0;
+            for (size_t i = 0; i < count; ++i)
+            {
+                auto b = s.batch(record_size);
+                uint32 id = b.read32();
+                uint16 flags = b.read16();
+                float value = b.read32f();
+                uint64 time = b.read64();
+                uint32 v;
+                std::memcpy(&v, &value, 4);
+                sum += id + flags + v + time;
+            }
+            times[2] = timer.us() - time0;
+            sums[2] = sum;
+        }
+
+        // LittleEndianReader: records into SoA arrays
+        {
+            auto stream = open();
+            Records records(count);
+            uint64 time0 = timer.us();
+            LittleEndianReader s(*stream);
+            const bulk::Field fields[] =
+            {
+                { 0, 4, records.id.data() },
+                { 4, 2, records.flags.data() },
+                { 6, 4, records.value.data() },
+                { 10, 8, records.time.data() },
+            };
+            s.read_records(fields, 4, record_size, count);
+            times[3] = timer.us() - time0;
+            sums[3] = records.checksum();
+        }
+
+        const size_t bytes = count * record_size;
+        const bool match = sums[0] == sums[1] && sums[0] == sums[2] && sums[0] == sums[3];
+
+        printf("%-12s %12.3f  %12.3f  %12.3f  %12.3f %s\n", name,
+            gbps(bytes, times[0]), gbps(bytes, times[1]),
+            gbps(bytes, times[2]), gbps(bytes, times[3]),
+            match ? "" : "(MISMATCH)");
+    }
+
+} // namespace
+
+void test_stream(const std::string& filename)
+{
+    const size_t count = 4 * 1024 * 1024;
+
+    {
+        std::vector<uint8> buffer(count * record_size);
+        uint8* p = buffer.data();
+        uint32 seed = 1;
+        for (size_t i = 0; i < count; ++i)
+        {
+            seed = seed * 1664525 + 1013904223;
+            ustore32le(p + 0, uint32(i));
+            ustore16le(p + 4, uint16(seed >> 16));
+            ustore32le(p + 6, seed & 0x3fffffff); // finite float bit patterns
+            ustore64le(p + 10, uint64(seed) * 1000003);
+            p += record_size;
+        }
+
+        FileStream file(filename, FileStream::WRITE);
+        file.write(buffer.data(), buffer.size());
+    }
+
+    printf("\nrecords: %zu x %zu bytes\n\n", count, record_size);
+    printf("source       stream GB/s   reader GB/s    batch GB/s      SoA GB/s\n");
+
+    test_reader("File", count, [&] {
+        return std::unique_ptr<Stream>(new File(filename));
+    });
+
+    File file(filename);
+    test_reader("MemoryStream", count, [&] {
+        return std::unique_ptr<Stream>(new MemoryStream(file));
+    });
+}
+
+// ----------------------------------------------------------------------
+// main()
+// ----------------------------------------------------------------------
+
+int main(int argc, const char* argv[])
+{
+    const std::string filename = argc > 1 ? argv[1] : "endian_records.bin";
+
+    // big-endian "sensor dump" of pseudo-random data; the float and half
+    // tests compare bit patterns so NaNs don't matter
+    const size_t size = 256 * 1024 * 1024;
+    std::vector<uint8> buffer(size);
+
+    uint32 seed = 1;
+    for (size_t i = 0; i < size; i += 4)
+    {
+        seed = seed * 1664525 + 1013904223;
+        std::memcpy(&buffer[i], &seed, 4);
+    }
+
+    Memory source(buffer.data(), size);
+
+    printf("big endian -> native, %zu MB\n\n", size >> 20);
+    printf("type           scalar GB/s   bulk GB/s   speedup\n");
+
+    test_array<uint16>("uint16", source, [] (BigEndianPointer& p) { return p.read16(); });
+    test_array<uint32>("uint32", source, [] (BigEndianPointer& p) { return p.read32(); });
+    test_array<uint64>("uint64", source, [] (BigEndianPointer& p) { return p.read64(); });
+    test_array<half>("half", source, [] (BigEndianPointer& p) { return p.read16f(); });
+    test_array<float>("float", source, [] (BigEndianPointer& p) { return p.read32f(); });
+    test_array<double>("double", source, [] (BigEndianPointer& p) { return p.read64f(); });
+    test_records(source);
+
+    test_stream(filename);
+}
@@ -0,0 +1,347 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <mango/mango.hpp>
+#include "bulkendian.hpp"
+
+/*
+    Buffered endian reader.
+
+    LittleEndianStream / BigEndianStream forward every read16() to
+    Stream::read(): a virtual call and a small memcpy per value. That is
+    fine for a header but not for parsing millions of values.
+
+    EndianReader reads the Stream in large windows and serves the values
+    from memory:
+
+    - read16() etc. check the window and load; the refill is out of line
+    - batch(n) checks once that n bytes are available and returns a
+      Batch which reads them without any checks
+    - read_array<T>() converts whole arrays with bulk::load_be/le; large
+      arrays are read straight from the Stream into the destination
+    - read_struct<T>() copies a packed record; use the uint16be-style
+      field types (misc/endian.cpp SomeHeader) for convert-on-read
+    - read_records() decodes an array of packed records into SoA arrays
+
+    Reading past the end of the stream throws.
+
+    The reader owns the position: don't read the underlying Stream while
+    the reader is in use.
+*/
+
+namespace mango
+{
+
+    template <bool BigEndian>
+    class EndianReader
+    {
+    protected:
+        Stream& m_stream;
+        std::vector<uint8> m_buffer;
+        const uint8* m_current;
+        const uint8* m_end;
+        uint64 m_remaining; // in the stream after the window
+
+        static uint16 load16(const uint8* p)
+        {
+            return BigEndian ? uload16be(p) : uload16le(p);
+        }
+
+        static uint32 load32(const uint8* p)
+        {
+            return BigEndian ? uload32be(p) : uload32le(p);
+        }
+
+        static uint64 load64(const uint8* p)
+        {
+            return BigEndian ? uload64be(p) : uload64le(p);
+        }
+
+        template <typename T>
+        static T cast(uint16 value)
+        {
+            T result;
+            std::memcpy(&result, &value, 2);
+            return result;
+        }
+
+        template <typename T>
+        static T cast(uint32 value)
+        {
+            T result;
+            std::memcpy(&result, &value, 4);
+            return result;
+        }
+
+        template <typename T>
+        static T cast(uint64 value)
+        {
+            T result;
+            std::memcpy(&result, &value, 8);
+            return result;
+        }
+
+        // make at least "bytes" available in the window
+        void refill(size_t bytes)
+        {
+            const size_t available = size_t(m_end - m_current);
+            if (available + m_remaining < bytes)
+            {
+                MANGO_EXCEPTION("EndianReader: read past end of stream.");
+            }
+
+            // the resize can move the buffer: m_current is only valid as an offset
+            const size_t position = size_t(m_current - m_buffer.data());
+            if (bytes > m_buffer.size())
+            {
+                m_buffer.resize(bytes);
+            }
+
+            // keep the unread tail and fill the rest of the window
+            std::memmove(m_buffer.data(), m_buffer.data() + position, available);
+            const size_t read = size_t(std::min<uint64>(m_buffer.size() - available, m_remaining));
+            m_stream.read(m_buffer.data() + available, read);
+            m_remaining -= read;
+
+            m_current = m_buffer.data();
+            m_end = m_current + available + read;
+        }
+
+        const uint8* consume(size_t bytes)
+        {
+            if (size_t(m_end - m_current) < bytes)
+            {
+                refill(bytes);
+            }
+
+            const uint8* p = m_current;
+            m_current += bytes;
+            return p;
+        }
+
+    public:
+        class Batch
+        {
+        protected:
+            const uint8* p;
+
+        public:
+            Batch(const uint8* address)
+                : p(address)
+            {
+            }
+
+            uint8 read8()
+            {
+                return *p++;
+            }
+
+            uint16 read16()
+            {
+                uint16 value = load16(p);
+                p += 2;
+                return value;
+            }
+
+            uint32 read32()
+            {
+                uint32 value = load32(p);
+                p += 4;
+                return value;
+            }
+
+            uint64 read64()
+            {
+                uint64 value = load64(p);
+                p += 8;
+                return value;
+            }
+
+            half read16f()
+            {
+                return cast<half>(read16());
+            }
+
+            float read32f()
+            {
+                return cast<float>(read32());
+            }
+
+            double read64f()
+            {
+                return cast<double>(read64());
+            }
+
+            void skip(size_t bytes)
+            {
+                p += bytes;
+            }
+        };
+
+        EndianReader(Stream& stream, size_t window = 256 * 1024)
+            : m_stream(stream)
+            , m_buffer(window)
+        {
+            m_current = m_buffer.data();
+            m_end = m_current;
+            m_remaining = stream.size() - stream.offset();
+        }
+
+        // position in the underlying stream
+        uint64 offset() const
+        {
+            return m_stream.size() - m_remaining - uint64(m_end - m_current);
+        }
+
+        uint64 remaining() const
+        {
+            return m_remaining + uint64(m_end - m_current);
+        }
+
+        // one bounds check for the next "bytes" bytes
+        Batch batch(size_t bytes)
+        {
+            return Batch(consume(bytes));
+        }
+
+        uint8 read8()
+        {
+            return *consume(1);
+        }
+
+        uint16 read16()
+        {
+            return load16(consume(2));
+        }
+
+        uint32 read32()
+        {
+            return load32(consume(4));
+        }
+
+        uint64 read64()
+        {
+            return load64(consume(8));
+        }
+
+        half read16f()
+        {
+            return cast<half>(read16());
+        }
+
+        float read32f()
+        {
+            return cast<float>(read32());
+        }
+
+        double read64f()
+        {
+            return cast<double>(read64());
+        }
+
+        void read(void* dest, size_t bytes)
+        {
+            uint8* d = reinterpret_cast<uint8*>(dest);
+
+            // drain the window, then bypass it for the rest
+            const size_t available = std::min(bytes, size_t(m_end - m_current));
+            std::memcpy(d, m_current, available);
+            m_current += available;
+            d += available;
+            bytes -= available;
+
+            if (bytes > m_buffer.size() / 2)
+            {
+                if (bytes > m_remaining)
+                {
+                    MANGO_EXCEPTION("EndianReader: read past end of stream.");
+                }
+                m_stream.read(d, bytes);
+                m_remaining -= bytes;
+            }
+            else if (bytes)
+            {
+                std::memcpy(d, consume(bytes), bytes);
+            }
+        }
+
+        void skip(uint64 bytes)
+        {
+            const size_t available = size_t(std::min<uint64>(bytes, uint64(m_end - m_current)));
+            m_current += available;
+            bytes -= available;
+
+            if (bytes)
+            {
+                if (bytes > m_remaining)
+                {
+                    MANGO_EXCEPTION("EndianReader: skip past end of stream.");
+                }
+                m_stream.seek(int64(bytes), Stream::CURRENT);
+                m_remaining -= bytes;
+            }
+        }
+
+        template <typename T>
+        void read_array(T* dest, size_t count)
+        {
+            read(dest, count * sizeof(T));
+            if (BigEndian)
+                bulk::load_be(dest, dest, count);
+            else
+                bulk::load_le(dest, dest, count);
+        }
+
+        template <typename T>
+        T read_struct()
+        {
+            T value;
+            std::memcpy(&value, consume(sizeof(T)), sizeof(T));
+            return value;
+        }
+
+        template <typename T>
+        void read_struct(T* dest, size_t count)
+        {
+            read(dest, count * sizeof(T));
+        }
+
+        // "count" packed records of "stride" bytes into the field arrays
+        void read_records(const bulk::Field* fields, size_t field_count, size_t stride, size_t count)
+        {
+            if (field_count > 16)
+            {
+                MANGO_EXCEPTION("EndianReader: too many fields.");
+            }
+
+            const size_t chunk = std::max<size_t>(1, m_buffer.size() / 2 / stride);
+
+            for (size_t base = 0; base < count; )
+            {
+                const size_t n = std::min(chunk, count - base);
+
+                bulk::Field window[16];
+                for (size_t f = 0; f < field_count; ++f)
+                {
+                    window[f] = fields[f];
+                    window[f].dest = reinterpret_cast<uint8*>(fields[f].dest) + base * fields[f].size;
+                }
+
+                const uint8* p = consume(n * stride);
+                if (BigEndian)
+                    bulk::decode_be(window, field_count, p, stride, n);
+                else
+                    bulk::decode_le(window, field_count, p, stride, n);
+
+                base += n;
+            }
+        }
+    };
+
+    using LittleEndianReader = EndianReader<false>;
+    using BigEndianReader = EndianReader<true>;
+
+} // namespace mango
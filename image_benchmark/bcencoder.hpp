@@ -0,0 +1,1205 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <mango/mango.hpp>
+#include <mango/image/image.hpp>
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+#include "mipmap.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+    #define BC_ENABLE_SSE2
+    #include <emmintrin.h>
+#endif
+
+/*
+    Block compressed texture encoders for the files misc/image_loading.cpp
+    maps straight to the driver.
+
+        std::vector<uint8> blocks(bc::bound(bc::Type::BC7, bitmap.width, bitmap.height));
+        bc::encode(Memory(blocks.data(), blocks.size()), bitmap, bc::Type::BC7);
+
+    BC1     RGB, 4 color mode (the 3 color + transparent mode is not used)
+    BC3     BC4 alpha block + BC1 color block
+    BC4     one channel (red), 8 level mode
+    BC5     two BC4 blocks (red, green), for normal maps
+    BC7     mode 6: one RGBA subset, 7777 endpoints with a p-bit each and
+            16 levels. Mode 6 is the universal mode of the fast BC7
+            encoders; the partitioned modes are not searched.
+
+    Every block goes through the same steps: the principal axis of the
+    pixels gives the first endpoints, the nearest palette entry is found
+    for every pixel and the endpoints are refined with least squares from
+    the chosen weights for as long as the error goes down. The tiers:
+
+    FAST    extremes of the pixels on the principal axis
+    NORMAL  one refinement; BC7 tries all four p-bit combinations
+    HIGH    four refinements; BC4 / BC5 search the neighbourhood of the
+            endpoints
+
+    The nearest palette entry search is the hot loop: SSE2 handles four
+    pixels at a time against one palette entry. encode<false>() is the
+    same algorithm in plain scalar code, for measuring the SIMD speedup;
+    it is not an independent reference encoder. The source is R8G8B8A8
+    or B8G8R8A8, other formats are converted with blit(). Edge blocks
+    repeat the last row and column. The rows of blocks are encoded in
+    bands in the ThreadPool; for a Texture the bands of every mip level
+    go into the same queue so that the small levels do not run one after
+    another.
+
+    decode() expands the blocks back to R8G8B8A8 for measuring the error:
+    BC4 is (r, 0, 0, 255), BC5 (r, g, 0, 255) and BC7 must be mode 6.
+
+    Texture is a compressed mip chain in one allocation; save() writes it
+    as DDS (DX10 header for BC7 and sRGB) or KTX by the file extension.
+*/
+
+namespace mango
+{
+namespace bc
+{
+
+    enum class Type
+    {
+        BC1,
+        BC3,
+        BC4,
+        BC5,
+        BC7
+    };
+
+    enum class Quality
+    {
+        FAST,
+        NORMAL,
+        HIGH
+    };
+
+    inline const char* getName(Type type)
+    {
+        switch (type)
+        {
+            case Type::BC1: return "BC1";
+            case Type::BC3: return "BC3";
+            case Type::BC4: return "BC4";
+            case Type::BC5: return "BC5";
+            case Type::BC7: return "BC7";
+        }
+        return "";
+    }
+
+    inline const char* getName(Quality quality)
+    {
+        switch (quality)
+        {
+            case Quality::FAST: return "fast";
+            case Quality::NORMAL: return "normal";
+            case Quality::HIGH: return "high";
+        }
+        return "";
+    }
+
+    inline int getBlockSize(Type type)
+    {
+        return type == Type::BC1 || type == Type::BC4 ? 8 : 16;
+    }
+
+    inline size_t bound(Type type, int width, int height)
+    {
+        return size_t((width + 3) / 4) * ((height + 3) / 4) * getBlockSize(type);
+    }
+
+    // -----------------------------------------------------------------
+    // block analysis
+    // -----------------------------------------------------------------
+
+    struct alignas(16) Block
+    {
+        float v[4][16];     // r, g, b, a of the 4x4 pixels, 0 .. 255
+    };
+
+    inline void load(Block& block, const Surface& source, int x0, int y0, bool bgra)
+    {
+        const int r = bgra ? 2 : 0;
+        const int b = bgra ? 0 : 2;
+
+        for (int y = 0; y < 4; ++y)
+        {
+            const uint8* scan = source.image + std::min(y0 + y, source.height - 1) * source.stride;
+            for (int x = 0; x < 4; ++x)
+            {
+                const uint8* s = scan + std::min(x0 + x, source.width - 1) * 4;
+                const int i = y * 4 + x;
+                block.v[0][i] = s[r];
+                block.v[1][i] = s[1];
+                block.v[2][i] = s[b];
+                block.v[3][i] = s[3];
+            }
+        }
+    }
+
+    // nearest palette entry of every pixel over the channels [first, first + channels);
+    // returns the sum of the squared distances
+    template <bool SIMD>
+    float nearest(uint8* index, const Block& block, int first, int channels, const float (*palette)[4], int count)
+    {
+        float total = 0.0f;
+
+#ifdef BC_ENABLE_SSE2
+        if (SIMD)
+        {
+            for (int i = 0; i < 16; i += 4)
+            {
+                __m128 value[4];
+                for (int c = 0; c < channels; ++c)
+                {
+                    value[c] = _mm_load_ps(block.v[first + c] + i);
+                }
+
+                __m128 best = _mm_set1_ps(std::numeric_limits<float>::max());
+                __m128i best_index = _mm_setzero_si128();
+
+                for (int k = 0; k < count; ++k)
+                {
+                    __m128 distance = _mm_setzero_ps();
+                    for (int c = 0; c < channels; ++c)
+                    {
+                        const __m128 delta = _mm_sub_ps(value[c], _mm_set1_ps(palette[k][c]));
+                        distance = _mm_add_ps(distance, _mm_mul_ps(delta, delta));
+                    }
+
+                    const __m128i mask = _mm_castps_si128(_mm_cmplt_ps(distance, best));
+                    best = _mm_min_ps(distance, best);
+                    best_index = _mm_or_si128(_mm_and_si128(mask, _mm_set1_epi32(k)), _mm_andnot_si128(mask, best_index));
+                }
+
+                alignas(16) int32 temp_index[4];
+                alignas(16) float temp_error[4];
+                _mm_store_si128(reinterpret_cast<__m128i*>(temp_index), best_index);
+                _mm_store_ps(temp_error, best);
+
+                for (int j = 0; j < 4; ++j)
+                {
+                    index[i + j] = uint8(temp_index[j]);
+                    total += temp_error[j];
+                }
+            }
+
+            return total;
+        }
+#endif
+
+        for (int i = 0; i < 16; ++i)
+        {
+            float best = std::numeric_limits<float>::max();
+            int best_index = 0;
+
+            for (int k = 0; k < count; ++k)
+            {
+                float distance = 0.0f;
+                for (int c = 0; c < channels; ++c)
+                {
+                    const float delta = block.v[first + c][i] - palette[k][c];
+                    distance += delta * delta;
+                }
+
+                if (distance < best)
+                {
+                    best = distance;
+                    best_index = k;
+                }
+            }
+
+            index[i] = uint8(best_index);
+            total += best;
+        }
+
+        return total;
+    }
+
+    // mean and principal axis (unit length, or zero for a flat block)
+    inline void principal(float* mean, float* axis, const Block& block, int first, int channels)
+    {
+        float covariance[4][4] = {};
+
+        for (int c = 0; c < channels; ++c)
+        {
+            float sum = 0.0f;
+            for (int i = 0; i < 16; ++i)
+                sum += block.v[first + c][i];
+            mean[c] = sum * (1.0f / 16.0f);
+        }
+
+        for (int c = 0; c < channels; ++c)
+        {
+            for (int d = c; d < channels; ++d)
+            {
+                float sum = 0.0f;
+                for (int i = 0; i < 16; ++i)
+                    sum += (block.v[first + c][i] - mean[c]) * (block.v[first + d][i] - mean[d]);
+                covariance[c][d] = sum;
+                covariance[d][c] = sum;
+            }
+        }
+
+        // power iteration from the row of the largest variance
+        int largest = 0;
+        for (int c = 1; c < channels; ++c)
+        {
+            if (covariance[c][c] > covariance[largest][largest])
+                largest = c;
+        }
+
+        for (int c = 0; c < channels; ++c)
+            axis[c] = covariance[largest][c];
+
+        for (int iteration = 0; iteration < 8; ++iteration)
+        {
+            float temp[4];
+            float scale = 0.0f;
+            for (int c = 0; c < channels; ++c)
+            {
+                temp[c] = 0.0f;
+                for (int d = 0; d < channels; ++d)
+                    temp[c] += covariance[c][d] * axis[d];
+                scale = std::max(scale, std::abs(temp[c]));
+            }
+
+            if (scale == 0.0f)
+                break;
+
+            for (int c = 0; c < channels; ++c)
+                axis[c] = temp[c] / scale;
+        }
+
+        float length = 0.0f;
+        for (int c = 0; c < channels; ++c)
+            length += axis[c] * axis[c];
+
+        length = length > 0.0f ? 1.0f / std::sqrt(length) : 0.0f;
+        for (int c = 0; c < channels; ++c)
+            axis[c] *= length;
+    }
+
+    // the extreme pixels projected on the axis
+    inline void extremes(float* e0, float* e1, const Block& block, int first, int channels, const float* mean, const float* axis)
+    {
+        float t0 = 0.0f;
+        float t1 = 0.0f;
+
+        for (int i = 0; i < 16; ++i)
+        {
+            float t = 0.0f;
+            for (int c = 0; c < channels; ++c)
+                t += (block.v[first + c][i] - mean[c]) * axis[c];
+            t0 = std::min(t0, t);
+            t1 = std::max(t1, t);
+        }
+
+        for (int c = 0; c < channels; ++c)
+        {
+            e0[c] = std::min(std::max(mean[c] + axis[c] * t0, 0.0f), 255.0f);
+            e1[c] = std::min(std::max(mean[c] + axis[c] * t1, 0.0f), 255.0f);
+        }
+    }
+
+    // least squares endpoints for the pixel weights t (0: e0, 1: e1); false when singular
+    inline bool refine(float* e0, float* e1, const Block& block, int first, int channels, const float* t)
+    {
+        float a = 0.0f;
+        float b = 0.0f;
+        float c = 0.0f;
+        float r0[4] = {};
+        float r1[4] = {};
+
+        for (int i = 0; i < 16; ++i)
+        {
+            const float w = t[i];
+            a += (1.0f - w) * (1.0f - w);
+            b += (1.0f - w) * w;
+            c += w * w;
+            for (int k = 0; k < channels; ++k)
+            {
+                r0[k] += (1.0f - w) * block.v[first + k][i];
+                r1[k] += w * block.v[first + k][i];
+            }
+        }
+
+        const float det = a * c - b * b;
+        if (std::abs(det) < 1e-4f)
+            return false;
+
+        const float scale = 1.0f / det;
+        for (int k = 0; k < channels; ++k)
+        {
+            e0[k] = std::min(std::max((c * r0[k] - b * r1[k]) * scale, 0.0f), 255.0f);
+            e1[k] = std::min(std::max((a * r1[k] - b * r0[k]) * scale, 0.0f), 255.0f);
+        }
+
+        return true;
+    }
+
+    inline int getRefinements(Quality quality)
+    {
+        return quality == Quality::FAST ? 0 : quality == Quality::NORMAL ? 1 : 4;
+    }
+
+    // -----------------------------------------------------------------
+    // BC1
+    // -----------------------------------------------------------------
+
+    inline uint16 pack565(const float* color)
+    {
+        const int r = int(color[0] * (31.0f / 255.0f) + 0.5f);
+        const int g = int(color[1] * (63.0f / 255.0f) + 0.5f);
+        const int b = int(color[2] * (31.0f / 255.0f) + 0.5f);
+        return uint16((r << 11) | (g << 5) | b);
+    }
+
+    // the colors the decoder produces; 3 color mode when c0 <= c1 unless "four" is set (BC3)
+    inline void bc1_colors(int (*color)[4], uint16 c0, uint16 c1, bool four)
+    {
+        const uint16 c[] = { c0, c1 };
+        for (int i = 0; i < 2; ++i)
+        {
+            const int r = (c[i] >> 11) & 31;
+            const int g = (c[i] >> 5) & 63;
+            const int b = c[i] & 31;
+            color[i][0] = (r << 3) | (r >> 2);
+            color[i][1] = (g << 2) | (g >> 4);
+            color[i][2] = (b << 3) | (b >> 2);
+            color[i][3] = 255;
+        }
+
+        for (int k = 0; k < 4; ++k)
+        {
+            if (four || c0 > c1)
+            {
+                color[2][k] = (color[0][k] * 2 + color[1][k] + 1) / 3;
+                color[3][k] = (color[0][k] + color[1][k] * 2 + 1) / 3;
+            }
+            else
+            {
+                color[2][k] = (color[0][k] + color[1][k]) / 2;
+                color[3][k] = 0;
+            }
+        }
+    }
+
+    template <bool SIMD>
+    void encode_bc1(uint8* dest, const Block& block, Quality quality)
+    {
+        static const float weight[] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+
+        float mean[4];
+        float axis[4];
+        float e0[4];
+        float e1[4];
+        principal(mean, axis, block, 0, 3);
+        extremes(e0, e1, block, 0, 3, mean, axis);
+
+        uint16 best0 = 0;
+        uint16 best1 = 0;
+        uint8 best_index[16];
+        float best_error = std::numeric_limits<float>::max();
+
+        for (int iteration = 0; ; ++iteration)
+        {
+            const uint16 c0 = pack565(e0);
+            const uint16 c1 = pack565(e1);
+
+            // the interpolated colors are symmetric: the order is fixed when writing
+            int color[4][4];
+            bc1_colors(color, c0, c1, true);
+
+            float palette[4][4];
+            for (int k = 0; k < 4; ++k)
+            {
+                for (int c = 0; c < 4; ++c)
+                    palette[k][c] = float(color[k][c]);
+            }
+
+            uint8 index[16];
+            const float error = nearest<SIMD>(index, block, 0, 3, palette, 4);
+            if (error < best_error)
+            {
+                best_error = error;
+                best0 = c0;
+                best1 = c1;
+                std::memcpy(best_index, index, 16);
+            }
+            else if (iteration)
+            {
+                break;
+            }
+
+            if (iteration == getRefinements(quality) || !error)
+                break;
+
+            float t[16];
+            for (int i = 0; i < 16; ++i)
+                t[i] = weight[index[i]];
+
+            if (!refine(e0, e1, block, 0, 3, t))
+                break;
+        }
+
+        // 4 color mode needs c0 > c1
+        uint32 mask = 0;
+        if (best0 != best1)
+        {
+            const uint32 flip = best0 < best1 ? 1 : 0;
+            for (int i = 0; i < 16; ++i)
+                mask |= (best_index[i] ^ flip) << (i * 2);
+            if (flip)
+                std::swap(best0, best1);
+        }
+
+        dest[0] = uint8(best0);
+        dest[1] = uint8(best0 >> 8);
+        dest[2] = uint8(best1);
+        dest[3] = uint8(best1 >> 8);
+        dest[4] = uint8(mask);
+        dest[5] = uint8(mask >> 8);
+        dest[6] = uint8(mask >> 16);
+        dest[7] = uint8(mask >> 24);
+    }
+
+    // -----------------------------------------------------------------
+    // BC4
+    // -----------------------------------------------------------------
+
+    // the values the decoder produces; 8 levels when a0 > a1, else 6 levels, 0 and 255
+    inline void bc4_values(int* value, int a0, int a1)
+    {
+        value[0] = a0;
+        value[1] = a1;
+
+        if (a0 > a1)
+        {
+            for (int i = 2; i < 8; ++i)
+                value[i] = ((8 - i) * a0 + (i - 1) * a1 + 3) / 7;
+        }
+        else
+        {
+            for (int i = 2; i < 6; ++i)
+                value[i] = ((6 - i) * a0 + (i - 1) * a1 + 2) / 5;
+            value[6] = 0;
+            value[7] = 255;
+        }
+    }
+
+    template <bool SIMD>
+    float bc4_evaluate(uint8* index, const Block& block, int channel, int a0, int a1)
+    {
+        int value[8];
+        bc4_values(value, a0, a1);
+
+        float palette[8][4];
+        for (int k = 0; k < 8; ++k)
+            palette[k][0] = float(value[k]);
+
+        return nearest<SIMD>(index, block, channel, 1, palette, 8);
+    }
+
+    template <bool SIMD>
+    void encode_bc4(uint8* dest, const Block& block, int channel, Quality quality)
+    {
+        static const float weight[] = { 0.0f, 1.0f, 1.0f / 7, 2.0f / 7, 3.0f / 7, 4.0f / 7, 5.0f / 7, 6.0f / 7 };
+
+        float e0 = 0.0f;
+        float e1 = 255.0f;
+        for (int i = 0; i < 16; ++i)
+        {
+            e0 = std::max(e0, block.v[channel][i]);
+            e1 = std::min(e1, block.v[channel][i]);
+        }
+
+        int best0 = 0;
+        int best1 = 0;
+        uint8 best_index[16];
+        float best_error = std::numeric_limits<float>::max();
+
+        for (int iteration = 0; ; ++iteration)
+        {
+            // refinement can swap the ends: keep the 8 level mode
+            const int a0 = int(std::max(e0, e1) + 0.5f);
+            const int a1 = int(std::min(e0, e1) + 0.5f);
+
+            uint8 index[16];
+            const float error = bc4_evaluate<SIMD>(index, block, channel, a0, a1);
+            if (error < best_error)
+            {
+                best_error = error;
+                best0 = a0;
+                best1 = a1;
+                std::memcpy(best_index, index, 16);
+            }
+            else if (iteration)
+            {
+                break;
+            }
+
+            if (iteration == getRefinements(quality) || !error)
+                break;
+
+            float t[16];
+            for (int i = 0; i < 16; ++i)
+                t[i] = weight[index[i]];
+
+            e0 = float(a0);
+            e1 = float(a1);
+            if (!refine(&e0, &e1, block, channel, 1, t))
+                break;
+        }
+
+        if (quality == Quality::HIGH && best_error > 0.0f)
+        {
+            const int c0 = best0;
+            const int c1 = best1;
+            for (int d0 = -2; d0 <= 2; ++d0)
+            {
+                for (int d1 = -2; d1 <= 2; ++d1)
+                {
+                    const int a0 = std::min(std::max(c0 + d0, 0), 255);
+                    const int a1 = std::min(std::max(c1 + d1, 0), 255);
+                    if (a0 <= a1)
+                        continue;
+
+                    uint8 index[16];
+                    const float error = bc4_evaluate<SIMD>(index, block, channel, a0, a1);
+                    if (error < best_error)
+                    {
+                        best_error = error;
+                        best0 = a0;
+                        best1 = a1;
+                        std::memcpy(best_index, index, 16);
+                    }
+                }
+            }
+        }
+
+        uint64 mask = 0;
+        for (int i = 0; i < 16; ++i)
+            mask |= uint64(best_index[i]) << (i * 3);
+
+        dest[0] = uint8(best0);
+        dest[1] = uint8(best1);
+        for (int i = 0; i < 6; ++i)
+            dest[2 + i] = uint8(mask >> (i * 8));
+    }
+
+    // -----------------------------------------------------------------
+    // BC7 mode 6
+    // -----------------------------------------------------------------
+
+    static const int bc7_weight4[] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+    struct BitWriter
+    {
+        uint64 data[2] = { 0, 0 };
+        int offset = 0;
+
+        void write(uint32 value, int bits)
+        {
+            for (int i = 0; i < bits; ++i, ++offset)
+                data[offset >> 6] |= uint64((value >> i) & 1) << (offset & 63);
+        }
+    };
+
+    struct BitReader
+    {
+        uint64 data[2];
+        int offset = 0;
+
+        BitReader(const uint8* p)
+        {
+            data[0] = 0;
+            data[1] = 0;
+            for (int i = 0; i < 16; ++i)
+                data[i >> 3] |= uint64(p[i]) << ((i & 7) * 8);
+        }
+
+        uint32 read(int bits)
+        {
+            uint32 value = 0;
+            for (int i = 0; i < bits; ++i, ++offset)
+                value |= uint32((data[offset >> 6] >> (offset & 63)) & 1) << i;
+            return value;
+        }
+    };
+
+    // 8 bit endpoint -> 7 bits with the p-bit
+    inline int bc7_quantize(float value, int pbit)
+    {
+        return std::min(std::max(int(std::floor((value - pbit) * 0.5f + 0.5f)), 0), 127);
+    }
+
+    inline void bc7_colors(int (*color)[4], const int (*q)[4], const int* pbit)
+    {
+        for (int c = 0; c < 4; ++c)
+        {
+            const int v0 = (q[0][c] << 1) | pbit[0];
+            const int v1 = (q[1][c] << 1) | pbit[1];
+            for (int k = 0; k < 16; ++k)
+                color[k][c] = ((64 - bc7_weight4[k]) * v0 + bc7_weight4[k] * v1 + 32) >> 6;
+        }
+    }
+
+    struct BC7Endpoints
+    {
+        int q[2][4];
+        int pbit[2];
+    };
+
+    template <bool SIMD>
+    float bc7_evaluate(uint8* index, BC7Endpoints& endpoints, const Block& block, const float* e0, const float* e1, Quality quality)
+    {
+        const float* e[] = { e0, e1 };
+        float best_error = std::numeric_limits<float>::max();
+
+        const int combinations = quality == Quality::FAST ? 1 : 4;
+
+        for (int combination = 0; combination < combinations; ++combination)
+        {
+            BC7Endpoints current;
+            current.pbit[0] = combination & 1;
+            current.pbit[1] = combination >> 1;
+
+            if (quality == Quality::FAST)
+            {
+                // the p-bit of each endpoint with the smaller quantization error
+                for (int i = 0; i < 2; ++i)
+                {
+                    float error[2] = { 0.0f, 0.0f };
+                    for (int p = 0; p < 2; ++p)
+                    {
+                        for (int c = 0; c < 4; ++c)
+                        {
+                            const float delta = float((bc7_quantize(e[i][c], p) << 1) | p) - e[i][c];
+                            error[p] += delta * delta;
+                        }
+                    }
+                    current.pbit[i] = error[1] < error[0];
+                }
+            }
+
+            for (int i = 0; i < 2; ++i)
+            {
+                for (int c = 0; c < 4; ++c)
+                    current.q[i][c] = bc7_quantize(e[i][c], current.pbit[i]);
+            }
+
+            int color[16][4];
+            bc7_colors(color, current.q, current.pbit);
+
+            float palette[16][4];
+            for (int k = 0; k < 16; ++k)
+            {
+                for (int c = 0; c < 4; ++c)
+                    palette[k][c] = float(color[k][c]);
+            }
+
+            uint8 temp[16];
+            const float error = nearest<SIMD>(temp, block, 0, 4, palette, 16);
+            if (error < best_error)
+            {
+                best_error = error;
+                endpoints = current;
+                std::memcpy(index, temp, 16);
+            }
+        }
+
+        return best_error;
+    }
+
+    template <bool SIMD>
+    void encode_bc7(uint8* dest, const Block& block, Quality quality)
+    {
+        float mean[4];
+        float axis[4];
+        float e0[4];
+        float e1[4];
+        principal(mean, axis, block, 0, 4);
+        extremes(e0, e1, block, 0, 4, mean, axis);
+
+        BC7Endpoints best;
+        uint8 best_index[16];
+        float best_error = std::numeric_limits<float>::max();
+        const int refinements = quality == Quality::HIGH ? 3 : getRefinements(quality);
+
+        for (int iteration = 0; ; ++iteration)
+        {
+            BC7Endpoints endpoints;
+            uint8 index[16];
+            const float error = bc7_evaluate<SIMD>(index, endpoints, block, e0, e1, quality);
+            if (error < best_error)
+            {
+                best_error = error;
+                best = endpoints;
+                std::memcpy(best_index, index, 16);
+            }
+            else if (iteration)
+            {
+                break;
+            }
+
+            if (iteration == refinements || !error)
+                break;
+
+            float t[16];
+            for (int i = 0; i < 16; ++i)
+                t[i] = bc7_weight4[index[i]] * (1.0f / 64.0f);
+
+            if (!refine(e0, e1, block, 0, 4, t))
+                break;
+        }
+
+        // the most significant bit of the first index is implicitly zero
+        if (best_index[0] & 8)
+        {
+            std::swap(best.q[0], best.q[1]);
+            std::swap(best.pbit[0], best.pbit[1]);
+            for (int i = 0; i < 16; ++i)
+                best_index[i] = uint8(15 - best_index[i]);
+        }
+
+        BitWriter writer;
+        writer.write(1 << 6, 7);
+        for (int c = 0; c < 4; ++c)
+        {
+            writer.write(best.q[0][c], 7);
+            writer.write(best.q[1][c], 7);
+        }
+        writer.write(best.pbit[0], 1);
+        writer.write(best.pbit[1], 1);
+        writer.write(best_index[0], 3);
+        for (int i = 1; i < 16; ++i)
+            writer.write(best_index[i], 4);
+
+        for (int i = 0; i < 16; ++i)
+            dest[i] = uint8(writer.data[i >> 3] >> ((i & 7) * 8));
+    }
+
+    // -----------------------------------------------------------------
+    // decoding
+    // -----------------------------------------------------------------
+
+    // 16 x R8G8B8A8 in row order
+    inline void decode_bc1(uint8* dest, const uint8* block, bool four)
+    {
+        const uint16 c0 = uint16(block[0] | (block[1] << 8));
+        const uint16 c1 = uint16(block[2] | (block[3] << 8));
+        const uint32 mask = block[4] | (block[5] << 8) | (block[6] << 16) | (uint32(block[7]) << 24);
+
+        int color[4][4];
+        bc1_colors(color, c0, c1, four);
+
+        for (int i = 0; i < 16; ++i)
+        {
+            const int k = (mask >> (i * 2)) & 3;
+            for (int c = 0; c < 4; ++c)
+                dest[i * 4 + c] = uint8(color[k][c]);
+        }
+    }
+
+    inline void decode_bc4(uint8* dest, const uint8* block)
+    {
+        int value[8];
+        bc4_values(value, block[0], block[1]);
+
+        uint64 mask = 0;
+        for (int i = 0; i < 6; ++i)
+            mask |= uint64(block[2 + i]) << (i * 8);
+
+        for (int i = 0; i < 16; ++i)
+            dest[i * 4] = uint8(value[(mask >> (i * 3)) & 7]);
+    }
+
+    inline void decode_bc7(uint8* dest, const uint8* block)
+    {
+        BitReader reader(block);
+        if (reader.read(7) != 1 << 6)
+            MANGO_EXCEPTION("bc: only BC7 mode 6 blocks are decoded.");
+
+        int q[2][4];
+        int pbit[2];
+        for (int c = 0; c < 4; ++c)
+        {
+            q[0][c] = reader.read(7);
+            q[1][c] = reader.read(7);
+        }
+        pbit[0] = reader.read(1);
+        pbit[1] = reader.read(1);
+
+        int color[16][4];
+        bc7_colors(color, q, pbit);
+
+        for (int i = 0; i < 16; ++i)
+        {
+            const int k = reader.read(i ? 4 : 3);
+            for (int c = 0; c < 4; ++c)
+                dest[i * 4 + c] = uint8(color[k][c]);
+        }
+    }
+
+    inline void decode_block(uint8* dest, const uint8* block, Type type)
+    {
+        switch (type)
+        {
+            case Type::BC1:
+                decode_bc1(dest, block, false);
+                break;
+
+            case Type::BC3:
+            {
+                uint8 alpha[64];
+                decode_bc1(dest, block + 8, true);
+                decode_bc4(alpha, block);
+                for (int i = 0; i < 16; ++i)
+                    dest[i * 4 + 3] = alpha[i * 4];
+                break;
+            }
+
+            case Type::BC4:
+            case Type::BC5:
+            {
+                uint8 green[64];
+                std::memset(dest, 0, 64);
+                decode_bc4(dest, block);
+                if (type == Type::BC5)
+                {
+                    decode_bc4(green, block + 8);
+                    for (int i = 0; i < 16; ++i)
+                        dest[i * 4 + 1] = green[i * 4];
+                }
+                for (int i = 0; i < 16; ++i)
+                    dest[i * 4 + 3] = 255;
+                break;
+            }
+
+            case Type::BC7:
+                decode_bc7(dest, block);
+                break;
+        }
+    }
+
+    // -----------------------------------------------------------------
+    // surfaces
+    // -----------------------------------------------------------------
+
+    template <bool SIMD>
+    void encode_block(uint8* dest, const Block& block, Type type, Quality quality)
+    {
+        switch (type)
+        {
+            case Type::BC1:
+                encode_bc1<SIMD>(dest, block, quality);
+                break;
+
+            case Type::BC3:
+                encode_bc4<SIMD>(dest, block, 3, quality);
+                encode_bc1<SIMD>(dest + 8, block, quality);
+                break;
+
+            case Type::BC4:
+                encode_bc4<SIMD>(dest, block, 0, quality);
+                break;
+
+            case Type::BC5:
+                encode_bc4<SIMD>(dest, block, 0, quality);
+                encode_bc4<SIMD>(dest + 8, block, 1, quality);
+                break;
+
+            case Type::BC7:
+                encode_bc7<SIMD>(dest, block, quality);
+                break;
+        }
+    }
+
+    // rows of blocks [y0, y1) of an R8G8B8A8 or B8G8R8A8 source
+    template <bool SIMD>
+    void encode_rows(uint8* image, const Surface& source, Type type, Quality quality, int y0, int y1)
+    {
+        const bool bgra = source.format == FORMAT_B8G8R8A8;
+        const int blocks_x = (source.width + 3) / 4;
+        const int block_size = getBlockSize(type);
+
+        Block block;
+        for (int by = y0; by < y1; ++by)
+        {
+            uint8* d = image + size_t(by) * blocks_x * block_size;
+            for (int bx = 0; bx < blocks_x; ++bx)
+            {
+                load(block, source, bx * 4, by * 4, bgra);
+                encode_block<SIMD>(d, block, type, quality);
+                d += block_size;
+            }
+        }
+    }
+
+    // the rows of blocks as bands of ~64K pixels into the queue
+    template <bool SIMD>
+    void enqueue_rows(ConcurrentQueue& q, uint8* image, const Surface& source, Type type, Quality quality)
+    {
+        const int blocks_x = (source.width + 3) / 4;
+        const int blocks_y = (source.height + 3) / 4;
+        const int rows = std::max(1, 4096 / blocks_x);
+
+        for (int y0 = 0; y0 < blocks_y; y0 += rows)
+        {
+            const int y1 = std::min(y0 + rows, blocks_y);
+            q.enqueue([=] {
+                encode_rows<SIMD>(image, source, type, quality, y0, y1);
+            });
+        }
+    }
+
+    // encode source into dest (at least bound() bytes), blocks in row order; returns the size
+    template <bool SIMD = true>
+    size_t encode(Memory dest, const Surface& source, Type type, Quality quality = Quality::NORMAL)
+    {
+        if (source.width <= 0 || source.height <= 0)
+            return 0;
+
+        const size_t bytes = bound(type, source.width, source.height);
+        if (dest.size < bytes)
+            MANGO_EXCEPTION("bc: the destination is too small.");
+
+        if (source.format != FORMAT_R8G8B8A8 && source.format != FORMAT_B8G8R8A8)
+        {
+            Bitmap temp(source.width, source.height, FORMAT_R8G8B8A8);
+            temp.blit(0, 0, source);
+            return encode<SIMD>(dest, temp, type, quality);
+        }
+
+        const int blocks_x = (source.width + 3) / 4;
+        const int blocks_y = (source.height + 3) / 4;
+
+        // a couple of bands is not worth the queue
+        if (blocks_y <= std::max(1, 4096 / blocks_x) * 2)
+        {
+            encode_rows<SIMD>(dest.address, source, type, quality, 0, blocks_y);
+            return bytes;
+        }
+
+        ConcurrentQueue q("bc");
+        enqueue_rows<SIMD>(q, dest.address, source, type, quality);
+        q.wait();
+
+        return bytes;
+    }
+
+    // expand the blocks to an R8G8B8A8 surface
+    inline void decode(const Surface& dest, Memory source, Type type)
+    {
+        if (dest.format != FORMAT_R8G8B8A8)
+            MANGO_EXCEPTION("bc: decode() writes R8G8B8A8.");
+        if (source.size < bound(type, dest.width, dest.height))
+            MANGO_EXCEPTION("bc: not enough blocks for the surface.");
+
+        const int blocks_x = (dest.width + 3) / 4;
+        const int blocks_y = (dest.height + 3) / 4;
+        const uint8* block = source.address;
+
+        for (int by = 0; by < blocks_y; ++by)
+        {
+            for (int bx = 0; bx < blocks_x; ++bx)
+            {
+                uint8 pixels[64];
+                decode_block(pixels, block, type);
+                block += getBlockSize(type);
+
+                const int width = std::min(4, dest.width - bx * 4);
+                const int height = std::min(4, dest.height - by * 4);
+                for (int y = 0; y < height; ++y)
+                {
+                    uint8* d = dest.image + (by * 4 + y) * dest.stride + bx * 16;
+                    std::memcpy(d, pixels + y * 16, width * 4);
+                }
+            }
+        }
+    }
+
+    // -----------------------------------------------------------------
+    // texture files
+    // -----------------------------------------------------------------
+
+    struct Texture
+    {
+        Type type;
+        bool srgb;
+        std::vector<mipmap::Level> levels;  // offset into data
+        std::vector<uint8> data;
+
+        size_t getSize(int level) const
+        {
+            return bound(type, levels[level].width, levels[level].height);
+        }
+    };
+
+    // every level of the chain into one allocation; the bands of all levels go into one queue
+    inline Texture encode(MipChain& chain, Type type, Quality quality = Quality::NORMAL, bool srgb = true)
+    {
+        Texture texture;
+        texture.type = type;
+        texture.srgb = srgb && type != Type::BC4 && type != Type::BC5;
+
+        size_t offset = 0;
+        for (int level = 0; level < chain.getLevels(); ++level)
+        {
+            const mipmap::Level& info = chain.getLevel(level);
+            texture.levels.push_back(mipmap::Level { info.width, info.height, offset });
+            offset += bound(type, info.width, info.height);
+        }
+
+        texture.data.resize(offset);
+
+        ConcurrentQueue q("bc mipmap");
+        for (int level = 0; level < chain.getLevels(); ++level)
+        {
+            uint8* image = texture.data.data() + texture.levels[level].offset;
+            enqueue_rows<true>(q, image, chain.getSurface(level), type, quality);
+        }
+        q.wait();
+
+        return texture;
+    }
+
+    namespace detail
+    {
+
+        inline void write32(std::vector<uint8>& header, uint32 value)
+        {
+            for (int i = 0; i < 4; ++i)
+                header.push_back(uint8(value >> (i * 8)));
+        }
+
+        inline uint32 fourcc(const char* s)
+        {
+            return uint32(s[0]) | (uint32(s[1]) << 8) | (uint32(s[2]) << 16) | (uint32(s[3]) << 24);
+        }
+
+    } // namespace detail
+
+    inline void writeDDS(Stream& stream, const Texture& texture)
+    {
+        // DXGI_FORMAT
+        uint32 dxgi = 0;
+        const char* legacy = nullptr;
+        switch (texture.type)
+        {
+            case Type::BC1: dxgi = texture.srgb ? 72 : 71; legacy = "DXT1"; break;
+            case Type::BC3: dxgi = texture.srgb ? 78 : 77; legacy = "DXT5"; break;
+            case Type::BC4: dxgi = 80; legacy = "ATI1"; break;
+            case Type::BC5: dxgi = 83; legacy = "ATI2"; break;
+            case Type::BC7: dxgi = texture.srgb ? 99 : 98; break;
+        }
+
+        // the legacy header has no sRGB and no BC7
+        const bool dx10 = !legacy || texture.srgb;
+        const int levels = int(texture.levels.size());
+
+        std::vector<uint8> header;
+        detail::write32(header, detail::fourcc("DDS "));
+        detail::write32(header, 124);
+        detail::write32(header, 0x1 | 0x2 | 0x4 | 0x1000 | 0x80000 | (levels > 1 ? 0x20000 : 0));
+        detail::write32(header, texture.levels[0].height);
+        detail::write32(header, texture.levels[0].width);
+        detail::write32(header, uint32(texture.getSize(0)));
+        detail::write32(header, 0);     // depth
+        detail::write32(header, levels);
+        for (int i = 0; i < 11; ++i)
+            detail::write32(header, 0);
+
+        // DDS_PIXELFORMAT
+        detail::write32(header, 32);
+        detail::write32(header, 0x4);   // DDPF_FOURCC
+        detail::write32(header, detail::fourcc(dx10 ? "DX10" : legacy));
+        for (int i = 0; i < 5; ++i)
+            detail::write32(header, 0);
+
+        detail::write32(header, 0x1000 | (levels > 1 ? 0x400008 : 0));
+        for (int i = 0; i < 4; ++i)
+            detail::write32(header, 0);
+
+        if (dx10)
+        {
+            detail::write32(header, dxgi);
+            detail::write32(header, 3);     // D3D10_RESOURCE_DIMENSION_TEXTURE2D
+            detail::write32(header, 0);
+            detail::write32(header, 1);     // array size
+            detail::write32(header, 0);
+        }
+
+        stream.write(header.data(), header.size());
+        stream.write(texture.data.data(), texture.data.size());
+    }
+
+    inline void writeKTX(Stream& stream, const Texture& texture)
+    {
+        uint32 internal = 0;
+        uint32 base = 0;
+        switch (texture.type)
+        {
+            case Type::BC1: internal = texture.srgb ? 0x8c4c : 0x83f0; base = 0x1907; break;
+            case Type::BC3: internal = texture.srgb ? 0x8c4f : 0x83f3; base = 0x1908; break;
+            case Type::BC4: internal = 0x8dbb; base = 0x1903; break;
+            case Type::BC5: internal = 0x8dbd; base = 0x8227; break;
+            case Type::BC7: internal = texture.srgb ? 0x8e8d : 0x8e8c; base = 0x1908; break;
+        }
+
+        static const uint8 identifier[] = { 0xab, 'K', 'T', 'X', ' ', '1', '1', 0xbb, '\r', '\n', 0x1a, '\n' };
+        std::vector<uint8> header(identifier, identifier + 12);
+        detail::write32(header, 0x04030201);
+        detail::write32(header, 0);     // glType
+        detail::write32(header, 1);     // glTypeSize
+        detail::write32(header, 0);     // glFormat
+        detail::write32(header, internal);
+        detail::write32(header, base);
+        detail::write32(header, texture.levels[0].width);
+        detail::write32(header, texture.levels[0].height);
+        detail::write32(header, 0);     // depth
+        detail::write32(header, 0);     // array elements
+        detail::write32(header, 1);     // faces
+        detail::write32(header, uint32(texture.levels.size()));
+        detail::write32(header, 0);     // key / value data
+        stream.write(header.data(), header.size());
+
+        // the block sizes are multiples of 4: no padding
+        for (int level = 0; level < int(texture.levels.size()); ++level)
+        {
+            std::vector<uint8> size;
+            detail::write32(size, uint32(texture.getSize(level)));
+            stream.write(size.data(), size.size());
+            stream.write(texture.data.data() + texture.levels[level].offset, texture.getSize(level));
+        }
+    }
+
+    // .dds or .ktx
+    inline void save(const std::string& filename, const Texture& texture)
+    {
+        std::string extension = filename.substr(std::min(filename.find_last_of('.'), filename.size()));
+        std::transform(extension.begin(), extension.end(), extension.begin(), [] (char c) {
+            return char(std::tolower(c));
+        });
+
+        if (extension != ".dds" && extension != ".ktx")
+            MANGO_EXCEPTION("bc: the texture file must be .dds or .ktx.");
+
+        FileStream file(filename, FileStream::WRITE);
+        if (extension == ".dds")
+            writeDDS(file, texture);
+        else
+            writeKTX(file, texture);
+    }
+
+} // namespace bc
+} // namespace mango
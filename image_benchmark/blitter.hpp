@@ -0,0 +1,586 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <mango/mango.hpp>
+#include <mango/image/image.hpp>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define BLITTER_ENABLE_X86
+    #include <immintrin.h>
+
+    #define BLITTER_TARGET_SSE2    __attribute__((target("sse2")))
+    #define BLITTER_TARGET_SSSE3   __attribute__((target("ssse3")))
+    #define BLITTER_TARGET_F16C    __attribute__((target("avx,f16c")))
+#endif
+
+/*
+    Specialized pixel format converters.
+
+    Surface::blit() converts between any two Formats; the pairs without a
+    dedicated converter decode and encode every component separately.
+    The converters here are generated from templates which describe the
+    pixel layout at compile time, so every pair becomes a loop of
+    constant shifts and masks:
+
+        BytePixel       8 bits per component, 3 or 4 bytes (RGBA, BGR, ..)
+        PackedPixel     16 bit packed (565, 5551, 4444)
+        HalfPixel       RGBA16F
+        FloatPixel      RGBA32F
+
+    Components are named from the least significant bits like the Format
+    constants: R5G6B5 has red in bits 0..4. Packing truncates to the
+    destination bits, unpacking replicates the high bits.
+
+    On x86 the hottest pairs have hand written versions selected at run
+    time with the CPU features: byte swizzles with SSSE3 pshufb, 565 to
+    8888 with SSE2 and half float with F16C.
+
+        blitter::blit(dest, source);
+
+    converts with a specialized converter when there is one and with
+    Surface::blit() when there is not. Large surfaces are converted in
+    row bands in the ThreadPool.
+*/
+
+namespace mango
+{
+namespace blitter
+{
+
+    using ConvertFunc = void (*)(uint8* dest, const uint8* source, int count);
+
+    // -----------------------------------------------------------------
+    // pixel layouts; unpack() returns 8 bit RGBA in r | g << 8 | b << 16 | a << 24
+    // -----------------------------------------------------------------
+
+    template <int Bytes, int RI, int GI, int BI, int AI>
+    struct BytePixel
+    {
+        static constexpr int bytes = Bytes;
+        static constexpr int R = RI;
+        static constexpr int G = GI;
+        static constexpr int B = BI;
+        static constexpr int A = AI;    // -1: no alpha
+
+        static uint32 unpack(const uint8* p)
+        {
+            const uint32 a = A < 0 ? 0xff : p[A < 0 ? 0 : A];
+            return p[R] | (p[G] << 8) | (p[B] << 16) | (a << 24);
+        }
+
+        static void pack(uint8* p, uint32 color)
+        {
+            p[R] = uint8(color);
+            p[G] = uint8(color >> 8);
+            p[B] = uint8(color >> 16);
+            if (A >= 0)
+                p[A < 0 ? 0 : A] = uint8(color >> 24);
+        }
+    };
+
+    // n bits -> 8 bits by replicating the high bits into the low bits
+    template <int Bits>
+    inline uint32 expand(uint32 x)
+    {
+        return Bits == 1 ? x * 255 : (x << (8 - Bits)) | (x >> std::max(2 * Bits - 8, 0));
+    }
+
+    template <int RS, int RO, int GS, int GO, int BS, int BO, int AS, int AO>
+    struct PackedPixel
+    {
+        static constexpr int bytes = 2;
+
+        static uint32 unpack(const uint8* p)
+        {
+            uint16 v;
+            std::memcpy(&v, p, 2);
+            const uint32 r = expand<RS>((v >> RO) & ((1 << RS) - 1));
+            const uint32 g = expand<GS>((v >> GO) & ((1 << GS) - 1));
+            const uint32 b = expand<BS>((v >> BO) & ((1 << BS) - 1));
+            const uint32 a = AS ? expand<AS ? AS : 8>((v >> AO) & ((1 << AS) - 1)) : 0xff;
+            return r | (g << 8) | (b << 16) | (a << 24);
+        }
+
+        static void pack(uint8* p, uint32 color)
+        {
+            uint32 v = ((color & 0xff) >> (8 - RS) << RO) |
+                       ((color >> 8 & 0xff) >> (8 - GS) << GO) |
+                       ((color >> 16 & 0xff) >> (8 - BS) << BO);
+            if (AS)
+                v |= (color >> 24) >> (8 - AS) << AO;
+            const uint16 v16 = uint16(v);
+            std::memcpy(p, &v16, 2);
+        }
+    };
+
+    // round to nearest even; by Fabian Giesen, public domain
+    inline uint16 float_to_half(float f)
+    {
+        uint32 x;
+        std::memcpy(&x, &f, 4);
+        const uint32 sign = x & 0x80000000;
+        x ^= sign;
+
+        uint32 h;
+        if (x >= (127 + 16) << 23)
+        {
+            // overflow, inf or nan; nan payload is kept and quieted like F16C does
+            h = x > (255 << 23) ? 0x7e00 | ((x >> 13) & 0x3ff) : 0x7c00;
+        }
+        else if (x < (113 << 23))
+        {
+            // denormal: the float addition rounds the mantissa
+            const uint32 magic = ((127 - 15) + (23 - 10) + 1) << 23;
+            float a, b;
+            std::memcpy(&a, &x, 4);
+            std::memcpy(&b, &magic, 4);
+            a += b;
+            std::memcpy(&h, &a, 4);
+            h -= magic;
+        }
+        else
+        {
+            const uint32 odd = (x >> 13) & 1;
+            x += ((15 - 127) << 23) + 0xfff;
+            x += odd;
+            h = x >> 13;
+        }
+
+        return uint16(h | (sign >> 16));
+    }
+
+    inline float half_to_float(uint16 h)
+    {
+        const uint32 sign = uint32(h & 0x8000) << 16;
+        const uint32 exponent = (h >> 10) & 0x1f;
+        const uint32 mantissa = h & 0x3ff;
+
+        if (!exponent)
+        {
+            const float f = mantissa * (1.0f / 16777216.0f);
+            return sign ? -f : f;
+        }
+
+        const uint32 x = sign | (exponent == 31 ? 0x7f800000 | (mantissa ? 0x400000 : 0) | (mantissa << 13)
+                                                : ((exponent + 112) << 23) | (mantissa << 13));
+        float f;
+        std::memcpy(&f, &x, 4);
+        return f;
+    }
+
+    inline uint32 float_to_unorm8(float f)
+    {
+        return uint32(std::min(std::max(f, 0.0f), 1.0f) * 255.0f + 0.5f);
+    }
+
+    struct FloatPixel
+    {
+        static constexpr int bytes = 16;
+
+        static void load(float* v, const uint8* p)
+        {
+            std::memcpy(v, p, 16);
+        }
+
+        static void store(uint8* p, const float* v)
+        {
+            std::memcpy(p, v, 16);
+        }
+
+        static uint32 unpack(const uint8* p)
+        {
+            float v[4];
+            load(v, p);
+            return float_to_unorm8(v[0]) | (float_to_unorm8(v[1]) << 8) |
+                   (float_to_unorm8(v[2]) << 16) | (float_to_unorm8(v[3]) << 24);
+        }
+
+        static void pack(uint8* p, uint32 color)
+        {
+            const float v[] =
+            {
+                (color & 0xff) / 255.0f, (color >> 8 & 0xff) / 255.0f,
+                (color >> 16 & 0xff) / 255.0f, (color >> 24) / 255.0f
+            };
+            store(p, v);
+        }
+    };
+
+    struct HalfPixel
+    {
+        static constexpr int bytes = 8;
+
+        static void load(float* v, const uint8* p)
+        {
+            uint16 h[4];
+            std::memcpy(h, p, 8);
+            for (int i = 0; i < 4; ++i)
+                v[i] = half_to_float(h[i]);
+        }
+
+        static void store(uint8* p, const float* v)
+        {
+            uint16 h[4];
+            for (int i = 0; i < 4; ++i)
+                h[i] = float_to_half(v[i]);
+            std::memcpy(p, h, 8);
+        }
+
+        static uint32 unpack(const uint8* p)
+        {
+            float v[4];
+            load(v, p);
+            return FloatPixel::unpack(reinterpret_cast<const uint8*>(v));
+        }
+
+        static void pack(uint8* p, uint32 color)
+        {
+            float v[4];
+            FloatPixel::pack(reinterpret_cast<uint8*>(v), color);
+            store(p, v);
+        }
+    };
+
+    using RGBA8 = BytePixel<4, 0, 1, 2, 3>;
+    using BGRA8 = BytePixel<4, 2, 1, 0, 3>;
+    using RGB8  = BytePixel<3, 0, 1, 2, -1>;
+    using BGR8  = BytePixel<3, 2, 1, 0, -1>;
+
+    using R5G6B5   = PackedPixel<5, 0, 6, 5, 5, 11, 0, 0>;
+    using B5G6R5   = PackedPixel<5, 11, 6, 5, 5, 0, 0, 0>;
+    using R5G5B5A1 = PackedPixel<5, 0, 5, 5, 5, 10, 1, 15>;
+    using B5G5R5A1 = PackedPixel<5, 10, 5, 5, 5, 0, 1, 15>;
+    using R4G4B4A4 = PackedPixel<4, 0, 4, 4, 4, 8, 4, 12>;
+    using B4G4R4A4 = PackedPixel<4, 8, 4, 4, 4, 0, 4, 12>;
+
+    // -----------------------------------------------------------------
+    // generic converters
+    // -----------------------------------------------------------------
+
+    template <typename Dest, typename Source>
+    void convert(uint8* dest, const uint8* source, int count)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            Dest::pack(dest, Source::unpack(source));
+            dest += Dest::bytes;
+            source += Source::bytes;
+        }
+    }
+
+    // float <-> float without going through 8 bits
+    template <typename Dest, typename Source>
+    void convert_float(uint8* dest, const uint8* source, int count)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            float v[4];
+            Source::load(v, source);
+            Dest::store(dest, v);
+            dest += Dest::bytes;
+            source += Source::bytes;
+        }
+    }
+
+    // -----------------------------------------------------------------
+    // x86
+    // -----------------------------------------------------------------
+
+#ifdef BLITTER_ENABLE_X86
+
+    // any BytePixel -> BytePixel: 4 pixels per pshufb
+    template <typename Dest, typename Source>
+    BLITTER_TARGET_SSSE3
+    void shuffle(uint8* dest, const uint8* source, int count)
+    {
+        // source byte for every destination byte, -1: opaque alpha
+        int index[4];
+        index[Dest::R] = Source::R;
+        index[Dest::G] = Source::G;
+        index[Dest::B] = Source::B;
+        if (Dest::A >= 0)
+            index[Dest::A < 0 ? 0 : Dest::A] = Source::A;
+
+        alignas(16) uint8 mask[16];
+        alignas(16) uint8 fill[16];
+        std::memset(mask, 0x80, 16);
+        std::memset(fill, 0, 16);
+
+        for (int i = 0; i < 4; ++i)
+        {
+            for (int k = 0; k < Dest::bytes; ++k)
+            {
+                const int j = i * Dest::bytes + k;
+                mask[j] = index[k] < 0 ? 0x80 : uint8(i * Source::bytes + index[k]);
+                fill[j] = index[k] < 0 ? 0xff : 0;
+            }
+        }
+
+        const __m128i m = _mm_load_si128(reinterpret_cast<const __m128i*>(mask));
+        const __m128i f = _mm_load_si128(reinterpret_cast<const __m128i*>(fill));
+
+        // the 16 byte load reads past the 4th pixel with 3 byte sources
+        const int simd = Source::bytes == 3 ? std::max(count - 2, 0) & ~3 : count & ~3;
+
+        for (int i = 0; i < simd; i += 4)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i * Source::bytes));
+            v = _mm_or_si128(_mm_shuffle_epi8(v, m), f);
+            uint8* d = dest + i * Dest::bytes;
+
+            if (Dest::bytes == 4)
+            {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(d), v);
+            }
+            else
+            {
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(d), v);
+                const uint32 tail = uint32(_mm_cvtsi128_si32(_mm_srli_si128(v, 8)));
+                std::memcpy(d + 8, &tail, 4);
+            }
+        }
+
+        convert<Dest, Source>(dest + simd * Dest::bytes, source + simd * Source::bytes, count - simd);
+    }
+
+    // 565 -> 8888: 8 pixels per iteration
+    template <typename Dest, typename Source, int RO, int BO>
+    BLITTER_TARGET_SSE2
+    void expand565(uint8* dest, const uint8* source, int count)
+    {
+        const __m128i mask5 = _mm_set1_epi16(0x1f);
+        const __m128i mask6 = _mm_set1_epi16(0x3f);
+        const __m128i alpha = _mm_set1_epi16(short(0xff00));
+        const int simd = count & ~7;
+
+        for (int i = 0; i < simd; i += 8)
+        {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i * 2));
+            __m128i r = _mm_and_si128(_mm_srli_epi16(v, RO), mask5);
+            __m128i g = _mm_and_si128(_mm_srli_epi16(v, 5), mask6);
+            __m128i b = _mm_and_si128(_mm_srli_epi16(v, BO), mask5);
+            r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+            g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+            b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+
+            // byte 0 and 2 of the destination pixel
+            const __m128i c0 = Dest::R == 0 ? r : b;
+            const __m128i c2 = Dest::R == 0 ? b : r;
+            const __m128i lo = _mm_or_si128(c0, _mm_slli_epi16(g, 8));
+            const __m128i hi = _mm_or_si128(c2, alpha);
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i * 4 + 0), _mm_unpacklo_epi16(lo, hi));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i * 4 + 16), _mm_unpackhi_epi16(lo, hi));
+        }
+
+        convert<Dest, Source>(dest + simd * 4, source + simd * 2, count - simd);
+    }
+
+    BLITTER_TARGET_F16C
+    inline void half_to_float_f16c(uint8* dest, const uint8* source, int count)
+    {
+        // 2 pixels per iteration
+        const int simd = count & ~1;
+        for (int i = 0; i < simd; i += 2)
+        {
+            const __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i * 8));
+            _mm256_storeu_ps(reinterpret_cast<float*>(dest + i * 16), _mm256_cvtph_ps(h));
+        }
+        convert_float<FloatPixel, HalfPixel>(dest + simd * 16, source + simd * 8, count - simd);
+    }
+
+    BLITTER_TARGET_F16C
+    inline void float_to_half_f16c(uint8* dest, const uint8* source, int count)
+    {
+        const int simd = count & ~1;
+        for (int i = 0; i < simd; i += 2)
+        {
+            const __m256 f = _mm256_loadu_ps(reinterpret_cast<const float*>(source + i * 16));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i * 8), _mm256_cvtps_ph(f, _MM_FROUND_TO_NEAREST_INT));
+        }
+        convert_float<HalfPixel, FloatPixel>(dest + simd * 8, source + simd * 16, count - simd);
+    }
+
+#endif // BLITTER_ENABLE_X86
+
+    // -----------------------------------------------------------------
+    // converter table
+    // -----------------------------------------------------------------
+
+    struct Converter
+    {
+        Format dest;
+        Format source;
+        ConvertFunc func;
+        const char* path;   // "template", "SSSE3", ..
+    };
+
+    class ConverterTable
+    {
+    protected:
+        std::vector<Converter> m_converters;
+
+        template <typename Dest, typename Source>
+        void add(const Format& dest, const Format& source)
+        {
+            m_converters.push_back(Converter { dest, source, convert<Dest, Source>, "template" });
+        }
+
+        // all pairs of the 8 bit layouts
+        template <typename Dest>
+        void addBytes(const Format& dest)
+        {
+            const Format formats[] = { FORMAT_R8G8B8A8, FORMAT_B8G8R8A8, FORMAT_R8G8B8, FORMAT_B8G8R8 };
+            const ConvertFunc funcs[] = { convert<Dest, RGBA8>, convert<Dest, BGRA8>, convert<Dest, RGB8>, convert<Dest, BGR8> };
+#ifdef BLITTER_ENABLE_X86
+            const ConvertFunc simd[] = { shuffle<Dest, RGBA8>, shuffle<Dest, BGRA8>, shuffle<Dest, RGB8>, shuffle<Dest, BGR8> };
+            const bool ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+
+            for (int i = 0; i < 4; ++i)
+            {
+                if (formats[i] == dest)
+                    continue;
+#ifdef BLITTER_ENABLE_X86
+                if (ssse3)
+                {
+                    m_converters.push_back(Converter { dest, formats[i], simd[i], "SSSE3" });
+                    continue;
+                }
+#endif
+                m_converters.push_back(Converter { dest, formats[i], funcs[i], "template" });
+            }
+        }
+
+        // packed <-> RGBA8 / BGRA8
+        template <typename Packed>
+        void addPacked(const Format& packed)
+        {
+            add<RGBA8, Packed>(FORMAT_R8G8B8A8, packed);
+            add<BGRA8, Packed>(FORMAT_B8G8R8A8, packed);
+            add<Packed, RGBA8>(packed, FORMAT_R8G8B8A8);
+            add<Packed, BGRA8>(packed, FORMAT_B8G8R8A8);
+        }
+
+        void replace(const Format& dest, const Format& source, ConvertFunc func, const char* path)
+        {
+            for (Converter& converter : m_converters)
+            {
+                if (converter.dest == dest && converter.source == source)
+                {
+                    converter.func = func;
+                    converter.path = path;
+                }
+            }
+        }
+
+    public:
+        ConverterTable()
+        {
+            addBytes<RGBA8>(FORMAT_R8G8B8A8);
+            addBytes<BGRA8>(FORMAT_B8G8R8A8);
+            addBytes<RGB8>(FORMAT_R8G8B8);
+            addBytes<BGR8>(FORMAT_B8G8R8);
+
+            addPacked<R5G6B5>(FORMAT_R5G6B5);
+            addPacked<B5G6R5>(FORMAT_B5G6R5);
+            addPacked<R5G5B5A1>(FORMAT_R5G5B5A1);
+            addPacked<B5G5R5A1>(FORMAT_B5G5R5A1);
+            addPacked<R4G4B4A4>(FORMAT_R4G4B4A4);
+            addPacked<B4G4R4A4>(FORMAT_B4G4R4A4);
+
+            add<RGBA8, HalfPixel>(FORMAT_R8G8B8A8, FORMAT_RGBA16F);
+            add<HalfPixel, RGBA8>(FORMAT_RGBA16F, FORMAT_R8G8B8A8);
+            add<RGBA8, FloatPixel>(FORMAT_R8G8B8A8, FORMAT_RGBA32F);
+            add<FloatPixel, RGBA8>(FORMAT_RGBA32F, FORMAT_R8G8B8A8);
+            m_converters.push_back(Converter { FORMAT_RGBA32F, FORMAT_RGBA16F, convert_float<FloatPixel, HalfPixel>, "template" });
+            m_converters.push_back(Converter { FORMAT_RGBA16F, FORMAT_RGBA32F, convert_float<HalfPixel, FloatPixel>, "template" });
+
+#ifdef BLITTER_ENABLE_X86
+            if (__builtin_cpu_supports("sse2"))
+            {
+                replace(FORMAT_R8G8B8A8, FORMAT_R5G6B5, expand565<RGBA8, R5G6B5, 0, 11>, "SSE2");
+                replace(FORMAT_B8G8R8A8, FORMAT_R5G6B5, expand565<BGRA8, R5G6B5, 0, 11>, "SSE2");
+                replace(FORMAT_R8G8B8A8, FORMAT_B5G6R5, expand565<RGBA8, B5G6R5, 11, 0>, "SSE2");
+                replace(FORMAT_B8G8R8A8, FORMAT_B5G6R5, expand565<BGRA8, B5G6R5, 11, 0>, "SSE2");
+            }
+
+            if (__builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c"))
+            {
+                replace(FORMAT_RGBA32F, FORMAT_RGBA16F, half_to_float_f16c, "F16C");
+                replace(FORMAT_RGBA16F, FORMAT_RGBA32F, float_to_half_f16c, "F16C");
+            }
+#endif
+        }
+
+        const Converter* find(const Format& dest, const Format& source) const
+        {
+            for (const Converter& converter : m_converters)
+            {
+                if (converter.dest == dest && converter.source == source)
+                    return &converter;
+            }
+            return nullptr;
+        }
+
+        const std::vector<Converter>& converters() const
+        {
+            return m_converters;
+        }
+    };
+
+    inline const ConverterTable& getConverterTable()
+    {
+        static const ConverterTable table;
+        return table;
+    }
+
+    // top-left corners aligned, clipped to the smaller surface
+    inline void blit(const Surface& dest, const Surface& source)
+    {
+        const Converter* converter = getConverterTable().find(dest.format, source.format);
+        if (!converter)
+        {
+            Surface target = dest;
+            target.blit(0, 0, source);
+            return;
+        }
+
+        const int width = std::min(dest.width, source.width);
+        const int height = std::min(dest.height, source.height);
+        const ConvertFunc func = converter->func;
+
+        auto rows = [=] (int y0, int y1) {
+            for (int y = y0; y < y1; ++y)
+            {
+                func(dest.image + y * dest.stride, source.image + y * source.stride, width);
+            }
+        };
+
+        // rows in bands of ~64K pixels
+        const int band = std::max(1, (64 * 1024) / std::max(width, 1));
+        if (height <= band * 2)
+        {
+            rows(0, height);
+            return;
+        }
+
+        ConcurrentQueue q("blitter");
+        for (int y = 0; y < height; y += band)
+        {
+            const int y1 = std::min(y + band, height);
+            q.enqueue([=] {
+                rows(y, y1);
+            });
+        }
+        q.wait();
+    }
+
+} // namespace blitter
+} // namespace mango
@@ -0,0 +1,1050 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#include <mango/mango.hpp>
+#include <mango/image/image.hpp>
+#include "srgb.hpp"
+#include "resample.hpp"
+#include "blitter.hpp"
+#include "tiledimage.hpp"
+#include "mipmap.hpp"
+#include "bcencoder.hpp"
+
+using namespace mango;
+
+// ----------------------------------------------------------------------
+// helpers
+// ----------------------------------------------------------------------
+
+namespace
+{
+
+    struct Random
+    {
+        uint32 seed = 1;
+
+        uint32 operator () ()
+        {
+            seed = seed * 1664525 + 1013904223;
+            return seed >> 8;
+        }
+    };
+
+    void fill(const Surface& surface, uint32 seed)
+    {
+        Random random;
+        random.seed = seed;
+
+        const int bytes = surface.width * surface.format.bytes();
+        for (int y = 0; y < surface.height; ++y)
+        {
+            uint8* scan = surface.image + y * surface.stride;
+            for (int x = 0; x < bytes; ++x)
+            {
+                scan[x] = uint8(random());
+            }
+        }
+    }
+
+    // time "func" over "iterations" runs; returns megapixels / second
+    template <typename Func>
+    double measure(const Surface& surface, int iterations, Func func)
+    {
+        Timer timer;
+        uint64 time0 = timer.us();
+        for (int i = 0; i < iterations; ++i)
+        {
+            func();
+        }
+        uint64 time1 = timer.us();
+        const double pixels = double(surface.width) * surface.height * iterations;
+        return time1 > time0 ? pixels / (time1 - time0) : 0.0;
+    }
+
+    void print(const char* name, double mps)
+    {
+        printf("  %-36s %10.1f MP/s\n", name, mps);
+    }
+
+} // namespace
+
+// ----------------------------------------------------------------------
+// sRGB
+// ----------------------------------------------------------------------
+
+/*
+    Whole image sRGB decode / encode: the misc/math.cpp example11 float4
+    functions called for every pixel against the table based conversion
+    in srgb.hpp on one thread and in bands on the ThreadPool.
+*/
+
+namespace
+{
+
+    // the float4 functions for every pixel of a surface
+    void decode_float4(const Surface& dest, const Surface& source)
+    {
+        for (int y = 0; y < source.height; ++y)
+        {
+            float* d = reinterpret_cast<float*>(dest.image + y * dest.stride);
+            const uint8* s = source.image + y * source.stride;
+            for (int x = 0; x < source.width; ++x)
+            {
+                float4 color = srgb_decode(float4(s[0], s[1], s[2], s[3]) * (1.0f / 255.0f));
+                d[0] = color.x;
+                d[1] = color.y;
+                d[2] = color.z;
+                d[3] = s[3] * (1.0f / 255.0f);
+                s += 4;
+                d += 4;
+            }
+        }
+    }
+
+    void encode_float4(const Surface& dest, const Surface& source)
+    {
+        for (int y = 0; y < source.height; ++y)
+        {
+            uint8* d = dest.image + y * dest.stride;
+            const float* s = reinterpret_cast<const float*>(source.image + y * source.stride);
+            for (int x = 0; x < source.width; ++x)
+            {
+                float4 color = srgb_encode(float4(s[0], s[1], s[2], s[3]));
+                d[0] = uint8(std::min(std::max(color.x, 0.0f), 1.0f) * 255.0f + 0.5f);
+                d[1] = uint8(std::min(std::max(color.y, 0.0f), 1.0f) * 255.0f + 0.5f);
+                d[2] = uint8(std::min(std::max(color.z, 0.0f), 1.0f) * 255.0f + 0.5f);
+                d[3] = srgb::encode_alpha(s[3]);
+                s += 4;
+                d += 4;
+            }
+        }
+    }
+
+    void decode_rows(const Surface& dest, const Surface& source, bool premultiply)
+    {
+        for (int y = 0; y < source.height; ++y)
+        {
+            float* d = reinterpret_cast<float*>(dest.image + y * dest.stride);
+            srgb::decode_row(d, source.image + y * source.stride, source.width, false, premultiply);
+        }
+    }
+
+    void encode_rows(const Surface& dest, const Surface& source, bool premultiplied)
+    {
+        for (int y = 0; y < source.height; ++y)
+        {
+            const float* s = reinterpret_cast<const float*>(source.image + y * source.stride);
+            srgb::encode_row(dest.image + y * dest.stride, s, source.width, false, premultiplied);
+        }
+    }
+
+    // number of 8 bit values which differ
+    size_t compare(const Surface& a, const Surface& b)
+    {
+        size_t count = 0;
+        const int bytes = a.width * a.format.bytes();
+        for (int y = 0; y < a.height; ++y)
+        {
+            const uint8* sa = a.image + y * a.stride;
+            const uint8* sb = b.image + y * b.stride;
+            for (int x = 0; x < bytes; ++x)
+            {
+                count += sa[x] != sb[x];
+            }
+        }
+        return count;
+    }
+
+    // encode results which differ from the correctly rounded double
+    // precision conversion: both sides of every code boundary and random
+    // floats in [0, 1]
+    size_t verify_encode(size_t samples)
+    {
+        const srgb::Tables& tables = srgb::getTables();
+
+        auto reference = [] (float x) {
+            return int(std::floor(srgb::exact_encode(std::min(std::max(double(x), 0.0), 1.0)) * 255.0 + 0.5));
+        };
+
+        size_t errors = 0;
+
+        for (int i = 1; i < 256; ++i)
+        {
+            const float x = tables.threshold[i];
+            errors += srgb::encode(tables, x) != reference(x);
+            errors += srgb::encode(tables, std::nextafter(x, -1.0f)) != reference(std::nextafter(x, -1.0f));
+        }
+
+        // out of range and special inputs; the premultiplied encode of a
+        // transparent pixel produces -0.0f
+        const float inf = std::numeric_limits<float>::infinity();
+        const float special[][2] =
+        {
+            { -0.0f, 0.0f }, { 0.0f, 0.0f }, { -1e-30f, 0.0f }, { -0.5f, 0.0f }, { -inf, 0.0f },
+            { std::numeric_limits<float>::quiet_NaN(), 0.0f }, { -std::numeric_limits<float>::quiet_NaN(), 0.0f },
+            { 1.0f, 255.0f }, { 1.5f, 255.0f }, { inf, 255.0f },
+        };
+
+        for (auto& s : special)
+        {
+            errors += srgb::encode(tables, s[0]) != int(s[1]);
+        }
+
+        Random random;
+        for (size_t i = 0; i < samples; ++i)
+        {
+            // uniform in the float bit patterns: dense near zero like the image data
+            uint32 bits = (random() << 8 | random()) % 0x3f800001;
+            float x;
+            std::memcpy(&x, &bits, 4);
+            errors += srgb::encode(tables, x) != reference(x);
+        }
+
+        return errors;
+    }
+
+} // namespace
+
+void test_srgb(int width, int height, int iterations)
+{
+    Bitmap source(width, height, FORMAT_R8G8B8A8);
+    Bitmap linear(width, height, FORMAT_RGBA32F);
+    Bitmap result(width, height, FORMAT_R8G8B8A8);
+    fill(source, 7);
+
+    printf("\nsRGB: %d x %d\n", width, height);
+
+    srgb::getTables();
+
+    print("decode float4", measure(source, iterations, [&] {
+        decode_float4(linear, source);
+    }));
+    print("decode table, 1 thread", measure(source, iterations, [&] {
+        decode_rows(linear, source, false);
+    }));
+    print("decode table, bands", measure(source, iterations, [&] {
+        srgb_decode(linear, source);
+    }));
+    print("decode table, bands, premultiply", measure(source, iterations, [&] {
+        srgb_decode(linear, source, true);
+    }));
+
+    srgb_decode(linear, source);
+
+    print("encode float4", measure(source, iterations, [&] {
+        encode_float4(result, linear);
+    }));
+    const size_t float4_errors = compare(source, result);
+
+    print("encode table, 1 thread", measure(source, iterations, [&] {
+        encode_rows(result, linear, false);
+    }));
+    print("encode table, bands", measure(source, iterations, [&] {
+        srgb_encode(result, linear);
+    }));
+    const size_t table_errors = compare(source, result);
+
+    srgb_decode(linear, source, true);
+    print("encode table, bands, premultiplied", measure(source, iterations, [&] {
+        srgb_encode(result, linear, true);
+    }));
+
+    // premultiplication loses color precision when alpha is small;
+    // only the opaque pixels must survive the round trip exactly
+    size_t premultiplied_errors = 0;
+    for (int y = 0; y < height; ++y)
+    {
+        const uint8* s = source.image + y * source.stride;
+        const uint8* r = result.image + y * result.stride;
+        for (int x = 0; x < width * 4; x += 4)
+        {
+            if (s[x + 3] == 255)
+                premultiplied_errors += std::memcmp(s + x, r + x, 4) != 0;
+        }
+    }
+
+    printf("\n  round trip 8 bit -> float -> 8 bit, values changed:\n");
+    printf("  %-36s %10zu\n", "float4", float4_errors);
+    printf("  %-36s %10zu\n", "table", table_errors);
+    printf("  %-36s %10zu\n", "table, premultiplied, opaque pixels", premultiplied_errors);
+    printf("  encode not correctly rounded: %zu\n", verify_encode(16 * 1024 * 1024));
+}
+
+// ----------------------------------------------------------------------
+// resample
+// ----------------------------------------------------------------------
+
+/*
+    resize() with every filter, through the 8 bit and the float pipeline.
+    The throughput is in source megapixels; "max diff" is the largest
+    difference between the 8 bit result and the rounded float result.
+*/
+
+namespace
+{
+
+    void to_float(const Surface& dest, const Surface& source)
+    {
+        for (int y = 0; y < source.height; ++y)
+        {
+            float* d = reinterpret_cast<float*>(dest.image + y * dest.stride);
+            const uint8* s = source.image + y * source.stride;
+            for (int x = 0; x < source.width * 4; ++x)
+            {
+                d[x] = s[x] * (1.0f / 255.0f);
+            }
+        }
+    }
+
+    int difference(const Surface& a, const Surface& b)
+    {
+        int diff = 0;
+        for (int y = 0; y < a.height; ++y)
+        {
+            const uint8* sa = a.image + y * a.stride;
+            const float* sb = reinterpret_cast<const float*>(b.image + y * b.stride);
+            for (int x = 0; x < a.width * 4; ++x)
+            {
+                const int value = int(std::min(std::max(sb[x], 0.0f), 1.0f) * 255.0f + 0.5f);
+                diff = std::max(diff, std::abs(sa[x] - value));
+            }
+        }
+        return diff;
+    }
+
+    void test_resize(const Surface& source, const Surface& fsource, const Surface& dest, const Surface& fdest, int iterations)
+    {
+        printf("\n%d x %d -> %d x %d\n", source.width, source.height, dest.width, dest.height);
+        printf("  filter              8 bit MP/s    float MP/s   max diff\n");
+
+        const resample::Filter filters[] =
+        {
+            resample::Filter::BOX,
+            resample::Filter::BILINEAR,
+            resample::Filter::BICUBIC,
+            resample::Filter::LANCZOS,
+            resample::Filter::KAISER
+        };
+
+        for (resample::Filter filter : filters)
+        {
+            double mps8 = measure(source, iterations, [&] {
+                resize(dest, source, filter);
+            });
+            double mps32 = measure(fsource, iterations, [&] {
+                resize(fdest, fsource, filter);
+            });
+            printf("  %-16s %12.1f %13.1f %10d\n", resample::getName(filter), mps8, mps32, difference(dest, fdest));
+        }
+    }
+
+} // namespace
+
+void test_resample(int size, int iterations)
+{
+    Bitmap source(size, size, FORMAT_R8G8B8A8);
+    Bitmap fsource(size, size, FORMAT_RGBA32F);
+    fill(source, 11);
+    to_float(fsource, source);
+
+    // downscale 4:1 and by a fraction
+    for (int dest_size : { size / 4, size * 2 / 3 })
+    {
+        Bitmap dest(dest_size, dest_size, FORMAT_R8G8B8A8);
+        Bitmap fdest(dest_size, dest_size, FORMAT_RGBA32F);
+        test_resize(source, fsource, dest, fdest, iterations);
+    }
+
+    // upscale a corner 2:1 straight into a rectangle of a larger surface
+    const int corner = size / 4;
+    Bitmap atlas(size, size, FORMAT_R8G8B8A8);
+    Bitmap fatlas(size, size, FORMAT_RGBA32F);
+    Surface dest(atlas, 16, 16, corner * 2, corner * 2);
+    Surface fdest(fatlas, 16, 16, corner * 2, corner * 2);
+    test_resize(Surface(source, 0, 0, corner, corner), Surface(fsource, 0, 0, corner, corner), dest, fdest, iterations * 4);
+}
+
+// ----------------------------------------------------------------------
+// blit
+// ----------------------------------------------------------------------
+
+/*
+    Surface::blit() between every pair of the common formats against the
+    specialized converters in blitter.hpp. The pairs where blit() is much
+    slower than the converter go through the generic per component path.
+
+    "differ" is the percentage of pixels which are not bit exact with
+    blit(); packing can truncate or round and the 8 bit to float scale
+    can be a division or a multiplication, so a small difference is
+    not necessarily a bug.
+*/
+
+namespace
+{
+
+    struct FormatName
+    {
+        Format format;
+        const char* name;
+    };
+
+    const FormatName formats[] =
+    {
+        { FORMAT_R8G8B8A8, "R8G8B8A8" },
+        { FORMAT_B8G8R8A8, "B8G8R8A8" },
+        { FORMAT_R8G8B8, "R8G8B8" },
+        { FORMAT_B8G8R8, "B8G8R8" },
+        { FORMAT_R5G6B5, "R5G6B5" },
+        { FORMAT_B5G6R5, "B5G6R5" },
+        { FORMAT_R5G5B5A1, "R5G5B5A1" },
+        { FORMAT_B5G5R5A1, "B5G5R5A1" },
+        { FORMAT_R4G4B4A4, "R4G4B4A4" },
+        { FORMAT_B4G4R4A4, "B4G4R4A4" },
+        { FORMAT_RGBA16F, "RGBA16F" },
+        { FORMAT_RGBA32F, "RGBA32F" },
+    };
+
+    double differ(const Surface& a, const Surface& b)
+    {
+        const int bytes = a.format.bytes();
+        size_t count = 0;
+        for (int y = 0; y < a.height; ++y)
+        {
+            const uint8* sa = a.image + y * a.stride;
+            const uint8* sb = b.image + y * b.stride;
+            for (int x = 0; x < a.width * bytes; x += bytes)
+            {
+                count += std::memcmp(sa + x, sb + x, bytes) != 0;
+            }
+        }
+        return 100.0 * count / (double(a.width) * a.height);
+    }
+
+} // namespace
+
+void test_blit(int width, int height, int iterations)
+{
+    Bitmap random(width, height, FORMAT_R8G8B8A8);
+    fill(random, 3);
+
+    printf("\nblit: %d x %d\n", width, height);
+    printf("  source     dest        blit MP/s  specialized MP/s  path        differ\n");
+
+    blitter::getConverterTable();
+
+    for (const FormatName& from : formats)
+    {
+        // convert the random pixels so that the float formats are valid
+        Bitmap source(width, height, from.format);
+        source.blit(0, 0, random);
+
+        for (const FormatName& to : formats)
+        {
+            if (from.format == to.format)
+                continue;
+
+            Bitmap a(width, height, to.format);
+            Bitmap b(width, height, to.format);
+
+            const double mps = measure(source, iterations, [&] {
+                a.blit(0, 0, source);
+            });
+
+            const blitter::Converter* converter = blitter::getConverterTable().find(to.format, from.format);
+            if (converter)
+            {
+                const double specialized = measure(source, iterations, [&] {
+                    blitter::blit(b, source);
+                });
+                printf("  %-10s %-10s %10.1f %17.1f  %-8s %8.2f%%\n", from.name, to.name, mps,
+                    specialized, converter->path, differ(a, b));
+            }
+            else
+            {
+                printf("  %-10s %-10s %10.1f %17s\n", from.name, to.name, mps, "-");
+            }
+        }
+    }
+}
+
+// ----------------------------------------------------------------------
+// tiles
+// ----------------------------------------------------------------------
+
+/*
+    Random viewport access to a TiledImage: a 1920 x 1080 viewport pans
+    around a 64K x 64K (16 GB as a Bitmap) procedural image, now and then
+    jumping to a random place and mip level. Reported: the read()
+    latency, the cache hit rate and the memory in the cache.
+*/
+
+namespace
+{
+
+    // a pixel hash with a few rounds of mixing to stand in for decoding
+    class ProceduralSource : public TileSource
+    {
+    protected:
+        int m_width;
+        int m_height;
+
+    public:
+        ProceduralSource(int width, int height)
+            : m_width(width)
+            , m_height(height)
+        {
+        }
+
+        int width() const override
+        {
+            return m_width;
+        }
+
+        int height() const override
+        {
+            return m_height;
+        }
+
+        void decode(const Surface& dest, int x0, int y0) override
+        {
+            for (int y = 0; y < dest.height; ++y)
+            {
+                uint32* d = reinterpret_cast<uint32*>(dest.image + y * dest.stride);
+                for (int x = 0; x < dest.width; ++x)
+                {
+                    uint32 h = uint32(x0 + x) * 0x9e3779b1u ^ uint32(y0 + y) * 0x85ebca6bu;
+                    for (int i = 0; i < 4; ++i)
+                    {
+                        h ^= h >> 15;
+                        h *= 0x2c1b3c6du;
+                    }
+                    d[x] = h | 0xff000000;
+                }
+            }
+        }
+    };
+
+    void test_viewports(TiledImage& image, const char* name, int steps)
+    {
+        Bitmap viewport(1920, 1080, FORMAT_R8G8B8A8);
+        Random random;
+        Timer timer;
+
+        std::vector<uint64> latency;
+        int level = 0;
+        int x = 0;
+        int y = 0;
+
+        for (int i = 0; i < steps; ++i)
+        {
+            if (random() % 16 == 0)
+            {
+                // jump
+                level = random() % 4;
+                x = random() % std::max(1, image.getWidth(level) - viewport.width);
+                y = random() % std::max(1, image.getHeight(level) - viewport.height);
+            }
+            else
+            {
+                // pan, staying inside the level
+                x = std::max(0, std::min(x + int(random() % 481) - 240, image.getWidth(level) - viewport.width));
+                y = std::max(0, std::min(y + int(random() % 271) - 135, image.getHeight(level) - viewport.height));
+            }
+
+            uint64 time0 = timer.us();
+            image.read(viewport, level, x, y);
+            uint64 time1 = timer.us();
+            latency.push_back(time1 - time0);
+        }
+
+        image.wait();
+        std::sort(latency.begin(), latency.end());
+
+        uint64 total = 0;
+        for (uint64 t : latency)
+            total += t;
+
+        const TiledImage::Statistics stats = image.getStatistics();
+        printf("  %-24s %7.2f %7.2f %7.2f %8.2f %7.1f%% %7d %7d %7.1f %7.1f\n", name,
+            total / 1000.0 / steps,
+            latency[steps / 2] / 1000.0,
+            latency[steps * 99 / 100] / 1000.0,
+            latency.back() / 1000.0,
+            stats.requests ? 100.0 * stats.hits / stats.requests : 0.0,
+            int(stats.decoded), int(stats.filtered),
+            stats.bytes / 1048576.0, stats.peak / 1048576.0);
+    }
+
+    void test_tiled(TileSource& source, int steps)
+    {
+        printf("  %-24s %7s %7s %7s %8s %8s %7s %7s %7s %7s\n", "", "avg ms", "p50", "p99", "max",
+            "hits", "decoded", "mip", "MB", "peak MB");
+
+        for (size_t budget : { size_t(64) << 20, size_t(256) << 20 })
+        {
+            for (bool prefetch : { false, true })
+            {
+                char name[64];
+                std::snprintf(name, sizeof(name), "%d MB%s", int(budget >> 20), prefetch ? ", prefetch" : "");
+
+                TiledImage image(source, budget);
+                image.setPrefetch(prefetch);
+                test_viewports(image, name, steps);
+            }
+        }
+    }
+
+} // namespace
+
+void test_tiles(const char* filename)
+{
+    ProceduralSource procedural(65536, 65536);
+    printf("\ntiled image: %d x %d procedural, Bitmap would be %.1f MB\n",
+        procedural.width(), procedural.height(), 4.0 * procedural.width() * procedural.height() / 1048576.0);
+    test_tiled(procedural, 400);
+
+    if (filename)
+    {
+        File file(filename);
+        DecoderTileSource decoder(file, filename);
+        printf("\ntiled image: %s, %d x %d\n", filename, decoder.width(), decoder.height());
+        test_tiled(decoder, 400);
+    }
+}
+
+// ----------------------------------------------------------------------
+// mipmap
+// ----------------------------------------------------------------------
+
+/*
+    Mip chains of a large, an odd sized and a batch of small images; the
+    throughput is in level 0 megapixels. The chains are verified against
+    a double precision reference which filters every level in linear
+    light straight from the definitions (box: area coverage, kaiser: the
+    windowed sinc) and encodes with the exact sRGB curve. "max diff" is
+    the largest difference in 8 bit codes over all levels, "min PSNR" is
+    the worst level.
+*/
+
+namespace
+{
+
+    // source pixels and weights of every destination pixel along one axis
+    using Taps = std::vector<std::vector<std::pair<int, double>>>;
+
+    Taps reference_taps(int source, int dest, mipmap::Filter filter)
+    {
+        const double scale = double(source) / dest;
+        Taps taps(dest);
+
+        for (int i = 0; i < dest; ++i)
+        {
+            std::vector<double> w(source, 0.0);
+
+            if (filter == mipmap::Filter::BOX)
+            {
+                // pixel edges in source pixels
+                const double x0 = i * scale;
+                const double x1 = (i + 1) * scale;
+                for (int j = 0; j < source; ++j)
+                {
+                    w[j] = std::max(0.0, std::min(j + 1.0, x1) - std::max(double(j), x0));
+                }
+            }
+            else
+            {
+                const double center = (i + 0.5) * scale;
+                const double radius = 3.0 * std::max(scale, 1.0);
+                for (int j = int(std::floor(center - radius)) - 1; j <= int(std::ceil(center + radius)) + 1; ++j)
+                {
+                    const double weight = resample::evaluate(resample::Filter::KAISER, (j + 0.5 - center) / std::max(scale, 1.0));
+                    w[std::min(std::max(j, 0), source - 1)] += weight;
+                }
+            }
+
+            double sum = 0.0;
+            for (double weight : w)
+                sum += weight;
+
+            for (int j = 0; j < source; ++j)
+            {
+                if (w[j] != 0.0)
+                    taps[i].emplace_back(j, w[j] / sum);
+            }
+        }
+
+        return taps;
+    }
+
+    // premultiplied linear RGBA, "width" pixels per row
+    std::vector<double> reference_level(const std::vector<double>& fine, int fine_width, int fine_height,
+                                        int width, int height, mipmap::Filter filter)
+    {
+        const Taps tx = reference_taps(fine_width, width, filter);
+        const Taps ty = reference_taps(fine_height, height, filter);
+
+        std::vector<double> temp(size_t(width) * fine_height * 4, 0.0);
+        for (int y = 0; y < fine_height; ++y)
+        {
+            for (int x = 0; x < width; ++x)
+            {
+                for (auto tap : tx[x])
+                {
+                    for (int i = 0; i < 4; ++i)
+                        temp[(size_t(y) * width + x) * 4 + i] += fine[(size_t(y) * fine_width + tap.first) * 4 + i] * tap.second;
+                }
+            }
+        }
+
+        std::vector<double> result(size_t(width) * height * 4, 0.0);
+        for (int y = 0; y < height; ++y)
+        {
+            for (auto tap : ty[y])
+            {
+                for (int k = 0; k < width * 4; ++k)
+                    result[size_t(y) * width * 4 + k] += temp[size_t(tap.first) * width * 4 + k] * tap.second;
+            }
+        }
+
+        return result;
+    }
+
+    // compare the levels of an R8G8B8A8 sRGB chain with the reference
+    void verify_chain(MipChain& chain, const Surface& source, mipmap::Filter filter, int& max_diff, double& min_psnr)
+    {
+        std::vector<double> linear(size_t(source.width) * source.height * 4);
+        for (int y = 0; y < source.height; ++y)
+        {
+            const uint8* s = source.image + y * source.stride;
+            for (int x = 0; x < source.width; ++x)
+            {
+                double* d = &linear[(size_t(y) * source.width + x) * 4];
+                d[3] = s[3] / 255.0;
+                for (int i = 0; i < 3; ++i)
+                    d[i] = srgb::exact_decode(s[i] / 255.0) * d[3];
+                s += 4;
+            }
+        }
+
+        max_diff = 0;
+        min_psnr = 99.0;
+
+        for (int level = 1; level < chain.getLevels(); ++level)
+        {
+            const mipmap::Level& fine = chain.getLevel(level - 1);
+            const mipmap::Level& info = chain.getLevel(level);
+            linear = reference_level(linear, fine.width, fine.height, info.width, info.height, filter);
+
+            const Surface surface = chain.getSurface(level);
+            double error = 0.0;
+
+            for (int y = 0; y < info.height; ++y)
+            {
+                const uint8* s = surface.image + y * surface.stride;
+                for (int x = 0; x < info.width; ++x)
+                {
+                    const double* p = &linear[(size_t(y) * info.width + x) * 4];
+                    const double alpha = std::min(std::max(p[3], 0.0), 1.0);
+                    int code[4];
+                    for (int i = 0; i < 3; ++i)
+                    {
+                        const double color = p[3] > 0.0 ? std::min(std::max(p[i] / p[3], 0.0), 1.0) : 0.0;
+                        code[i] = int(std::floor(srgb::exact_encode(color) * 255.0 + 0.5));
+                    }
+                    code[3] = int(std::floor(alpha * 255.0 + 0.5));
+
+                    for (int i = 0; i < 4; ++i)
+                    {
+                        const int diff = std::abs(s[i] - code[i]);
+                        max_diff = std::max(max_diff, diff);
+                        error += double(diff) * diff;
+                    }
+                    s += 4;
+                }
+            }
+
+            const double mse = error / (double(info.width) * info.height * 4);
+            if (mse > 0.0)
+                min_psnr = std::min(min_psnr, 10.0 * std::log10(255.0 * 255.0 / mse));
+        }
+    }
+
+    const mipmap::Filter mipmap_filters[] = { mipmap::Filter::BOX, mipmap::Filter::KAISER };
+
+    void test_chain(int width, int height, int iterations)
+    {
+        Bitmap source(width, height, FORMAT_R8G8B8A8);
+        fill(source, 13);
+        MipChain chain(width, height);
+
+        for (mipmap::Filter filter : mipmap_filters)
+        {
+            char name[64];
+            std::snprintf(name, sizeof(name), "%d x %d, %s, %d levels", width, height,
+                mipmap::getName(filter), chain.getLevels());
+            print(name, measure(source, iterations, [&] {
+                generateMipmaps(chain, source, filter);
+            }));
+        }
+    }
+
+    void test_batch(int count, int width, int height)
+    {
+        // the images are stacked in one bitmap
+        Bitmap bitmap(width, height * count, FORMAT_R8G8B8A8);
+        fill(bitmap, 19);
+
+        std::vector<Surface> sources;
+        std::vector<MipChain> chains;
+
+        for (int i = 0; i < count; ++i)
+        {
+            sources.emplace_back(bitmap, 0, i * height, width, height);
+            chains.emplace_back(width, height);
+        }
+
+        const double pixels = double(width) * height * count;
+        Timer timer;
+
+        for (mipmap::Filter filter : mipmap_filters)
+        {
+            uint64 time0 = timer.us();
+            for (int i = 0; i < count; ++i)
+            {
+                generateMipmaps(chains[i], sources[i], filter);
+            }
+            uint64 time1 = timer.us();
+            generateMipmaps(chains, sources, filter);
+            uint64 time2 = timer.us();
+
+            char name[64];
+            std::snprintf(name, sizeof(name), "%d x %d x %d, %s, one by one", count, width, height, mipmap::getName(filter));
+            print(name, time1 > time0 ? pixels / (time1 - time0) : 0.0);
+            std::snprintf(name, sizeof(name), "%d x %d x %d, %s, batch", count, width, height, mipmap::getName(filter));
+            print(name, time2 > time1 ? pixels / (time2 - time1) : 0.0);
+        }
+    }
+
+    void test_verify(const Surface& source, const char* name)
+    {
+        MipChain chain(source.width, source.height);
+
+        for (mipmap::Filter filter : mipmap_filters)
+        {
+            generateMipmaps(chain, source, filter);
+
+            int max_diff;
+            double min_psnr;
+            verify_chain(chain, source, filter, max_diff, min_psnr);
+            printf("  %-28s %-8s %10d %10.2f\n", name, mipmap::getName(filter), max_diff, min_psnr);
+        }
+    }
+
+} // namespace
+
+void test_mipmap(const char* filename)
+{
+    printf("\nmipmap chain\n");
+    test_chain(4096, 4096, 2);
+    test_chain(3999, 2999, 2);
+    test_batch(256, 256, 256);
+
+    printf("\n  %-28s %-8s %10s %10s\n", "reference", "filter", "max diff", "min PSNR");
+
+    const int sizes[][2] = { { 512, 512 }, { 333, 97 }, { 1, 75 } };
+    for (auto size : sizes)
+    {
+        Bitmap source(size[0], size[1], FORMAT_R8G8B8A8);
+        fill(source, 17);
+
+        char name[64];
+        std::snprintf(name, sizeof(name), "%d x %d", size[0], size[1]);
+        test_verify(source, name);
+    }
+
+    if (filename)
+    {
+        Bitmap bitmap(filename, FORMAT_R8G8B8A8);
+        test_verify(bitmap, filename);
+    }
+}
+
+// ----------------------------------------------------------------------
+// block compression
+// ----------------------------------------------------------------------
+
+/*
+    Every BC format and quality tier through the SSE2 encoder and the
+    same algorithm compiled as scalar code: the speedup is what the SIMD
+    palette search buys, and the two PSNR columns should agree. There is
+    no comparison against an external encoder. The throughput is in
+    source megapixels and the PSNR is over the channels the format
+    stores, after decoding the blocks back. Random pixels are the worst
+    case for block compression so the test image is smooth gradients
+    with some noise, hard edges and an alpha ramp.
+
+    With an image file the mip chain of the file is compressed to BC7 and
+    written to bc7.dds and bc7.ktx.
+*/
+
+namespace
+{
+
+    void fill_texture(const Surface& surface)
+    {
+        Random random;
+        for (int y = 0; y < surface.height; ++y)
+        {
+            uint8* d = surface.image + y * surface.stride;
+            for (int x = 0; x < surface.width; ++x)
+            {
+                const int noise = int(random() % 17) - 8;
+                const int edge = ((x >> 6) ^ (y >> 6)) & 1 ? 40 : 0;
+                const float r = 128.0f + 90.0f * std::sin(x * 0.013f + y * 0.007f) + noise + edge;
+                const float g = 128.0f + 90.0f * std::sin(y * 0.011f - x * 0.005f) + noise;
+                const float b = 128.0f + 90.0f * std::cos((x + y) * 0.02f) - edge;
+                const float a = 255.0f * (x + y) / float(surface.width + surface.height);
+                d[0] = uint8(std::min(std::max(r, 0.0f), 255.0f));
+                d[1] = uint8(std::min(std::max(g, 0.0f), 255.0f));
+                d[2] = uint8(std::min(std::max(b, 0.0f), 255.0f));
+                d[3] = uint8(std::min(std::max(a, 0.0f), 255.0f));
+                d += 4;
+            }
+        }
+    }
+
+    double psnr(const Surface& a, const Surface& b, int channels)
+    {
+        double error = 0.0;
+        for (int y = 0; y < a.height; ++y)
+        {
+            const uint8* sa = a.image + y * a.stride;
+            const uint8* sb = b.image + y * b.stride;
+            for (int x = 0; x < a.width; ++x)
+            {
+                for (int c = 0; c < channels; ++c)
+                {
+                    const double delta = double(sa[x * 4 + c]) - sb[x * 4 + c];
+                    error += delta * delta;
+                }
+            }
+        }
+
+        const double mse = error / (double(a.width) * a.height * channels);
+        return mse > 0.0 ? 10.0 * std::log10(255.0 * 255.0 / mse) : 99.0;
+    }
+
+    int getChannels(bc::Type type)
+    {
+        switch (type)
+        {
+            case bc::Type::BC1: return 3;
+            case bc::Type::BC4: return 1;
+            case bc::Type::BC5: return 2;
+            default: return 4;
+        }
+    }
+
+} // namespace
+
+void test_bc(int width, int height, int iterations, const char* filename)
+{
+    Bitmap source(width, height, FORMAT_R8G8B8A8);
+    Bitmap result(width, height, FORMAT_R8G8B8A8);
+    fill_texture(source);
+
+    printf("\nblock compression: %d x %d\n", width, height);
+    printf("  %-16s %10s %10s %12s %12s %10s\n", "format", "MP/s", "PSNR", "scalar MP/s", "scalar PSNR", "speedup");
+
+    const bc::Type types[] = { bc::Type::BC1, bc::Type::BC3, bc::Type::BC4, bc::Type::BC5, bc::Type::BC7 };
+    const bc::Quality qualities[] = { bc::Quality::FAST, bc::Quality::NORMAL, bc::Quality::HIGH };
+
+    for (bc::Type type : types)
+    {
+        std::vector<uint8> blocks(bc::bound(type, width, height));
+        const Memory memory(blocks.data(), blocks.size());
+        const int channels = getChannels(type);
+
+        for (bc::Quality quality : qualities)
+        {
+            const double mps = measure(source, iterations, [&] {
+                bc::encode(memory, source, type, quality);
+            });
+            bc::decode(result, memory, type);
+            const double simd_psnr = psnr(source, result, channels);
+
+            const double scalar_mps = measure(source, iterations, [&] {
+                bc::encode<false>(memory, source, type, quality);
+            });
+            bc::decode(result, memory, type);
+            const double scalar_psnr = psnr(source, result, channels);
+
+            char name[64];
+            std::snprintf(name, sizeof(name), "%s %s", bc::getName(type), bc::getName(quality));
+            printf("  %-16s %10.1f %10.2f %12.1f %12.2f %9.1fx\n", name, mps, simd_psnr, scalar_mps, scalar_psnr,
+                scalar_mps > 0.0 ? mps / scalar_mps : 0.0);
+        }
+    }
+
+    if (filename)
+    {
+        Bitmap bitmap(filename, FORMAT_R8G8B8A8);
+        MipChain chain(bitmap.width, bitmap.height);
+        generateMipmaps(chain, bitmap);
+
+        bc::Texture texture = bc::encode(chain, bc::Type::BC7);
+        bc::save("bc7.dds", texture);
+        bc::save("bc7.ktx", texture);
+
+        Bitmap decoded(bitmap.width, bitmap.height, FORMAT_R8G8B8A8);
+        bc::decode(decoded, Memory(texture.data.data(), texture.getSize(0)), bc::Type::BC7);
+        printf("\n  %s: %d levels, %.2f dB, written to bc7.dds and bc7.ktx\n", filename,
+            chain.getLevels(), psnr(bitmap, decoded, 4));
+    }
+}
+
+// ----------------------------------------------------------------------
+// main()
+// ----------------------------------------------------------------------
+
+int main(int argc, const char* argv[])
+{
+    const char* test = argc > 1 ? argv[1] : "";
+    auto enabled = [&] (const char* name) {
+        return !*test || !std::strcmp(test, name);
+    };
+
+    if (enabled("--srgb"))
+    {
+        test_srgb(4096, 4096, 4);
+    }
+
+    if (enabled("--resample"))
+    {
+        test_resample(4096, 2);
+    }
+
+    if (enabled("--blit"))
+    {
+        test_blit(1024, 1024, 4);
+    }
+
+    if (enabled("--tiles"))
+    {
+        // optional image file for the ImageDecoder backed source
+        test_tiles(argc > 2 ? argv[2] : nullptr);
+    }
+
+    if (enabled("--mipmap"))
+    {
+        // optional image file to verify against the reference
+        test_mipmap(argc > 2 ? argv[2] : nullptr);
+    }
+
+    if (enabled("--bc"))
+    {
+        // optional image file to compress into bc7.dds / bc7.ktx
+        test_bc(512, 512, 2, argc > 2 ? argv[2] : nullptr);
+    }
+}
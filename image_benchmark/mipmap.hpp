@@ -0,0 +1,378 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <mango/mango.hpp>
+#include <mango/image/image.hpp>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include "srgb.hpp"
+#include "resample.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+    #define MIPMAP_ENABLE_SSE2
+    #include <emmintrin.h>
+#endif
+
+/*
+    Mipmap chain generation for decoded images before the GPU upload.
+
+        MipChain chain(bitmap.width, bitmap.height);
+        generateMipmaps(chain, bitmap, mipmap::Filter::KAISER);
+
+    Every level of the chain is in one allocation, largest first, rows
+    packed without padding: the layout a DDS / KTX file or a texture
+    upload wants. getSurface(level) gives a Surface of one level.
+
+    The levels are filtered in linear light: the 8 bit sRGB input is
+    decoded with the srgb.hpp tables, the color is weighted with alpha
+    (premultiplied) so that transparent pixels do not bleed into their
+    neighbours and every level is encoded back to sRGB with correct
+    rounding. With srgb = false the channels are treated as independent
+    linear data (normal maps, masks). Each level is computed from the
+    float result of the previous level, not from its 8 bit encoding.
+
+    Sizes are halved and rounded down, down to 1 x 1. Filters:
+
+    box     2x2 average in SSE2 when the previous level has even (or 1)
+            width and height. An odd size is halved with the exact area
+            weights: 5 -> 2 weights the source pixels 2/5, 2/5, 1/5.
+
+    kaiser  Kaiser windowed sinc over 12 source pixels per axis through
+            the resample.hpp weights and passes: sharper than the box
+            without the Lanczos ringing. Negative lobes are clamped by
+            the encoding.
+
+    Levels depend on each other, so one chain is parallel inside a level
+    (bands of rows in the ThreadPool) and a batch of chains is parallel
+    across the chains, one chain per task.
+*/
+
+namespace mango
+{
+namespace mipmap
+{
+
+    enum class Filter
+    {
+        BOX,
+        KAISER
+    };
+
+    inline const char* getName(Filter filter)
+    {
+        switch (filter)
+        {
+            case Filter::BOX: return "box";
+            case Filter::KAISER: return "kaiser";
+        }
+        return "";
+    }
+
+    struct Level
+    {
+        int width;
+        int height;
+        size_t offset;  // bytes from the start of the chain
+    };
+
+    class MipChain
+    {
+    protected:
+        Format m_format;
+        std::vector<Level> m_levels;
+        std::vector<uint8> m_data;
+
+    public:
+        MipChain(int width, int height, Format format = FORMAT_R8G8B8A8)
+            : m_format(format)
+        {
+            if (format != FORMAT_R8G8B8A8 && format != FORMAT_B8G8R8A8)
+                MANGO_EXCEPTION("mipmap: the chain must be R8G8B8A8 or B8G8R8A8.");
+            if (width < 1 || height < 1)
+                MANGO_EXCEPTION("mipmap: empty image.");
+
+            size_t offset = 0;
+            for (;;)
+            {
+                m_levels.push_back(Level { width, height, offset });
+                offset += size_t(width) * height * 4;
+                if (width == 1 && height == 1)
+                    break;
+                width = std::max(1, width / 2);
+                height = std::max(1, height / 2);
+            }
+
+            m_data.resize(offset);
+        }
+
+        const Format& getFormat() const
+        {
+            return m_format;
+        }
+
+        int getLevels() const
+        {
+            return int(m_levels.size());
+        }
+
+        const Level& getLevel(int level) const
+        {
+            return m_levels[level];
+        }
+
+        Surface getSurface(int level)
+        {
+            const Level& info = m_levels[level];
+            return Surface(info.width, info.height, m_format, info.width * 4, m_data.data() + info.offset);
+        }
+
+        const uint8* data() const
+        {
+            return m_data.data();
+        }
+
+        size_t size() const
+        {
+            return m_data.size();
+        }
+    };
+
+    namespace detail
+    {
+
+        // linear rows of the previous level: the 8 bit level 0 is decoded on the fly
+        struct Rows
+        {
+            int width;
+            const uint8* image;     // level 0
+            size_t stride;
+            const float* linear;    // the other levels
+            bool bgra;
+            bool srgb;
+
+            const float* get(int y, float* scratch) const
+            {
+                if (linear)
+                    return linear + size_t(y) * width * 4;
+
+                const uint8* s = image + y * stride;
+                if (srgb)
+                {
+                    srgb::decode_row(scratch, s, width, bgra, true);
+                }
+                else
+                {
+                    for (int i = 0; i < width * 4; ++i)
+                    {
+                        scratch[i] = s[i] * (1.0f / 255.0f);
+                    }
+                }
+                return scratch;
+            }
+        };
+
+        // 2x2 average of rows a and b; step is 4 floats or 0 when the previous level is 1 pixel wide
+        inline void box(float* dest, const float* a, const float* b, int width, int step)
+        {
+            for (int x = 0; x < width; ++x)
+            {
+#ifdef MIPMAP_ENABLE_SSE2
+                __m128 sum = _mm_add_ps(_mm_loadu_ps(a), _mm_loadu_ps(a + step));
+                sum = _mm_add_ps(sum, _mm_add_ps(_mm_loadu_ps(b), _mm_loadu_ps(b + step)));
+                _mm_storeu_ps(dest, _mm_mul_ps(sum, _mm_set1_ps(0.25f)));
+#else
+                for (int i = 0; i < 4; ++i)
+                {
+                    dest[i] = (a[i] + a[i + step] + b[i] + b[i + step]) * 0.25f;
+                }
+#endif
+                a += step * 2;
+                b += step * 2;
+                dest += 4;
+            }
+        }
+
+        // separable filter for the rows [y0, y1) of the level
+        inline void filter(float* dest, int width, const Rows& fine,
+                           const resample::Weights& wx, const resample::Weights& wy, int y0, int y1)
+        {
+            const int count = width * 4;
+            const int sy0 = wy.start[y0];
+            const int sy1 = wy.start[y1 - 1] + wy.taps;
+
+            std::vector<float> scratch(size_t(fine.width) * 4);
+            std::vector<float> buffer(size_t(sy1 - sy0) * count);
+            for (int y = sy0; y < sy1; ++y)
+            {
+                resample::horizontal(&buffer[size_t(y - sy0) * count], fine.get(y, scratch.data()), wx, 0, width);
+            }
+
+            std::vector<const float*> rows(wy.taps);
+            for (int y = y0; y < y1; ++y)
+            {
+                for (int i = 0; i < wy.taps; ++i)
+                {
+                    rows[i] = &buffer[size_t(wy.start[y] + i - sy0) * count];
+                }
+                resample::vertical(dest + size_t(y) * count, rows.data(), &wy.coefficient[size_t(y) * wy.taps], wy.taps, count);
+            }
+        }
+
+        // rows in bands of ~64K pixels; func(y0, y1)
+        template <typename Func>
+        void bands(int width, int height, bool parallel, Func func)
+        {
+            const int rows = std::max(1, (64 * 1024) / std::max(width, 1));
+
+            if (!parallel || height <= rows * 2)
+            {
+                func(0, height);
+                return;
+            }
+
+            ConcurrentQueue q("mipmap");
+            for (int y0 = 0; y0 < height; y0 += rows)
+            {
+                const int y1 = std::min(y0 + rows, height);
+                q.enqueue([=] {
+                    func(y0, y1);
+                });
+            }
+            q.wait();
+        }
+
+        inline void generate(MipChain& chain, const Surface& source, Filter filter, bool srgb, bool parallel)
+        {
+            const Level& top = chain.getLevel(0);
+            if (source.width != top.width || source.height != top.height)
+                MANGO_EXCEPTION("mipmap: the source and the chain have different dimensions.");
+
+            Surface level0 = chain.getSurface(0);
+            if (source.format == chain.getFormat())
+            {
+                for (int y = 0; y < source.height; ++y)
+                {
+                    std::memcpy(level0.image + y * level0.stride, source.image + y * source.stride, source.width * 4);
+                }
+            }
+            else
+            {
+                level0.blit(0, 0, source);
+            }
+
+            const bool bgra = chain.getFormat() == FORMAT_B8G8R8A8;
+            if (srgb)
+                srgb::getTables();
+
+            std::vector<float> current;
+            std::vector<float> next;
+
+            for (int level = 1; level < chain.getLevels(); ++level)
+            {
+                const Level& info = chain.getLevel(level);
+                const Level& previous = chain.getLevel(level - 1);
+
+                const Rows fine { previous.width, level0.image, size_t(level0.stride),
+                                  level > 1 ? current.data() : nullptr, bgra, srgb };
+
+                next.resize(size_t(info.width) * info.height * 4);
+                float* linear = next.data();
+                uint8* encoded = chain.getSurface(level).image;
+
+                const bool even = (previous.width == 1 || !(previous.width & 1)) &&
+                                  (previous.height == 1 || !(previous.height & 1));
+                const resample::Filter kernel = filter == Filter::KAISER ? resample::Filter::KAISER : resample::Filter::BOX;
+
+                std::unique_ptr<resample::Weights> wx;
+                std::unique_ptr<resample::Weights> wy;
+                if (filter != Filter::BOX || !even)
+                {
+                    wx.reset(new resample::Weights(previous.width, info.width, kernel));
+                    wy.reset(new resample::Weights(previous.height, info.height, kernel));
+                }
+
+                bands(info.width, info.height, parallel, [&] (int y0, int y1) {
+                    if (wx)
+                    {
+                        detail::filter(linear, info.width, fine, *wx, *wy, y0, y1);
+                    }
+                    else
+                    {
+                        const int xstep = previous.width > 1 ? 4 : 0;
+                        const int ystep = previous.height > 1 ? 1 : 0;
+                        std::vector<float> scratch(size_t(previous.width) * 8);
+
+                        for (int y = y0; y < y1; ++y)
+                        {
+                            const float* a = fine.get(y * 2, scratch.data());
+                            const float* b = fine.get(y * 2 + ystep, scratch.data() + previous.width * 4);
+                            box(linear + size_t(y) * info.width * 4, a, b, info.width, xstep);
+                        }
+                    }
+
+                    for (int y = y0; y < y1; ++y)
+                    {
+                        const float* s = linear + size_t(y) * info.width * 4;
+                        uint8* d = encoded + size_t(y) * info.width * 4;
+                        if (srgb)
+                        {
+                            srgb::encode_row(d, s, info.width, bgra, true);
+                        }
+                        else
+                        {
+                            for (int i = 0; i < info.width * 4; ++i)
+                            {
+                                d[i] = srgb::encode_alpha(s[i]);
+                            }
+                        }
+                    }
+                });
+
+                std::swap(current, next);
+            }
+        }
+
+    } // namespace detail
+
+} // namespace mipmap
+
+    using mipmap::MipChain;
+
+    // fill the chain from source: level 0 is a copy (converted to the chain format), the rest are filtered
+    inline void generateMipmaps(MipChain& chain, const Surface& source,
+                                mipmap::Filter filter = mipmap::Filter::BOX, bool srgb = true)
+    {
+        mipmap::detail::generate(chain, source, filter, srgb, true);
+    }
+
+    // a batch of images: one chain per task
+    inline void generateMipmaps(std::vector<MipChain>& chains, const std::vector<Surface>& sources,
+                                mipmap::Filter filter = mipmap::Filter::BOX, bool srgb = true)
+    {
+        if (chains.size() != sources.size())
+            MANGO_EXCEPTION("mipmap: the batch has different number of chains and sources.");
+
+        if (chains.size() == 1)
+        {
+            generateMipmaps(chains[0], sources[0], filter, srgb);
+            return;
+        }
+
+        ConcurrentQueue q("mipmap");
+        for (size_t i = 0; i < chains.size(); ++i)
+        {
+            MipChain* chain = &chains[i];
+            const Surface* source = &sources[i];
+            q.enqueue([=] {
+                mipmap::detail::generate(*chain, *source, filter, srgb, false);
+            });
+        }
+        q.wait();
+    }
+
+} // namespace mango
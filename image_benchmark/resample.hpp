@@ -0,0 +1,522 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <mango/mango.hpp>
+#include <mango/image/image.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+    #define RESAMPLE_ENABLE_SSE2
+    #include <emmintrin.h>
+#endif
+
+/*
+    Separable image resampling between Surfaces.
+
+        resize(dest, source, Filter::LANCZOS);
+
+    The destination is written in place like the decoders do in
+    misc/image_loading.cpp example5: it can be a Bitmap, a Surface over
+    memory the caller owns or a rectangle of a larger surface. The size
+    of the destination is the size of the result.
+
+    Filters: box (area average when downscaling, nearest when upscaling),
+    bilinear (tent), bicubic (Catmull-Rom), Lanczos-3 and Kaiser windowed
+    sinc (radius 3, alpha 4; less ringing than Lanczos). When
+    downscaling the filter is stretched over the source pixels covering
+    one destination pixel so that nothing aliases.
+
+    Weights are computed once per axis: every destination column / row
+    has "taps" source pixels starting at start[i]. The edge pixels are
+    repeated; their weights are folded into the first and last taps.
+
+    Two pipelines:
+
+    8 bit   R8G8B8A8 / B8G8R8A8. Weights are 1.14 fixed point, the
+            horizontal pass keeps 6 fraction bits in int16 and the vertical
+            pass rounds and saturates back to 8 bits. Two taps per
+            pmaddwd with SSE2.
+
+    float   RGBA32F, one pixel per SSE register in the horizontal pass and
+            four floats of a row in the vertical pass. Not clamped:
+            negative lobes can overshoot.
+
+    The channels are filtered independently; premultiply alpha first
+    (srgb_decode) when the transparent pixels have garbage color. Other
+    formats are converted to the closest supported one with blit().
+
+    The destination is split into 256 x 64 tiles which are filtered in
+    the ThreadPool. Every tile runs the horizontal pass for the source
+    rows and destination columns it needs into its own buffer.
+*/
+
+namespace mango
+{
+namespace resample
+{
+
+    enum class Filter
+    {
+        BOX,
+        BILINEAR,
+        BICUBIC,
+        LANCZOS,
+        KAISER
+    };
+
+    inline const char* getName(Filter filter)
+    {
+        switch (filter)
+        {
+            case Filter::BOX: return "box";
+            case Filter::BILINEAR: return "bilinear";
+            case Filter::BICUBIC: return "bicubic";
+            case Filter::LANCZOS: return "lanczos";
+            case Filter::KAISER: return "kaiser";
+        }
+        return "";
+    }
+
+    // radius of the filter in source pixels when not scaled
+    inline float getSupport(Filter filter)
+    {
+        switch (filter)
+        {
+            case Filter::BOX: return 0.5f;
+            case Filter::BILINEAR: return 1.0f;
+            case Filter::BICUBIC: return 2.0f;
+            case Filter::LANCZOS: return 3.0f;
+            case Filter::KAISER: return 3.0f;
+        }
+        return 1.0f;
+    }
+
+    inline double sinc(double x)
+    {
+        if (x == 0.0)
+            return 1.0;
+        x *= 3.14159265358979323846;
+        return std::sin(x) / x;
+    }
+
+    // modified Bessel function of the first kind, order 0
+    inline double bessel_i0(double x)
+    {
+        double sum = 1.0;
+        double term = 1.0;
+        const double y = x * x * 0.25;
+        for (int k = 1; k < 32 && term > sum * 1e-12; ++k)
+        {
+            term *= y / (double(k) * k);
+            sum += term;
+        }
+        return sum;
+    }
+
+    inline double evaluate(Filter filter, double x)
+    {
+        x = std::abs(x);
+
+        switch (filter)
+        {
+            case Filter::BOX:
+                return x < 0.5 ? 1.0 : 0.0;
+
+            case Filter::BILINEAR:
+                return x < 1.0 ? 1.0 - x : 0.0;
+
+            case Filter::BICUBIC:
+                // Catmull-Rom: B = 0, C = 0.5
+                if (x < 1.0)
+                    return (1.5 * x - 2.5) * x * x + 1.0;
+                if (x < 2.0)
+                    return ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0;
+                return 0.0;
+
+            case Filter::LANCZOS:
+                return x < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+
+            case Filter::KAISER:
+            {
+                const double alpha = 4.0;
+                const double t = x / 3.0;
+                return t < 1.0 ? sinc(x) * bessel_i0(alpha * std::sqrt(1.0 - t * t)) / bessel_i0(alpha) : 0.0;
+            }
+        }
+
+        return 0.0;
+    }
+
+    static constexpr int WEIGHT_BITS = 14;      // 1.14 fixed point weights
+    static constexpr int FRACTION_BITS = 6;     // between the passes in the 8 bit pipeline
+
+    struct Weights
+    {
+        int taps;
+        std::vector<int> start;             // first source pixel of every output
+        std::vector<float> coefficient;     // taps per output
+        std::vector<int16> fixed;           // the same in fixed point, sum is exactly 1 << WEIGHT_BITS
+
+        Weights(int source, int dest, Filter filter)
+        {
+            const double scale = double(source) / dest;
+            const double stretch = std::max(scale, 1.0);
+            const double support = getSupport(filter) * stretch;
+
+            // box downscale: the weight is the part of the source pixel covered by the
+            // destination pixel, so odd sizes (5 -> 2) still use every source pixel
+            const bool area = filter == Filter::BOX && scale > 1.0;
+
+            const int window = int(std::ceil(support * 2.0)) + 1 + area;
+            taps = std::min(window, source);
+            start.resize(dest);
+            coefficient.resize(size_t(dest) * taps);
+            fixed.resize(size_t(dest) * taps);
+
+            std::vector<double> w(taps);
+
+            for (int i = 0; i < dest; ++i)
+            {
+                const double center = (i + 0.5) * scale - 0.5;
+                const int left = area ? int(std::floor(center - support + 0.5)) : int(std::ceil(center - support));
+                const int first = std::min(std::max(left, 0), source - taps);
+                start[i] = first;
+
+                std::fill(w.begin(), w.end(), 0.0);
+                double sum = 0.0;
+
+                for (int j = left; j < left + window; ++j)
+                {
+                    const double weight = area ?
+                        std::max(0.0, std::min(j + 0.5, center + support) - std::max(j - 0.5, center - support)) :
+                        evaluate(filter, (j - center) / stretch);
+                    w[std::min(std::max(j, 0), source - 1) - first] += weight;
+                    sum += weight;
+                }
+
+                if (sum == 0.0)
+                {
+                    // box upscale exactly between two pixels
+                    const int nearest = std::min(std::max(int(std::floor(center + 0.5)), 0), source - 1);
+                    w[nearest - first] = 1.0;
+                    sum = 1.0;
+                }
+
+                float* c = &coefficient[size_t(i) * taps];
+                int16* f = &fixed[size_t(i) * taps];
+                int total = 0;
+                int largest = 0;
+
+                for (int k = 0; k < taps; ++k)
+                {
+                    c[k] = float(w[k] / sum);
+                    f[k] = int16(std::lround(w[k] / sum * (1 << WEIGHT_BITS)));
+                    total += f[k];
+                    if (std::abs(f[k]) > std::abs(f[largest]))
+                        largest = k;
+                }
+
+                // rounding error goes to the largest weight: constant color stays constant
+                f[largest] = int16(f[largest] + (1 << WEIGHT_BITS) - total);
+            }
+        }
+    };
+
+    // -----------------------------------------------------------------
+    // 8 bit pipeline
+    // -----------------------------------------------------------------
+
+    // 4 x uint8 pixels -> 4 x int16 per pixel with FRACTION_BITS
+    inline void horizontal(int16* dest, const uint8* source, const Weights& weights, int x0, int x1)
+    {
+        const int taps = weights.taps;
+        const int32 round = 1 << (WEIGHT_BITS - FRACTION_BITS - 1);
+
+        for (int x = x0; x < x1; ++x)
+        {
+            const uint8* s = source + weights.start[x] * 4;
+            const int16* c = &weights.fixed[size_t(x) * taps];
+
+#ifdef RESAMPLE_ENABLE_SSE2
+            const __m128i zero = _mm_setzero_si128();
+            __m128i sum = _mm_set1_epi32(round);
+            int i = 0;
+
+            for ( ; i + 1 < taps; i += 2)
+            {
+                // r0 r1 g0 g1 b0 b1 a0 a1 * w0 w1 w0 w1 ..
+                __m128i p = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(s + i * 4)), zero);
+                p = _mm_unpacklo_epi16(p, _mm_srli_si128(p, 8));
+                const __m128i w = _mm_set1_epi32(int32(uint16(c[i])) | int32(uint32(uint16(c[i + 1])) << 16));
+                sum = _mm_add_epi32(sum, _mm_madd_epi16(p, w));
+            }
+
+            if (i < taps)
+            {
+                int32 pixel;
+                std::memcpy(&pixel, s + i * 4, 4);
+                __m128i p = _mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel), zero);
+                p = _mm_unpacklo_epi16(p, zero);
+                sum = _mm_add_epi32(sum, _mm_madd_epi16(p, _mm_set1_epi32(uint16(c[i]))));
+            }
+
+            sum = _mm_srai_epi32(sum, WEIGHT_BITS - FRACTION_BITS);
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(dest), _mm_packs_epi32(sum, sum));
+#else
+            for (int channel = 0; channel < 4; ++channel)
+            {
+                int32 sum = round;
+                for (int i = 0; i < taps; ++i)
+                {
+                    sum += s[i * 4 + channel] * c[i];
+                }
+                sum >>= WEIGHT_BITS - FRACTION_BITS;
+                dest[channel] = int16(std::min(std::max(sum, -32768), 32767));
+            }
+#endif
+
+            dest += 4;
+        }
+    }
+
+    // "count" int16 values from every row -> uint8
+    inline void vertical(uint8* dest, const int16* const* rows, const int16* c, int taps, int count)
+    {
+        const int32 round = 1 << (WEIGHT_BITS + FRACTION_BITS - 1);
+        int k = 0;
+
+#ifdef RESAMPLE_ENABLE_SSE2
+        for ( ; k + 8 <= count; k += 8)
+        {
+            __m128i lo = _mm_set1_epi32(round);
+            __m128i hi = lo;
+            int i = 0;
+
+            for ( ; i + 1 < taps; i += 2)
+            {
+                const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[i] + k));
+                const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[i + 1] + k));
+                const __m128i w = _mm_set1_epi32(int32(uint16(c[i])) | int32(uint32(uint16(c[i + 1])) << 16));
+                lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+                hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+            }
+
+            if (i < taps)
+            {
+                const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[i] + k));
+                const __m128i zero = _mm_setzero_si128();
+                const __m128i w = _mm_set1_epi32(uint16(c[i]));
+                lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, zero), w));
+                hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, zero), w));
+            }
+
+            lo = _mm_srai_epi32(lo, WEIGHT_BITS + FRACTION_BITS);
+            hi = _mm_srai_epi32(hi, WEIGHT_BITS + FRACTION_BITS);
+            const __m128i v = _mm_packs_epi32(lo, hi);
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(dest + k), _mm_packus_epi16(v, v));
+        }
+#endif
+
+        for ( ; k < count; ++k)
+        {
+            int32 sum = round;
+            for (int i = 0; i < taps; ++i)
+            {
+                sum += rows[i][k] * c[i];
+            }
+            sum >>= WEIGHT_BITS + FRACTION_BITS;
+            dest[k] = uint8(std::min(std::max(sum, 0), 255));
+        }
+    }
+
+    // -----------------------------------------------------------------
+    // float pipeline
+    // -----------------------------------------------------------------
+
+    inline void horizontal(float* dest, const float* source, const Weights& weights, int x0, int x1)
+    {
+        const int taps = weights.taps;
+
+        for (int x = x0; x < x1; ++x)
+        {
+            const float* s = source + weights.start[x] * 4;
+            const float* c = &weights.coefficient[size_t(x) * taps];
+
+#ifdef RESAMPLE_ENABLE_SSE2
+            __m128 sum = _mm_setzero_ps();
+            for (int i = 0; i < taps; ++i)
+            {
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(s + i * 4), _mm_set1_ps(c[i])));
+            }
+            _mm_storeu_ps(dest, sum);
+#else
+            for (int channel = 0; channel < 4; ++channel)
+            {
+                float sum = 0.0f;
+                for (int i = 0; i < taps; ++i)
+                {
+                    sum += s[i * 4 + channel] * c[i];
+                }
+                dest[channel] = sum;
+            }
+#endif
+
+            dest += 4;
+        }
+    }
+
+    inline void vertical(float* dest, const float* const* rows, const float* c, int taps, int count)
+    {
+        int k = 0;
+
+#ifdef RESAMPLE_ENABLE_SSE2
+        for ( ; k + 8 <= count; k += 8)
+        {
+            __m128 a = _mm_setzero_ps();
+            __m128 b = _mm_setzero_ps();
+            for (int i = 0; i < taps; ++i)
+            {
+                const __m128 w = _mm_set1_ps(c[i]);
+                a = _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(rows[i] + k + 0), w));
+                b = _mm_add_ps(b, _mm_mul_ps(_mm_loadu_ps(rows[i] + k + 4), w));
+            }
+            _mm_storeu_ps(dest + k + 0, a);
+            _mm_storeu_ps(dest + k + 4, b);
+        }
+#endif
+
+        for ( ; k < count; ++k)
+        {
+            float sum = 0.0f;
+            for (int i = 0; i < taps; ++i)
+            {
+                sum += rows[i][k] * c[i];
+            }
+            dest[k] = sum;
+        }
+    }
+
+    // -----------------------------------------------------------------
+    // tiles
+    // -----------------------------------------------------------------
+
+    struct Tile
+    {
+        int x0, y0, x1, y1;
+    };
+
+    inline const int16* coefficients(const Weights& weights, int i, int16)
+    {
+        return &weights.fixed[size_t(i) * weights.taps];
+    }
+
+    inline const float* coefficients(const Weights& weights, int i, float)
+    {
+        return &weights.coefficient[size_t(i) * weights.taps];
+    }
+
+    // Pixel: uint8 or float, Temp: int16 or float
+    template <typename Pixel, typename Temp>
+    void filter(const Surface& dest, const Surface& source, const Weights& wx, const Weights& wy, Tile tile)
+    {
+        const int count = (tile.x1 - tile.x0) * 4;
+        const int sy0 = wy.start[tile.y0];
+        const int sy1 = wy.start[tile.y1 - 1] + wy.taps;
+
+        // horizontal pass for the source rows and the columns of the tile
+        std::vector<Temp> buffer(size_t(sy1 - sy0) * count);
+        for (int y = sy0; y < sy1; ++y)
+        {
+            const Pixel* s = reinterpret_cast<const Pixel*>(source.image + y * source.stride);
+            horizontal(&buffer[size_t(y - sy0) * count], s, wx, tile.x0, tile.x1);
+        }
+
+        std::vector<const Temp*> rows(wy.taps);
+
+        for (int y = tile.y0; y < tile.y1; ++y)
+        {
+            for (int i = 0; i < wy.taps; ++i)
+            {
+                rows[i] = &buffer[size_t(wy.start[y] + i - sy0) * count];
+            }
+
+            Pixel* d = reinterpret_cast<Pixel*>(dest.image + y * dest.stride) + tile.x0 * 4;
+            vertical(d, rows.data(), coefficients(wy, y, Temp()), wy.taps, count);
+        }
+    }
+
+    template <typename Pixel, typename Temp>
+    void filter(const Surface& dest, const Surface& source, Filter filter)
+    {
+        const Weights wx(source.width, dest.width, filter);
+        const Weights wy(source.height, dest.height, filter);
+
+        const int tile_width = 256;
+        const int tile_height = 64;
+
+        if (dest.width * dest.height <= tile_width * tile_height * 2)
+        {
+            resample::filter<Pixel, Temp>(dest, source, wx, wy, Tile { 0, 0, dest.width, dest.height });
+            return;
+        }
+
+        ConcurrentQueue q("resample");
+        for (int y = 0; y < dest.height; y += tile_height)
+        {
+            for (int x = 0; x < dest.width; x += tile_width)
+            {
+                const Tile tile { x, y, std::min(x + tile_width, dest.width), std::min(y + tile_height, dest.height) };
+                q.enqueue([&, tile] {
+                    resample::filter<Pixel, Temp>(dest, source, wx, wy, tile);
+                });
+            }
+        }
+        q.wait();
+    }
+
+    inline bool isSupported(const Format& format)
+    {
+        return format == FORMAT_R8G8B8A8 || format == FORMAT_B8G8R8A8 || format == FORMAT_RGBA32F;
+    }
+
+} // namespace resample
+
+    // resample source to the size of dest
+    inline void resize(const Surface& dest, const Surface& source, resample::Filter filter = resample::Filter::BICUBIC)
+    {
+        if (dest.width <= 0 || dest.height <= 0 || source.width <= 0 || source.height <= 0)
+            return;
+
+        const Format format = resample::isSupported(source.format) ? source.format :
+                              resample::isSupported(dest.format) ? dest.format : FORMAT_R8G8B8A8;
+
+        if (source.format != format)
+        {
+            Bitmap temp(source.width, source.height, format);
+            temp.blit(0, 0, source);
+            resize(dest, temp, filter);
+            return;
+        }
+
+        if (dest.format != format)
+        {
+            Bitmap temp(dest.width, dest.height, format);
+            resize(temp, source, filter);
+            Surface target = dest;
+            target.blit(0, 0, temp);
+            return;
+        }
+
+        if (format == FORMAT_RGBA32F)
+            resample::filter<float, float>(dest, source, filter);
+        else
+            resample::filter<uint8, int16>(dest, source, filter);
+    }
+
+} // namespace mango
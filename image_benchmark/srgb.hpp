@@ -0,0 +1,264 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <mango/mango.hpp>
+#include <mango/image/image.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+/*
+    Bulk sRGB conversion between 8 bit and linear float surfaces.
+
+    misc/math.cpp example11 converts one float4 at a time. Whole images
+    are converted here with tables:
+
+    decode: the 8 bit input has only 256 values so the linear values are
+            simply looked up.
+
+    encode: the float is clamped to [0, 1] and the exponent and the top 7
+            mantissa bits select one of 1665 buckets. Every bucket stores
+            the sRGB code at its start and is narrow enough to contain at
+            most one code boundary, so one compare against the boundary
+            ("threshold") of the next code finishes the job. The thresholds
+            are the smallest floats which round to the code when the exact
+            conversion is done in double precision: the result is correctly
+            rounded, not "within 0.6 codes".
+
+    The color channels of R8G8B8A8 / B8G8R8A8 surfaces are converted, the
+    alpha is linear in both directions. The linear surface is RGBA32F;
+    with premultiply the color is multiplied with alpha after decoding
+    and divided by it before encoding.
+
+    Large surfaces are split into horizontal bands which are converted in
+    the ThreadPool.
+*/
+
+namespace mango
+{
+namespace srgb
+{
+
+    static constexpr int BUCKET_BITS = 7;                  // mantissa bits in the bucket index
+    static constexpr int BUCKET_MIN_EXPONENT = 127 - 13;   // below 2^-13 everything is code 0
+    static constexpr int BUCKET_COUNT = (13 << BUCKET_BITS) + 1;
+
+    inline double exact_decode(double s)
+    {
+        return s <= 0.04045 ? s / 12.92 : std::pow((s + 0.055) / 1.055, 2.4);
+    }
+
+    inline double exact_encode(double linear)
+    {
+        return linear <= 0.0031308 ? linear * 12.92 : 1.055 * std::pow(linear, 1.0 / 2.4) - 0.055;
+    }
+
+    struct Tables
+    {
+        float decode[256];
+        float threshold[257];   // code i starts at threshold[i]
+        uint8 encode[BUCKET_COUNT];
+
+        Tables()
+        {
+            for (int i = 0; i < 256; ++i)
+            {
+                decode[i] = float(exact_decode(i / 255.0));
+            }
+
+            threshold[0] = -std::numeric_limits<float>::infinity();
+            threshold[256] = std::numeric_limits<float>::infinity();
+
+            for (int i = 1; i < 256; ++i)
+            {
+                // the smallest float which encodes to at least i - 0.5
+                const double boundary = (i - 0.5) / 255.0;
+                float x = float(exact_decode(boundary));
+                while (exact_encode(x) < boundary)
+                    x = std::nextafter(x, 2.0f);
+                while (exact_encode(std::nextafter(x, -1.0f)) >= boundary)
+                    x = std::nextafter(x, -1.0f);
+                threshold[i] = x;
+            }
+
+            for (int i = 0; i < BUCKET_COUNT; ++i)
+            {
+                const float start = i ? bucketStart(i) : 0.0f;
+                int code = 0;
+                while (threshold[code + 1] <= start)
+                    ++code;
+                encode[i] = uint8(code);
+            }
+        }
+
+        static float bucketStart(int index)
+        {
+            uint32 bits = uint32(index + (BUCKET_MIN_EXPONENT << BUCKET_BITS)) << (23 - BUCKET_BITS);
+            float x;
+            std::memcpy(&x, &bits, 4);
+            return x;
+        }
+    };
+
+    inline const Tables& getTables()
+    {
+        static const Tables tables;
+        return tables;
+    }
+
+    // linear [0, 1] -> correctly rounded 8 bit sRGB; negative (including -0),
+    // NaN -> 0 and >= 1 (including +inf) -> 255
+    inline uint8 encode(const Tables& tables, float linear)
+    {
+        // the range is checked on the bits: -ffast-math folds away float
+        // comparisons against NaN, and -0.0f passes std::max(x, 0.0f)
+        uint32 bits;
+        std::memcpy(&bits, &linear, 4);
+        if (bits - 1 >= 0x3f800000 - 1)
+        {
+            // +0, [1, +inf], NaN or the sign bit set; only [1, +inf] is 255
+            return bits >= 0x3f800000 && bits <= 0x7f800000 ? 255 : 0;
+        }
+
+        const int index = std::max(int(bits >> (23 - BUCKET_BITS)) - (BUCKET_MIN_EXPONENT << BUCKET_BITS), 0);
+
+        const int code = tables.encode[index];
+        return uint8(code + (linear >= tables.threshold[code + 1]));
+    }
+
+    inline uint8 encode_alpha(float alpha)
+    {
+        return uint8(std::min(std::max(alpha, 0.0f), 1.0f) * 255.0f + 0.5f);
+    }
+
+    // source: width x 4 bytes (r, g, b, a or b, g, r, a), dest: width x RGBA float
+    inline void decode_row(float* dest, const uint8* source, int width, bool bgra, bool premultiply)
+    {
+        const Tables& tables = getTables();
+        const int r = bgra ? 2 : 0;
+        const int b = bgra ? 0 : 2;
+
+        for (int x = 0; x < width; ++x)
+        {
+            const float alpha = source[3] * (1.0f / 255.0f);
+            const float scale = premultiply ? alpha : 1.0f;
+            dest[0] = tables.decode[source[r]] * scale;
+            dest[1] = tables.decode[source[1]] * scale;
+            dest[2] = tables.decode[source[b]] * scale;
+            dest[3] = alpha;
+            source += 4;
+            dest += 4;
+        }
+    }
+
+    inline void encode_row(uint8* dest, const float* source, int width, bool bgra, bool premultiplied)
+    {
+        const Tables& tables = getTables();
+        const int r = bgra ? 2 : 0;
+        const int b = bgra ? 0 : 2;
+
+        for (int x = 0; x < width; ++x)
+        {
+            const float alpha = source[3];
+            float scale = 1.0f;
+            if (premultiplied)
+            {
+                // fully transparent color is lost in premultiplication
+                scale = alpha > 0.0f ? 1.0f / alpha : 0.0f;
+            }
+            dest[r] = encode(tables, source[0] * scale);
+            dest[1] = encode(tables, source[1] * scale);
+            dest[b] = encode(tables, source[2] * scale);
+            dest[3] = encode_alpha(alpha);
+            source += 4;
+            dest += 4;
+        }
+    }
+
+    namespace detail
+    {
+
+        inline bool isBGRA(const Format& format)
+        {
+            if (format == FORMAT_R8G8B8A8)
+                return false;
+            if (format == FORMAT_B8G8R8A8)
+                return true;
+            MANGO_EXCEPTION("srgb: the 8 bit surface must be R8G8B8A8 or B8G8R8A8.");
+            return false;
+        }
+
+        inline void validate(const Surface& a, const Surface& b)
+        {
+            if (a.width != b.width || a.height != b.height)
+                MANGO_EXCEPTION("srgb: the surfaces have different dimensions.");
+        }
+
+        // rows in bands of ~64K pixels
+        template <typename Func>
+        void bands(int width, int height, Func func)
+        {
+            const int rows = std::max(1, (64 * 1024) / std::max(width, 1));
+
+            if (height <= rows * 2)
+            {
+                for (int y = 0; y < height; ++y)
+                    func(y);
+                return;
+            }
+
+            ConcurrentQueue q("srgb");
+            for (int y0 = 0; y0 < height; y0 += rows)
+            {
+                const int y1 = std::min(y0 + rows, height);
+                q.enqueue([=] {
+                    for (int y = y0; y < y1; ++y)
+                        func(y);
+                });
+            }
+            q.wait();
+        }
+
+    } // namespace detail
+
+} // namespace srgb
+
+    // 8 bit sRGB -> RGBA32F linear
+    inline void srgb_decode(const Surface& dest, const Surface& source, bool premultiply = false)
+    {
+        srgb::detail::validate(dest, source);
+        const bool bgra = srgb::detail::isBGRA(source.format);
+        if (dest.format != FORMAT_RGBA32F)
+            MANGO_EXCEPTION("srgb: the linear surface must be RGBA32F.");
+
+        srgb::getTables();
+
+        srgb::detail::bands(source.width, source.height, [&] (int y) {
+            float* d = reinterpret_cast<float*>(dest.image + y * dest.stride);
+            const uint8* s = source.image + y * source.stride;
+            srgb::decode_row(d, s, source.width, bgra, premultiply);
+        });
+    }
+
+    // RGBA32F linear -> 8 bit sRGB
+    inline void srgb_encode(const Surface& dest, const Surface& source, bool premultiplied = false)
+    {
+        srgb::detail::validate(dest, source);
+        const bool bgra = srgb::detail::isBGRA(dest.format);
+        if (source.format != FORMAT_RGBA32F)
+            MANGO_EXCEPTION("srgb: the linear surface must be RGBA32F.");
+
+        srgb::getTables();
+
+        srgb::detail::bands(source.width, source.height, [&] (int y) {
+            uint8* d = dest.image + y * dest.stride;
+            const float* s = reinterpret_cast<const float*>(source.image + y * source.stride);
+            srgb::encode_row(d, s, source.width, bgra, premultiplied);
+        });
+    }
+
+} // namespace mango
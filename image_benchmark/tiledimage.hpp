@@ -0,0 +1,584 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <mango/mango.hpp>
+#include <mango/image/image.hpp>
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/*
+    Tiled image with lazy decoding.
+
+    A Bitmap holds every pixel of the image; for a gigapixel image only a
+    few viewports worth of it is ever looked at. TiledImage splits the
+    image into square tiles which are produced when they are accessed the
+    first time and kept in a LRU cache with a byte budget:
+
+        SurfaceTileSource source(surface);     // or DecoderTileSource
+        TiledImage image(source, 256 << 20);
+        image.read(viewport, level, x, y);
+
+    The pixels come from a TileSource which fills any rectangle of the
+    full resolution image:
+
+        SurfaceTileSource   a Surface which is not necessarily resident,
+                            for example a memory mapped raw file: only the
+                            pages under the requested tiles are touched.
+
+        DecoderTileSource   an ImageDecoder. The decoder interface decodes
+                            whole images (the restart markers of a JPEG
+                            are not exposed) so the first request decodes
+                            the image once and the tiles are copied out of
+                            it; the memory savings need a source with
+                            region access.
+
+    Mip levels are generated per tile when they are accessed: a tile of
+    level n is the 2x2 box filtered four tiles of level n - 1, which are
+    in turn fetched through the cache. Nothing is computed for the
+    regions which are never looked at.
+
+    The filtering recursion is capped: a tile of level n depends on 4^d
+    tiles of level n - d, which for the coarse levels of a large image is
+    the whole image. A request goes down at most "filter depth" levels
+    (setFilterDepth(), 3 by default); a tile which is needed below that
+    and is not in the cache is point sampled from the source instead, one
+    source pixel per tile pixel. The coarsest levels of a big image are
+    then aliased approximations, which is fine for an overview and keeps
+    the cost of any request under 4^depth tiles. A point sampled tile is
+    cached only as a stand-in: a request which may filter the tile
+    produces it again, so a level read directly is always filtered no
+    matter what was read before it.
+
+    read() prefetches the ring of tiles around the viewport in the
+    ThreadPool. Concurrent requests for the same tile wait for the one
+    which is being produced instead of producing it again. A tile which
+    fails to prefetch is left out of the cache; the next read() of it
+    produces it again and reports the error. Tiles are R8G8B8A8.
+*/
+
+namespace mango
+{
+
+    class TileSource
+    {
+    public:
+        virtual ~TileSource() {}
+
+        virtual int width() const = 0;
+        virtual int height() const = 0;
+
+        // fill dest (R8G8B8A8) with the rectangle starting at (x, y)
+        virtual void decode(const Surface& dest, int x, int y) = 0;
+
+        // fill dest with the pixel at the center of each step x step block of
+        // the rectangle starting at (x, y), clamped to the image
+        virtual void subsample(const Surface& dest, int x, int y, int step)
+        {
+            for (int j = 0; j < dest.height; ++j)
+            {
+                const int sy = std::min(y + j * step + step / 2, height() - 1);
+                for (int i = 0; i < dest.width; ++i)
+                {
+                    const int sx = std::min(x + i * step + step / 2, width() - 1);
+                    decode(Surface(dest, i, j, 1, 1), sx, sy);
+                }
+            }
+        }
+    };
+
+    class SurfaceTileSource : public TileSource
+    {
+    protected:
+        Surface m_surface;
+
+    public:
+        SurfaceTileSource(const Surface& surface)
+            : m_surface(surface)
+        {
+        }
+
+        int width() const override
+        {
+            return m_surface.width;
+        }
+
+        int height() const override
+        {
+            return m_surface.height;
+        }
+
+        void decode(const Surface& dest, int x, int y) override
+        {
+            Surface target = dest;
+            target.blit(0, 0, Surface(m_surface, x, y, dest.width, dest.height));
+        }
+    };
+
+    class DecoderTileSource : public TileSource
+    {
+    protected:
+        ImageDecoder m_decoder;
+        ImageHeader m_header;
+        std::unique_ptr<Bitmap> m_bitmap;
+        std::mutex m_mutex;
+
+    public:
+        // the memory must stay alive as long as the source
+        DecoderTileSource(const Memory& memory, const std::string& extension)
+            : m_decoder(memory, extension)
+        {
+            if (!m_decoder.isDecoder())
+                MANGO_EXCEPTION("DecoderTileSource: no decoder for the image.");
+            m_header = m_decoder.header();
+        }
+
+        int width() const override
+        {
+            return m_header.width;
+        }
+
+        int height() const override
+        {
+            return m_header.height;
+        }
+
+        void decode(const Surface& dest, int x, int y) override
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (!m_bitmap)
+                {
+                    m_bitmap.reset(new Bitmap(m_header.width, m_header.height, FORMAT_R8G8B8A8));
+                    m_decoder.decode(*m_bitmap, 0, 0, 0);
+                }
+            }
+
+            Surface target = dest;
+            target.blit(0, 0, Surface(*m_bitmap, x, y, dest.width, dest.height));
+        }
+    };
+
+    struct Tile
+    {
+        int width;
+        int height;
+        std::vector<uint8> pixels;
+
+        Tile(int width, int height)
+            : width(width)
+            , height(height)
+            , pixels(size_t(width) * height * 4)
+        {
+        }
+
+        Surface surface() const
+        {
+            return Surface(width, height, FORMAT_R8G8B8A8, width * 4, pixels.data());
+        }
+    };
+
+    class TiledImage
+    {
+    public:
+        using TilePtr = std::shared_ptr<const Tile>;
+
+        struct Statistics
+        {
+            uint64 requests;    // getTile() calls, including the mip and prefetch ones
+            uint64 hits;        // found in the cache (or being produced)
+            uint64 decoded;     // level 0 tiles from the TileSource
+            uint64 filtered;    // mip tiles
+            uint64 sampled;     // mip tiles below the filter depth
+            uint64 evicted;
+            size_t bytes;       // in the cache now
+            size_t peak;
+        };
+
+    protected:
+        struct Key
+        {
+            int level;
+            int x;
+            int y;
+
+            bool operator < (const Key& other) const
+            {
+                if (level != other.level)
+                    return level < other.level;
+                if (y != other.y)
+                    return y < other.y;
+                return x < other.x;
+            }
+        };
+
+        struct Entry
+        {
+            std::shared_future<TilePtr> tile;
+            std::list<Key>::iterator lru;
+            size_t bytes;   // 0 while being produced
+            bool sampled;   // point sampled below the filter depth
+        };
+
+        TileSource& m_source;
+        const size_t m_budget;
+        const int m_tile_size;
+        int m_levels;
+        int m_filter_depth = 3;
+        bool m_prefetch = true;
+
+        std::mutex m_mutex;
+        std::map<Key, Entry> m_entries;
+        std::list<Key> m_lru;   // most recently used first
+
+        std::atomic<uint64> m_requests { 0 };
+        std::atomic<uint64> m_hits { 0 };
+        std::atomic<uint64> m_decoded { 0 };
+        std::atomic<uint64> m_filtered { 0 };
+        std::atomic<uint64> m_sampled { 0 };
+        uint64 m_evicted = 0;
+        size_t m_bytes = 0;
+        size_t m_peak = 0;
+
+        ConcurrentQueue m_queue;
+
+        TilePtr produce(const Key& key, int depth)
+        {
+            const int tile_size = m_tile_size;
+            const int w = std::min(tile_size, getWidth(key.level) - key.x * tile_size);
+            const int h = std::min(tile_size, getHeight(key.level) - key.y * tile_size);
+            std::shared_ptr<Tile> tile = std::make_shared<Tile>(w, h);
+
+            if (!key.level)
+            {
+                m_source.decode(tile->surface(), key.x * tile_size, key.y * tile_size);
+                ++m_decoded;
+                return tile;
+            }
+
+            if (!depth)
+            {
+                const int step = 1 << key.level;
+                m_source.subsample(tile->surface(), key.x * tile_size * step, key.y * tile_size * step, step);
+                ++m_sampled;
+                return tile;
+            }
+
+            // 2x2 box filter from the (up to) four tiles of the previous level
+            const int fine_width = getWidth(key.level - 1);
+            const int fine_height = getHeight(key.level - 1);
+            TilePtr fine[2][2];
+
+            for (int py = 0; py < 2; ++py)
+            {
+                for (int px = 0; px < 2; ++px)
+                {
+                    const int tx = key.x * 2 + px;
+                    const int ty = key.y * 2 + py;
+                    if (tx * tile_size < fine_width && ty * tile_size < fine_height)
+                        fine[py][px] = fetch(key.level - 1, tx, ty, depth - 1);
+                }
+            }
+
+            // pixel of the previous level in tile coordinates; clamped at the edges
+            auto sample = [&] (int x, int y) {
+                x = std::min(x, fine_width - 1 - key.x * tile_size * 2);
+                y = std::min(y, fine_height - 1 - key.y * tile_size * 2);
+                const Tile& t = *fine[y / tile_size][x / tile_size];
+                return &t.pixels[(size_t(y % tile_size) * t.width + x % tile_size) * 4];
+            };
+
+            for (int y = 0; y < h; ++y)
+            {
+                uint8* d = &tile->pixels[size_t(y) * w * 4];
+                for (int x = 0; x < w; ++x)
+                {
+                    const uint8* a = sample(x * 2 + 0, y * 2 + 0);
+                    const uint8* b = sample(x * 2 + 1, y * 2 + 0);
+                    const uint8* c = sample(x * 2 + 0, y * 2 + 1);
+                    const uint8* e = sample(x * 2 + 1, y * 2 + 1);
+                    for (int i = 0; i < 4; ++i)
+                    {
+                        d[i] = uint8((a[i] + b[i] + c[i] + e[i] + 2) >> 2);
+                    }
+                    d += 4;
+                }
+            }
+
+            // the finer tiles were only inputs to the filter; make them the first to go so that
+            // building a coarse view does not push the coarse tiles themselves out of the cache
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                for (int py = 0; py < 2; ++py)
+                {
+                    for (int px = 0; px < 2; ++px)
+                    {
+                        auto i = m_entries.find(Key { key.level - 1, key.x * 2 + px, key.y * 2 + py });
+                        if (i != m_entries.end())
+                            m_lru.splice(m_lru.end(), m_lru, i->second.lru);
+                    }
+                }
+            }
+
+            ++m_filtered;
+            return tile;
+        }
+
+        // caller holds the mutex
+        void evict()
+        {
+            auto i = m_lru.end();
+            while (m_bytes > m_budget && i != m_lru.begin())
+            {
+                --i;
+                auto entry = m_entries.find(*i);
+                if (!entry->second.bytes)
+                    continue;   // being produced
+
+                m_bytes -= entry->second.bytes;
+                m_entries.erase(entry);
+                i = m_lru.erase(i);
+                ++m_evicted;
+            }
+        }
+
+        // filter depth of the request: how many levels further down the tile may be filtered from
+        TilePtr fetch(int level, int x, int y, int depth)
+        {
+            const Key key { level, x, y };
+            const bool sampled = level > 0 && !depth;
+            std::promise<TilePtr> promise;
+
+            ++m_requests;
+
+            for (;;)
+            {
+                std::shared_future<TilePtr> cached;
+                bool stale = false;
+
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    auto i = m_entries.find(key);
+                    if (i != m_entries.end() && i->second.sampled && !sampled && i->second.bytes)
+                    {
+                        // a point sampled tile doesn't do for a request which may filter
+                        m_bytes -= i->second.bytes;
+                        m_lru.erase(i->second.lru);
+                        m_entries.erase(i);
+                        i = m_entries.end();
+                    }
+
+                    if (i != m_entries.end())
+                    {
+                        m_lru.splice(m_lru.begin(), m_lru, i->second.lru);
+                        cached = i->second.tile;
+                        stale = i->second.sampled && !sampled;
+                    }
+                    else
+                    {
+                        m_lru.push_front(key);
+                        m_entries[key] = Entry { promise.get_future().share(), m_lru.begin(), 0, sampled };
+                    }
+                }
+
+                if (!cached.valid())
+                    break;
+
+                // waits when another thread is producing the tile; a point
+                // sampled one is replaced on the next round once it is done
+                TilePtr tile = cached.get();
+                if (!stale)
+                {
+                    ++m_hits;
+                    return tile;
+                }
+            }
+
+            TilePtr tile;
+            try
+            {
+                tile = produce(key, depth);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                auto i = m_entries.find(key);
+                m_lru.erase(i->second.lru);
+                m_entries.erase(i);
+                promise.set_exception(std::current_exception());
+                throw;
+            }
+
+            promise.set_value(tile);
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            const size_t bytes = tile->pixels.size() + sizeof(Tile);
+            m_entries[key].bytes = bytes;
+            m_bytes += bytes;
+            m_peak = std::max(m_peak, m_bytes);
+            evict();
+
+            return tile;
+        }
+
+    public:
+        TiledImage(TileSource& source, size_t budget, int tile_size = 256)
+            : m_source(source)
+            , m_budget(budget)
+            , m_tile_size(tile_size)
+            , m_queue("tiles")
+        {
+            m_levels = 1;
+            while (getWidth(m_levels - 1) > 1 || getHeight(m_levels - 1) > 1)
+                ++m_levels;
+        }
+
+        ~TiledImage()
+        {
+            m_queue.wait();
+        }
+
+        int getLevels() const
+        {
+            return m_levels;
+        }
+
+        void checkLevel(int level) const
+        {
+            if (level < 0 || level >= m_levels)
+                MANGO_EXCEPTION("TiledImage: level out of range.");
+        }
+
+        int getWidth(int level) const
+        {
+            return std::max(1, m_source.width() >> level);
+        }
+
+        int getHeight(int level) const
+        {
+            return std::max(1, m_source.height() >> level);
+        }
+
+        int getTileSize() const
+        {
+            return m_tile_size;
+        }
+
+        void setPrefetch(bool enable)
+        {
+            m_prefetch = enable;
+        }
+
+        void setFilterDepth(int depth)
+        {
+            m_filter_depth = std::max(0, depth);
+        }
+
+        TilePtr getTile(int level, int x, int y)
+        {
+            checkLevel(level);
+            return fetch(level, x, y, m_filter_depth);
+        }
+
+        // copy the rectangle (x, y, dest.width, dest.height) of a level into dest (R8G8B8A8)
+        void read(const Surface& dest, int level, int x, int y)
+        {
+            checkLevel(level);
+
+            const int tile_size = m_tile_size;
+            const int x1 = std::min(x + dest.width, getWidth(level));
+            const int y1 = std::min(y + dest.height, getHeight(level));
+            if (x >= x1 || y >= y1)
+                return;
+
+            const int tx0 = x / tile_size;
+            const int ty0 = y / tile_size;
+            const int tx1 = (x1 - 1) / tile_size;
+            const int ty1 = (y1 - 1) / tile_size;
+
+            if (m_prefetch)
+            {
+                prefetch(level, tx0 - 1, ty0 - 1, tx1 + 1, ty1 + 1, true);
+            }
+
+            for (int ty = ty0; ty <= ty1; ++ty)
+            {
+                for (int tx = tx0; tx <= tx1; ++tx)
+                {
+                    TilePtr tile = getTile(level, tx, ty);
+
+                    // intersection of the tile and the viewport
+                    const int left = std::max(x, tx * tile_size);
+                    const int top = std::max(y, ty * tile_size);
+                    const int right = std::min(x1, tx * tile_size + tile->width);
+                    const int bottom = std::min(y1, ty * tile_size + tile->height);
+
+                    for (int py = top; py < bottom; ++py)
+                    {
+                        const uint8* s = &tile->pixels[(size_t(py - ty * tile_size) * tile->width + left - tx * tile_size) * 4];
+                        uint8* d = dest.image + (py - y) * dest.stride + (left - x) * 4;
+                        std::memcpy(d, s, (right - left) * 4);
+                    }
+                }
+            }
+        }
+
+        // produce the tiles in [x0, x1] x [y0, y1] of a level in the ThreadPool; with
+        // "ring" only the border of the rectangle
+        void prefetch(int level, int x0, int y0, int x1, int y1, bool ring = false)
+        {
+            checkLevel(level);
+
+            const int tiles_x = (getWidth(level) + m_tile_size - 1) / m_tile_size;
+            const int tiles_y = (getHeight(level) + m_tile_size - 1) / m_tile_size;
+
+            for (int ty = std::max(y0, 0); ty <= std::min(y1, tiles_y - 1); ++ty)
+            {
+                for (int tx = std::max(x0, 0); tx <= std::min(x1, tiles_x - 1); ++tx)
+                {
+                    if (ring && tx != x0 && tx != x1 && ty != y0 && ty != y1)
+                        continue;
+
+                    {
+                        std::lock_guard<std::mutex> lock(m_mutex);
+                        if (m_entries.count(Key { level, tx, ty }))
+                            continue;
+                    }
+
+                    m_queue.enqueue([this, level, tx, ty] {
+                        try
+                        {
+                            getTile(level, tx, ty);
+                        }
+                        catch (...)
+                        {
+                            // getTile() did not cache the failure; a synchronous
+                            // request produces the tile again and gets the error
+                        }
+                    });
+                }
+            }
+        }
+
+        // wait for the prefetching to finish
+        void wait()
+        {
+            m_queue.wait();
+        }
+
+        Statistics getStatistics()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return Statistics { m_requests, m_hits, m_decoded, m_filtered, m_sampled, m_evicted, m_bytes, m_peak };
+        }
+    };
+
+} // namespace mango
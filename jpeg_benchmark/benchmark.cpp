@@ -3,6 +3,7 @@
     Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
 */
 #include <mango/mango.hpp>
+#include <sys/mman.h>
 
 using namespace mango;
 
@@ -14,6 +15,9 @@ void warmup(const char* filename)
 {
     File file(filename);
     Memory memory = file;
+
+    // the mapping is page aligned; read ahead aggressively for the copy
+    ::madvise(const_cast<uint8*>(memory.address), memory.size, MADV_SEQUENTIAL);
     std::vector<char> buffer(memory.size);
     std::memcpy(buffer.data(), memory.address, memory.size);
 }
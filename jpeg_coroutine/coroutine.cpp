@@ -0,0 +1,808 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#include <mango/mango.hpp>
+#include <coroutine>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+using namespace mango;
+
+/*
+    C++20 coroutines on top of the MANGO ThreadPool. The pipeline
+    "read file, decode image, collect results" is written as straight-line
+    code; every co_await is a point where the coroutine is suspended and the
+    worker thread is released back to the pool to do something else.
+
+    The pool itself does not know anything about coroutines. Resuming a
+    coroutine is just another task which is enqueued into a ConcurrentQueue or
+    a SerialQueue, so all of the queue semantics (priorities, barriers,
+    serialization) apply unchanged.
+*/
+
+namespace coro
+{
+
+    // -----------------------------------------------------------------
+    // FrameArena
+    // -----------------------------------------------------------------
+
+    /*
+        Coroutine frames are heap allocated by default. The frames in a
+        pipeline are short-lived and roughly the same size so we recycle
+        them through per-thread free lists. A frame can be released on a
+        different thread than it was allocated on (the coroutine migrated to
+        another worker); the block simply moves into that thread's free list.
+
+        The slabs are never returned to the system; they are owned by a
+        process-wide list so that a block migrating out of a thread which
+        has terminated stays valid.
+    */
+
+    class FrameArena
+    {
+    protected:
+        static constexpr size_t granularity = 64;
+        static constexpr size_t classes = 32; // frames up to 2 KB
+        static constexpr size_t slab_size = 64 * 1024;
+
+        struct Block
+        {
+            Block* next;
+        };
+
+        Block* m_free[classes] = { };
+        uint8* m_current = nullptr;
+        size_t m_remaining = 0;
+
+        static std::mutex& slabMutex()
+        {
+            static std::mutex mutex;
+            return mutex;
+        }
+
+        static std::vector<std::unique_ptr<uint8[]>>& slabs()
+        {
+            static std::vector<std::unique_ptr<uint8[]>> slabs;
+            return slabs;
+        }
+
+        uint8* allocateSlab()
+        {
+            std::lock_guard<std::mutex> lock(slabMutex());
+            slabs().emplace_back(new uint8[slab_size]);
+            return slabs().back().get();
+        }
+
+    public:
+        static std::atomic<uint64> arena_allocs;
+        static std::atomic<uint64> heap_allocs;
+
+        static FrameArena& instance()
+        {
+            thread_local FrameArena arena;
+            return arena;
+        }
+
+        void* allocate(size_t size)
+        {
+            const size_t index = (size + granularity - 1) / granularity;
+            if (index >= classes)
+            {
+                ++heap_allocs;
+                return ::operator new(size);
+            }
+
+            ++arena_allocs;
+
+            Block* block = m_free[index];
+            if (block)
+            {
+                m_free[index] = block->next;
+                return block;
+            }
+
+            const size_t bytes = index * granularity;
+            if (m_remaining < bytes)
+            {
+                m_current = allocateSlab();
+                m_remaining = slab_size;
+            }
+
+            void* p = m_current;
+            m_current += bytes;
+            m_remaining -= bytes;
+            return p;
+        }
+
+        void release(void* p, size_t size)
+        {
+            const size_t index = (size + granularity - 1) / granularity;
+            if (index >= classes)
+            {
+                ::operator delete(p);
+                return;
+            }
+
+            Block* block = reinterpret_cast<Block*>(p);
+            block->next = m_free[index];
+            m_free[index] = block;
+        }
+    };
+
+    std::atomic<uint64> FrameArena::arena_allocs { 0 };
+    std::atomic<uint64> FrameArena::heap_allocs { 0 };
+
+    // -----------------------------------------------------------------
+    // task<T>
+    // -----------------------------------------------------------------
+
+    /*
+        task<T> is lazy: the body does not run until the task is awaited.
+        When the body completes the awaiting coroutine is resumed directly
+        with symmetric transfer; no trip through the pool is required.
+    */
+
+    template <typename T>
+    class task;
+
+    namespace detail
+    {
+
+        struct promise_base
+        {
+            std::coroutine_handle<> continuation;
+            std::exception_ptr exception;
+
+            static void* operator new(size_t size)
+            {
+                return FrameArena::instance().allocate(size);
+            }
+
+            static void operator delete(void* p, size_t size)
+            {
+                FrameArena::instance().release(p, size);
+            }
+
+            struct final_awaiter
+            {
+                bool await_ready() const noexcept { return false; }
+
+                template <typename P>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+                {
+                    std::coroutine_handle<> next = h.promise().continuation;
+                    return next ? next : std::noop_coroutine();
+                }
+
+                void await_resume() noexcept {}
+            };
+
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            final_awaiter final_suspend() noexcept { return {}; }
+
+            void unhandled_exception()
+            {
+                exception = std::current_exception();
+            }
+        };
+
+        template <typename T>
+        struct promise : promise_base
+        {
+            T value;
+
+            task<T> get_return_object();
+
+            void return_value(T v)
+            {
+                value = std::move(v);
+            }
+
+            T result()
+            {
+                if (exception)
+                    std::rethrow_exception(exception);
+                return std::move(value);
+            }
+        };
+
+        template <>
+        struct promise<void> : promise_base
+        {
+            task<void> get_return_object();
+
+            void return_void() {}
+
+            void result()
+            {
+                if (exception)
+                    std::rethrow_exception(exception);
+            }
+        };
+
+    } // namespace detail
+
+    template <typename T = void>
+    class task
+    {
+    public:
+        using promise_type = detail::promise<T>;
+        using handle_type = std::coroutine_handle<promise_type>;
+
+    protected:
+        handle_type m_handle;
+
+    public:
+        explicit task(handle_type handle)
+            : m_handle(handle)
+        {
+        }
+
+        task(task&& other) noexcept
+            : m_handle(std::exchange(other.m_handle, nullptr))
+        {
+        }
+
+        task(const task&) = delete;
+        task& operator = (const task&) = delete;
+
+        ~task()
+        {
+            if (m_handle)
+                m_handle.destroy();
+        }
+
+        bool await_ready() const noexcept
+        {
+            return !m_handle || m_handle.done();
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+        {
+            m_handle.promise().continuation = awaiting;
+            return m_handle;
+        }
+
+        T await_resume()
+        {
+            return m_handle.promise().result();
+        }
+    };
+
+    namespace detail
+    {
+
+        template <typename T>
+        task<T> promise<T>::get_return_object()
+        {
+            return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+        }
+
+        inline task<void> promise<void>::get_return_object()
+        {
+            return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+        }
+
+        // Eagerly started, self-destroying coroutine used to drive a task
+        // to completion and run a callback when it is done.
+        struct detached
+        {
+            struct promise_type : promise_base
+            {
+                detached get_return_object() { return {}; }
+                std::suspend_never initial_suspend() noexcept { return {}; }
+                std::suspend_never final_suspend() noexcept { return {}; }
+                void return_void() {}
+                void unhandled_exception() { std::terminate(); }
+            };
+        };
+
+    } // namespace detail
+
+    // -----------------------------------------------------------------
+    // schedule()
+    // -----------------------------------------------------------------
+
+    /*
+        co_await schedule(queue) suspends the coroutine and resumes it as a
+        task in the given queue. Works with ConcurrentQueue and SerialQueue;
+        on a SerialQueue the code after the co_await is serialized with the
+        rest of the queue until the next suspension point.
+    */
+
+    template <typename Queue>
+    struct schedule_awaiter
+    {
+        Queue& queue;
+
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            queue.enqueue([h] {
+                h.resume();
+            });
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    template <typename Queue>
+    schedule_awaiter<Queue> schedule(Queue& queue)
+    {
+        return { queue };
+    }
+
+    // -----------------------------------------------------------------
+    // drained()
+    // -----------------------------------------------------------------
+
+    /*
+        co_await drained(queue, resume) suspends until every task which was
+        enqueued into "queue" before this point has completed. A barrier is
+        inserted so the same ordering rules as with barrier() apply to
+        anything that is enqueued into "queue" afterwards. The coroutine
+        continues in the "resume" queue so that it does not hold up "queue"
+        if it happens to be serial.
+
+        This is the non-blocking replacement for calling queue.wait() in a task.
+    */
+
+    template <typename Queue, typename ResumeQueue>
+    struct drained_awaiter
+    {
+        Queue& queue;
+        ResumeQueue& resume;
+
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            ResumeQueue* target = &resume;
+            queue.barrier();
+            queue.enqueue([h, target] {
+                target->enqueue([h] {
+                    h.resume();
+                });
+            });
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    template <typename Queue, typename ResumeQueue>
+    drained_awaiter<Queue, ResumeQueue> drained(Queue& queue, ResumeQueue& resume)
+    {
+        return { queue, resume };
+    }
+
+    // -----------------------------------------------------------------
+    // IoService
+    // -----------------------------------------------------------------
+
+    /*
+        File reads can block (page faults on a memory mapped file are I/O)
+        and we never want to block a pool worker. The IoService runs a
+        free-standing thread which services read requests and resumes the
+        requesting coroutine in the queue it asked for.
+    */
+
+    class IoService
+    {
+    protected:
+        struct Request
+        {
+            std::function<void()> work;
+        };
+
+        std::mutex m_mutex;
+        std::condition_variable m_condition;
+        std::deque<Request> m_requests;
+        bool m_stop = false;
+        std::thread m_thread;
+
+        void run()
+        {
+            for (;;)
+            {
+                Request request;
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_condition.wait(lock, [this] {
+                        return m_stop || !m_requests.empty();
+                    });
+
+                    if (m_requests.empty())
+                        break;
+
+                    request = std::move(m_requests.front());
+                    m_requests.pop_front();
+                }
+
+                request.work();
+            }
+        }
+
+    public:
+        IoService()
+            : m_thread([this] { run(); })
+        {
+        }
+
+        ~IoService()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stop = true;
+            }
+            m_condition.notify_one();
+            m_thread.join();
+        }
+
+        void submit(std::function<void()> work)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_requests.push_back({ std::move(work) });
+            }
+            m_condition.notify_one();
+        }
+
+        template <typename Queue>
+        struct read_awaiter
+        {
+            IoService& io;
+            const Path& path;
+            std::string filename;
+            Queue& resume;
+            SharedMemory result;
+            std::exception_ptr exception;
+
+            bool await_ready() const noexcept { return false; }
+
+            void await_suspend(std::coroutine_handle<> h)
+            {
+                io.submit([this, h] {
+                    try
+                    {
+                        File file(path, filename);
+                        SharedMemory memory(size_t(file.size()));
+                        Memory target = memory;
+                        std::memcpy(target.address, file.data(), target.size);
+                        result = memory;
+                    }
+                    catch (...)
+                    {
+                        exception = std::current_exception();
+                    }
+
+                    resume.enqueue([h] {
+                        h.resume();
+                    });
+                });
+            }
+
+            SharedMemory await_resume()
+            {
+                if (exception)
+                    std::rethrow_exception(exception);
+                return std::move(result);
+            }
+        };
+
+        // co_await io.read(path, filename, queue) reads the file on the I/O
+        // thread and resumes the coroutine in the given queue.
+        template <typename Queue>
+        read_awaiter<Queue> read(const Path& path, const std::string& filename, Queue& resume)
+        {
+            return { *this, path, filename, resume, SharedMemory(), nullptr };
+        }
+    };
+
+    // -----------------------------------------------------------------
+    // when_all()
+    // -----------------------------------------------------------------
+
+    /*
+        Start all of the tasks and resume the awaiting coroutine when the
+        last one has completed. The tasks run concurrently as long as they
+        suspend into a ConcurrentQueue; the results keep the input order.
+        If tasks throw, every task still runs to completion and the first
+        exception is rethrown from the co_await.
+    */
+
+    template <typename T>
+    struct when_all_awaiter
+    {
+        std::vector<task<T>>& tasks;
+        std::vector<T> results;
+        std::atomic<size_t> counter;
+        std::coroutine_handle<> awaiting;
+        std::mutex mutex;
+        std::exception_ptr exception;
+
+        when_all_awaiter(std::vector<task<T>>& tasks)
+            : tasks(tasks)
+            , results(tasks.size())
+            , counter(tasks.size() + 1)
+        {
+        }
+
+        static detail::detached drive(task<T>& t, T& result, when_all_awaiter* self)
+        {
+            try
+            {
+                result = co_await t;
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(self->mutex);
+                if (!self->exception)
+                    self->exception = std::current_exception();
+            }
+
+            if (--self->counter == 0)
+                self->awaiting.resume();
+        }
+
+        bool await_ready() const noexcept
+        {
+            return tasks.empty();
+        }
+
+        bool await_suspend(std::coroutine_handle<> h)
+        {
+            awaiting = h;
+            for (size_t i = 0; i < tasks.size(); ++i)
+            {
+                drive(tasks[i], results[i], this);
+            }
+
+            // the extra count is ours; if the tasks already completed
+            // inline we continue without suspending
+            return --counter != 0;
+        }
+
+        std::vector<T> await_resume()
+        {
+            if (exception)
+                std::rethrow_exception(exception);
+            return std::move(results);
+        }
+    };
+
+    template <typename T>
+    task<std::vector<T>> when_all(std::vector<task<T>> tasks)
+    {
+        co_return co_await when_all_awaiter<T>(tasks);
+    }
+
+    // -----------------------------------------------------------------
+    // sync_wait()
+    // -----------------------------------------------------------------
+
+    /*
+        Bridge from a free-standing thread (e.g. main) into the coroutine
+        world. The calling thread sleeps until the task completes; NEVER
+        call this from a task running in the ThreadPool.
+    */
+
+    namespace detail
+    {
+
+        template <typename T>
+        struct sync_state
+        {
+            std::mutex mutex;
+            std::condition_variable condition;
+            bool done = false;
+            T result {};
+            std::exception_ptr exception;
+        };
+
+        template <typename T>
+        detached sync_drive(task<T>& t, sync_state<T>& state)
+        {
+            try
+            {
+                state.result = co_await t;
+            }
+            catch (...)
+            {
+                state.exception = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.done = true;
+            state.condition.notify_one();
+        }
+
+    } // namespace detail
+
+    template <typename T>
+    T sync_wait(task<T> t)
+    {
+        detail::sync_state<T> state;
+        detail::sync_drive(t, state);
+
+        std::unique_lock<std::mutex> lock(state.mutex);
+        state.condition.wait(lock, [&state] { return state.done; });
+
+        if (state.exception)
+            std::rethrow_exception(state.exception);
+        return std::move(state.result);
+    }
+
+} // namespace coro
+
+// -----------------------------------------------------------------
+// coroutine jpeg reader
+// -----------------------------------------------------------------
+
+/*
+    The jpeg_multithread/jpegtest.cpp folder loader written with coroutines.
+    The read happens on the I/O thread and the decoding in the pool; the
+    worker is never blocked waiting for the file contents.
+*/
+
+coro::task<size_t> load_image(coro::IoService& io, ConcurrentQueue& q, const Path& path,
+                              std::string filename, size_t index, size_t count)
+{
+    // map and read the file; resumes in the decoding queue
+    SharedMemory memory = co_await io.read(path, filename, q);
+
+    printf("filename: %s (%zu / %zu) begin.\n", filename.c_str(), index + 1, count);
+    Bitmap bitmap(memory, filename);
+    printf("filename: %s (%zu / %zu) done.\n", filename.c_str(), index + 1, count);
+
+    co_return size_t(bitmap.width) * bitmap.height * 4;
+}
+
+coro::task<size_t> load_folder(coro::IoService& io, ConcurrentQueue& q, const Path& path)
+{
+    const size_t count = path.size();
+
+    std::vector<coro::task<size_t>> tasks;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        const auto& node = path[i];
+        if (!node.isDirectory())
+        {
+            tasks.push_back(load_image(io, q, path, node.name, i, count));
+        }
+    }
+
+    std::vector<size_t> sizes = co_await coro::when_all(std::move(tasks));
+
+    size_t image_bytes = 0;
+    for (size_t bytes : sizes)
+    {
+        image_bytes += bytes;
+    }
+
+    co_return image_bytes;
+}
+
+void test_jpeg(const std::string& folder)
+{
+    ConcurrentQueue q("jpeg reader coroutine");
+    coro::IoService io;
+
+    Path path(folder);
+
+    Timer timer;
+    uint64 time0 = timer.ms();
+
+    size_t image_bytes = coro::sync_wait(load_folder(io, q, path));
+
+    uint64 time1 = timer.ms();
+    printf("image: %zu MB (%d ms)\n", image_bytes / (1024 * 1024), int(time1 - time0));
+}
+
+// -----------------------------------------------------------------
+// context switch overhead
+// -----------------------------------------------------------------
+
+/*
+    How much does a suspension cost? We measure three things:
+
+    - enqueue:  plain lambda tasks through a SerialQueue; the baseline
+    - schedule: a coroutine hopping through the same SerialQueue
+    - await:    awaiting a task which completes immediately; this is just the
+                frame allocation from the arena plus symmetric transfer
+
+    The difference between the first two is the coroutine tax on a pool
+    round-trip. The third is what a "function call" through co_await costs.
+*/
+
+coro::task<int> immediate(int value)
+{
+    co_return value + 1;
+}
+
+coro::task<int> hop(SerialQueue& q, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        co_await coro::schedule(q);
+    }
+    co_return count;
+}
+
+coro::task<int> chain(int count)
+{
+    int value = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        value = co_await immediate(value);
+    }
+    co_return value;
+}
+
+void test_overhead()
+{
+    const int count = 1000 * 1000;
+
+    SerialQueue q("context switch");
+    Timer timer;
+
+    uint64 time0 = timer.us();
+
+    std::atomic<int> counter { 0 };
+    for (int i = 0; i < count; ++i)
+    {
+        q.enqueue([&counter] {
+            ++counter;
+        });
+    }
+    q.wait();
+
+    uint64 time1 = timer.us();
+
+    coro::sync_wait(hop(q, count));
+
+    uint64 time2 = timer.us();
+
+    coro::sync_wait(chain(count));
+
+    uint64 time3 = timer.us();
+
+    printf("enqueue:  %6d ns / task\n", int((time1 - time0) * 1000 / count));
+    printf("schedule: %6d ns / switch\n", int((time2 - time1) * 1000 / count));
+    printf("await:    %6d ns / await\n", int((time3 - time2) * 1000 / count));
+    printf("frames:   %llu from arena, %llu from heap\n",
+        (unsigned long long)coro::FrameArena::arena_allocs.load(),
+        (unsigned long long)coro::FrameArena::heap_allocs.load());
+}
+
+/*
+    The enqueue and schedule tests are not quite the same thing: the lambda
+    tasks are all in flight at once while the coroutine enqueues the next hop
+    only after the previous one has run, so schedule also includes the
+    wake-up latency of the worker. It is the realistic number for a pipeline
+    where every stage depends on the previous one.
+*/
+
+// -----------------------------------------------------------------
+// main
+// -----------------------------------------------------------------
+
+int main(int argc, const char* argv[])
+{
+    if (argc < 2)
+    {
+        printf("Too few arguments. Usage: %s <folder>\n", argv[0]);
+        return 1;
+    }
+
+    test_jpeg(argv[1]);
+    test_overhead();
+    printf("* done *\n");
+}
@@ -0,0 +1,426 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <mango/mango.hpp>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+/*
+    Bounded multi-producer / multi-consumer channel.
+
+    The ring buffer is the well known design by Dmitry Vyukov: every cell has
+    a sequence number which tells whose turn it is to use the cell, so the
+    producers and consumers only contend on their own position counter with
+    a single compare-and-swap.
+
+    Three ways to use it:
+
+    - try_push() / try_pop() never block; safe to call from ThreadPool tasks.
+    - push() / pop() block a free-standing thread. The thread spins briefly
+      and then sleeps on a condition variable. The fast path does not touch
+      the mutex at all.
+    - connect() attaches a consumer function to the channel. When data
+      arrives a task is enqueued which drains the channel, so no thread is
+      parked waiting for data (see misc/concurrency.cpp example2).
+*/
+
+namespace mango
+{
+
+    template <typename T>
+    class Channel
+    {
+    protected:
+        static constexpr size_t cacheline = 64;
+
+        struct Cell
+        {
+            std::atomic<size_t> sequence;
+            T data;
+        };
+
+        std::vector<Cell> m_buffer;
+        const size_t m_mask;
+
+        alignas(cacheline) std::atomic<size_t> m_enqueue { 0 };
+        alignas(cacheline) std::atomic<size_t> m_dequeue { 0 };
+        alignas(cacheline) std::atomic<int> m_sleepers { 0 };
+        std::atomic<uint32> m_epoch { 0 };
+        std::atomic<bool> m_closed { false };
+
+        std::mutex m_mutex;
+        std::condition_variable m_condition;
+
+        // consumer attached with connect()
+        std::function<void(T&)> m_consumer;
+        std::function<void(std::function<void()>)> m_schedule;
+        std::atomic<int> m_active { 0 };
+        int m_max_active = 0;
+
+        static size_t roundup(size_t capacity)
+        {
+            size_t size = 2;
+            while (size < capacity)
+            {
+                size *= 2;
+            }
+            return size;
+        }
+
+        void wakeup()
+        {
+            // pairs with the increment in sleep(); a sleeper that registered
+            // before our update is guaranteed to be seen here
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (m_sleepers.load(std::memory_order_relaxed))
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                ++m_epoch;
+                m_condition.notify_all();
+            }
+        }
+
+        template <typename Predicate>
+        bool sleep(Predicate predicate)
+        {
+            for (int i = 0; i < 64; ++i)
+            {
+                if (predicate())
+                    return true;
+                std::this_thread::yield();
+            }
+
+            ++m_sleepers;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            // the predicate runs without the mutex: a successful try_push /
+            // try_pop calls wakeup(), which takes it. Any wakeup() after the
+            // epoch was read changes it, so none is lost before the wait.
+            bool status;
+            for (;;)
+            {
+                const uint32 epoch = m_epoch.load();
+                status = predicate();
+                if (status || m_closed)
+                    break;
+
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_condition.wait(lock, [&] {
+                    return m_epoch.load() != epoch || m_closed;
+                });
+            }
+
+            --m_sleepers;
+            return status;
+        }
+
+        void schedule()
+        {
+            if (!m_consumer)
+                return;
+
+            // start drainers until we hit the limit or the channel is empty
+            int active = m_active.load();
+            while (active < m_max_active && !empty())
+            {
+                if (m_active.compare_exchange_weak(active, active + 1))
+                {
+                    m_schedule([this] { drain(); });
+                    return;
+                }
+            }
+        }
+
+        void drain()
+        {
+            T value;
+
+            for (;;)
+            {
+                while (try_pop(value))
+                {
+                    m_consumer(value);
+                }
+
+                --m_active;
+
+                // an item might have been pushed after our last try_pop but
+                // before we released the slot; the producer saw us as active
+                // and did not schedule anyone, so we have to pick it up
+                if (empty())
+                    break;
+
+                int active = m_active.load();
+                if (active >= m_max_active || !m_active.compare_exchange_strong(active, active + 1))
+                    break;
+            }
+        }
+
+    public:
+        Channel(size_t capacity)
+            : m_buffer(roundup(capacity))
+            , m_mask(m_buffer.size() - 1)
+        {
+            for (size_t i = 0; i < m_buffer.size(); ++i)
+            {
+                m_buffer[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        ~Channel()
+        {
+        }
+
+        size_t capacity() const
+        {
+            return m_buffer.size();
+        }
+
+        bool empty() const
+        {
+            const size_t pos = m_dequeue.load(std::memory_order_relaxed);
+            const Cell& cell = m_buffer[pos & m_mask];
+            return intptr_t(cell.sequence.load(std::memory_order_acquire)) - intptr_t(pos + 1) < 0;
+        }
+
+        // -------------------------------------------------------------
+        // non-blocking
+        // -------------------------------------------------------------
+
+        bool try_push(const T& value)
+        {
+            T temp(value);
+            return try_push(std::move(temp));
+        }
+
+        // the value is moved from only if the push succeeds
+        bool try_push(T&& value)
+        {
+            size_t pos = m_enqueue.load(std::memory_order_relaxed);
+            Cell* cell;
+
+            for (;;)
+            {
+                cell = &m_buffer[pos & m_mask];
+                size_t sequence = cell->sequence.load(std::memory_order_acquire);
+                intptr_t diff = intptr_t(sequence) - intptr_t(pos);
+
+                if (diff == 0)
+                {
+                    if (m_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                }
+                else if (diff < 0)
+                {
+                    return false; // full
+                }
+                else
+                {
+                    pos = m_enqueue.load(std::memory_order_relaxed);
+                }
+            }
+
+            cell->data = std::move(value);
+            cell->sequence.store(pos + 1, std::memory_order_release);
+
+            wakeup();
+            schedule();
+            return true;
+        }
+
+        bool try_pop(T& value)
+        {
+            size_t pos = m_dequeue.load(std::memory_order_relaxed);
+            Cell* cell;
+
+            for (;;)
+            {
+                cell = &m_buffer[pos & m_mask];
+                size_t sequence = cell->sequence.load(std::memory_order_acquire);
+                intptr_t diff = intptr_t(sequence) - intptr_t(pos + 1);
+
+                if (diff == 0)
+                {
+                    if (m_dequeue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                }
+                else if (diff < 0)
+                {
+                    return false; // empty
+                }
+                else
+                {
+                    pos = m_dequeue.load(std::memory_order_relaxed);
+                }
+            }
+
+            value = std::move(cell->data);
+            cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+
+            wakeup();
+            return true;
+        }
+
+        // -------------------------------------------------------------
+        // batch
+        // -------------------------------------------------------------
+
+        /*
+            The batch operations claim a run of consecutive cells with a single
+            compare-and-swap. The run is cut short at the first cell which is
+            not ready, so the return value can be anything from zero to count.
+        */
+
+        size_t try_push(T* values, size_t count)
+        {
+            size_t pos = m_enqueue.load(std::memory_order_relaxed);
+            size_t n;
+
+            for (;;)
+            {
+                n = 0;
+                while (n < count && n <= m_mask)
+                {
+                    const Cell& cell = m_buffer[(pos + n) & m_mask];
+                    if (cell.sequence.load(std::memory_order_acquire) != pos + n)
+                        break;
+                    ++n;
+                }
+
+                if (!n)
+                    return 0;
+
+                if (m_enqueue.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed))
+                    break;
+            }
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                Cell& cell = m_buffer[(pos + i) & m_mask];
+                cell.data = std::move(values[i]);
+                cell.sequence.store(pos + i + 1, std::memory_order_release);
+            }
+
+            wakeup();
+            schedule();
+            return n;
+        }
+
+        size_t try_pop(T* values, size_t count)
+        {
+            size_t pos = m_dequeue.load(std::memory_order_relaxed);
+            size_t n;
+
+            for (;;)
+            {
+                n = 0;
+                while (n < count && n <= m_mask)
+                {
+                    const Cell& cell = m_buffer[(pos + n) & m_mask];
+                    if (cell.sequence.load(std::memory_order_acquire) != pos + n + 1)
+                        break;
+                    ++n;
+                }
+
+                if (!n)
+                    return 0;
+
+                if (m_dequeue.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed))
+                    break;
+            }
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                Cell& cell = m_buffer[(pos + i) & m_mask];
+                values[i] = std::move(cell.data);
+                cell.sequence.store(pos + i + m_mask + 1, std::memory_order_release);
+            }
+
+            wakeup();
+            return n;
+        }
+
+        // -------------------------------------------------------------
+        // blocking (free-standing threads only)
+        // -------------------------------------------------------------
+
+        // returns false if the channel was closed before the value was pushed
+        bool push(T&& value)
+        {
+            return sleep([&] {
+                return try_push(std::move(value));
+            });
+        }
+
+        // returns false when the channel is closed and drained
+        bool pop(T& value)
+        {
+            return sleep([&] {
+                return try_pop(value);
+            });
+        }
+
+        // all of the values are pushed unless the channel is closed
+        size_t push(T* values, size_t count)
+        {
+            size_t n = 0;
+            while (n < count)
+            {
+                size_t s = 0;
+                if (!sleep([&] { return (s = try_push(values + n, count - n)) != 0; }))
+                    break;
+                n += s;
+            }
+            return n;
+        }
+
+        // waits for at least one value
+        size_t pop(T* values, size_t count)
+        {
+            size_t n = 0;
+            sleep([&] { return (n = try_pop(values, count)) != 0; });
+            return n;
+        }
+
+        void close()
+        {
+            m_closed = true;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_condition.notify_all();
+        }
+
+        bool closed() const
+        {
+            return m_closed;
+        }
+
+        // -------------------------------------------------------------
+        // ThreadPool integration
+        // -------------------------------------------------------------
+
+        /*
+            Attach a consumer to the channel. Every time data is pushed and
+            fewer than "concurrency" drain tasks are active, a new one is
+            enqueued into the queue. A drain task runs the consumer until the
+            channel is empty and then retires. Use concurrency 1 with a
+            SerialQueue for in-order consumers.
+
+            Must be called before the first push. The queue must outlive the
+            channel's traffic.
+        */
+        template <typename Queue, typename Function>
+        void connect(Queue& queue, int concurrency, Function function)
+        {
+            m_consumer = function;
+            m_max_active = concurrency;
+            m_schedule = [&queue] (std::function<void()> task) {
+                queue.enqueue(std::move(task));
+            };
+        }
+    };
+
+} // namespace mango
@@ -3,6 +3,10 @@
     Copyright (C) 2012-2017 Twilight Finland 3D Oy Ltd. All rights reserved.
 */
 #include <mango/mango.hpp>
+#include <deque>
+#include <future>
+#include "channel.hpp"
+#include "../mmap_benchmark/mapping.hpp"
 
 using namespace mango;
 
@@ -29,6 +33,8 @@ void test_jpeg(const std::string& folder)
             q.enqueue([&path, filename, i, count, &image_bytes] {
                 printf("filename: %s (%zu / %zu) begin.\n", filename.c_str(), i + 1, count);
                 File file(path, filename);
+                // decoded front to back: a larger readahead than the fault driven default
+                advise(file, Access::SEQUENTIAL);
                 Bitmap bitmap(file, filename);
                 image_bytes += bitmap.width * bitmap.height * 4;
                 printf("filename: %s (%zu / %zu) done.\n", filename.c_str(), i + 1, count);
@@ -40,6 +46,296 @@ void test_jpeg(const std::string& folder)
     printf("image: %zu MB\n", image_bytes / (1024 * 1024));
 }
 
+// -----------------------------------------------------------------
+// channel pipelined jpeg reader
+// -----------------------------------------------------------------
+
+/*
+    Same as above but split into three stages connected with channels:
+
+    file:    main thread maps the files, starts the readahead and pushes
+             them into "files". This is the free-standing thread which is
+             allowed to block; when the decoders fall behind the push
+             blocks and we get back-pressure.
+             It also waits for a free slot in "images" before each file, so
+             there are never more images in flight than "images" can hold.
+    decode:  consumer tasks attached to "files" decode in a ConcurrentQueue.
+             A file which fails to decode is delivered with failed = true.
+    collect: one consumer task attached to "images" in a SerialQueue.
+
+    None of the pool workers ever sleep waiting for data or space; the tasks
+    are enqueued when there is something for them to do.
+*/
+
+struct CompressedImage
+{
+    std::string filename;
+    std::shared_ptr<File> file;
+    size_t index;
+};
+
+struct DecodedImage
+{
+    std::string filename;
+    size_t bytes;
+    size_t index;
+    bool failed;
+};
+
+void test_jpeg_pipeline(const std::string& folder)
+{
+    ConcurrentQueue decoder("jpeg decoder");
+    SerialQueue collector("jpeg collector");
+
+    Channel<CompressedImage> files(64);
+    const size_t capacity = 256;
+    Channel<DecodedImage> images(capacity);
+
+    Path path(folder);
+    const size_t count = path.size();
+
+    size_t image_bytes = 0;
+    size_t failures = 0;
+    std::atomic<size_t> pending { 1 };
+    std::promise<void> done;
+
+    // images between the reader and the collector
+    std::mutex slot_mutex;
+    std::condition_variable slot_condition;
+    size_t in_flight = 0;
+
+    images.connect(collector, 1, [&] (DecodedImage& image) {
+        if (image.failed)
+        {
+            printf("filename: %s (%zu / %zu) failed.\n", image.filename.c_str(), image.index + 1, count);
+            ++failures;
+        }
+        else
+        {
+            printf("filename: %s (%zu / %zu) done.\n", image.filename.c_str(), image.index + 1, count);
+            image_bytes += image.bytes;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(slot_mutex);
+            --in_flight;
+        }
+        slot_condition.notify_one();
+
+        if (--pending == 0)
+            done.set_value();
+    });
+
+    files.connect(decoder, ThreadPool::getHardwareConcurrency(), [&] (CompressedImage& image) {
+        printf("filename: %s (%zu / %zu) begin.\n", image.filename.c_str(), image.index + 1, count);
+        DecodedImage result { image.filename, 0, image.index, false };
+
+        try
+        {
+            Bitmap bitmap(*image.file, image.filename);
+            result.bytes = size_t(bitmap.width) * bitmap.height * 4;
+        }
+        catch (...)
+        {
+            result.failed = true;
+        }
+
+        // the reader reserved a slot for every image: this never fails and never blocks
+        images.try_push(std::move(result));
+    });
+
+    Timer timer;
+    uint64 time0 = timer.ms();
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        const auto& node = path[i];
+        if (!node.isDirectory())
+        {
+            {
+                std::unique_lock<std::mutex> lock(slot_mutex);
+                slot_condition.wait(lock, [&] { return in_flight < capacity; });
+                ++in_flight;
+            }
+
+            ++pending;
+            // start reading the file while it waits for a decoder
+            std::shared_ptr<File> file = std::make_shared<File>(path, node.name);
+            advise(*file, Access::SEQUENTIAL);
+            prefetch(*file);
+            files.push({ node.name, file, i });
+        }
+    }
+
+    // release the reader's reference
+    if (--pending == 0)
+        done.set_value();
+
+    done.get_future().wait();
+    decoder.wait();
+    collector.wait();
+
+    uint64 time1 = timer.ms();
+    printf("image: %zu MB, %zu failed (%d ms)\n", image_bytes / (1024 * 1024), failures, int(time1 - time0));
+}
+
+// -----------------------------------------------------------------
+// channel throughput
+// -----------------------------------------------------------------
+
+/*
+    The traditional way to connect stages: std::deque protected by a mutex
+    with a condition variable to sleep on. Used as the baseline.
+*/
+
+template <typename T>
+class MutexQueue
+{
+protected:
+    std::mutex m_mutex;
+    std::condition_variable m_not_empty;
+    std::condition_variable m_not_full;
+    std::deque<T> m_queue;
+    size_t m_capacity;
+    bool m_closed = false;
+
+public:
+    MutexQueue(size_t capacity)
+        : m_capacity(capacity)
+    {
+    }
+
+    void push(T value)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_not_full.wait(lock, [this] { return m_queue.size() < m_capacity; });
+        m_queue.push_back(std::move(value));
+        m_not_empty.notify_one();
+    }
+
+    bool pop(T& value)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_not_empty.wait(lock, [this] { return m_closed || !m_queue.empty(); });
+        if (m_queue.empty())
+            return false;
+        value = std::move(m_queue.front());
+        m_queue.pop_front();
+        m_not_full.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_not_empty.notify_all();
+    }
+};
+
+template <typename Queue, typename Push, typename Pop>
+void test_throughput(const char* name, int producers, int consumers, Push push, Pop pop)
+{
+    const int count = 4 * 1000 * 1000;
+    const int per_producer = count / producers;
+
+    Queue queue(1024);
+    std::atomic<uint64> checksum { 0 };
+
+    Timer timer;
+    uint64 time0 = timer.us();
+
+    std::vector<std::thread> consumer_threads;
+    for (int i = 0; i < consumers; ++i)
+    {
+        consumer_threads.emplace_back([&] {
+            checksum += pop(queue);
+        });
+    }
+
+    std::vector<std::thread> producer_threads;
+    for (int i = 0; i < producers; ++i)
+    {
+        producer_threads.emplace_back([&, i] {
+            push(queue, i * per_producer, per_producer);
+        });
+    }
+
+    for (auto& thread : producer_threads)
+        thread.join();
+
+    queue.close();
+
+    for (auto& thread : consumer_threads)
+        thread.join();
+
+    uint64 time1 = timer.us();
+    const uint64 expected = uint64(producers * per_producer) * (producers * per_producer - 1) / 2;
+
+    printf("%-16s %dp/%dc: %7.1f M items/s %s\n", name, producers, consumers,
+        double(producers * per_producer) / std::max<uint64>(1, time1 - time0),
+        checksum == expected ? "" : "(CHECKSUM FAILED)");
+}
+
+void test_channel()
+{
+    auto mutex_push = [] (MutexQueue<int>& q, int first, int count) {
+        for (int i = 0; i < count; ++i)
+            q.push(first + i);
+    };
+
+    auto mutex_pop = [] (MutexQueue<int>& q) {
+        uint64 sum = 0;
+        int value;
+        while (q.pop(value))
+            sum += value;
+        return sum;
+    };
+
+    auto channel_push = [] (Channel<int>& q, int first, int count) {
+        for (int i = 0; i < count; ++i)
+            q.push(first + i);
+    };
+
+    auto channel_pop = [] (Channel<int>& q) {
+        uint64 sum = 0;
+        int value;
+        while (q.pop(value))
+            sum += value;
+        return sum;
+    };
+
+    auto batch_push = [] (Channel<int>& q, int first, int count) {
+        int values[64];
+        for (int i = 0; i < count; i += 64)
+        {
+            const int n = std::min(64, count - i);
+            for (int j = 0; j < n; ++j)
+                values[j] = first + i + j;
+            q.push(values, n);
+        }
+    };
+
+    auto batch_pop = [] (Channel<int>& q) {
+        uint64 sum = 0;
+        int values[64];
+        while (size_t n = q.pop(values, 64))
+        {
+            for (size_t j = 0; j < n; ++j)
+                sum += values[j];
+        }
+        return sum;
+    };
+
+    const int configs[][2] = { { 1, 1 }, { 2, 2 }, { 4, 4 } };
+    for (auto& config : configs)
+    {
+        test_throughput<MutexQueue<int>>("mutex queue", config[0], config[1], mutex_push, mutex_pop);
+        test_throughput<Channel<int>>("channel", config[0], config[1], channel_push, channel_pop);
+        test_throughput<Channel<int>>("channel batch", config[0], config[1], batch_push, batch_pop);
+    }
+}
+
 // -----------------------------------------------------------------
 // main
 // -----------------------------------------------------------------
@@ -52,6 +348,8 @@ int main(int argc, const char* argv[])
         return 1;
     }
 
+    test_channel();
     test_jpeg(argv[1]);
+    test_jpeg_pipeline(argv[1]);
     printf("* done *\n");
 }
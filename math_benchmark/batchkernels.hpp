@@ -0,0 +1,144 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+
+/*
+    Batch kernels over SoA arrays.
+
+    batchmath.hpp includes this once per instruction set, inside the
+    namespace of that instruction set, with Vec and BATCH_TARGET defined.
+    No include guard on purpose.
+
+    Every kernel processes the whole vectors and leaves the tail to the
+    scalar kernel.
+*/
+
+BATCH_TARGET
+inline Vec rsqrt_nr(Vec a)
+{
+    // hardware estimate + one Newton-Raphson step: ~23 bits
+    Vec y = rsqrt(a);
+    return y * (Vec::set1(1.5f) - Vec::set1(0.5f) * a * y * y);
+}
+
+BATCH_TARGET
+inline void transform(const float* m, bool translate, Output3 dest, Input3 source, size_t count)
+{
+    const Vec m00 = Vec::set1(m[0]), m01 = Vec::set1(m[1]), m02 = Vec::set1(m[2]);
+    const Vec m10 = Vec::set1(m[4]), m11 = Vec::set1(m[5]), m12 = Vec::set1(m[6]);
+    const Vec m20 = Vec::set1(m[8]), m21 = Vec::set1(m[9]), m22 = Vec::set1(m[10]);
+    const Vec t0 = Vec::set1(translate ? m[12] : 0.0f);
+    const Vec t1 = Vec::set1(translate ? m[13] : 0.0f);
+    const Vec t2 = Vec::set1(translate ? m[14] : 0.0f);
+
+    const size_t n = count & ~size_t(Vec::size - 1);
+
+    for (size_t i = 0; i < n; i += Vec::size)
+    {
+        const Vec x = Vec::load(source.x + i);
+        const Vec y = Vec::load(source.y + i);
+        const Vec z = Vec::load(source.z + i);
+        store(dest.x + i, fmadd(x, m00, fmadd(y, m10, fmadd(z, m20, t0))));
+        store(dest.y + i, fmadd(x, m01, fmadd(y, m11, fmadd(z, m21, t1))));
+        store(dest.z + i, fmadd(x, m02, fmadd(y, m12, fmadd(z, m22, t2))));
+    }
+
+    scalar::transform(m, translate, dest.offset(n), source.offset(n), count - n);
+}
+
+BATCH_TARGET
+inline void normalize(Output3 dest, Input3 source, size_t count)
+{
+    const size_t n = count & ~size_t(Vec::size - 1);
+
+    for (size_t i = 0; i < n; i += Vec::size)
+    {
+        const Vec x = Vec::load(source.x + i);
+        const Vec y = Vec::load(source.y + i);
+        const Vec z = Vec::load(source.z + i);
+        const Vec s = rsqrt_nr(fmadd(x, x, fmadd(y, y, z * z)));
+        store(dest.x + i, x * s);
+        store(dest.y + i, y * s);
+        store(dest.z + i, z * s);
+    }
+
+    scalar::normalize(dest.offset(n), source.offset(n), count - n);
+}
+
+BATCH_TARGET
+inline void dot(float* dest, Input3 a, Input3 b, size_t count)
+{
+    const size_t n = count & ~size_t(Vec::size - 1);
+
+    for (size_t i = 0; i < n; i += Vec::size)
+    {
+        const Vec x = Vec::load(a.x + i) * Vec::load(b.x + i);
+        const Vec y = fmadd(Vec::load(a.y + i), Vec::load(b.y + i), x);
+        store(dest + i, fmadd(Vec::load(a.z + i), Vec::load(b.z + i), y));
+    }
+
+    scalar::dot(dest + n, a.offset(n), b.offset(n), count - n);
+}
+
+BATCH_TARGET
+inline void cross(Output3 dest, Input3 a, Input3 b, size_t count)
+{
+    const size_t n = count & ~size_t(Vec::size - 1);
+
+    for (size_t i = 0; i < n; i += Vec::size)
+    {
+        const Vec ax = Vec::load(a.x + i), ay = Vec::load(a.y + i), az = Vec::load(a.z + i);
+        const Vec bx = Vec::load(b.x + i), by = Vec::load(b.y + i), bz = Vec::load(b.z + i);
+        store(dest.x + i, ay * bz - az * by);
+        store(dest.y + i, az * bx - ax * bz);
+        store(dest.z + i, ax * by - ay * bx);
+    }
+
+    scalar::cross(dest.offset(n), a.offset(n), b.offset(n), count - n);
+}
+
+BATCH_TARGET
+inline void normals(Output3 dest, Input3 vertices, const uint32* indices, size_t count)
+{
+    const size_t n = count & ~size_t(Vec::size - 1);
+
+    alignas(64) int32 ia[Vec::size];
+    alignas(64) int32 ib[Vec::size];
+    alignas(64) int32 ic[Vec::size];
+
+    for (size_t i = 0; i < n; i += Vec::size)
+    {
+        // the triangle list is AoS; transpose the indices for the gathers
+        const uint32* s = indices + i * 3;
+        for (int j = 0; j < Vec::size; ++j)
+        {
+            ia[j] = int32(s[j * 3 + 0]);
+            ib[j] = int32(s[j * 3 + 1]);
+            ic[j] = int32(s[j * 3 + 2]);
+        }
+
+        const Vec ax = Vec::gather(vertices.x, ia);
+        const Vec ay = Vec::gather(vertices.y, ia);
+        const Vec az = Vec::gather(vertices.z, ia);
+
+        // misc/math.cpp example5: normalize(cross(a - b, a - c))
+        const Vec ux = ax - Vec::gather(vertices.x, ib);
+        const Vec uy = ay - Vec::gather(vertices.y, ib);
+        const Vec uz = az - Vec::gather(vertices.z, ib);
+        const Vec vx = ax - Vec::gather(vertices.x, ic);
+        const Vec vy = ay - Vec::gather(vertices.y, ic);
+        const Vec vz = az - Vec::gather(vertices.z, ic);
+
+        const Vec nx = uy * vz - uz * vy;
+        const Vec ny = uz * vx - ux * vz;
+        const Vec nz = ux * vy - uy * vx;
+        const Vec s2 = rsqrt_nr(fmadd(nx, nx, fmadd(ny, ny, nz * nz)));
+
+        store(dest.x + i, nx * s2);
+        store(dest.y + i, ny * s2);
+        store(dest.z + i, nz * s2);
+    }
+
+    scalar::normals(dest.offset(n), vertices, indices + n * 3, count - n);
+}
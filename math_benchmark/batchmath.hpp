@@ -0,0 +1,569 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <mango/mango.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define BATCH_ENABLE_X86
+    #include <immintrin.h>
+
+    #define BATCH_TARGET_SSE2    __attribute__((target("sse2")))
+    #define BATCH_TARGET_AVX2    __attribute__((target("avx2,fma")))
+    #define BATCH_TARGET_AVX512  __attribute__((target("avx512f,avx2,fma")))
+#endif
+
+/*
+    Batch math over SoA arrays.
+
+    misc/math.cpp works on one float3 at a time: the fourth lane of the
+    register is wasted and cross() is mostly shuffles. Here the x, y and z
+    components of a large array of vectors are stored in separate arrays
+    (Float3Array) and the kernels process 4, 8 or 16 vectors per
+    instruction with no shuffles at all:
+
+        transform_points    p * m, with the translation (m[3])
+        transform_vectors   v * m, without the translation
+        normalize
+        dot, cross
+        triangle_normals    normalize(cross(a - b, a - c)) like example5,
+                            for a triangle list indexing the vertices
+
+    The instruction set is chosen at runtime: the mango SIMD types are
+    fixed when the program is compiled, so the kernels are written once
+    (batchkernels.hpp) over a small Vec wrapper and compiled for SSE2,
+    AVX2 + FMA and AVX-512F with function target attributes. setISA()
+    selects a lower one for testing.
+
+    Arrays larger than 128K elements are split into 64K element chunks
+    which are processed in the ThreadPool.
+*/
+
+namespace mango
+{
+namespace batch
+{
+
+    struct Output3
+    {
+        float* x;
+        float* y;
+        float* z;
+
+        Output3 offset(size_t i) const
+        {
+            return Output3 { x + i, y + i, z + i };
+        }
+    };
+
+    struct Input3
+    {
+        const float* x;
+        const float* y;
+        const float* z;
+
+        Input3 offset(size_t i) const
+        {
+            return Input3 { x + i, y + i, z + i };
+        }
+    };
+
+    // -----------------------------------------------------------------
+    // Float3Array
+    // -----------------------------------------------------------------
+
+    class Float3Array
+    {
+    protected:
+        std::vector<float, AlignedAllocator<float>> m_x;
+        std::vector<float, AlignedAllocator<float>> m_y;
+        std::vector<float, AlignedAllocator<float>> m_z;
+
+    public:
+        Float3Array(size_t size = 0)
+            : m_x(size), m_y(size), m_z(size)
+        {
+        }
+
+        // from AoS
+        Float3Array(const float3* source, size_t size)
+            : m_x(size), m_y(size), m_z(size)
+        {
+            for (size_t i = 0; i < size; ++i)
+            {
+                set(i, source[i]);
+            }
+        }
+
+        size_t size() const
+        {
+            return m_x.size();
+        }
+
+        void resize(size_t size)
+        {
+            m_x.resize(size);
+            m_y.resize(size);
+            m_z.resize(size);
+        }
+
+        float* x() { return m_x.data(); }
+        float* y() { return m_y.data(); }
+        float* z() { return m_z.data(); }
+        const float* x() const { return m_x.data(); }
+        const float* y() const { return m_y.data(); }
+        const float* z() const { return m_z.data(); }
+
+        float3 get(size_t i) const
+        {
+            return float3(m_x[i], m_y[i], m_z[i]);
+        }
+
+        void set(size_t i, const float3& v)
+        {
+            m_x[i] = v.x;
+            m_y[i] = v.y;
+            m_z[i] = v.z;
+        }
+
+        Output3 output()
+        {
+            return Output3 { x(), y(), z() };
+        }
+
+        Input3 input() const
+        {
+            return Input3 { x(), y(), z() };
+        }
+    };
+
+    // -----------------------------------------------------------------
+    // scalar kernels
+    // -----------------------------------------------------------------
+
+    // also used for the tails of the vector kernels; m is 4x4 row-major
+    // with the basis vectors in the rows and the translation in row 3
+    namespace scalar
+    {
+
+        inline void transform(const float* m, bool translate, Output3 dest, Input3 source, size_t count)
+        {
+            const float t0 = translate ? m[12] : 0.0f;
+            const float t1 = translate ? m[13] : 0.0f;
+            const float t2 = translate ? m[14] : 0.0f;
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                const float x = source.x[i];
+                const float y = source.y[i];
+                const float z = source.z[i];
+                dest.x[i] = x * m[0] + y * m[4] + z * m[8] + t0;
+                dest.y[i] = x * m[1] + y * m[5] + z * m[9] + t1;
+                dest.z[i] = x * m[2] + y * m[6] + z * m[10] + t2;
+            }
+        }
+
+        inline void normalize(Output3 dest, Input3 source, size_t count)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                const float x = source.x[i];
+                const float y = source.y[i];
+                const float z = source.z[i];
+                const float s = 1.0f / std::sqrt(x * x + y * y + z * z);
+                dest.x[i] = x * s;
+                dest.y[i] = y * s;
+                dest.z[i] = z * s;
+            }
+        }
+
+        inline void dot(float* dest, Input3 a, Input3 b, size_t count)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                dest[i] = a.x[i] * b.x[i] + a.y[i] * b.y[i] + a.z[i] * b.z[i];
+            }
+        }
+
+        inline void cross(Output3 dest, Input3 a, Input3 b, size_t count)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                const float ax = a.x[i], ay = a.y[i], az = a.z[i];
+                const float bx = b.x[i], by = b.y[i], bz = b.z[i];
+                dest.x[i] = ay * bz - az * by;
+                dest.y[i] = az * bx - ax * bz;
+                dest.z[i] = ax * by - ay * bx;
+            }
+        }
+
+        inline void normals(Output3 dest, Input3 vertices, const uint32* indices, size_t count)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                const uint32 a = indices[i * 3 + 0];
+                const uint32 b = indices[i * 3 + 1];
+                const uint32 c = indices[i * 3 + 2];
+
+                const float ux = vertices.x[a] - vertices.x[b];
+                const float uy = vertices.y[a] - vertices.y[b];
+                const float uz = vertices.z[a] - vertices.z[b];
+                const float vx = vertices.x[a] - vertices.x[c];
+                const float vy = vertices.y[a] - vertices.y[c];
+                const float vz = vertices.z[a] - vertices.z[c];
+
+                const float nx = uy * vz - uz * vy;
+                const float ny = uz * vx - ux * vz;
+                const float nz = ux * vy - uy * vx;
+                const float s = 1.0f / std::sqrt(nx * nx + ny * ny + nz * nz);
+
+                dest.x[i] = nx * s;
+                dest.y[i] = ny * s;
+                dest.z[i] = nz * s;
+            }
+        }
+
+    } // namespace scalar
+
+#ifdef BATCH_ENABLE_X86
+
+    // -----------------------------------------------------------------
+    // SSE2
+    // -----------------------------------------------------------------
+
+    namespace sse2
+    {
+
+        #define BATCH_TARGET BATCH_TARGET_SSE2
+
+        struct Vec
+        {
+            static constexpr int size = 4;
+            __m128 v;
+
+            BATCH_TARGET static Vec set1(float s) { return Vec { _mm_set1_ps(s) }; }
+            BATCH_TARGET static Vec load(const float* p) { return Vec { _mm_loadu_ps(p) }; }
+
+            BATCH_TARGET static Vec gather(const float* base, const int32* index)
+            {
+                return Vec { _mm_setr_ps(base[index[0]], base[index[1]], base[index[2]], base[index[3]]) };
+            }
+        };
+
+        BATCH_TARGET inline Vec operator + (Vec a, Vec b) { return Vec { _mm_add_ps(a.v, b.v) }; }
+        BATCH_TARGET inline Vec operator - (Vec a, Vec b) { return Vec { _mm_sub_ps(a.v, b.v) }; }
+        BATCH_TARGET inline Vec operator * (Vec a, Vec b) { return Vec { _mm_mul_ps(a.v, b.v) }; }
+        BATCH_TARGET inline Vec fmadd(Vec a, Vec b, Vec c) { return Vec { _mm_add_ps(_mm_mul_ps(a.v, b.v), c.v) }; }
+        BATCH_TARGET inline Vec rsqrt(Vec a) { return Vec { _mm_rsqrt_ps(a.v) }; }
+        BATCH_TARGET inline void store(float* p, Vec a) { _mm_storeu_ps(p, a.v); }
+
+        #include "batchkernels.hpp"
+        #undef BATCH_TARGET
+
+    } // namespace sse2
+
+    // -----------------------------------------------------------------
+    // AVX2 + FMA
+    // -----------------------------------------------------------------
+
+    namespace avx2
+    {
+
+        #define BATCH_TARGET BATCH_TARGET_AVX2
+
+        struct Vec
+        {
+            static constexpr int size = 8;
+            __m256 v;
+
+            BATCH_TARGET static Vec set1(float s) { return Vec { _mm256_set1_ps(s) }; }
+            BATCH_TARGET static Vec load(const float* p) { return Vec { _mm256_loadu_ps(p) }; }
+
+            BATCH_TARGET static Vec gather(const float* base, const int32* index)
+            {
+                __m256i i = _mm256_load_si256(reinterpret_cast<const __m256i*>(index));
+                return Vec { _mm256_i32gather_ps(base, i, 4) };
+            }
+        };
+
+        BATCH_TARGET inline Vec operator + (Vec a, Vec b) { return Vec { _mm256_add_ps(a.v, b.v) }; }
+        BATCH_TARGET inline Vec operator - (Vec a, Vec b) { return Vec { _mm256_sub_ps(a.v, b.v) }; }
+        BATCH_TARGET inline Vec operator * (Vec a, Vec b) { return Vec { _mm256_mul_ps(a.v, b.v) }; }
+        BATCH_TARGET inline Vec fmadd(Vec a, Vec b, Vec c) { return Vec { _mm256_fmadd_ps(a.v, b.v, c.v) }; }
+        BATCH_TARGET inline Vec rsqrt(Vec a) { return Vec { _mm256_rsqrt_ps(a.v) }; }
+        BATCH_TARGET inline void store(float* p, Vec a) { _mm256_storeu_ps(p, a.v); }
+
+        #include "batchkernels.hpp"
+        #undef BATCH_TARGET
+
+    } // namespace avx2
+
+    // -----------------------------------------------------------------
+    // AVX-512F
+    // -----------------------------------------------------------------
+
+    namespace avx512
+    {
+
+        #define BATCH_TARGET BATCH_TARGET_AVX512
+
+        struct Vec
+        {
+            static constexpr int size = 16;
+            __m512 v;
+
+            BATCH_TARGET static Vec set1(float s) { return Vec { _mm512_set1_ps(s) }; }
+            BATCH_TARGET static Vec load(const float* p) { return Vec { _mm512_loadu_ps(p) }; }
+
+            BATCH_TARGET static Vec gather(const float* base, const int32* index)
+            {
+                __m512i i = _mm512_load_si512(index);
+                // the masked forms: the plain ones start from _mm512_undefined_ps()
+                return Vec { _mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xffff, i, base, 4) };
+            }
+        };
+
+        BATCH_TARGET inline Vec operator + (Vec a, Vec b) { return Vec { _mm512_add_ps(a.v, b.v) }; }
+        BATCH_TARGET inline Vec operator - (Vec a, Vec b) { return Vec { _mm512_sub_ps(a.v, b.v) }; }
+        BATCH_TARGET inline Vec operator * (Vec a, Vec b) { return Vec { _mm512_mul_ps(a.v, b.v) }; }
+        BATCH_TARGET inline Vec fmadd(Vec a, Vec b, Vec c) { return Vec { _mm512_fmadd_ps(a.v, b.v, c.v) }; }
+        BATCH_TARGET inline Vec rsqrt(Vec a) { return Vec { _mm512_maskz_rsqrt14_ps(0xffff, a.v) }; }
+        BATCH_TARGET inline void store(float* p, Vec a) { _mm512_storeu_ps(p, a.v); }
+
+        #include "batchkernels.hpp"
+        #undef BATCH_TARGET
+
+    } // namespace avx512
+
+#endif // BATCH_ENABLE_X86
+
+    // -----------------------------------------------------------------
+    // dispatch
+    // -----------------------------------------------------------------
+
+    enum class ISA
+    {
+        SCALAR,
+        SSE2,
+        AVX2,
+        AVX512
+    };
+
+    inline const char* getName(ISA isa)
+    {
+        static const char* names[] = { "scalar", "SSE2", "AVX2", "AVX-512" };
+        return names[int(isa)];
+    }
+
+    inline bool isSupported(ISA isa)
+    {
+        switch (isa)
+        {
+            case ISA::SCALAR:
+                return true;
+#ifdef BATCH_ENABLE_X86
+            case ISA::SSE2:
+                return __builtin_cpu_supports("sse2");
+            case ISA::AVX2:
+                return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+            case ISA::AVX512:
+                return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") &&
+                       __builtin_cpu_supports("fma");
+#endif
+            default:
+                return false;
+        }
+    }
+
+    struct Kernels
+    {
+        void (*transform)(const float* m, bool translate, Output3 dest, Input3 source, size_t count);
+        void (*normalize)(Output3 dest, Input3 source, size_t count);
+        void (*dot)(float* dest, Input3 a, Input3 b, size_t count);
+        void (*cross)(Output3 dest, Input3 a, Input3 b, size_t count);
+        void (*normals)(Output3 dest, Input3 vertices, const uint32* indices, size_t count);
+    };
+
+    inline const Kernels& getKernels(ISA isa)
+    {
+        static const Kernels table[] =
+        {
+            { scalar::transform, scalar::normalize, scalar::dot, scalar::cross, scalar::normals },
+#ifdef BATCH_ENABLE_X86
+            { sse2::transform, sse2::normalize, sse2::dot, sse2::cross, sse2::normals },
+            { avx2::transform, avx2::normalize, avx2::dot, avx2::cross, avx2::normals },
+            { avx512::transform, avx512::normalize, avx512::dot, avx512::cross, avx512::normals },
+#endif
+        };
+        return table[int(isa)];
+    }
+
+    namespace detail
+    {
+
+        inline ISA getBestISA()
+        {
+            ISA best = ISA::SCALAR;
+            for (ISA isa : { ISA::SSE2, ISA::AVX2, ISA::AVX512 })
+            {
+                if (isSupported(isa))
+                    best = isa;
+            }
+            return best;
+        }
+
+        inline std::atomic<int>& current()
+        {
+            static std::atomic<int> isa { int(getBestISA()) };
+            return isa;
+        }
+
+        // large arrays in parallel chunks
+        template <typename Func>
+        void parallel(size_t count, Func func)
+        {
+            const size_t chunk = 64 * 1024;
+
+            if (count <= chunk * 2)
+            {
+                func(0, count);
+                return;
+            }
+
+            ConcurrentQueue q("batch");
+            for (size_t i = 0; i < count; i += chunk)
+            {
+                const size_t n = std::min(chunk, count - i);
+                q.enqueue([=] {
+                    func(i, n);
+                });
+            }
+            q.wait();
+        }
+
+        inline void getMatrix(float* m, const float4x4& matrix)
+        {
+            for (int i = 0; i < 4; ++i)
+            {
+                for (int j = 0; j < 4; ++j)
+                {
+                    m[i * 4 + j] = matrix[i][j];
+                }
+            }
+        }
+
+    } // namespace detail
+
+    inline ISA getISA()
+    {
+        return ISA(detail::current().load());
+    }
+
+    inline void setISA(ISA isa)
+    {
+        if (!isSupported(isa))
+        {
+            MANGO_EXCEPTION("batch: instruction set not supported.");
+        }
+        detail::current() = int(isa);
+    }
+
+    // -----------------------------------------------------------------
+    // API
+    // -----------------------------------------------------------------
+
+    // dest may be the same array as a source in all of these, except
+    // that triangle_normals() copies the vertices first when they alias the normals
+
+    inline void transform_points(Float3Array& dest, const Float3Array& source, const float4x4& matrix)
+    {
+        float m[16];
+        detail::getMatrix(m, matrix);
+        dest.resize(source.size());
+
+        const Kernels& k = getKernels(getISA());
+        Output3 d = dest.output();
+        Input3 s = source.input();
+        detail::parallel(source.size(), [&] (size_t i, size_t n) {
+            k.transform(m, true, d.offset(i), s.offset(i), n);
+        });
+    }
+
+    inline void transform_vectors(Float3Array& dest, const Float3Array& source, const float4x4& matrix)
+    {
+        float m[16];
+        detail::getMatrix(m, matrix);
+        dest.resize(source.size());
+
+        const Kernels& k = getKernels(getISA());
+        Output3 d = dest.output();
+        Input3 s = source.input();
+        detail::parallel(source.size(), [&] (size_t i, size_t n) {
+            k.transform(m, false, d.offset(i), s.offset(i), n);
+        });
+    }
+
+    inline void normalize(Float3Array& dest, const Float3Array& source)
+    {
+        dest.resize(source.size());
+
+        const Kernels& k = getKernels(getISA());
+        Output3 d = dest.output();
+        Input3 s = source.input();
+        detail::parallel(source.size(), [&] (size_t i, size_t n) {
+            k.normalize(d.offset(i), s.offset(i), n);
+        });
+    }
+
+    inline void dot(float* dest, const Float3Array& a, const Float3Array& b)
+    {
+        const Kernels& k = getKernels(getISA());
+        Input3 sa = a.input();
+        Input3 sb = b.input();
+        detail::parallel(std::min(a.size(), b.size()), [&] (size_t i, size_t n) {
+            k.dot(dest + i, sa.offset(i), sb.offset(i), n);
+        });
+    }
+
+    inline void cross(Float3Array& dest, const Float3Array& a, const Float3Array& b)
+    {
+        const size_t count = std::min(a.size(), b.size());
+        dest.resize(count);
+
+        const Kernels& k = getKernels(getISA());
+        Output3 d = dest.output();
+        Input3 sa = a.input();
+        Input3 sb = b.input();
+        detail::parallel(count, [&] (size_t i, size_t n) {
+            k.cross(d.offset(i), sa.offset(i), sb.offset(i), n);
+        });
+    }
+
+    // indices: triangle list, 3 * count vertex indices
+    inline void triangle_normals(Float3Array& normals, const Float3Array& vertices, const uint32* indices, size_t count)
+    {
+        if (&normals == &vertices)
+        {
+            // the normals are indexed by triangle, the vertices by index: they can't share storage
+            const Float3Array copy(vertices);
+            triangle_normals(normals, copy, indices, count);
+            return;
+        }
+
+        normals.resize(count);
+
+        const Kernels& k = getKernels(getISA());
+        Output3 d = normals.output();
+        Input3 v = vertices.input();
+        detail::parallel(count, [&] (size_t i, size_t n) {
+            k.normals(d.offset(i), v, indices + i * 3, n);
+        });
+    }
+
+} // namespace batch
+} // namespace mango
@@ -0,0 +1,414 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <mango/mango.hpp>
+#include <cstring>
+#include <limits>
+#include "batchmath.hpp"
+
+/*
+    Vectorized sin, cos, exp, log, pow and rsqrt over float arrays.
+
+    misc/simd.cpp example3 uses simd::sin (Sleef) on one vector at a time;
+    this processes whole arrays with the runtime selected instruction set
+    of batchmath.hpp and lets the caller pick the precision per call:
+
+        Precision::PRECISE   cephes polynomials, a few ulp
+        Precision::FAST      shorter polynomials, 1e-4 .. 1e-6 relative;
+                             rsqrt is the hardware estimate alone
+
+    pow() takes a scalar exponent (gamma curves and the like) and is
+    exp(y * log(x)), so its error grows with |y * log(x)|.
+
+    The kernels are in fastmathkernels.hpp. They need integer lane
+    operations for the exponent tricks, which the Vec wrappers of
+    batchmath.hpp don't have; they are added here as an Int type per
+    instruction set. The scalar version uses the same kernels with a one
+    lane Vec so that the tails get the same results as the vectors.
+
+    Ranges: sin / cos are accurate for |x| < 8192 (the reduction is exact
+    up to there, beyond it the error grows with |x|), denormals are
+    treated as zero by log() and rsqrt(), and exp() flushes results below
+    FLT_MIN to zero.
+
+    NaN is tested on the bits, not with an unordered compare: -ffast-math
+    assumes there are no NaNs and folds cmpunord(x, x) to false.
+*/
+
+namespace mango
+{
+namespace batch
+{
+
+    enum class Precision
+    {
+        PRECISE,
+        FAST
+    };
+
+    // -----------------------------------------------------------------
+    // scalar
+    // -----------------------------------------------------------------
+
+    namespace scalar
+    {
+
+        struct Vec
+        {
+            static constexpr int size = 1;
+            float v;
+
+            static Vec set1(float s) { return Vec { s }; }
+            static Vec load(const float* p) { return Vec { *p }; }
+        };
+
+        struct Int
+        {
+            int32 v;
+
+            static Int set1(int32 s) { return Int { s }; }
+        };
+
+        inline Vec operator + (Vec a, Vec b) { return Vec { a.v + b.v }; }
+        inline Vec operator - (Vec a, Vec b) { return Vec { a.v - b.v }; }
+        inline Vec operator * (Vec a, Vec b) { return Vec { a.v * b.v }; }
+        inline Vec operator / (Vec a, Vec b) { return Vec { a.v / b.v }; }
+        inline Vec fmadd(Vec a, Vec b, Vec c) { return Vec { a.v * b.v + c.v }; }
+        inline Vec min(Vec a, Vec b) { return Vec { std::min(a.v, b.v) }; }
+        inline Vec max(Vec a, Vec b) { return Vec { std::max(a.v, b.v) }; }
+        inline void store(float* p, Vec a) { *p = a.v; }
+
+        inline Int operator + (Int a, Int b) { return Int { int32(uint32(a.v) + uint32(b.v)) }; }
+        inline Int operator - (Int a, Int b) { return Int { int32(uint32(a.v) - uint32(b.v)) }; }
+        inline Int operator & (Int a, Int b) { return Int { a.v & b.v }; }
+        inline Int operator | (Int a, Int b) { return Int { a.v | b.v }; }
+        inline Int operator ^ (Int a, Int b) { return Int { a.v ^ b.v }; }
+        template <int N> Int shl(Int a) { return Int { int32(uint32(a.v) << N) }; }
+        template <int N> Int shr(Int a) { return Int { int32(uint32(a.v) >> N) }; }
+        template <int N> Int sra(Int a) { return Int { a.v >> N }; }
+
+        inline Vec as_float(Int a)
+        {
+            float f;
+            std::memcpy(&f, &a.v, 4);
+            return Vec { f };
+        }
+
+        inline Int as_int(Vec a)
+        {
+            int32 i;
+            std::memcpy(&i, &a.v, 4);
+            return Int { i };
+        }
+
+        // round to nearest like cvtps2dq; the arguments are range limited
+        inline Int round_int(Vec a) { return Int { int32(std::nearbyint(a.v)) }; }
+        inline Vec to_float(Int a) { return Vec { float(a.v) }; }
+
+        inline Int cmplt(Vec a, Vec b) { return Int { a.v < b.v ? -1 : 0 }; }
+        inline Int cmpeq(Vec a, Vec b) { return Int { a.v == b.v ? -1 : 0 }; }
+        inline Int cmpeq(Int a, Int b) { return Int { a.v == b.v ? -1 : 0 }; }
+        inline Int cmpgt(Int a, Int b) { return Int { a.v > b.v ? -1 : 0 }; }
+        inline Vec select(Int mask, Vec a, Vec b) { return mask.v ? a : b; }
+
+        // fmadd() is not fused here: keep -ffast-math from folding the
+        // parts of a Cody-Waite constant back together
+        inline Vec keep(Vec a)
+        {
+#if defined(__GNUC__)
+            __asm__ ("" : "+g" (a.v));
+#endif
+            return a;
+        }
+
+        // the classic bit trick and one Newton-Raphson step: ~12 bits like
+        // the SSE estimate, and the same special cases: +-0 and denormals
+        // -> +-inf, +inf -> 0, negative and NaN -> NaN
+        inline Vec rsqrt(Vec a)
+        {
+            const int32 i = as_int(a).v;
+
+            if ((i & 0x7fffffff) < 0x00800000)
+                return as_float(Int::set1((i & 0x80000000) | 0x7f800000));
+
+            if (i == 0x7f800000)
+                return Vec { 0.0f };
+
+            if (i < 0 || i > 0x7f800000)
+                return Vec { std::numeric_limits<float>::quiet_NaN() };
+
+            Vec y = as_float(Int::set1(0x5f3759df) - sra<1>(as_int(a)));
+            return y * (Vec::set1(1.5f) - Vec::set1(0.5f) * a * y * y);
+        }
+
+        #define BATCH_TARGET
+        #include "fastmathkernels.hpp"
+        #undef BATCH_TARGET
+
+    } // namespace scalar
+
+#ifdef BATCH_ENABLE_X86
+
+    // -----------------------------------------------------------------
+    // SSE2
+    // -----------------------------------------------------------------
+
+    namespace sse2
+    {
+
+        #define BATCH_TARGET BATCH_TARGET_SSE2
+
+        struct Int
+        {
+            __m128i v;
+
+            BATCH_TARGET static Int set1(int32 s) { return Int { _mm_set1_epi32(s) }; }
+        };
+
+        BATCH_TARGET inline Vec operator / (Vec a, Vec b) { return Vec { _mm_div_ps(a.v, b.v) }; }
+        BATCH_TARGET inline Vec min(Vec a, Vec b) { return Vec { _mm_min_ps(a.v, b.v) }; }
+        BATCH_TARGET inline Vec max(Vec a, Vec b) { return Vec { _mm_max_ps(a.v, b.v) }; }
+
+        BATCH_TARGET inline Int operator + (Int a, Int b) { return Int { _mm_add_epi32(a.v, b.v) }; }
+        BATCH_TARGET inline Int operator - (Int a, Int b) { return Int { _mm_sub_epi32(a.v, b.v) }; }
+        BATCH_TARGET inline Int operator & (Int a, Int b) { return Int { _mm_and_si128(a.v, b.v) }; }
+        BATCH_TARGET inline Int operator | (Int a, Int b) { return Int { _mm_or_si128(a.v, b.v) }; }
+        BATCH_TARGET inline Int operator ^ (Int a, Int b) { return Int { _mm_xor_si128(a.v, b.v) }; }
+        template <int N> BATCH_TARGET Int shl(Int a) { return Int { _mm_slli_epi32(a.v, N) }; }
+        template <int N> BATCH_TARGET Int shr(Int a) { return Int { _mm_srli_epi32(a.v, N) }; }
+        template <int N> BATCH_TARGET Int sra(Int a) { return Int { _mm_srai_epi32(a.v, N) }; }
+
+        BATCH_TARGET inline Vec as_float(Int a) { return Vec { _mm_castsi128_ps(a.v) }; }
+        BATCH_TARGET inline Int as_int(Vec a) { return Int { _mm_castps_si128(a.v) }; }
+        BATCH_TARGET inline Int round_int(Vec a) { return Int { _mm_cvtps_epi32(a.v) }; }
+        BATCH_TARGET inline Vec to_float(Int a) { return Vec { _mm_cvtepi32_ps(a.v) }; }
+
+        BATCH_TARGET inline Int cmplt(Vec a, Vec b) { return Int { _mm_castps_si128(_mm_cmplt_ps(a.v, b.v)) }; }
+        BATCH_TARGET inline Int cmpeq(Vec a, Vec b) { return Int { _mm_castps_si128(_mm_cmpeq_ps(a.v, b.v)) }; }
+        BATCH_TARGET inline Int cmpeq(Int a, Int b) { return Int { _mm_cmpeq_epi32(a.v, b.v) }; }
+        BATCH_TARGET inline Int cmpgt(Int a, Int b) { return Int { _mm_cmpgt_epi32(a.v, b.v) }; }
+
+        // no FMA in SSE2: see scalar::keep()
+        BATCH_TARGET inline Vec keep(Vec a)
+        {
+            __asm__ ("" : "+x" (a.v));
+            return a;
+        }
+
+        BATCH_TARGET inline Vec select(Int mask, Vec a, Vec b)
+        {
+            __m128 m = _mm_castsi128_ps(mask.v);
+            return Vec { _mm_or_ps(_mm_and_ps(m, a.v), _mm_andnot_ps(m, b.v)) };
+        }
+
+        #include "fastmathkernels.hpp"
+        #undef BATCH_TARGET
+
+    } // namespace sse2
+
+    // -----------------------------------------------------------------
+    // AVX2 + FMA
+    // -----------------------------------------------------------------
+
+    namespace avx2
+    {
+
+        #define BATCH_TARGET BATCH_TARGET_AVX2
+
+        struct Int
+        {
+            __m256i v;
+
+            BATCH_TARGET static Int set1(int32 s) { return Int { _mm256_set1_epi32(s) }; }
+        };
+
+        BATCH_TARGET inline Vec operator / (Vec a, Vec b) { return Vec { _mm256_div_ps(a.v, b.v) }; }
+        BATCH_TARGET inline Vec min(Vec a, Vec b) { return Vec { _mm256_min_ps(a.v, b.v) }; }
+        BATCH_TARGET inline Vec max(Vec a, Vec b) { return Vec { _mm256_max_ps(a.v, b.v) }; }
+
+        BATCH_TARGET inline Int operator + (Int a, Int b) { return Int { _mm256_add_epi32(a.v, b.v) }; }
+        BATCH_TARGET inline Int operator - (Int a, Int b) { return Int { _mm256_sub_epi32(a.v, b.v) }; }
+        BATCH_TARGET inline Int operator & (Int a, Int b) { return Int { _mm256_and_si256(a.v, b.v) }; }
+        BATCH_TARGET inline Int operator | (Int a, Int b) { return Int { _mm256_or_si256(a.v, b.v) }; }
+        BATCH_TARGET inline Int operator ^ (Int a, Int b) { return Int { _mm256_xor_si256(a.v, b.v) }; }
+        template <int N> BATCH_TARGET Int shl(Int a) { return Int { _mm256_slli_epi32(a.v, N) }; }
+        template <int N> BATCH_TARGET Int shr(Int a) { return Int { _mm256_srli_epi32(a.v, N) }; }
+        template <int N> BATCH_TARGET Int sra(Int a) { return Int { _mm256_srai_epi32(a.v, N) }; }
+
+        BATCH_TARGET inline Vec as_float(Int a) { return Vec { _mm256_castsi256_ps(a.v) }; }
+        BATCH_TARGET inline Int as_int(Vec a) { return Int { _mm256_castps_si256(a.v) }; }
+        BATCH_TARGET inline Int round_int(Vec a) { return Int { _mm256_cvtps_epi32(a.v) }; }
+        BATCH_TARGET inline Vec to_float(Int a) { return Vec { _mm256_cvtepi32_ps(a.v) }; }
+
+        BATCH_TARGET inline Int cmplt(Vec a, Vec b) { return Int { _mm256_castps_si256(_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)) }; }
+        BATCH_TARGET inline Int cmpeq(Vec a, Vec b) { return Int { _mm256_castps_si256(_mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ)) }; }
+        BATCH_TARGET inline Int cmpeq(Int a, Int b) { return Int { _mm256_cmpeq_epi32(a.v, b.v) }; }
+        BATCH_TARGET inline Int cmpgt(Int a, Int b) { return Int { _mm256_cmpgt_epi32(a.v, b.v) }; }
+        BATCH_TARGET inline Vec keep(Vec a) { return a; }
+
+        BATCH_TARGET inline Vec select(Int mask, Vec a, Vec b)
+        {
+            return Vec { _mm256_blendv_ps(b.v, a.v, _mm256_castsi256_ps(mask.v)) };
+        }
+
+        #include "fastmathkernels.hpp"
+        #undef BATCH_TARGET
+
+    } // namespace avx2
+
+    // -----------------------------------------------------------------
+    // AVX-512F
+    // -----------------------------------------------------------------
+
+    namespace avx512
+    {
+
+        #define BATCH_TARGET BATCH_TARGET_AVX512
+
+        // comparisons produce __mmask16; they are expanded to lane masks
+        // so that the kernels look the same for every instruction set
+        struct Int
+        {
+            __m512i v;
+
+            BATCH_TARGET static Int set1(int32 s) { return Int { _mm512_set1_epi32(s) }; }
+
+            BATCH_TARGET static Int expand(__mmask16 mask)
+            {
+                return Int { _mm512_maskz_mov_epi32(mask, _mm512_set1_epi32(-1)) };
+            }
+        };
+
+        BATCH_TARGET inline Vec operator / (Vec a, Vec b) { return Vec { _mm512_div_ps(a.v, b.v) }; }
+        BATCH_TARGET inline Vec min(Vec a, Vec b) { return Vec { _mm512_min_ps(a.v, b.v) }; }
+        BATCH_TARGET inline Vec max(Vec a, Vec b) { return Vec { _mm512_max_ps(a.v, b.v) }; }
+
+        BATCH_TARGET inline Int operator + (Int a, Int b) { return Int { _mm512_add_epi32(a.v, b.v) }; }
+        BATCH_TARGET inline Int operator - (Int a, Int b) { return Int { _mm512_sub_epi32(a.v, b.v) }; }
+        BATCH_TARGET inline Int operator & (Int a, Int b) { return Int { _mm512_and_si512(a.v, b.v) }; }
+        BATCH_TARGET inline Int operator | (Int a, Int b) { return Int { _mm512_or_si512(a.v, b.v) }; }
+        BATCH_TARGET inline Int operator ^ (Int a, Int b) { return Int { _mm512_xor_si512(a.v, b.v) }; }
+        template <int N> BATCH_TARGET Int shl(Int a) { return Int { _mm512_slli_epi32(a.v, N) }; }
+        template <int N> BATCH_TARGET Int shr(Int a) { return Int { _mm512_srli_epi32(a.v, N) }; }
+        template <int N> BATCH_TARGET Int sra(Int a) { return Int { _mm512_srai_epi32(a.v, N) }; }
+
+        BATCH_TARGET inline Vec as_float(Int a) { return Vec { _mm512_castsi512_ps(a.v) }; }
+        BATCH_TARGET inline Int as_int(Vec a) { return Int { _mm512_castps_si512(a.v) }; }
+        BATCH_TARGET inline Int round_int(Vec a) { return Int { _mm512_cvtps_epi32(a.v) }; }
+        BATCH_TARGET inline Vec to_float(Int a) { return Vec { _mm512_cvtepi32_ps(a.v) }; }
+
+        BATCH_TARGET inline Int cmplt(Vec a, Vec b) { return Int::expand(_mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ)); }
+        BATCH_TARGET inline Int cmpeq(Vec a, Vec b) { return Int::expand(_mm512_cmp_ps_mask(a.v, b.v, _CMP_EQ_OQ)); }
+        BATCH_TARGET inline Int cmpeq(Int a, Int b) { return Int::expand(_mm512_cmpeq_epi32_mask(a.v, b.v)); }
+        BATCH_TARGET inline Int cmpgt(Int a, Int b) { return Int::expand(_mm512_cmpgt_epi32_mask(a.v, b.v)); }
+        BATCH_TARGET inline Vec keep(Vec a) { return a; }
+
+        BATCH_TARGET inline Vec select(Int mask, Vec a, Vec b)
+        {
+            return Vec { _mm512_mask_blend_ps(_mm512_test_epi32_mask(mask.v, mask.v), b.v, a.v) };
+        }
+
+        #include "fastmathkernels.hpp"
+        #undef BATCH_TARGET
+
+    } // namespace avx512
+
+#endif // BATCH_ENABLE_X86
+
+    // -----------------------------------------------------------------
+    // dispatch
+    // -----------------------------------------------------------------
+
+    struct MathKernels
+    {
+        using Unary = size_t (*)(float* dest, const float* source, size_t count, bool fast);
+
+        Unary sin;
+        Unary cos;
+        Unary exp;
+        Unary log;
+        size_t (*pow)(float* dest, const float* source, float y, size_t count, bool fast);
+        Unary rsqrt;
+    };
+
+    inline const MathKernels& getMathKernels(ISA isa)
+    {
+        static const MathKernels table[] =
+        {
+            { scalar::sin, scalar::cos, scalar::exp, scalar::log, scalar::pow, scalar::rsqrt },
+#ifdef BATCH_ENABLE_X86
+            { sse2::sin, sse2::cos, sse2::exp, sse2::log, sse2::pow, sse2::rsqrt },
+            { avx2::sin, avx2::cos, avx2::exp, avx2::log, avx2::pow, avx2::rsqrt },
+            { avx512::sin, avx512::cos, avx512::exp, avx512::log, avx512::pow, avx512::rsqrt },
+#endif
+        };
+        return table[int(isa)];
+    }
+
+    namespace detail
+    {
+
+        // vectors with the current instruction set, the tail with scalar
+        inline void unary(MathKernels::Unary MathKernels::*func,
+                          float* dest, const float* source, size_t count, Precision precision)
+        {
+            const bool fast = precision == Precision::FAST;
+            const MathKernels::Unary vector = getMathKernels(getISA()).*func;
+            const MathKernels::Unary tail = getMathKernels(ISA::SCALAR).*func;
+
+            parallel(count, [&] (size_t i, size_t n) {
+                const size_t done = vector(dest + i, source + i, n, fast);
+                tail(dest + i + done, source + i + done, n - done, fast);
+            });
+        }
+
+    } // namespace detail
+
+    // -----------------------------------------------------------------
+    // API
+    // -----------------------------------------------------------------
+
+    // dest may be the same array as source
+
+    inline void sin(float* dest, const float* source, size_t count, Precision precision = Precision::PRECISE)
+    {
+        detail::unary(&MathKernels::sin, dest, source, count, precision);
+    }
+
+    inline void cos(float* dest, const float* source, size_t count, Precision precision = Precision::PRECISE)
+    {
+        detail::unary(&MathKernels::cos, dest, source, count, precision);
+    }
+
+    inline void exp(float* dest, const float* source, size_t count, Precision precision = Precision::PRECISE)
+    {
+        detail::unary(&MathKernels::exp, dest, source, count, precision);
+    }
+
+    inline void log(float* dest, const float* source, size_t count, Precision precision = Precision::PRECISE)
+    {
+        detail::unary(&MathKernels::log, dest, source, count, precision);
+    }
+
+    inline void rsqrt(float* dest, const float* source, size_t count, Precision precision = Precision::PRECISE)
+    {
+        detail::unary(&MathKernels::rsqrt, dest, source, count, precision);
+    }
+
+    inline void pow(float* dest, const float* source, float y, size_t count, Precision precision = Precision::PRECISE)
+    {
+        const bool fast = precision == Precision::FAST;
+        const auto vector = getMathKernels(getISA()).pow;
+        const auto tail = getMathKernels(ISA::SCALAR).pow;
+
+        detail::parallel(count, [&] (size_t i, size_t n) {
+            const size_t done = vector(dest + i, source + i, y, n, fast);
+            tail(dest + i + done, source + i + done, y, n - done, fast);
+        });
+    }
+
+} // namespace batch
+} // namespace mango
@@ -0,0 +1,273 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+
+/*
+    Transcendental function kernels.
+
+    fastmath.hpp includes this once per instruction set (and once for the
+    one lane scalar Vec), inside the namespace of that instruction set,
+    with Vec, Int and BATCH_TARGET defined. No include guard on purpose.
+
+    Every function has two polynomials: Fast = true is the reduced
+    precision one. The array kernels process the whole vectors and return
+    how many elements they did; the caller does the tail with the scalar
+    kernels.
+*/
+
+// NaN from the bits: an unordered compare is folded away by -ffast-math
+BATCH_TARGET inline Int isnan(Vec x)
+{
+    return cmpgt(as_int(x) & Int::set1(0x7fffffff), Int::set1(0x7f800000));
+}
+
+// sin(x) for quadrant = 0, cos(x) for quadrant = 1. The argument is
+// reduced to [-pi/4, pi/4] with a three part pi/2 (Cody-Waite); the
+// second part has 11 significant bits, so q * part is exact only while
+// q < 2^13 (|x| < ~12800); the documented range is |x| < 8192.
+// keep() stops the compiler from reassociating the parts.
+template <bool Fast>
+BATCH_TARGET inline Vec sincos_ps(Vec x, int32 quadrant)
+{
+    Int q = round_int(x * Vec::set1(0.636619772367581f));
+    Vec qf = to_float(q);
+
+    Vec r = keep(fmadd(qf, Vec::set1(-1.5703125f), x));
+    r = keep(fmadd(qf, Vec::set1(-4.837512969970703125e-4f), r));
+    r = fmadd(qf, Vec::set1(-7.54978995489188216e-8f), r);
+
+    Vec z = r * r;
+    Vec s;
+    Vec c;
+
+    if (Fast)
+    {
+        // Taylor: r - r^3 / 6 + r^5 / 120, 1 - z / 2 + z^2 / 24 - z^3 / 720
+        s = fmadd(fmadd(z, Vec::set1(1.0f / 120.0f), Vec::set1(-1.0f / 6.0f)) * z, r, r);
+        c = fmadd(fmadd(fmadd(z, Vec::set1(-1.0f / 720.0f), Vec::set1(1.0f / 24.0f)), z, Vec::set1(-0.5f)), z, Vec::set1(1.0f));
+    }
+    else
+    {
+        // cephes sinf / cosf
+        s = fmadd(z, Vec::set1(-1.9515295891e-4f), Vec::set1(8.3321608736e-3f));
+        s = fmadd(s, z, Vec::set1(-1.6666654611e-1f));
+        s = fmadd(s * z, r, r);
+
+        c = fmadd(z, Vec::set1(2.443315711809948e-5f), Vec::set1(-1.388731625493765e-3f));
+        c = fmadd(c, z, Vec::set1(4.166664568298827e-2f));
+        c = fmadd(c * z, z, fmadd(z, Vec::set1(-0.5f), Vec::set1(1.0f)));
+    }
+
+    // odd quadrants use the other polynomial, quadrants 2 and 3 are negated
+    q = q + Int::set1(quadrant);
+    Vec result = select(cmpeq(q & Int::set1(1), Int::set1(1)), c, s);
+    return as_float(as_int(result) ^ shl<30>(q & Int::set1(2)));
+}
+
+// cephes expf: x = n * ln2 + r, exp(x) = 2^n * exp(r)
+template <bool Fast>
+BATCH_TARGET inline Vec exp_ps(Vec x)
+{
+    const Vec hi = Vec::set1(88.72283935546875f);  // ln(FLT_MAX)
+    const Vec lo = Vec::set1(-87.33654475f);       // ln(FLT_MIN)
+
+    Vec xc = min(max(x, lo), hi);
+    Int n = round_int(xc * Vec::set1(1.44269504088896341f));
+    Vec nf = to_float(n);
+
+    Vec r = keep(fmadd(nf, Vec::set1(-0.693359375f), xc));
+    r = fmadd(nf, Vec::set1(2.12194440e-4f), r);
+
+    Vec p;
+
+    if (Fast)
+    {
+        p = fmadd(r, Vec::set1(1.0f / 24.0f), Vec::set1(1.0f / 6.0f));
+        p = fmadd(p, r, Vec::set1(0.5f));
+        p = fmadd(p, r, Vec::set1(1.0f));
+        p = fmadd(p, r, Vec::set1(1.0f));
+    }
+    else
+    {
+        p = fmadd(r, Vec::set1(1.9875691500e-4f), Vec::set1(1.3981999507e-3f));
+        p = fmadd(p, r, Vec::set1(8.3334519073e-3f));
+        p = fmadd(p, r, Vec::set1(4.1665795894e-2f));
+        p = fmadd(p, r, Vec::set1(1.6666665459e-1f));
+        p = fmadd(p, r, Vec::set1(5.0000001201e-1f));
+        p = fmadd(p * r, r, r + Vec::set1(1.0f));
+    }
+
+    // 2^n in two halves: n is in [-126, 128] and 2^128 is not a float
+    Int n1 = sra<1>(n);
+    Int n2 = n - n1;
+    p = p * as_float(shl<23>(n1 + Int::set1(127)));
+    p = p * as_float(shl<23>(n2 + Int::set1(127)));
+
+    p = select(cmplt(hi, x), Vec::set1(std::numeric_limits<float>::infinity()), p);
+    p = select(cmplt(x, lo), Vec::set1(0.0f), p);
+    return select(isnan(x), x, p);
+}
+
+// cephes logf: x = 2^e * m, m in [sqrt(0.5), sqrt(2)); denormals are not
+// normalized first
+template <bool Fast>
+BATCH_TARGET inline Vec log_ps(Vec x)
+{
+    Int i = as_int(x);
+    Int e = shr<23>(i) - Int::set1(126);
+    Vec m = as_float((i & Int::set1(0x007fffff)) | Int::set1(0x3f000000));
+
+    // m in [0.5, 1): below sqrt(0.5) use 2m and e - 1
+    Int small = cmplt(m, Vec::set1(0.707106781186547524f));
+    e = e - (small & Int::set1(1));
+    m = m + select(small, m, Vec::set1(0.0f)) - Vec::set1(1.0f);
+    Vec ef = to_float(e);
+
+    Vec y;
+
+    if (Fast)
+    {
+        // log(1 + m) = 2 atanh(s), s = m / (2 + m), |s| < 0.172
+        Vec s = m / (m + Vec::set1(2.0f));
+        Vec s2 = s * s;
+        y = fmadd(s2, Vec::set1(0.2f), Vec::set1(1.0f / 3.0f));
+        y = fmadd(y, s2, Vec::set1(1.0f));
+        y = y * (s + s);
+        y = fmadd(ef, Vec::set1(0.693147180559945f), y);
+    }
+    else
+    {
+        Vec z = m * m;
+        y = fmadd(m, Vec::set1(7.0376836292e-2f), Vec::set1(-1.1514610310e-1f));
+        y = fmadd(y, m, Vec::set1(1.1676998740e-1f));
+        y = fmadd(y, m, Vec::set1(-1.2420140846e-1f));
+        y = fmadd(y, m, Vec::set1(1.4249322787e-1f));
+        y = fmadd(y, m, Vec::set1(-1.6668057665e-1f));
+        y = fmadd(y, m, Vec::set1(2.0000714765e-1f));
+        y = fmadd(y, m, Vec::set1(-2.4999993993e-1f));
+        y = fmadd(y, m, Vec::set1(3.3333331174e-1f));
+        y = y * m * z;
+        y = fmadd(ef, Vec::set1(-2.12194440e-4f), y);
+        y = fmadd(z, Vec::set1(-0.5f), y);
+        y = m + y;
+        y = fmadd(ef, Vec::set1(0.693359375f), y);
+    }
+
+    const Vec inf = Vec::set1(std::numeric_limits<float>::infinity());
+    y = select(cmpeq(x, Vec::set1(0.0f)), Vec::set1(0.0f) - inf, y);
+    y = select(cmplt(x, Vec::set1(0.0f)), Vec::set1(std::numeric_limits<float>::quiet_NaN()), y);
+    y = select(cmpeq(x, inf), inf, y);
+    return select(isnan(x), x, y);
+}
+
+// hardware estimate (12 bits, 14 with AVX-512), one Newton-Raphson step
+// for the precise one
+template <bool Fast>
+BATCH_TARGET inline Vec rsqrt_ps(Vec x)
+{
+    Vec y = rsqrt(x);
+    if (Fast)
+        return y;
+
+    Vec nr = y * (Vec::set1(1.5f) - Vec::set1(0.5f) * x * y * y);
+
+    // the step turns the infinite estimate of 0 (and of the denormals
+    // where the estimate treats them as zero) and the 0 of inf into NaN
+    Int special = cmpeq(as_int(y) & Int::set1(0x7fffffff), Int::set1(0x7f800000)) |
+                  cmpeq(x, Vec::set1(std::numeric_limits<float>::infinity()));
+    return select(special, y, nr);
+}
+
+// -----------------------------------------------------------------
+// arrays
+// -----------------------------------------------------------------
+
+struct SinOp
+{
+    template <bool Fast>
+    BATCH_TARGET Vec apply(Vec x) const { return sincos_ps<Fast>(x, 0); }
+};
+
+struct CosOp
+{
+    template <bool Fast>
+    BATCH_TARGET Vec apply(Vec x) const { return sincos_ps<Fast>(x, 1); }
+};
+
+struct ExpOp
+{
+    template <bool Fast>
+    BATCH_TARGET Vec apply(Vec x) const { return exp_ps<Fast>(x); }
+};
+
+struct LogOp
+{
+    template <bool Fast>
+    BATCH_TARGET Vec apply(Vec x) const { return log_ps<Fast>(x); }
+};
+
+// x^y = exp(y * log(x)); the error grows with |y * log(x)|
+struct PowOp
+{
+    float y;
+
+    template <bool Fast>
+    BATCH_TARGET Vec apply(Vec x) const { return exp_ps<Fast>(Vec::set1(y) * log_ps<Fast>(x)); }
+};
+
+struct RsqrtOp
+{
+    template <bool Fast>
+    BATCH_TARGET Vec apply(Vec x) const { return rsqrt_ps<Fast>(x); }
+};
+
+template <bool Fast, typename Op>
+BATCH_TARGET inline size_t map_ps(float* dest, const float* source, size_t count, const Op& op)
+{
+    const size_t n = count & ~size_t(Vec::size - 1);
+
+    for (size_t i = 0; i < n; i += Vec::size)
+    {
+        store(dest + i, op.template apply<Fast>(Vec::load(source + i)));
+    }
+
+    return n;
+}
+
+template <typename Op>
+BATCH_TARGET inline size_t map_ps(float* dest, const float* source, size_t count, bool fast, const Op& op)
+{
+    return fast ? map_ps<true>(dest, source, count, op)
+                : map_ps<false>(dest, source, count, op);
+}
+
+BATCH_TARGET inline size_t sin(float* dest, const float* source, size_t count, bool fast)
+{
+    return map_ps(dest, source, count, fast, SinOp());
+}
+
+BATCH_TARGET inline size_t cos(float* dest, const float* source, size_t count, bool fast)
+{
+    return map_ps(dest, source, count, fast, CosOp());
+}
+
+BATCH_TARGET inline size_t exp(float* dest, const float* source, size_t count, bool fast)
+{
+    return map_ps(dest, source, count, fast, ExpOp());
+}
+
+BATCH_TARGET inline size_t log(float* dest, const float* source, size_t count, bool fast)
+{
+    return map_ps(dest, source, count, fast, LogOp());
+}
+
+BATCH_TARGET inline size_t pow(float* dest, const float* source, float y, size_t count, bool fast)
+{
+    return map_ps(dest, source, count, fast, PowOp { y });
+}
+
+BATCH_TARGET inline size_t rsqrt(float* dest, const float* source, size_t count, bool fast)
+{
+    return map_ps(dest, source, count, fast, RsqrtOp());
+}
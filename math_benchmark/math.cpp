@@ -0,0 +1,465 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#include <mango/mango.hpp>
+#include "batchmath.hpp"
+#include "fastmath.hpp"
+
+using namespace mango;
+using namespace mango::batch;
+
+// ----------------------------------------------------------------------
+// helpers
+// ----------------------------------------------------------------------
+
+namespace
+{
+
+    struct Random
+    {
+        uint32 seed = 1;
+
+        float operator () ()
+        {
+            seed = seed * 1664525 + 1013904223;
+            return float(seed >> 8) / float(1 << 23) - 1.0f;
+        }
+    };
+
+    std::vector<float3> getVectors(size_t count, uint32 seed)
+    {
+        Random random;
+        random.seed = seed;
+
+        std::vector<float3> vectors(count);
+        for (float3& v : vectors)
+        {
+            v = float3(random() * 10.0f, random() * 10.0f, random() * 10.0f + 20.0f);
+        }
+        return vectors;
+    }
+
+    float error(const std::vector<float3>& a, const Float3Array& b)
+    {
+        float e = 0.0f;
+        for (size_t i = 0; i < a.size(); ++i)
+        {
+            float3 v = b.get(i);
+            e = std::max(e, std::abs(a[i].x - v.x));
+            e = std::max(e, std::abs(a[i].y - v.y));
+            e = std::max(e, std::abs(a[i].z - v.z));
+        }
+        return e;
+    }
+
+    float error(const std::vector<float>& a, const std::vector<float>& b)
+    {
+        float e = 0.0f;
+        for (size_t i = 0; i < a.size(); ++i)
+        {
+            e = std::max(e, std::abs(a[i] - b[i]) / std::max(1.0f, std::abs(a[i])));
+        }
+        return e;
+    }
+
+    const ISA isas[] = { ISA::SCALAR, ISA::SSE2, ISA::AVX2, ISA::AVX512 };
+
+    // time "func" over "iterations" runs; returns million elements / second
+    template <typename Func>
+    double measure(size_t count, int iterations, Func func)
+    {
+        Timer timer;
+        uint64 time0 = timer.us();
+        for (int i = 0; i < iterations; ++i)
+        {
+            func();
+        }
+        uint64 time1 = timer.us();
+        return time1 > time0 ? double(count) * iterations / (time1 - time0) : 0.0;
+    }
+
+    /*
+        One row: the float3 loop, then the same operation over Float3Array
+        with each instruction set; "compute" runs the batch operation and
+        returns the largest difference to the float3 result.
+    */
+    template <typename Reference, typename Batch>
+    void row(const char* name, size_t count, int iterations, Reference reference, Batch compute)
+    {
+        printf("%-18s %9.1f", name, measure(count, iterations, reference));
+
+        float e = 0.0f;
+        for (ISA isa : isas)
+        {
+            if (!isSupported(isa))
+            {
+                printf("  %9s", "-");
+                continue;
+            }
+
+            setISA(isa);
+            e = std::max(e, compute());
+            printf("  %9.1f", measure(count, iterations, [&] { compute(); }));
+        }
+
+        printf("  %9.2e\n", e);
+    }
+
+} // namespace
+
+// ----------------------------------------------------------------------
+// test
+// ----------------------------------------------------------------------
+
+void test_batch(size_t count, int iterations)
+{
+    const ISA best = getISA();
+
+    std::vector<float3> a = getVectors(count, 1);
+    std::vector<float3> b = getVectors(count, 2);
+    std::vector<float3> result(count);
+    std::vector<float> scalars(count);
+
+    Float3Array sa(a.data(), count);
+    Float3Array sb(b.data(), count);
+    Float3Array sresult;
+    std::vector<float> sscalars(count);
+
+    float4x4 m;
+    m[0] = float4(0.8f, 0.6f, 0.0f, 0.0f);
+    m[1] = float4(-0.6f, 0.8f, 0.0f, 0.0f);
+    m[2] = float4(0.0f, 0.0f, 2.0f, 0.0f);
+    m[3] = float4(10.0f, -5.0f, 3.0f, 1.0f);
+
+    printf("\n%zu vectors%s\n\n", count, count > 128 * 1024 ? " (parallel)" : "");
+    printf("operation          float3 M/s");
+    for (ISA isa : isas)
+        printf("  %9s", getName(isa));
+    printf("  max error\n");
+
+    row("transform point", count, iterations, [&] {
+        for (size_t i = 0; i < count; ++i)
+        {
+            const float3& p = a[i];
+            float4 r = m[0] * p.x + m[1] * p.y + m[2] * p.z + m[3];
+            result[i] = float3(r.x, r.y, r.z);
+        }
+    }, [&] {
+        transform_points(sresult, sa, m);
+        return error(result, sresult);
+    });
+
+    row("transform vector", count, iterations, [&] {
+        for (size_t i = 0; i < count; ++i)
+        {
+            const float3& p = a[i];
+            float4 r = m[0] * p.x + m[1] * p.y + m[2] * p.z;
+            result[i] = float3(r.x, r.y, r.z);
+        }
+    }, [&] {
+        transform_vectors(sresult, sa, m);
+        return error(result, sresult);
+    });
+
+    row("normalize", count, iterations, [&] {
+        for (size_t i = 0; i < count; ++i)
+        {
+            result[i] = normalize(a[i]);
+        }
+    }, [&] {
+        normalize(sresult, sa);
+        return error(result, sresult);
+    });
+
+    row("dot", count, iterations, [&] {
+        for (size_t i = 0; i < count; ++i)
+        {
+            scalars[i] = dot(a[i], b[i]);
+        }
+    }, [&] {
+        dot(sscalars.data(), sa, sb);
+        return error(scalars, sscalars);
+    });
+
+    row("cross", count, iterations, [&] {
+        for (size_t i = 0; i < count; ++i)
+        {
+            result[i] = cross(a[i], b[i]);
+        }
+    }, [&] {
+        cross(sresult, sa, sb);
+        // relative to the magnitude of the inputs (up to ~30 * 30)
+        return error(result, sresult) / 1000.0f;
+    });
+
+    setISA(best);
+}
+
+/*
+    Triangle normals of a height field mesh: misc/math.cpp example5 for
+    every triangle of an index buffer.
+*/
+
+void test_normals(int size, int iterations)
+{
+    const ISA best = getISA();
+
+    std::vector<float3> vertices(size_t(size) * size);
+    Random random;
+    for (int y = 0; y < size; ++y)
+    {
+        for (int x = 0; x < size; ++x)
+        {
+            vertices[y * size + x] = float3(float(x), float(y), random() * 2.0f);
+        }
+    }
+
+    std::vector<uint32> indices;
+    indices.reserve(size_t(size - 1) * (size - 1) * 6);
+    for (int y = 0; y < size - 1; ++y)
+    {
+        for (int x = 0; x < size - 1; ++x)
+        {
+            uint32 i = y * size + x;
+            indices.insert(indices.end(), { i, i + 1, i + size });
+            indices.insert(indices.end(), { i + 1, i + size + 1, i + size });
+        }
+    }
+
+    const size_t count = indices.size() / 3;
+    std::vector<float3> result(count);
+    Float3Array svertices(vertices.data(), vertices.size());
+    Float3Array sresult;
+
+    row("triangle normals", count, iterations, [&] {
+        for (size_t i = 0; i < count; ++i)
+        {
+            float3 a = vertices[indices[i * 3 + 0]];
+            float3 b = vertices[indices[i * 3 + 1]];
+            float3 c = vertices[indices[i * 3 + 2]];
+            result[i] = normalize(cross(a - b, a - c));
+        }
+    }, [&] {
+        triangle_normals(sresult, svertices, indices.data(), count);
+        return error(result, sresult);
+    });
+
+    setISA(best);
+}
+
+// ----------------------------------------------------------------------
+// transcendentals
+// ----------------------------------------------------------------------
+
+/*
+    Accuracy and throughput of the batch sin / cos / exp / log / pow / rsqrt
+    against libm (the misc/math.cpp example4 scalar loop; whether it gets
+    vectorized depends on the compiler and the libm) and the mango float4
+    functions (misc/simd.cpp example3). The error is in float ulps of the
+    double precision result.
+*/
+
+namespace
+{
+
+    // the sampled ranges have a finite exact result; std::isnan() can't
+    // be trusted with -ffast-math so look at the exponent bits
+    double ulp_error(float value, double exact)
+    {
+        uint32 bits;
+        std::memcpy(&bits, &value, 4);
+        if ((bits & 0x7f800000) == 0x7f800000)
+            return 1e9;
+
+        int exponent;
+        std::frexp(exact, &exponent);
+        const double ulp = std::ldexp(1.0, std::max(exponent - 24, -149));
+        return std::abs(double(value) - exact) / ulp;
+    }
+
+    struct Function
+    {
+        const char* name;
+        float min;
+        float max;
+        bool logarithmic;   // sample the range log-uniformly
+        float y;            // exponent for pow
+
+        double (*exact)(double x, double y);
+        float (*libm)(float x, float y);
+        float4 (*vector)(float4 x, float y);
+        void (*batch)(float* dest, const float* source, float y, size_t count, Precision precision);
+    };
+
+    const Function functions[] =
+    {
+        { "sin", -3.14159f, 3.14159f, false, 0.0f,
+            [] (double x, double) { return std::sin(x); },
+            [] (float x, float) { return std::sin(x); },
+            [] (float4 x, float) { return sin(x); },
+            [] (float* d, const float* s, float, size_t n, Precision p) { batch::sin(d, s, n, p); } },
+        { "sin", -10000.0f, 10000.0f, false, 0.0f,
+            [] (double x, double) { return std::sin(x); },
+            [] (float x, float) { return std::sin(x); },
+            [] (float4 x, float) { return sin(x); },
+            [] (float* d, const float* s, float, size_t n, Precision p) { batch::sin(d, s, n, p); } },
+        { "cos", -3.14159f, 3.14159f, false, 0.0f,
+            [] (double x, double) { return std::cos(x); },
+            [] (float x, float) { return std::cos(x); },
+            [] (float4 x, float) { return cos(x); },
+            [] (float* d, const float* s, float, size_t n, Precision p) { batch::cos(d, s, n, p); } },
+        { "exp", -87.0f, 88.0f, false, 0.0f,
+            [] (double x, double) { return std::exp(x); },
+            [] (float x, float) { return std::exp(x); },
+            [] (float4 x, float) { return exp(x); },
+            [] (float* d, const float* s, float, size_t n, Precision p) { batch::exp(d, s, n, p); } },
+        { "log", 1e-30f, 1e30f, true, 0.0f,
+            [] (double x, double) { return std::log(x); },
+            [] (float x, float) { return std::log(x); },
+            [] (float4 x, float) { return log(x); },
+            [] (float* d, const float* s, float, size_t n, Precision p) { batch::log(d, s, n, p); } },
+        { "pow 2.4", 0.001f, 1.0f, true, 2.4f,
+            [] (double x, double y) { return std::pow(x, y); },
+            [] (float x, float y) { return std::pow(x, y); },
+            [] (float4 x, float y) { return pow(x, float4(y, y, y, y)); },
+            [] (float* d, const float* s, float y, size_t n, Precision p) { batch::pow(d, s, y, n, p); } },
+        { "pow 1/2.4", 0.001f, 1.0f, true, 1.0f / 2.4f,
+            [] (double x, double y) { return std::pow(x, y); },
+            [] (float x, float y) { return std::pow(x, y); },
+            [] (float4 x, float y) { return pow(x, float4(y, y, y, y)); },
+            [] (float* d, const float* s, float y, size_t n, Precision p) { batch::pow(d, s, y, n, p); } },
+        { "rsqrt", 1e-30f, 1e30f, true, 0.0f,
+            [] (double x, double) { return 1.0 / std::sqrt(x); },
+            [] (float x, float) { return 1.0f / std::sqrt(x); },
+            nullptr,
+            [] (float* d, const float* s, float, size_t n, Precision p) { batch::rsqrt(d, s, n, p); } },
+    };
+
+    void print_function(const char* name, double ulp, double throughput)
+    {
+        if (ulp < 1e8)
+            printf("  %-22s %12.1f %10.1f\n", name, ulp, throughput);
+        else
+            printf("  %-22s %12s %10.1f\n", name, "wrong", throughput);
+    }
+
+} // namespace
+
+void test_transcendental(size_t count, int iterations)
+{
+    const ISA best = getISA();
+
+    std::vector<float> source(count);
+    std::vector<float> dest(count);
+    std::vector<double> exact(count);
+
+    printf("\n%zu elements\n", count);
+
+    for (const Function& f : functions)
+    {
+        Random random;
+        for (float& x : source)
+        {
+            const float t = random() * 0.5f + 0.5f;
+            // in double: max / min overflows a float for the wide ranges
+            x = f.logarithmic ? float(f.min * std::pow(double(f.max) / f.min, double(t)))
+                              : f.min + (f.max - f.min) * t;
+        }
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            exact[i] = f.exact(source[i], f.y);
+        }
+
+        auto error = [&] {
+            double e = 0.0;
+            for (size_t i = 0; i < count; ++i)
+                e = std::max(e, ulp_error(dest[i], exact[i]));
+            return e;
+        };
+
+        printf("\n%s [%g, %g]\n", f.name, f.min, f.max);
+        printf("  implementation              max ulp     M/s\n");
+
+        // libm
+        double throughput = measure(count, iterations, [&] {
+            for (size_t i = 0; i < count; ++i)
+                dest[i] = f.libm(source[i], f.y);
+        });
+        print_function("libm", error(), throughput);
+
+        // mango float4
+        if (f.vector)
+        {
+            throughput = measure(count, iterations, [&] {
+                for (size_t i = 0; i + 4 <= count; i += 4)
+                {
+                    float4 v = f.vector(float4(source[i + 0], source[i + 1], source[i + 2], source[i + 3]), f.y);
+                    dest[i + 0] = v[0];
+                    dest[i + 1] = v[1];
+                    dest[i + 2] = v[2];
+                    dest[i + 3] = v[3];
+                }
+            });
+            // the loop leaves the last count % 4 elements; count is a multiple of 4
+            print_function("float4", error(), throughput);
+        }
+
+        for (Precision precision : { Precision::PRECISE, Precision::FAST })
+        {
+            for (ISA isa : isas)
+            {
+                if (!isSupported(isa))
+                    continue;
+
+                setISA(isa);
+                throughput = measure(count, iterations, [&] {
+                    f.batch(dest.data(), source.data(), f.y, count, precision);
+                });
+
+                char name[64];
+                std::snprintf(name, sizeof(name), "%s %s", getName(isa),
+                    precision == Precision::FAST ? "fast" : "precise");
+                print_function(name, error(), throughput);
+            }
+        }
+    }
+
+    setISA(best);
+}
+
+// ----------------------------------------------------------------------
+// main()
+// ----------------------------------------------------------------------
+
+int main(int argc, const char* argv[])
+{
+    bool vectors = true;
+    bool transcendental = true;
+
+    if (argc > 1)
+    {
+        vectors = !std::strcmp(argv[1], "--vectors");
+        transcendental = !std::strcmp(argv[1], "--transcendental");
+    }
+
+    printf("instruction set: %s\n", getName(getISA()));
+
+    if (vectors)
+    {
+        // single thread: below the parallel threshold
+        test_batch(64 * 1024 + 3, 64);
+        test_normals(181, 64);
+
+        // large arrays: in chunks in the ThreadPool
+        test_batch(8 * 1024 * 1024, 2);
+        test_normals(2048, 2);
+    }
+
+    if (transcendental)
+    {
+        // single thread, so that M/s is per core
+        test_transcendental(128 * 1024, 16);
+    }
+}
@@ -0,0 +1,543 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <mango/mango.hpp>
+#include <atomic>
+#include <mutex>
+#include <cstdlib>
+
+/*
+    Arena and pool allocators which hand out Memory.
+
+    misc/memory.cpp: Memory does not own what it points to. That is exactly
+    what scratch space wants; the owner is an allocator with a lifetime the
+    caller controls, instead of a heap allocation (and a shared_ptr control
+    block for SharedMemory) per buffer.
+
+    Arena        bump allocator over large chunks. Nothing is freed
+                 individually; reset() or a Marker rewinds it. Use it for
+                 scratch that dies together: a frame, a decoded batch.
+    getThreadArena()
+                 one Arena per thread; FrameScope rewinds it at the end of
+                 a scope so that nested users share it.
+    Pool         size classes of power of two blocks with a free list per
+                 class. Blocks are freed individually, from any thread. The
+                 process-wide Pool::instance() also has a small per-thread
+                 cache (up to 256 KB per class) in front of the free lists;
+                 it is never destroyed so the caches can be flushed into it
+                 when the threads exit.
+    PooledMemory reference counted block from a Pool with the interface of
+                 SharedMemory (converts to Memory, copyable, the last copy
+                 releases). SharedMemory itself always deletes[] its
+                 pointer so it can't be given a pool block; use this where
+                 the lifetime crosses threads.
+
+    The allocators count what they do; see Statistics.
+*/
+
+namespace mango
+{
+
+    struct AllocatorStatistics
+    {
+        std::atomic<uint64> allocations { 0 };
+        std::atomic<uint64> system_allocations { 0 }; // malloc calls made
+        std::atomic<uint64> system_bytes { 0 };
+        std::atomic<uint64> resets { 0 };
+    };
+
+    // -----------------------------------------------------------------
+    // Arena
+    // -----------------------------------------------------------------
+
+    class Arena
+    {
+    protected:
+        struct Chunk
+        {
+            uint8* address;
+            size_t size;
+        };
+
+        std::vector<Chunk> m_chunks;
+        size_t m_chunk_size;
+        size_t m_current;   // chunk index
+        size_t m_offset;    // within the current chunk
+        AllocatorStatistics m_stats;
+
+        void grow(size_t size, size_t alignment)
+        {
+            // reuse the chunks left behind by a reset before allocating more
+            while (++m_current < m_chunks.size())
+            {
+                if (m_chunks[m_current].size >= size + alignment)
+                {
+                    m_offset = 0;
+                    return;
+                }
+            }
+
+            Chunk chunk;
+            chunk.size = std::max(m_chunk_size, size + alignment);
+            chunk.address = reinterpret_cast<uint8*>(std::malloc(chunk.size));
+            if (!chunk.address)
+            {
+                MANGO_EXCEPTION("Arena: out of memory.");
+            }
+
+            ++m_stats.system_allocations;
+            m_stats.system_bytes += chunk.size;
+
+            m_chunks.push_back(chunk);
+            m_current = m_chunks.size() - 1;
+            m_offset = 0;
+        }
+
+    public:
+        struct Marker
+        {
+            size_t chunk;
+            size_t offset;
+        };
+
+        Arena(size_t chunk_size = 1024 * 1024)
+            : m_chunk_size(chunk_size)
+            , m_current(0)
+            , m_offset(0)
+        {
+        }
+
+        ~Arena()
+        {
+            for (Chunk& chunk : m_chunks)
+            {
+                std::free(chunk.address);
+            }
+        }
+
+        Arena(const Arena&) = delete;
+        Arena& operator = (const Arena&) = delete;
+
+        Memory allocate(size_t size, size_t alignment = 16)
+        {
+            ++m_stats.allocations;
+
+            if (m_chunks.empty())
+            {
+                m_current = size_t(-1);
+                grow(size, alignment);
+            }
+
+            Chunk* chunk = &m_chunks[m_current];
+            uintptr_t base = uintptr_t(chunk->address);
+            uintptr_t aligned = (base + m_offset + alignment - 1) & ~uintptr_t(alignment - 1);
+
+            if (aligned + size > base + chunk->size)
+            {
+                grow(size, alignment);
+                chunk = &m_chunks[m_current];
+                base = uintptr_t(chunk->address);
+                aligned = (base + alignment - 1) & ~uintptr_t(alignment - 1);
+            }
+
+            m_offset = size_t(aligned + size - base);
+            return Memory(reinterpret_cast<uint8*>(aligned), size);
+        }
+
+        template <typename T>
+        T* allocate_array(size_t count)
+        {
+            Memory memory = allocate(count * sizeof(T), std::max<size_t>(16, alignof(T)));
+            return reinterpret_cast<T*>(memory.address);
+        }
+
+        Marker mark() const
+        {
+            return Marker { m_current, m_offset };
+        }
+
+        // release everything allocated after the marker
+        void rewind(const Marker& marker)
+        {
+            m_current = marker.chunk;
+            m_offset = marker.offset;
+        }
+
+        // release everything; the chunks are kept for the next frame
+        void reset()
+        {
+            m_current = 0;
+            m_offset = 0;
+            ++m_stats.resets;
+        }
+
+        size_t capacity() const
+        {
+            size_t size = 0;
+            for (const Chunk& chunk : m_chunks)
+                size += chunk.size;
+            return size;
+        }
+
+        const AllocatorStatistics& statistics() const
+        {
+            return m_stats;
+        }
+    };
+
+    inline Arena& getThreadArena()
+    {
+        thread_local Arena arena(4 * 1024 * 1024);
+        return arena;
+    }
+
+    // rewinds the thread arena to where it was when the scope was entered
+    class FrameScope
+    {
+    protected:
+        Arena& m_arena;
+        Arena::Marker m_marker;
+
+    public:
+        FrameScope(Arena& arena = getThreadArena())
+            : m_arena(arena)
+            , m_marker(arena.mark())
+        {
+        }
+
+        ~FrameScope()
+        {
+            m_arena.rewind(m_marker);
+        }
+
+        Arena& arena() const
+        {
+            return m_arena;
+        }
+    };
+
+    // -----------------------------------------------------------------
+    // Pool
+    // -----------------------------------------------------------------
+
+    class Pool
+    {
+    public:
+        static constexpr int min_class = 6;     // 64 bytes
+        static constexpr int max_class = 26;    // 64 MB
+        static constexpr int class_count = max_class - min_class + 1;
+        static constexpr size_t alignment = 64;
+
+    protected:
+        struct Block
+        {
+            Block* next;
+        };
+
+        struct FreeList
+        {
+            std::mutex mutex;
+            Block* head = nullptr;
+            size_t count = 0;
+        };
+
+        // per-thread cache in front of the shared free lists; at most 32
+        // blocks and 256 KB per class, so the large classes are not cached
+        struct ThreadCache
+        {
+            static constexpr size_t max_blocks = 32;
+            static constexpr size_t max_bytes = 256 * 1024;
+
+            static size_t capacity(int index)
+            {
+                return std::min(max_blocks, max_bytes >> (index + min_class));
+            }
+
+            Pool* pool = nullptr;
+            Block* head[class_count] = { };
+            size_t count[class_count] = { };
+
+            ~ThreadCache()
+            {
+                if (pool)
+                    pool->flush(*this);
+            }
+        };
+
+        FreeList m_lists[class_count];
+        size_t m_retain; // bytes per class kept in the shared free lists
+        bool m_thread_cache;
+        AllocatorStatistics m_stats;
+
+        static int getClass(size_t size)
+        {
+            int c = min_class;
+            while ((size_t(1) << c) < size)
+                ++c;
+            return c;
+        }
+
+        ThreadCache* getCache()
+        {
+            if (!m_thread_cache)
+                return nullptr;
+
+            thread_local ThreadCache cache;
+            cache.pool = this;
+            return &cache;
+        }
+
+        void flush(ThreadCache& cache)
+        {
+            for (int i = 0; i < class_count; ++i)
+            {
+                while (Block* block = cache.head[i])
+                {
+                    cache.head[i] = block->next;
+                    release(block, i);
+                }
+                cache.count[i] = 0;
+            }
+        }
+
+        void release(Block* block, int index)
+        {
+            FreeList& list = m_lists[index];
+            const size_t size = size_t(1) << (index + min_class);
+
+            std::unique_lock<std::mutex> lock(list.mutex);
+            if (list.count * size < m_retain)
+            {
+                block->next = list.head;
+                list.head = block;
+                ++list.count;
+            }
+            else
+            {
+                lock.unlock();
+                std::free(block);
+            }
+        }
+
+    public:
+        Pool(size_t retain = 64 * 1024 * 1024)
+            : m_retain(retain)
+            , m_thread_cache(false)
+        {
+        }
+
+        ~Pool()
+        {
+            for (FreeList& list : m_lists)
+            {
+                while (Block* block = list.head)
+                {
+                    list.head = block->next;
+                    std::free(block);
+                }
+            }
+        }
+
+        Pool(const Pool&) = delete;
+        Pool& operator = (const Pool&) = delete;
+
+        static Pool& instance()
+        {
+            static Pool* pool = [] {
+                Pool* pool = new Pool();
+                pool->m_thread_cache = true;
+                return pool;
+            } ();
+            return *pool;
+        }
+
+        // the returned Memory is the requested size; the block is rounded
+        // up to the size class
+        Memory allocate(size_t size)
+        {
+            ++m_stats.allocations;
+
+            const int c = getClass(std::max<size_t>(size, sizeof(Block)));
+            if (c > max_class)
+            {
+                MANGO_EXCEPTION("Pool: allocation too large.");
+            }
+
+            const int index = c - min_class;
+            Block* block = nullptr;
+
+            if (ThreadCache* cache = getCache())
+            {
+                block = cache->head[index];
+                if (block)
+                {
+                    cache->head[index] = block->next;
+                    --cache->count[index];
+                }
+            }
+
+            if (!block)
+            {
+                FreeList& list = m_lists[index];
+                std::lock_guard<std::mutex> lock(list.mutex);
+                block = list.head;
+                if (block)
+                {
+                    list.head = block->next;
+                    --list.count;
+                }
+            }
+
+            if (!block)
+            {
+                const size_t bytes = size_t(1) << c;
+                void* address = nullptr;
+                if (::posix_memalign(&address, alignment, bytes))
+                {
+                    MANGO_EXCEPTION("Pool: out of memory.");
+                }
+
+                block = reinterpret_cast<Block*>(address);
+                ++m_stats.system_allocations;
+                m_stats.system_bytes += bytes;
+            }
+
+            return Memory(reinterpret_cast<uint8*>(block), size);
+        }
+
+        // free a block from allocate(); any thread
+        void free(Memory memory)
+        {
+            if (!memory.address)
+                return;
+
+            const int index = getClass(std::max<size_t>(memory.size, sizeof(Block))) - min_class;
+            Block* block = reinterpret_cast<Block*>(memory.address);
+
+            if (ThreadCache* cache = getCache())
+            {
+                if (cache->count[index] < ThreadCache::capacity(index))
+                {
+                    block->next = cache->head[index];
+                    cache->head[index] = block;
+                    ++cache->count[index];
+                    return;
+                }
+            }
+
+            release(block, index);
+        }
+
+        const AllocatorStatistics& statistics() const
+        {
+            return m_stats;
+        }
+    };
+
+    // -----------------------------------------------------------------
+    // PooledMemory
+    // -----------------------------------------------------------------
+
+    class PooledMemory
+    {
+    protected:
+        struct Header
+        {
+            std::atomic<int> references;
+            Pool* pool;
+            size_t size;
+        };
+
+        static constexpr size_t header_size = Pool::alignment;
+
+        Header* m_header;
+
+        void release()
+        {
+            if (m_header && --m_header->references == 0)
+            {
+                Pool* pool = m_header->pool;
+                const size_t size = m_header->size;
+                m_header->~Header();
+                pool->free(Memory(reinterpret_cast<uint8*>(m_header), header_size + size));
+            }
+            m_header = nullptr;
+        }
+
+    public:
+        PooledMemory()
+            : m_header(nullptr)
+        {
+        }
+
+        explicit PooledMemory(size_t size, Pool& pool = Pool::instance())
+        {
+            static_assert(sizeof(Header) <= header_size, "Header does not fit.");
+
+            Memory memory = pool.allocate(header_size + size);
+            m_header = new (memory.address) Header();
+            m_header->references = 1;
+            m_header->pool = &pool;
+            m_header->size = size;
+        }
+
+        PooledMemory(const PooledMemory& other)
+            : m_header(other.m_header)
+        {
+            if (m_header)
+                ++m_header->references;
+        }
+
+        PooledMemory(PooledMemory&& other)
+            : m_header(other.m_header)
+        {
+            other.m_header = nullptr;
+        }
+
+        ~PooledMemory()
+        {
+            release();
+        }
+
+        PooledMemory& operator = (const PooledMemory& other)
+        {
+            if (other.m_header)
+                ++other.m_header->references;
+            release();
+            m_header = other.m_header;
+            return *this;
+        }
+
+        PooledMemory& operator = (PooledMemory&& other)
+        {
+            if (this != &other)
+            {
+                release();
+                m_header = other.m_header;
+                other.m_header = nullptr;
+            }
+            return *this;
+        }
+
+        operator Memory () const
+        {
+            if (!m_header)
+                return Memory();
+            return Memory(reinterpret_cast<uint8*>(m_header) + header_size, m_header->size);
+        }
+
+        uint8* data() const
+        {
+            return m_header ? reinterpret_cast<uint8*>(m_header) + header_size : nullptr;
+        }
+
+        size_t size() const
+        {
+            return m_header ? m_header->size : 0;
+        }
+    };
+
+} // namespace mango
@@ -0,0 +1,352 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#include <mango/mango.hpp>
+#include "arena.hpp"
+
+using namespace mango;
+
+// ----------------------------------------------------------------------
+// helpers
+// ----------------------------------------------------------------------
+
+namespace
+{
+
+    // allocation sizes of a "frame": mostly small with some large buffers
+    std::vector<size_t> getSizes(size_t count)
+    {
+        std::vector<size_t> sizes(count);
+        uint32 seed = 1;
+        for (size_t& size : sizes)
+        {
+            seed = seed * 1664525 + 1013904223;
+            const uint32 r = seed >> 8;
+            size = (r & 15) ? 64 + (r % 4096) : 64 * 1024 + (r % (256 * 1024));
+        }
+        return sizes;
+    }
+
+    void print(const char* name, size_t allocations, uint64 system, uint64 us)
+    {
+        printf("%-24s %10.1f  %14llu\n", name,
+            us ? allocations / double(us) : 0.0,
+            (unsigned long long)system);
+    }
+
+    // write the first and the last byte like a user of the scratch would
+    inline uint32 use(Memory memory)
+    {
+        memory.address[0] = uint8(memory.size);
+        memory.address[memory.size - 1] = uint8(memory.size >> 8);
+        return memory.address[0];
+    }
+
+} // namespace
+
+// ----------------------------------------------------------------------
+// allocation throughput
+// ----------------------------------------------------------------------
+
+/*
+    Every frame allocates "count" buffers which all die at the end of the
+    frame. The malloc and SharedMemory rows are the current practice.
+*/
+
+void test_allocation(int frames, size_t count)
+{
+    const std::vector<size_t> sizes = getSizes(count);
+    const size_t allocations = frames * count;
+
+    printf("allocation: %d frames x %zu buffers\n\n", frames, count);
+    printf("allocator                 Mallocs/s   system allocs\n");
+
+    Timer timer;
+    uint32 sum = 0;
+    std::vector<Memory> live(count);
+
+    // malloc / free
+    {
+        uint64 time0 = timer.us();
+        for (int f = 0; f < frames; ++f)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                live[i] = Memory(reinterpret_cast<uint8*>(std::malloc(sizes[i])), sizes[i]);
+                sum += use(live[i]);
+            }
+            for (size_t i = 0; i < count; ++i)
+            {
+                std::free(live[i].address);
+            }
+        }
+        print("malloc", allocations, allocations, timer.us() - time0);
+    }
+
+    // SharedMemory: allocation + control block
+    {
+        std::vector<SharedMemory> shared(count);
+        uint64 time0 = timer.us();
+        for (int f = 0; f < frames; ++f)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                shared[i] = SharedMemory(sizes[i]);
+                sum += use(shared[i]);
+            }
+            for (size_t i = 0; i < count; ++i)
+            {
+                shared[i] = SharedMemory();
+            }
+        }
+        print("SharedMemory", allocations, allocations * 2, timer.us() - time0);
+    }
+
+    // Arena with a reset per frame
+    {
+        Arena arena;
+        uint64 time0 = timer.us();
+        for (int f = 0; f < frames; ++f)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                sum += use(arena.allocate(sizes[i]));
+            }
+            arena.reset();
+        }
+        print("Arena", allocations, arena.statistics().system_allocations, timer.us() - time0);
+    }
+
+    // Pool with individual frees
+    {
+        Pool& pool = Pool::instance();
+        const uint64 system0 = pool.statistics().system_allocations;
+
+        uint64 time0 = timer.us();
+        for (int f = 0; f < frames; ++f)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                live[i] = pool.allocate(sizes[i]);
+                sum += use(live[i]);
+            }
+            for (size_t i = 0; i < count; ++i)
+            {
+                pool.free(live[i]);
+            }
+        }
+        print("Pool", allocations, pool.statistics().system_allocations - system0, timer.us() - time0);
+    }
+
+    // PooledMemory: the SharedMemory replacement
+    {
+        Pool& pool = Pool::instance();
+        const uint64 system0 = pool.statistics().system_allocations;
+
+        std::vector<PooledMemory> shared(count);
+        uint64 time0 = timer.us();
+        for (int f = 0; f < frames; ++f)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                shared[i] = PooledMemory(sizes[i]);
+                sum += use(shared[i]);
+            }
+            for (size_t i = 0; i < count; ++i)
+            {
+                shared[i] = PooledMemory();
+            }
+        }
+        print("PooledMemory", allocations, pool.statistics().system_allocations - system0, timer.us() - time0);
+    }
+
+    // the same from every worker at once; each task is a frame
+    {
+        const int threads = ThreadPool::getHardwareConcurrency();
+        std::atomic<uint32> total { 0 };
+
+        uint64 time0 = timer.us();
+        ConcurrentQueue q("malloc");
+        for (int f = 0; f < frames * threads; ++f)
+        {
+            q.enqueue([&] {
+                std::vector<uint8*> buffers(count);
+                uint32 s = 0;
+                for (size_t i = 0; i < count; ++i)
+                {
+                    buffers[i] = reinterpret_cast<uint8*>(std::malloc(sizes[i]));
+                    s += use(Memory(buffers[i], sizes[i]));
+                }
+                for (uint8* buffer : buffers)
+                    std::free(buffer);
+                total += s;
+            });
+        }
+        q.wait();
+        print("malloc (parallel)", allocations * threads, allocations * threads, timer.us() - time0);
+
+        time0 = timer.us();
+        ConcurrentQueue q2("arena");
+        for (int f = 0; f < frames * threads; ++f)
+        {
+            q2.enqueue([&] {
+                FrameScope frame;
+                uint32 s = 0;
+                for (size_t i = 0; i < count; ++i)
+                {
+                    s += use(frame.arena().allocate(sizes[i]));
+                }
+                total += s;
+            });
+        }
+        q2.wait();
+        // the worker arenas allocate their chunks on the first frames and
+        // reuse them after that; the count is per thread and not summed here
+        uint64 time1 = timer.us();
+        printf("%-24s %10.1f  %14s\n", "thread Arena (parallel)",
+            time1 > time0 ? allocations * threads / double(time1 - time0) : 0.0, "-");
+
+        sum += total;
+    }
+
+    printf("checksum: %u\n", sum);
+}
+
+// ----------------------------------------------------------------------
+// lz4 scratch
+// ----------------------------------------------------------------------
+
+/*
+    Compress a buffer in 64 KB blocks; each call needs a bound() sized
+    destination. The reference allocates a Buffer per call.
+*/
+
+void test_lz4(Memory source)
+{
+    const size_t block_size = 64 * 1024;
+    const size_t blocks = source.size / block_size;
+
+    Timer timer;
+    size_t compressed0 = 0;
+    size_t compressed1 = 0;
+
+    uint64 time0 = timer.us();
+    for (size_t i = 0; i < blocks; ++i)
+    {
+        Buffer buffer(lz4::bound(block_size));
+        compressed0 += lz4::compress(buffer, source.slice(i * block_size, block_size), 1);
+    }
+    uint64 time1 = timer.us();
+    for (size_t i = 0; i < blocks; ++i)
+    {
+        FrameScope frame;
+        Memory scratch = frame.arena().allocate(lz4::bound(block_size));
+        compressed1 += lz4::compress(scratch, source.slice(i * block_size, block_size), 1);
+    }
+    uint64 time2 = timer.us();
+
+    printf("\nlz4: %zu blocks, Buffer %.1f us / block, Arena %.1f us / block %s\n",
+        blocks,
+        double(time1 - time0) / std::max<size_t>(1, blocks),
+        double(time2 - time1) / std::max<size_t>(1, blocks),
+        compressed0 == compressed1 ? "" : "(MISMATCH)");
+}
+
+// ----------------------------------------------------------------------
+// image decoding
+// ----------------------------------------------------------------------
+
+/*
+    Decode a folder of images into scratch surfaces (misc/image_loading.cpp
+    example5) with the target memory from a vector, from the thread Arena
+    and from the Pool. The decoded images are "consumed" and thrown away.
+*/
+
+void test_decode(const std::string& folder)
+{
+    Path path(folder);
+
+    std::vector<std::string> filenames;
+    for (size_t i = 0; i < path.size(); ++i)
+    {
+        if (!path[i].isDirectory())
+            filenames.push_back(path[i].name);
+    }
+
+    printf("\ndecode: %zu files\n", filenames.size());
+
+    for (int mode = 0; mode < 3; ++mode)
+    {
+        static const char* names[] = { "vector", "thread Arena", "PooledMemory" };
+
+        std::atomic<uint64> pixels { 0 };
+        Timer timer;
+        uint64 time0 = timer.us();
+
+        ConcurrentQueue q("decode");
+        for (const auto& filename : filenames)
+        {
+            q.enqueue([&, filename, mode] {
+                File file(path, filename);
+                ImageDecoder decoder(file, filename);
+                if (!decoder.isDecoder())
+                    return;
+
+                ImageHeader header = decoder.header();
+                const int stride = header.width * header.format.bytes();
+                const size_t bytes = size_t(header.height) * stride;
+
+                FrameScope frame;
+                std::vector<uint8> vector;
+                PooledMemory pooled;
+                uint8* image = nullptr;
+
+                switch (mode)
+                {
+                    case 0:
+                        vector.resize(bytes);
+                        image = vector.data();
+                        break;
+                    case 1:
+                        image = frame.arena().allocate(bytes).address;
+                        break;
+                    case 2:
+                        pooled = PooledMemory(bytes);
+                        image = pooled.data();
+                        break;
+                }
+
+                Surface surface(header.width, header.height, header.format, stride, image);
+                decoder.decode(surface, 0, 0, 0);
+                pixels += uint64(header.width) * header.height;
+            });
+        }
+        q.wait();
+
+        uint64 time1 = timer.us();
+        printf("%-14s %8.1f ms  %8.1f MP/s\n", names[mode], (time1 - time0) / 1000.0,
+            time1 > time0 ? double(pixels) / (time1 - time0) : 0.0);
+    }
+}
+
+// ----------------------------------------------------------------------
+// main()
+// ----------------------------------------------------------------------
+
+int main(int argc, const char* argv[])
+{
+    test_allocation(1000, 1000);
+
+    std::vector<uint8> source(64 * 1024 * 1024);
+    for (size_t i = 0; i < source.size(); ++i)
+    {
+        source[i] = uint8((i * 7) ^ (i >> 9));
+    }
+    test_lz4(Memory(source.data(), source.size()));
+
+    if (argc > 1)
+    {
+        test_decode(argv[1]);
+    }
+}
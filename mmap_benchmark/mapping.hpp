@@ -0,0 +1,287 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <mango/mango.hpp>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+    Access pattern hints for memory mapped files.
+
+    File maps everything and leaves the paging to the kernel, which guesses
+    the access pattern from the faults. The default readahead window is
+    small for a decoder that streams through a whole file, and too large
+    for a container where a few entries are picked out of a big archive.
+
+    advise() gives the kernel the pattern for any Memory view: a File, an
+    entry inside a container (the range is within the container mapping)
+    or a part of either. prefetch() starts reading a range in the
+    background and returns right away.
+
+    MappedFile is a native file mapping with a few more controls that File
+    does not have: MAP_POPULATE, and dropping the file from the page cache
+    (used for the cold-cache benchmark). DONTNEED is only available there:
+    madvise(MADV_DONTNEED) on a decompressed entry, which is anonymous
+    memory, would throw the contents away.
+*/
+
+namespace mango
+{
+
+    enum class Access
+    {
+        NORMAL,
+        SEQUENTIAL,  // aggressive readahead, pages behind are dropped early
+        RANDOM,      // no readahead
+        WILLNEED,    // start reading the range now
+    };
+
+    namespace detail
+    {
+
+        // madvise needs page aligned addresses; round the range outwards
+        inline bool getPageRange(Memory memory, void*& address, size_t& size)
+        {
+            static const uintptr_t page = uintptr_t(::sysconf(_SC_PAGESIZE));
+
+            if (!memory.address || !memory.size)
+                return false;
+
+            uintptr_t begin = uintptr_t(memory.address) & ~(page - 1);
+            uintptr_t end = (uintptr_t(memory.address) + memory.size + page - 1) & ~(page - 1);
+            address = reinterpret_cast<void*>(begin);
+            size = size_t(end - begin);
+            return true;
+        }
+
+        inline int getAdvice(Access access)
+        {
+            switch (access)
+            {
+                case Access::SEQUENTIAL: return MADV_SEQUENTIAL;
+                case Access::RANDOM:     return MADV_RANDOM;
+                case Access::WILLNEED:   return MADV_WILLNEED;
+                default:                 return MADV_NORMAL;
+            }
+        }
+
+    } // namespace detail
+
+    // the hint is advisory; a failure is not an error
+    inline bool advise(Memory memory, Access access)
+    {
+        void* address;
+        size_t size;
+        if (!detail::getPageRange(memory, address, size))
+            return false;
+
+        return ::madvise(address, size, detail::getAdvice(access)) == 0;
+    }
+
+    /*
+        Default hint for a file by its extension: image and stream formats are
+        decoded front to back, containers are read where the entries are.
+    */
+    inline Access getDefaultAccess(const std::string& filename)
+    {
+        static const char* sequential[] = { ".jpg", ".jpeg", ".png", ".tga", ".bmp", ".gif", ".hdr", ".ml4s" };
+        static const char* random[] = { ".zip", ".rar", ".ml4f", ".dds", ".ktx", ".pvr" };
+
+        std::string extension = toLower(getExtension(filename));
+
+        for (const char* e : sequential)
+        {
+            if (extension == e)
+                return Access::SEQUENTIAL;
+        }
+
+        for (const char* e : random)
+        {
+            if (extension == e)
+                return Access::RANDOM;
+        }
+
+        return Access::NORMAL;
+    }
+
+    /*
+        Apply the default hint to a File before handing it to a decoder:
+
+            File file(path, "image.jpg");
+            advise(file);
+            Bitmap bitmap(file, file.filename());
+
+        Decompressed container entries are not file backed; the hint does
+        nothing for them and is harmless.
+    */
+    inline bool advise(const File& file)
+    {
+        return advise(Memory(file), getDefaultAccess(file.filename()));
+    }
+
+    // -----------------------------------------------------------------
+    // prefetch
+    // -----------------------------------------------------------------
+
+    /*
+        MADV_WILLNEED starts readahead and returns, but the kernel caps the
+        amount it will queue and it does nothing for memory that is not file
+        backed. touch() faults the range in one page at a time; run it in a
+        queue to have the range resident before the consumer gets there.
+    */
+
+    inline void prefetch(Memory memory)
+    {
+        advise(memory, Access::WILLNEED);
+    }
+
+    inline uint32 touch(Memory memory)
+    {
+        static const size_t page = size_t(::sysconf(_SC_PAGESIZE));
+
+        uint32 sum = 0;
+        for (size_t i = 0; i < memory.size; i += page)
+        {
+            sum += memory.address[i];
+        }
+        return sum;
+    }
+
+    // the task keeps only the view: wait() on the queue before the File or
+    // mapping that owns the memory goes away
+    template <typename Queue>
+    void prefetch(Queue& queue, Memory memory)
+    {
+        prefetch(memory);
+        queue.enqueue([memory] {
+            volatile uint32 sum = touch(memory);
+            (void) sum;
+        });
+    }
+
+    // -----------------------------------------------------------------
+    // MappedFile
+    // -----------------------------------------------------------------
+
+    class MappedFile
+    {
+    protected:
+        int m_file;
+        uint8* m_address;
+        size_t m_size;
+
+    public:
+        enum Flags : uint32
+        {
+            POPULATE = 1, // fault the whole file in at map time
+        };
+
+        MappedFile(const std::string& filename, Access access = Access::NORMAL, uint32 flags = 0)
+            : m_file(-1)
+            , m_address(nullptr)
+            , m_size(0)
+        {
+            m_file = ::open(filename.c_str(), O_RDONLY);
+            if (m_file < 0)
+            {
+                MANGO_EXCEPTION("MappedFile: cannot open \"" + filename + "\".");
+            }
+
+            struct stat s;
+            if (::fstat(m_file, &s) < 0)
+            {
+                ::close(m_file);
+                MANGO_EXCEPTION("MappedFile: cannot stat \"" + filename + "\".");
+            }
+
+            m_size = size_t(s.st_size);
+            if (m_size)
+            {
+                int mmap_flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+                if (flags & POPULATE)
+                    mmap_flags |= MAP_POPULATE;
+#endif
+
+                void* address = ::mmap(nullptr, m_size, PROT_READ, mmap_flags, m_file, 0);
+                if (address == MAP_FAILED)
+                {
+                    ::close(m_file);
+                    MANGO_EXCEPTION("MappedFile: cannot map \"" + filename + "\".");
+                }
+
+                m_address = reinterpret_cast<uint8*>(address);
+                advise(access);
+            }
+        }
+
+        ~MappedFile()
+        {
+            if (m_address)
+            {
+                ::munmap(m_address, m_size);
+            }
+
+            ::close(m_file);
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator = (const MappedFile&) = delete;
+
+        operator Memory () const
+        {
+            return Memory(m_address, m_size);
+        }
+
+        const uint8* data() const
+        {
+            return m_address;
+        }
+
+        size_t size() const
+        {
+            return m_size;
+        }
+
+        bool advise(Access access)
+        {
+            bool status = mango::advise(*this, access);
+
+            // the page cache readahead follows the file, not the mapping
+            if (access == Access::SEQUENTIAL)
+                ::posix_fadvise(m_file, 0, 0, POSIX_FADV_SEQUENTIAL);
+            else if (access == Access::RANDOM)
+                ::posix_fadvise(m_file, 0, 0, POSIX_FADV_RANDOM);
+
+            return status;
+        }
+
+        // start reading a byte range in the background
+        void prefetch(uint64 offset, uint64 size)
+        {
+            ::posix_fadvise(m_file, off_t(offset), off_t(size), POSIX_FADV_WILLNEED);
+        }
+
+        /*
+            Drop the mapped pages of this process and ask the kernel to evict
+            the file from the page cache. Clean pages which no other process
+            maps are released; the next access reads from the device.
+        */
+        void dontneed()
+        {
+            if (m_address)
+            {
+                // file backed read-only mapping; the pages are re-read on access
+                ::madvise(m_address, m_size, MADV_DONTNEED);
+            }
+
+            ::posix_fadvise(m_file, 0, 0, POSIX_FADV_DONTNEED);
+        }
+    };
+
+} // namespace mango
@@ -0,0 +1,313 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#include <mango/mango.hpp>
+#include "mapping.hpp"
+
+using namespace mango;
+
+/*
+    Cold-cache read benchmark for the access hints.
+
+    Every file is evicted from the page cache before it is read, so each
+    run pays for the device reads; run it on the storage you care about
+    (local SSD, spinning disk, network mount). The results for a warm cache
+    are all the same.
+*/
+
+// ----------------------------------------------------------------------
+// helpers
+// ----------------------------------------------------------------------
+
+namespace
+{
+
+    std::vector<std::string> getFilenames(const std::string& folder)
+    {
+        Path path(folder);
+
+        std::vector<std::string> filenames;
+        for (size_t i = 0; i < path.size(); ++i)
+        {
+            const auto& node = path[i];
+            if (!node.isDirectory() && !node.isContainer())
+            {
+                filenames.push_back(folder + node.name);
+            }
+        }
+
+        return filenames;
+    }
+
+    void evict(const std::vector<std::string>& filenames)
+    {
+        for (const auto& filename : filenames)
+        {
+            MappedFile file(filename);
+            file.dontneed();
+        }
+    }
+
+    // resident bytes of the mapping; readahead beyond what was read shows here
+    size_t getResident(Memory memory)
+    {
+        const size_t page = size_t(::sysconf(_SC_PAGESIZE));
+        const size_t count = (memory.size + page - 1) / page;
+
+        std::vector<unsigned char> pages(count);
+        if (::mincore(memory.address, memory.size, pages.data()) < 0)
+            return 0;
+
+        size_t resident = 0;
+        for (unsigned char p : pages)
+        {
+            resident += p & 1;
+        }
+        return resident * page;
+    }
+
+    uint64 sequential(Memory memory, bool decode, const std::string& filename)
+    {
+        if (decode)
+        {
+            ImageDecoder decoder(memory, filename);
+            if (decoder.isDecoder())
+            {
+                Bitmap bitmap(memory, filename);
+                return uint64(bitmap.width) * bitmap.height;
+            }
+        }
+
+        // read every 64 bits like a decoder would
+        uint64 sum = 0;
+        const size_t count = memory.size / 8;
+        for (size_t i = 0; i < count; ++i)
+        {
+            sum += uload64le(memory.address + i * 8);
+        }
+        return sum;
+    }
+
+    uint64 randomReads(Memory memory, int reads)
+    {
+        const size_t read_size = 4096;
+        if (memory.size < read_size)
+            return touch(memory);
+
+        uint64 sum = 0;
+        uint32 seed = 1;
+        for (int i = 0; i < reads; ++i)
+        {
+            seed = seed * 1664525 + 1013904223;
+            const size_t offset = seed % (memory.size - read_size);
+            sum += touch(memory.slice(offset, read_size));
+        }
+        return sum;
+    }
+
+    struct Result
+    {
+        uint64 bytes = 0;
+        uint64 resident = 0;
+        uint64 us = 0;
+    };
+
+    void print(const char* name, const Result& result)
+    {
+        printf("%-26s %10.1f  %10.1f  %12.1f\n", name,
+            result.us / 1000.0,
+            result.us ? double(result.bytes) / result.us : 0.0,
+            result.resident / (1024.0 * 1024.0));
+    }
+
+} // namespace
+
+// ----------------------------------------------------------------------
+// sequential
+// ----------------------------------------------------------------------
+
+void test_sequential(const std::vector<std::string>& filenames, bool decode)
+{
+    printf("\nsequential%s                  ms        MB/s   resident MB\n", decode ? " decode" : "       ");
+
+    struct Mode
+    {
+        const char* name;
+        Access access;
+        uint32 flags;
+    };
+
+    const Mode modes[] =
+    {
+        { "normal",         Access::NORMAL,     0 },
+        { "sequential",     Access::SEQUENTIAL, 0 },
+        { "willneed",       Access::WILLNEED,   0 },
+        { "populate",       Access::NORMAL,     MappedFile::POPULATE },
+    };
+
+    Timer timer;
+    uint64 checksum = 0;
+
+    // the plain File for reference; this is how the decoders map today
+    {
+        evict(filenames);
+
+        Result result;
+        uint64 time0 = timer.us();
+        for (const auto& filename : filenames)
+        {
+            File file(filename);
+            checksum += sequential(file, decode, filename);
+            result.bytes += file.size();
+        }
+        result.us = timer.us() - time0;
+        print("File", result);
+    }
+
+    // the same with the default hint for the file type
+    {
+        evict(filenames);
+
+        Result result;
+        uint64 time0 = timer.us();
+        for (const auto& filename : filenames)
+        {
+            File file(filename);
+            advise(file);
+            checksum += sequential(file, decode, filename);
+            result.bytes += file.size();
+        }
+        result.us = timer.us() - time0;
+        print("File + default hint", result);
+    }
+
+    for (const Mode& mode : modes)
+    {
+        evict(filenames);
+
+        Result result;
+        uint64 time0 = timer.us();
+        for (const auto& filename : filenames)
+        {
+            MappedFile file(filename, mode.access, mode.flags);
+            checksum += sequential(file, decode, filename);
+            result.bytes += file.size();
+            result.resident += getResident(file);
+        }
+        result.us = timer.us() - time0;
+        print(mode.name, result);
+    }
+
+    // the default for the file type, and the next file prefetched in the
+    // background while the current one is processed
+    {
+        evict(filenames);
+
+        SerialQueue q("prefetch");
+        std::unique_ptr<MappedFile> next;
+
+        Result result;
+        uint64 time0 = timer.us();
+        for (size_t i = 0; i < filenames.size(); ++i)
+        {
+            std::unique_ptr<MappedFile> file = std::move(next);
+            if (!file)
+            {
+                file.reset(new MappedFile(filenames[i], getDefaultAccess(filenames[i])));
+            }
+
+            if (i + 1 < filenames.size())
+            {
+                next.reset(new MappedFile(filenames[i + 1], getDefaultAccess(filenames[i + 1])));
+                prefetch(q, *next);
+            }
+
+            checksum += sequential(*file, decode, filenames[i]);
+            result.bytes += file->size();
+            result.resident += getResident(*file);
+
+            // the prefetch task must not outlive the mapping it touches
+            q.wait();
+        }
+        result.us = timer.us() - time0;
+        print("default + async prefetch", result);
+    }
+
+    printf("checksum: %llu\n", (unsigned long long)checksum);
+}
+
+// ----------------------------------------------------------------------
+// random
+// ----------------------------------------------------------------------
+
+/*
+    Container style access: a few small reads at random offsets. With the
+    default readahead every read pulls in its neighbours too; the resident
+    column shows how much was read from the device.
+*/
+
+void test_random(const std::vector<std::string>& filenames)
+{
+    const int reads = 64;
+
+    printf("\nrandom %d x 4 KB                 ms        MB/s   resident MB\n", reads);
+
+    const Access modes[] = { Access::NORMAL, Access::RANDOM };
+    const char* names[] = { "normal", "random" };
+
+    Timer timer;
+    uint64 checksum = 0;
+
+    for (int m = 0; m < 2; ++m)
+    {
+        evict(filenames);
+
+        Result result;
+        uint64 time0 = timer.us();
+        for (const auto& filename : filenames)
+        {
+            MappedFile file(filename, modes[m]);
+            checksum += randomReads(file, reads);
+            result.bytes += std::min<size_t>(file.size(), reads * 4096);
+            result.resident += getResident(file);
+        }
+        result.us = timer.us() - time0;
+        print(names[m], result);
+    }
+
+    printf("checksum: %llu\n", (unsigned long long)checksum);
+}
+
+// ----------------------------------------------------------------------
+// main()
+// ----------------------------------------------------------------------
+
+int main(int argc, const char* argv[])
+{
+    std::string folder;
+    bool decode = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::string(argv[i]) == "--decode")
+            decode = true;
+        else
+            folder = argv[i];
+    }
+
+    if (folder.empty())
+    {
+        printf("Too few arguments. usage: %s [--decode] <folder>\n", argv[0]);
+        return 1;
+    }
+
+    if (folder.back() != '/')
+        folder += '/';
+
+    std::vector<std::string> filenames = getFilenames(folder);
+    printf("folder: %s (%zu files)\n", folder.c_str(), filenames.size());
+
+    test_sequential(filenames, decode);
+    test_random(filenames);
+}
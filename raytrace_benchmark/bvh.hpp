@@ -0,0 +1,641 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <mango/mango.hpp>
+#include <algorithm>
+#include <atomic>
+#include <limits>
+
+/*
+    Bounding volume hierarchy over Boxes.
+
+    misc/math.cpp example10 intersects a FastRay with every Box; this does
+    the same in O(log n) per ray.
+
+    Build: top-down binary tree with binned SAH (16 bins per axis). The
+    two halves of a large node are built in parallel in the ThreadPool.
+    The binary tree is then collapsed into a 4-wide tree by pulling up the
+    largest grandchildren into the parent.
+
+    Node: the bounds of the four children in SoA form, one float32x4 per
+    bound component, so one slab test checks all four children:
+
+        minx[4] miny[4] minz[4] maxx[4] maxy[4] maxz[4]   child[4] count[4] mask
+
+    count > 0 is a leaf (primitives child .. child + count - 1 in the
+    primitive index array), count == 0 is an inner node. mask has a bit for
+    each used slot; the slab test can't reject the bounds of an unused slot
+    on its own, inverted bounds pass it on half of the ray directions.
+
+    Queries:
+
+        closest(ray, range)        nearest box along the ray; range is the
+                                   IntersectRange of that box
+        any(ray, range, tmax)      first box found closer than tmax, not
+                                   necessarily the nearest one; for
+                                   shadow and occlusion rays
+
+    Both return the index of the box or -1. The traversal stack is a fixed
+    array: every node pops one entry and pushes at most four, so a tree of
+    depth d needs 3 * d + 1 entries. The constructor checks the depth of
+    the tree it built against max_stack.
+*/
+
+namespace mango
+{
+
+    class BVH
+    {
+    public:
+        static constexpr int max_leaf_size = 4;
+        static constexpr int max_stack = 256;
+
+        struct Node
+        {
+            float32x4 minx, miny, minz;
+            float32x4 maxx, maxy, maxz;
+            int32 child[4];
+            uint32 count[4];
+            int mask;
+        };
+
+    protected:
+        struct Bounds
+        {
+            float min[3];
+            float max[3];
+
+            void clear()
+            {
+                for (int i = 0; i < 3; ++i)
+                {
+                    min[i] = std::numeric_limits<float>::max();
+                    max[i] = -std::numeric_limits<float>::max();
+                }
+            }
+
+            void extend(const Bounds& b)
+            {
+                for (int i = 0; i < 3; ++i)
+                {
+                    min[i] = std::min(min[i], b.min[i]);
+                    max[i] = std::max(max[i], b.max[i]);
+                }
+            }
+
+            void extend(const float* p)
+            {
+                for (int i = 0; i < 3; ++i)
+                {
+                    min[i] = std::min(min[i], p[i]);
+                    max[i] = std::max(max[i], p[i]);
+                }
+            }
+
+            float area() const
+            {
+                const float x = max[0] - min[0];
+                const float y = max[1] - min[1];
+                const float z = max[2] - min[2];
+                return x < 0 ? 0.0f : 2.0f * (x * y + y * z + z * x);
+            }
+        };
+
+        struct BuildNode
+        {
+            Bounds bounds;
+            int32 left;
+            int32 right;
+            uint32 first;
+            uint32 count; // > 0 for leaf
+        };
+
+        struct Builder
+        {
+            const std::vector<Bounds>& prims;
+            std::vector<float> centroids; // 3 per primitive
+            std::vector<uint32>& indices;
+            std::vector<BuildNode> nodes;
+            std::atomic<int32> next { 0 };
+            std::atomic<int> pending { 0 };
+            ConcurrentQueue queue;
+
+            Builder(const std::vector<Bounds>& prims, std::vector<uint32>& indices)
+                : prims(prims)
+                , centroids(prims.size() * 3)
+                , indices(indices)
+                , nodes(std::max<size_t>(1, prims.size() * 2))
+                , queue("bvh build")
+            {
+                for (size_t i = 0; i < prims.size(); ++i)
+                {
+                    for (int a = 0; a < 3; ++a)
+                    {
+                        centroids[i * 3 + a] = (prims[i].min[a] + prims[i].max[a]) * 0.5f;
+                    }
+                }
+            }
+
+            void build(int32 index, uint32 first, uint32 count)
+            {
+                BuildNode& node = nodes[index];
+                node.bounds.clear();
+
+                Bounds centroid;
+                centroid.clear();
+
+                for (uint32 i = first; i < first + count; ++i)
+                {
+                    node.bounds.extend(prims[indices[i]]);
+                    centroid.extend(&centroids[indices[i] * 3]);
+                }
+
+                node.first = first;
+                node.count = count;
+                node.left = -1;
+                node.right = -1;
+
+                if (count <= max_leaf_size)
+                    return;
+
+                uint32 split = partition(node.bounds, centroid, first, count);
+                if (split == first || split == first + count)
+                {
+                    // SAH prefers a leaf or all centroids are equal; keep the
+                    // leaves small anyway with a median split along the
+                    // largest centroid extent (any order if they are equal)
+                    if (count <= max_leaf_size * 4)
+                        return;
+
+                    int axis = 0;
+                    for (int a = 1; a < 3; ++a)
+                    {
+                        if (centroid.max[a] - centroid.min[a] > centroid.max[axis] - centroid.min[axis])
+                            axis = a;
+                    }
+
+                    split = first + count / 2;
+                    const float* c = centroids.data() + axis;
+                    std::nth_element(indices.begin() + first, indices.begin() + split, indices.begin() + first + count,
+                        [c] (uint32 x, uint32 y) { return c[x * 3] < c[y * 3]; });
+                }
+
+                node.left = next++;
+                node.right = next++;
+                node.count = 0;
+
+                const int32 left = node.left;
+                const int32 right = node.right;
+
+                if (count > 16 * 1024)
+                {
+                    ++pending;
+                    queue.enqueue([this, left, first, split] {
+                        build(left, first, split - first);
+                        --pending;
+                    });
+                }
+                else
+                {
+                    build(left, first, split - first);
+                }
+
+                build(right, split, first + count - split);
+            }
+
+            // binned SAH; returns the split position or first / first + count for a leaf
+            uint32 partition(const Bounds& bounds, const Bounds& centroid, uint32 first, uint32 count)
+            {
+                constexpr int bin_count = 16;
+
+                float best_cost = bounds.area() * count;
+                int best_axis = -1;
+                int best_bin = 0;
+
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    const float cmin = centroid.min[axis];
+                    const float extent = centroid.max[axis] - cmin;
+                    if (extent <= 0.0f)
+                        continue;
+
+                    const float scale = bin_count / extent;
+
+                    Bounds bins[bin_count];
+                    uint32 counts[bin_count] = { };
+                    for (Bounds& b : bins)
+                        b.clear();
+
+                    for (uint32 i = first; i < first + count; ++i)
+                    {
+                        const uint32 p = indices[i];
+                        int b = std::min(bin_count - 1, int((centroids[p * 3 + axis] - cmin) * scale));
+                        bins[b].extend(prims[p]);
+                        ++counts[b];
+                    }
+
+                    // sweep from the right to get the right side areas
+                    float right_area[bin_count];
+                    Bounds acc;
+                    acc.clear();
+                    uint32 right_count[bin_count];
+                    uint32 n = 0;
+                    for (int b = bin_count - 1; b > 0; --b)
+                    {
+                        acc.extend(bins[b]);
+                        n += counts[b];
+                        right_area[b] = acc.area();
+                        right_count[b] = n;
+                    }
+
+                    acc.clear();
+                    n = 0;
+                    for (int b = 0; b < bin_count - 1; ++b)
+                    {
+                        acc.extend(bins[b]);
+                        n += counts[b];
+                        const float cost = acc.area() * n + right_area[b + 1] * right_count[b + 1];
+                        if (n && right_count[b + 1] && cost < best_cost)
+                        {
+                            best_cost = cost;
+                            best_axis = axis;
+                            best_bin = b;
+                        }
+                    }
+                }
+
+                if (best_axis < 0)
+                    return first;
+
+                const float cmin = centroid.min[best_axis];
+                const float scale = bin_count / (centroid.max[best_axis] - cmin);
+
+                uint32* begin = indices.data() + first;
+                uint32* middle = std::partition(begin, begin + count, [&] (uint32 p) {
+                    int b = std::min(bin_count - 1, int((centroids[p * 3 + best_axis] - cmin) * scale));
+                    return b <= best_bin;
+                });
+
+                return first + uint32(middle - begin);
+            }
+        };
+
+        std::vector<Node, AlignedAllocator<Node>> m_nodes;
+        std::vector<uint32> m_indices;
+        std::vector<Box> m_boxes;
+        int m_depth = 0;
+
+        static void setChild(float* bounds, int slot, const Bounds& b)
+        {
+            for (int a = 0; a < 3; ++a)
+            {
+                bounds[a * 4 + slot] = b.min[a];
+                bounds[12 + a * 4 + slot] = b.max[a];
+            }
+        }
+
+        static void store(Node& node, const float* bounds, const int32* child, const uint32* count)
+        {
+            node.minx = float32x4(bounds[0], bounds[1], bounds[2], bounds[3]);
+            node.miny = float32x4(bounds[4], bounds[5], bounds[6], bounds[7]);
+            node.minz = float32x4(bounds[8], bounds[9], bounds[10], bounds[11]);
+            node.maxx = float32x4(bounds[12], bounds[13], bounds[14], bounds[15]);
+            node.maxy = float32x4(bounds[16], bounds[17], bounds[18], bounds[19]);
+            node.maxz = float32x4(bounds[20], bounds[21], bounds[22], bounds[23]);
+            for (int i = 0; i < 4; ++i)
+            {
+                node.child[i] = child[i];
+                node.count[i] = count[i];
+            }
+            node.mask = 0;
+            for (int i = 0; i < 4; ++i)
+            {
+                if (child[i] >= 0)
+                    node.mask |= 1 << i;
+            }
+        }
+
+        int32 collapse(const std::vector<BuildNode>& nodes, int32 index, int depth)
+        {
+            m_depth = std::max(m_depth, depth);
+
+            // gather up to four children, opening the largest inner child
+            int32 children[4] = { nodes[index].left, nodes[index].right, -1, -1 };
+            int n = 2;
+
+            while (n < 4)
+            {
+                int largest = -1;
+                float area = -1.0f;
+                for (int i = 0; i < n; ++i)
+                {
+                    const BuildNode& c = nodes[children[i]];
+                    if (!c.count && c.bounds.area() > area)
+                    {
+                        area = c.bounds.area();
+                        largest = i;
+                    }
+                }
+
+                if (largest < 0)
+                    break;
+
+                const BuildNode& c = nodes[children[largest]];
+                children[largest] = c.left;
+                children[n++] = c.right;
+            }
+
+            const int32 result = int32(m_nodes.size());
+            m_nodes.emplace_back();
+
+            float bounds[24];
+            int32 child[4];
+            uint32 count[4];
+
+            Bounds empty;
+            empty.clear();
+
+            for (int i = 0; i < 4; ++i)
+            {
+                if (i < n)
+                {
+                    const BuildNode& c = nodes[children[i]];
+                    setChild(bounds, i, c.bounds);
+                    if (c.count)
+                    {
+                        child[i] = int32(c.first);
+                        count[i] = c.count;
+                    }
+                    else
+                    {
+                        child[i] = collapse(nodes, children[i], depth + 1);
+                        count[i] = 0;
+                    }
+                }
+                else
+                {
+                    setChild(bounds, i, empty);
+                    child[i] = -1;
+                    count[i] = 0;
+                }
+            }
+
+            store(m_nodes[result], bounds, child, count);
+            return result;
+        }
+
+        struct SlabRay
+        {
+            float32x4 ox, oy, oz;
+            float32x4 ix, iy, iz;
+
+            SlabRay(const FastRay& ray)
+                : ox(ray.origin.x), oy(ray.origin.y), oz(ray.origin.z)
+                , ix(ray.invdir.x), iy(ray.invdir.y), iz(ray.invdir.z)
+            {
+            }
+        };
+
+        // slab test of the ray against the four children; returns the hit
+        // mask and the entry distances
+        static int slab(const Node& node, const SlabRay& r, float tmax, float32x4& tnear)
+        {
+            float32x4 x0 = (node.minx - r.ox) * r.ix;
+            float32x4 x1 = (node.maxx - r.ox) * r.ix;
+            float32x4 y0 = (node.miny - r.oy) * r.iy;
+            float32x4 y1 = (node.maxy - r.oy) * r.iy;
+            float32x4 z0 = (node.minz - r.oz) * r.iz;
+            float32x4 z1 = (node.maxz - r.oz) * r.iz;
+
+            float32x4 t0 = max(max(min(x0, x1), min(y0, y1)), max(min(z0, z1), float32x4(0.0f)));
+            float32x4 t1 = min(min(max(x0, x1), max(y0, y1)), min(max(z0, z1), float32x4(tmax)));
+
+            tnear = t0;
+            return get_mask(t0 <= t1) & node.mask;
+        }
+
+        // the box is hit in front of the origin; range.t0 is negative when
+        // the ray starts inside the box and the caller clamps it to 0
+        bool intersect(uint32 primitive, const FastRay& ray, IntersectRange& range) const
+        {
+            return range.intersect(m_boxes[primitive], ray) && range.t1 >= 0.0f;
+        }
+
+    public:
+        BVH(const std::vector<Box>& boxes)
+            : m_boxes(boxes)
+        {
+            const size_t count = boxes.size();
+            if (!count)
+                return;
+
+            std::vector<Bounds> prims(count);
+            for (size_t i = 0; i < count; ++i)
+            {
+                for (int a = 0; a < 3; ++a)
+                {
+                    prims[i].min[a] = std::min(boxes[i].corner[0][a], boxes[i].corner[1][a]);
+                    prims[i].max[a] = std::max(boxes[i].corner[0][a], boxes[i].corner[1][a]);
+                }
+            }
+
+            m_indices.resize(count);
+            for (size_t i = 0; i < count; ++i)
+                m_indices[i] = uint32(i);
+
+            Builder builder(prims, m_indices);
+            builder.next = 1;
+            builder.build(0, 0, uint32(count));
+
+            do
+            {
+                builder.queue.wait();
+            } while (builder.pending > 0);
+
+            const BuildNode& root = builder.nodes[0];
+            m_nodes.reserve(builder.next / 2 + 1);
+
+            if (root.count)
+            {
+                // a single leaf; the root node has one child
+                Bounds empty;
+                empty.clear();
+
+                float bounds[24];
+                setChild(bounds, 0, root.bounds);
+                for (int i = 1; i < 4; ++i)
+                    setChild(bounds, i, empty);
+
+                const int32 child[4] = { int32(root.first), -1, -1, -1 };
+                const uint32 count[4] = { root.count, 0, 0, 0 };
+
+                m_nodes.emplace_back();
+                store(m_nodes[0], bounds, child, count);
+                m_depth = 1;
+            }
+            else
+            {
+                collapse(builder.nodes, 0, 1);
+            }
+
+            if (3 * m_depth + 1 > max_stack)
+            {
+                MANGO_EXCEPTION("BVH: the tree is too deep for the traversal stack.");
+            }
+        }
+
+        size_t getNodeCount() const
+        {
+            return m_nodes.size();
+        }
+
+        int getDepth() const
+        {
+            return m_depth;
+        }
+
+        const std::vector<uint32>& getIndices() const
+        {
+            return m_indices;
+        }
+
+        /*
+            Closest box along the ray. Returns the index of the box (into the
+            vector given to the constructor) or -1, and its IntersectRange.
+        */
+        int closest(const Ray& ray, IntersectRange& result) const
+        {
+            if (m_nodes.empty())
+                return -1;
+
+            const FastRay fast(ray);
+            const SlabRay r(fast);
+
+            float best = std::numeric_limits<float>::max();
+            int hit = -1;
+
+            struct Entry
+            {
+                int32 node;
+                float t;
+            };
+
+            Entry stack[max_stack];
+            int top = 0;
+            stack[top++] = { 0, 0.0f };
+
+            while (top > 0)
+            {
+                const Entry entry = stack[--top];
+                if (entry.t > best)
+                    continue;
+
+                const Node& node = m_nodes[entry.node];
+                float32x4 tnear;
+                int mask = slab(node, r, best, tnear);
+
+                // children in near to far order; push the far ones first
+                Entry children[4];
+                int n = 0;
+
+                while (mask)
+                {
+                    const int i = u32_tzcnt(mask);
+                    mask &= mask - 1;
+
+                    if (node.count[i])
+                    {
+                        for (uint32 j = 0; j < node.count[i]; ++j)
+                        {
+                            const uint32 p = m_indices[node.child[i] + j];
+                            IntersectRange range;
+                            if (intersect(p, fast, range))
+                            {
+                                const float t = std::max(range.t0, 0.0f);
+                                if (t < best)
+                                {
+                                    best = t;
+                                    hit = int(p);
+                                    result = range;
+                                }
+                            }
+                        }
+                    }
+                    else
+                    {
+                        Entry e = { node.child[i], tnear[i] };
+                        int k = n++;
+                        while (k > 0 && children[k - 1].t < e.t)
+                        {
+                            children[k] = children[k - 1];
+                            --k;
+                        }
+                        children[k] = e;
+                    }
+                }
+
+                for (int i = 0; i < n; ++i)
+                {
+                    stack[top++] = children[i];
+                }
+            }
+
+            return hit;
+        }
+
+        /*
+            Any box hit closer than tmax. Stops at the first one found, which
+            is not necessarily the closest. Returns the index of the box or
+            -1, and its IntersectRange.
+        */
+        int any(const Ray& ray, IntersectRange& result, float tmax = std::numeric_limits<float>::max()) const
+        {
+            if (m_nodes.empty())
+                return -1;
+
+            const FastRay fast(ray);
+            const SlabRay r(fast);
+
+            int32 stack[max_stack];
+            int top = 0;
+            stack[top++] = 0;
+
+            while (top > 0)
+            {
+                const Node& node = m_nodes[stack[--top]];
+                float32x4 tnear;
+                int mask = slab(node, r, tmax, tnear);
+
+                while (mask)
+                {
+                    const int i = u32_tzcnt(mask);
+                    mask &= mask - 1;
+
+                    if (node.count[i])
+                    {
+                        for (uint32 j = 0; j < node.count[i]; ++j)
+                        {
+                            const uint32 p = m_indices[node.child[i] + j];
+                            IntersectRange range;
+                            if (intersect(p, fast, range) && std::max(range.t0, 0.0f) < tmax)
+                            {
+                                result = range;
+                                return int(p);
+                            }
+                        }
+                    }
+                    else
+                    {
+                        stack[top++] = node.child[i];
+                    }
+                }
+            }
+
+            return -1;
+        }
+    };
+
+} // namespace mango
@@ -0,0 +1,376 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <mango/mango.hpp>
+#include <algorithm>
+#include <limits>
+
+/*
+    Ray packets.
+
+    Intersect and IntersectRange (misc/math.cpp examples 8 - 10) test one
+    Ray with float3 math. A RayPacket keeps 4 or 8 rays in SoA form, one
+    float32x4 / float32x8 per component, and tests all of them against a
+    primitive at once:
+
+        ox oy oz   origins
+        dx dy dz   directions
+        ix iy iz   1 / direction, for the slab test
+
+    The intersect() overloads return the hit mask as a vector mask and the
+    distances per lane; lanes which missed have undefined distances. A
+    packet with fewer rays than lanes repeats its first ray and clears the
+    unused lanes from RayPacket::mask; the results of those lanes are
+    computed but ignored.
+
+        Plane      t
+        Sphere     t0, t1 (enter, leave) like IntersectRange
+        Box        t0, t1 slab range like IntersectRange + FastRay
+        PacketTriangle
+                   t, u, v (barycentric), two-sided; the edges are
+                   precomputed from the three corners
+
+    RayStream sorts incoherent rays into packets: rays going into the same
+    direction octant and roughly the same direction share a packet, so that
+    their lanes hit and miss together. closest() finds the nearest primitive
+    for every ray and writes the results in the original ray order.
+*/
+
+namespace mango
+{
+
+    template <typename V>
+    struct PacketTraits;
+
+    template <>
+    struct PacketTraits<float32x4>
+    {
+        using Mask = mask32x4;
+        static constexpr int size = 4;
+
+        static float32x4 load(const float* p)
+        {
+            return float32x4(p[0], p[1], p[2], p[3]);
+        }
+    };
+
+    template <>
+    struct PacketTraits<float32x8>
+    {
+        using Mask = mask32x8;
+        static constexpr int size = 8;
+
+        static float32x8 load(const float* p)
+        {
+            return float32x8(p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7]);
+        }
+    };
+
+    // -----------------------------------------------------------------
+    // RayPacket
+    // -----------------------------------------------------------------
+
+    template <typename V>
+    struct RayPacket
+    {
+        using Mask = typename PacketTraits<V>::Mask;
+        static constexpr int size = PacketTraits<V>::size;
+
+        V ox, oy, oz;
+        V dx, dy, dz;
+        V ix, iy, iz;
+        int mask;           // active lanes
+        uint32 index[size]; // source ray of each lane
+
+        RayPacket()
+            : mask(0)
+        {
+        }
+
+        // rays[indices[0 .. count - 1]]
+        RayPacket(const Ray* rays, const uint32* indices, int count)
+        {
+            float lanes[9][size];
+
+            for (int i = 0; i < size; ++i)
+            {
+                const uint32 s = indices[i < count ? i : 0];
+                const Ray& ray = rays[s];
+                index[i] = s;
+
+                lanes[0][i] = ray.origin.x;
+                lanes[1][i] = ray.origin.y;
+                lanes[2][i] = ray.origin.z;
+                lanes[3][i] = ray.direction.x;
+                lanes[4][i] = ray.direction.y;
+                lanes[5][i] = ray.direction.z;
+                lanes[6][i] = 1.0f / ray.direction.x;
+                lanes[7][i] = 1.0f / ray.direction.y;
+                lanes[8][i] = 1.0f / ray.direction.z;
+            }
+
+            ox = PacketTraits<V>::load(lanes[0]);
+            oy = PacketTraits<V>::load(lanes[1]);
+            oz = PacketTraits<V>::load(lanes[2]);
+            dx = PacketTraits<V>::load(lanes[3]);
+            dy = PacketTraits<V>::load(lanes[4]);
+            dz = PacketTraits<V>::load(lanes[5]);
+            ix = PacketTraits<V>::load(lanes[6]);
+            iy = PacketTraits<V>::load(lanes[7]);
+            iz = PacketTraits<V>::load(lanes[8]);
+
+            mask = count < size ? (1 << count) - 1 : (1 << size) - 1;
+        }
+    };
+
+    using RayPacket4 = RayPacket<float32x4>;
+    using RayPacket8 = RayPacket<float32x8>;
+
+    // -----------------------------------------------------------------
+    // intersection
+    // -----------------------------------------------------------------
+
+    struct PacketTriangle
+    {
+        float3 origin;
+        float3 edge1;
+        float3 edge2;
+
+        PacketTriangle(float3 p0, float3 p1, float3 p2)
+            : origin(p0)
+            , edge1(p1.x - p0.x, p1.y - p0.y, p1.z - p0.z)
+            , edge2(p2.x - p0.x, p2.y - p0.y, p2.z - p0.z)
+        {
+        }
+    };
+
+    template <typename V>
+    typename RayPacket<V>::Mask intersect(const RayPacket<V>& r, const Plane& plane, V& t)
+    {
+        // Plane::distance() is dot(normal, point) + k for some k; take k
+        // from the plane so that the packet agrees with it
+        const V k(plane.distance(float3(0.0f, 0.0f, 0.0f)));
+        const V nx(plane.normal.x);
+        const V ny(plane.normal.y);
+        const V nz(plane.normal.z);
+
+        V distance = nx * r.ox + ny * r.oy + nz * r.oz + k;
+        V denom = nx * r.dx + ny * r.dy + nz * r.dz;
+
+        t = V(0.0f) - distance / denom;
+        return (denom != V(0.0f)) & (t >= V(0.0f));
+    }
+
+    template <typename V>
+    typename RayPacket<V>::Mask intersect(const RayPacket<V>& r, const Sphere& sphere, V& t0, V& t1)
+    {
+        V cx = r.ox - V(sphere.center.x);
+        V cy = r.oy - V(sphere.center.y);
+        V cz = r.oz - V(sphere.center.z);
+
+        V a = r.dx * r.dx + r.dy * r.dy + r.dz * r.dz;
+        V b = cx * r.dx + cy * r.dy + cz * r.dz;
+        V c = cx * cx + cy * cy + cz * cz - V(sphere.radius * sphere.radius);
+
+        V discriminant = b * b - a * c;
+        V s = sqrt(max(discriminant, V(0.0f)));
+        V inva = V(1.0f) / a;
+
+        t0 = (V(0.0f) - b - s) * inva;
+        t1 = (s - b) * inva;
+        return (discriminant >= V(0.0f)) & (t1 >= V(0.0f));
+    }
+
+    template <typename V>
+    typename RayPacket<V>::Mask intersect(const RayPacket<V>& r, const Box& box, V& t0, V& t1)
+    {
+        V x0 = (V(box.corner[0].x) - r.ox) * r.ix;
+        V x1 = (V(box.corner[1].x) - r.ox) * r.ix;
+        V y0 = (V(box.corner[0].y) - r.oy) * r.iy;
+        V y1 = (V(box.corner[1].y) - r.oy) * r.iy;
+        V z0 = (V(box.corner[0].z) - r.oz) * r.iz;
+        V z1 = (V(box.corner[1].z) - r.oz) * r.iz;
+
+        t0 = max(max(min(x0, x1), min(y0, y1)), min(z0, z1));
+        t1 = min(min(max(x0, x1), max(y0, y1)), max(z0, z1));
+        return (t0 <= t1) & (t1 >= V(0.0f));
+    }
+
+    // Moller-Trumbore
+    template <typename V>
+    typename RayPacket<V>::Mask intersect(const RayPacket<V>& r, const PacketTriangle& triangle, V& t, V& u, V& v)
+    {
+        const V e1x(triangle.edge1.x), e1y(triangle.edge1.y), e1z(triangle.edge1.z);
+        const V e2x(triangle.edge2.x), e2y(triangle.edge2.y), e2z(triangle.edge2.z);
+
+        // p = d x e2
+        V px = r.dy * e2z - r.dz * e2y;
+        V py = r.dz * e2x - r.dx * e2z;
+        V pz = r.dx * e2y - r.dy * e2x;
+
+        V det = e1x * px + e1y * py + e1z * pz;
+        V invdet = V(1.0f) / det;
+
+        V sx = r.ox - V(triangle.origin.x);
+        V sy = r.oy - V(triangle.origin.y);
+        V sz = r.oz - V(triangle.origin.z);
+        u = (sx * px + sy * py + sz * pz) * invdet;
+
+        // q = s x e1
+        V qx = sy * e1z - sz * e1y;
+        V qy = sz * e1x - sx * e1z;
+        V qz = sx * e1y - sy * e1x;
+        v = (r.dx * qx + r.dy * qy + r.dz * qz) * invdet;
+        t = (e2x * qx + e2y * qy + e2z * qz) * invdet;
+
+        return (det != V(0.0f)) & (u >= V(0.0f)) & (v >= V(0.0f)) &
+               (u + v <= V(1.0f)) & (t >= V(0.0f));
+    }
+
+    // distance to the first surface along the ray, for closest()
+    template <typename V>
+    typename RayPacket<V>::Mask nearest(const RayPacket<V>& r, const Plane& plane, V& t)
+    {
+        return intersect(r, plane, t);
+    }
+
+    template <typename V>
+    typename RayPacket<V>::Mask nearest(const RayPacket<V>& r, const Sphere& sphere, V& t)
+    {
+        V t0, t1;
+        auto mask = intersect(r, sphere, t0, t1);
+        t = select(t0 >= V(0.0f), t0, t1);
+        return mask;
+    }
+
+    // boxes are solid: a ray starting inside hits at 0 (see BVH::closest)
+    template <typename V>
+    typename RayPacket<V>::Mask nearest(const RayPacket<V>& r, const Box& box, V& t)
+    {
+        V t0, t1;
+        auto mask = intersect(r, box, t0, t1);
+        t = max(t0, V(0.0f));
+        return mask;
+    }
+
+    template <typename V>
+    typename RayPacket<V>::Mask nearest(const RayPacket<V>& r, const PacketTriangle& triangle, V& t)
+    {
+        V u, v;
+        return intersect(r, triangle, t, u, v);
+    }
+
+    // -----------------------------------------------------------------
+    // RayStream
+    // -----------------------------------------------------------------
+
+    template <typename V>
+    class RayStream
+    {
+    protected:
+        static constexpr int lanes = RayPacket<V>::size;
+
+        std::vector<RayPacket<V>, AlignedAllocator<RayPacket<V>>> m_packets;
+        size_t m_count;
+
+        // direction octant in the top bits, then the direction quantized
+        // to 32 steps per axis
+        static uint32 getKey(const Ray& ray)
+        {
+            const float3& d = ray.direction;
+            const float length = std::sqrt(d.x * d.x + d.y * d.y + d.z * d.z);
+            const float scale = length > 0.0f ? 15.5f / length : 0.0f;
+
+            uint32 octant = (d.x < 0) | ((d.y < 0) << 1) | ((d.z < 0) << 2);
+            uint32 x = uint32(d.x * scale + 16.0f) & 31;
+            uint32 y = uint32(d.y * scale + 16.0f) & 31;
+            uint32 z = uint32(d.z * scale + 16.0f) & 31;
+            return (octant << 15) | (x << 10) | (y << 5) | z;
+        }
+
+    public:
+        RayStream(const Ray* rays, size_t count, bool sort = true)
+            : m_count(count)
+        {
+            std::vector<uint64> keys(count);
+            for (size_t i = 0; i < count; ++i)
+            {
+                const uint64 key = sort ? getKey(rays[i]) : 0;
+                keys[i] = (key << 32) | i;
+            }
+
+            if (sort)
+            {
+                std::sort(keys.begin(), keys.end());
+            }
+
+            std::vector<uint32> indices(count);
+            for (size_t i = 0; i < count; ++i)
+            {
+                indices[i] = uint32(keys[i]);
+            }
+
+            m_packets.reserve((count + lanes - 1) / lanes);
+            for (size_t i = 0; i < count; i += lanes)
+            {
+                const int n = int(std::min<size_t>(lanes, count - i));
+                m_packets.emplace_back(rays, indices.data() + i, n);
+            }
+        }
+
+        const std::vector<RayPacket<V>, AlignedAllocator<RayPacket<V>>>& packets() const
+        {
+            return m_packets;
+        }
+
+        size_t size() const
+        {
+            return m_count;
+        }
+
+        /*
+            Nearest primitive for every ray: distance[i] and hit[i] for the
+            i:th ray given to the constructor; hit is -1 for a miss.
+        */
+        template <typename Primitive>
+        void closest(const Primitive* primitives, size_t count, float* distance, int32* hit) const
+        {
+            for (const RayPacket<V>& packet : m_packets)
+            {
+                V best(std::numeric_limits<float>::max());
+                int32 index[lanes];
+                for (int i = 0; i < lanes; ++i)
+                    index[i] = -1;
+
+                for (size_t j = 0; j < count; ++j)
+                {
+                    V t;
+                    auto mask = nearest(packet, primitives[j], t);
+                    mask = mask & (t < best);
+
+                    int bits = get_mask(mask) & packet.mask;
+                    if (bits)
+                    {
+                        best = select(mask, t, best);
+                        do
+                        {
+                            index[u32_tzcnt(bits)] = int32(j);
+                            bits &= bits - 1;
+                        } while (bits);
+                    }
+                }
+
+                for (int bits = packet.mask; bits; bits &= bits - 1)
+                {
+                    const int i = u32_tzcnt(bits);
+                    distance[packet.index[i]] = best[i];
+                    hit[packet.index[i]] = index[i];
+                }
+            }
+        }
+    };
+
+} // namespace mango
@@ -0,0 +1,398 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#include <mango/mango.hpp>
+#include "bvh.hpp"
+#include "packet.hpp"
+
+using namespace mango;
+
+// ----------------------------------------------------------------------
+// helpers
+// ----------------------------------------------------------------------
+
+namespace
+{
+
+    struct Random
+    {
+        uint32 seed = 1;
+
+        float operator () ()
+        {
+            seed = seed * 1664525 + 1013904223;
+            return float(seed >> 8) / float(1 << 24);
+        }
+    };
+
+    // small boxes scattered in a 100 unit cube
+    std::vector<Box> getBoxes(size_t count)
+    {
+        Random random;
+        std::vector<Box> boxes(count);
+
+        for (Box& box : boxes)
+        {
+            float3 center(random() * 100.0f, random() * 100.0f, random() * 100.0f);
+            float3 size(0.1f + random(), 0.1f + random(), 0.1f + random());
+            box.corner[0] = float3(center.x - size.x, center.y - size.y, center.z - size.z);
+            box.corner[1] = float3(center.x + size.x, center.y + size.y, center.z + size.z);
+        }
+
+        return boxes;
+    }
+
+    // rays from the outside of the cube towards random points inside it
+    std::vector<Ray> getRays(size_t count)
+    {
+        Random random;
+        random.seed = 7;
+        std::vector<Ray> rays(count);
+
+        for (Ray& ray : rays)
+        {
+            float3 origin(-20.0f + random() * 140.0f, -20.0f + random() * 140.0f, -20.0f);
+            float3 target(random() * 100.0f, random() * 100.0f, random() * 100.0f);
+            ray.origin = origin;
+            ray.direction = normalize(float3(target.x - origin.x, target.y - origin.y, target.z - origin.z));
+        }
+
+        return rays;
+    }
+
+    // the reference: misc/math.cpp example10
+    int closest_linear(const std::vector<Box>& boxes, const Ray& ray, float& distance)
+    {
+        FastRay fast(ray);
+        int hit = -1;
+        distance = std::numeric_limits<float>::max();
+
+        for (size_t i = 0; i < boxes.size(); ++i)
+        {
+            IntersectRange is;
+            if (is.intersect(boxes[i], fast) && is.t1 >= 0.0f)
+            {
+                const float t = std::max(is.t0, 0.0f);
+                if (t < distance)
+                {
+                    distance = t;
+                    hit = int(i);
+                }
+            }
+        }
+
+        return hit;
+    }
+
+    // scalar Moller-Trumbore; there is no Intersect for triangles
+    bool intersect(const Ray& ray, const PacketTriangle& triangle, float& t)
+    {
+        const float3& d = ray.direction;
+        const float3& e1 = triangle.edge1;
+        const float3& e2 = triangle.edge2;
+
+        float3 p(d.y * e2.z - d.z * e2.y, d.z * e2.x - d.x * e2.z, d.x * e2.y - d.y * e2.x);
+        float det = e1.x * p.x + e1.y * p.y + e1.z * p.z;
+        if (det == 0.0f)
+            return false;
+
+        float invdet = 1.0f / det;
+        float3 s(ray.origin.x - triangle.origin.x, ray.origin.y - triangle.origin.y, ray.origin.z - triangle.origin.z);
+        float u = (s.x * p.x + s.y * p.y + s.z * p.z) * invdet;
+
+        float3 q(s.y * e1.z - s.z * e1.y, s.z * e1.x - s.x * e1.z, s.x * e1.y - s.y * e1.x);
+        float v = (d.x * q.x + d.y * q.y + d.z * q.z) * invdet;
+        t = (e2.x * q.x + e2.y * q.y + e2.z * q.z) * invdet;
+
+        return u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t >= 0.0f;
+    }
+
+    // nearest hit of a single ray, the same conventions as packet.hpp nearest()
+    bool nearest(const Ray& ray, const Plane& plane, float& t)
+    {
+        Intersect is;
+        if (!is.intersect(ray, plane))
+            return false;
+        t = is.t0;
+        return true;
+    }
+
+    bool nearest(const Ray& ray, const Sphere& sphere, float& t)
+    {
+        IntersectRange is;
+        if (!is.intersect(ray, sphere) || is.t1 < 0.0f)
+            return false;
+        t = is.t0 >= 0.0f ? is.t0 : is.t1;
+        return true;
+    }
+
+    bool nearest(const Ray& ray, const Box& box, float& t)
+    {
+        // FastRay per test: the scalar code has no other way to pass it
+        IntersectRange is;
+        if (!is.intersect(box, FastRay(ray)) || is.t1 < 0.0f)
+            return false;
+        t = std::max(is.t0, 0.0f);
+        return true;
+    }
+
+    bool nearest(const Ray& ray, const PacketTriangle& triangle, float& t)
+    {
+        return intersect(ray, triangle, t);
+    }
+
+    void print(const char* name, size_t rays, uint64 us)
+    {
+        printf("%-24s %12.3f\n", name, us ? rays / double(us) : 0.0);
+    }
+
+} // namespace
+
+// ----------------------------------------------------------------------
+// test
+// ----------------------------------------------------------------------
+
+void test_bvh(size_t box_count, size_t ray_count)
+{
+    const std::vector<Box> boxes = getBoxes(box_count);
+    const std::vector<Ray> rays = getRays(ray_count);
+
+    Timer timer;
+
+    uint64 time0 = timer.us();
+    BVH bvh(boxes);
+    uint64 time1 = timer.us();
+
+    printf("boxes: %zu, rays: %zu\n", box_count, ray_count);
+    printf("build: %.1f ms, %zu nodes, depth %d\n\n", (time1 - time0) / 1000.0,
+        bvh.getNodeCount(), bvh.getDepth());
+
+    // the linear loop on a sample of the rays; it is the reference for the
+    // correctness check, which is done after the timing
+    const size_t sample = std::min<size_t>(ray_count, 1000);
+    std::vector<int> expected(sample);
+    std::vector<float> distance(sample);
+
+    time0 = timer.us();
+    for (size_t i = 0; i < sample; ++i)
+    {
+        expected[i] = closest_linear(boxes, rays[i], distance[i]);
+    }
+    time1 = timer.us();
+
+    printf("ray type                       Mrays/s\n");
+    print("linear", sample, time1 - time0);
+
+    size_t errors = 0;
+    for (size_t i = 0; i < sample; ++i)
+    {
+        IntersectRange range;
+        int hit = bvh.closest(rays[i], range);
+
+        // equal distances may resolve to either box
+        if (hit != expected[i] && (hit < 0 || expected[i] < 0 || std::max(range.t0, 0.0f) != distance[i]))
+            ++errors;
+        if ((bvh.any(rays[i], range) >= 0) != (expected[i] >= 0))
+            ++errors;
+    }
+
+    // serial
+    uint32 hits = 0;
+
+    time0 = timer.us();
+    for (const Ray& ray : rays)
+    {
+        IntersectRange range;
+        hits += bvh.closest(ray, range) >= 0;
+    }
+    time1 = timer.us();
+    print("BVH closest", ray_count, time1 - time0);
+
+    time0 = timer.us();
+    for (const Ray& ray : rays)
+    {
+        IntersectRange range;
+        hits += bvh.any(ray, range, 50.0f) >= 0;
+    }
+    time1 = timer.us();
+    print("BVH any", ray_count, time1 - time0);
+
+    // parallel: blocks of rays as tasks
+    const size_t block_size = 4096;
+    std::atomic<uint32> total { 0 };
+
+    time0 = timer.us();
+    ConcurrentQueue q("raytrace");
+    for (size_t base = 0; base < ray_count; base += block_size)
+    {
+        q.enqueue([&, base] {
+            const size_t end = std::min(ray_count, base + block_size);
+            uint32 count = 0;
+            for (size_t i = base; i < end; ++i)
+            {
+                IntersectRange range;
+                count += bvh.closest(rays[i], range) >= 0;
+            }
+            total += count;
+        });
+    }
+    q.wait();
+    time1 = timer.us();
+    print("BVH closest (parallel)", ray_count, time1 - time0);
+
+    printf("\nhits: %u, errors: %zu\n", hits + total, errors);
+}
+
+// ----------------------------------------------------------------------
+// packets
+// ----------------------------------------------------------------------
+
+/*
+    Nearest of a list of primitives for every ray: the single ray
+    Intersect / IntersectRange loop against RayStream with 4 and 8 lanes.
+    The stream sorts the rays into packets, which is timed separately.
+*/
+
+namespace
+{
+
+    template <typename Primitive>
+    void test_primitive(const char* name, const std::vector<Ray>& rays,
+                        const std::vector<Primitive>& primitives,
+                        const RayStream<float32x4>& stream4,
+                        const RayStream<float32x8>& stream8)
+    {
+        const size_t count = rays.size();
+        std::vector<float> distance[3];
+        std::vector<int32> hit[3];
+        for (int i = 0; i < 3; ++i)
+        {
+            distance[i].resize(count);
+            hit[i].resize(count);
+        }
+
+        Timer timer;
+
+        uint64 time0 = timer.us();
+        for (size_t i = 0; i < count; ++i)
+        {
+            float best = std::numeric_limits<float>::max();
+            int32 index = -1;
+            for (size_t j = 0; j < primitives.size(); ++j)
+            {
+                float t;
+                if (nearest(rays[i], primitives[j], t) && t < best)
+                {
+                    best = t;
+                    index = int32(j);
+                }
+            }
+            distance[0][i] = best;
+            hit[0][i] = index;
+        }
+        uint64 time1 = timer.us();
+        stream4.closest(primitives.data(), primitives.size(), distance[1].data(), hit[1].data());
+        uint64 time2 = timer.us();
+        stream8.closest(primitives.data(), primitives.size(), distance[2].data(), hit[2].data());
+        uint64 time3 = timer.us();
+
+        // the nearest primitive may differ where two are at the same
+        // distance, and a grazing hit may turn into a miss when the scalar
+        // and the SIMD math round differently (-ffast-math contracts them
+        // differently); a few rays in ten thousand is rounding, more is a bug
+        size_t mismatch = 0;
+        for (int k = 1; k < 3; ++k)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (hit[k][i] == hit[0][i])
+                    continue;
+                if (hit[k][i] < 0 || hit[0][i] < 0 ||
+                    std::abs(distance[k][i] - distance[0][i]) > 1e-3f * std::max(1.0f, distance[0][i]))
+                    ++mismatch;
+            }
+        }
+
+        const double tests = double(count) * primitives.size();
+        printf("%-10s %12.1f  %12.1f  %12.1f %s\n", name,
+            time1 > time0 ? tests / (time1 - time0) : 0.0,
+            time2 > time1 ? tests / (time2 - time1) : 0.0,
+            time3 > time2 ? tests / (time3 - time2) : 0.0,
+            mismatch * 10000 > count * 2 ? "(MISMATCH)" : "");
+    }
+
+} // namespace
+
+void test_packets(size_t ray_count, size_t primitive_count)
+{
+    const std::vector<Ray> rays = getRays(ray_count);
+
+    Random random;
+    random.seed = 3;
+
+    std::vector<Plane> planes;
+    std::vector<Sphere> spheres(primitive_count);
+    std::vector<Box> boxes = getBoxes(primitive_count);
+    std::vector<PacketTriangle> triangles;
+
+    // the rays go towards +z; the planes face them so that the one and two
+    // sided plane tests agree
+    for (size_t i = 0; i < primitive_count; ++i)
+    {
+        float3 normal = normalize(float3(random() - 0.5f, random() - 0.5f, -4.0f));
+        planes.emplace_back(normal, random() * 100.0f);
+    }
+
+    for (Sphere& sphere : spheres)
+    {
+        sphere.center = float3(random() * 100.0f, random() * 100.0f, random() * 100.0f);
+        sphere.radius = 1.0f + random() * 10.0f;
+    }
+
+    for (size_t i = 0; i < primitive_count; ++i)
+    {
+        float3 p(random() * 100.0f, random() * 100.0f, random() * 100.0f);
+        triangles.emplace_back(p,
+            float3(p.x + random() * 20.0f, p.y + random() * 5.0f, p.z + random() * 5.0f),
+            float3(p.x + random() * 5.0f, p.y + random() * 20.0f, p.z + random() * 5.0f));
+    }
+
+    Timer timer;
+    uint64 time0 = timer.us();
+    RayStream<float32x4> stream4(rays.data(), rays.size());
+    uint64 time1 = timer.us();
+    RayStream<float32x8> stream8(rays.data(), rays.size());
+    uint64 time2 = timer.us();
+
+    printf("\npackets: %zu rays x %zu primitives\n", ray_count, primitive_count);
+    printf("sort into packets: x4 %.1f ms, x8 %.1f ms\n\n",
+        (time1 - time0) / 1000.0, (time2 - time1) / 1000.0);
+    printf("primitive   single M/s   packet4 M/s   packet8 M/s\n");
+
+    test_primitive("Plane", rays, planes, stream4, stream8);
+    test_primitive("Sphere", rays, spheres, stream4, stream8);
+    test_primitive("Box", rays, boxes, stream4, stream8);
+    test_primitive("Triangle", rays, triangles, stream4, stream8);
+}
+
+// ----------------------------------------------------------------------
+// main()
+// ----------------------------------------------------------------------
+
+int main(int argc, const char* argv[])
+{
+    size_t box_count = 100000;
+    size_t ray_count = 1000000;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!std::strcmp(argv[i], "--boxes") && i + 1 < argc)
+            box_count = std::strtoul(argv[++i], nullptr, 10);
+        else if (!std::strcmp(argv[i], "--rays") && i + 1 < argc)
+            ray_count = std::strtoul(argv[++i], nullptr, 10);
+    }
+
+    test_bvh(box_count, ray_count);
+    test_packets(ray_count / 4, 64);
+}
@@ -0,0 +1,415 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#include <mango/mango.hpp>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <queue>
+#include <thread>
+
+using namespace mango;
+
+/*
+    Deadline-aware scheduling on top of the ThreadPool.
+
+    The Priority of a ConcurrentQueue is coarse on purpose (see
+    misc/concurrency.cpp example5). The problem we want to solve is a HIGH
+    priority interactive task waiting behind a flood of batch tasks which
+    were already handed to the pool before it arrived.
+
+    The trick is late binding. The tasks are not enqueued into the pool
+    directly; the scheduler keeps them in its own ready lists and enqueues a
+    "dispatch" task for each one. The dispatch decides which task to run when
+    a worker actually picks it up, not when it was submitted:
+
+    - earliest deadline first (EDF) among the queues which can run
+    - a task without an explicit deadline gets "now + budget" where the budget
+      comes from the queue; a LOW queue has a long budget but its deadline
+      does not move, so eventually it is the earliest one and gets to run.
+      This is the aging which guarantees that no queue is starved.
+    - a queue can be capped to K concurrently running tasks. A dispatch which
+      finds only capped queues is parked and re-issued when a task from a
+      capped queue completes.
+*/
+
+namespace
+{
+
+    inline uint64 now()
+    {
+        using namespace std::chrono;
+        return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    constexpr uint64 operator "" _us(unsigned long long value)
+    {
+        return value * 1000;
+    }
+
+    constexpr uint64 operator "" _ms(unsigned long long value)
+    {
+        return value * 1000 * 1000;
+    }
+
+} // namespace
+
+// -----------------------------------------------------------------
+// DeadlineScheduler
+// -----------------------------------------------------------------
+
+class DeadlineScheduler
+{
+public:
+    class Queue;
+
+protected:
+    struct Task
+    {
+        uint64 deadline;
+        uint64 sequence;
+        std::function<void()> function;
+
+        bool earlier(const Task& task) const
+        {
+            if (deadline != task.deadline)
+                return deadline < task.deadline;
+            return sequence < task.sequence;
+        }
+
+        // std::priority_queue is a max-heap; "less" is "later"
+        bool operator < (const Task& task) const
+        {
+            return task.earlier(*this);
+        }
+    };
+
+    ConcurrentQueue m_dispatch;
+    std::mutex m_mutex;
+    std::vector<Queue*> m_queues;
+    uint64 m_sequence = 0;
+    int m_parked = 0;
+
+    void submit(Queue* queue, uint64 deadline, std::function<void()> function);
+    void dispatch();
+
+public:
+    DeadlineScheduler()
+        : m_dispatch("deadline dispatch", Priority::HIGH)
+    {
+    }
+
+    ~DeadlineScheduler()
+    {
+        m_dispatch.wait();
+    }
+
+    void wait()
+    {
+        m_dispatch.wait();
+    }
+};
+
+/*
+    Queue which is scheduled by DeadlineScheduler.
+
+    budget:      relative deadline given to tasks enqueued without one
+    concurrency: maximum number of tasks from this queue running at once
+                 (0 = no limit)
+*/
+
+class DeadlineScheduler::Queue
+{
+protected:
+    friend class DeadlineScheduler;
+
+    DeadlineScheduler& m_scheduler;
+    std::string m_name;
+    uint64 m_budget;
+    int m_concurrency;
+    int m_running = 0;
+    std::priority_queue<Task> m_tasks;
+
+public:
+    Queue(DeadlineScheduler& scheduler, const std::string& name, uint64 budget, int concurrency = 0)
+        : m_scheduler(scheduler)
+        , m_name(name)
+        , m_budget(budget)
+        , m_concurrency(concurrency)
+    {
+        std::lock_guard<std::mutex> lock(m_scheduler.m_mutex);
+        m_scheduler.m_queues.push_back(this);
+    }
+
+    ~Queue()
+    {
+        m_scheduler.wait();
+        std::lock_guard<std::mutex> lock(m_scheduler.m_mutex);
+        auto& queues = m_scheduler.m_queues;
+        queues.erase(std::remove(queues.begin(), queues.end(), this), queues.end());
+    }
+
+    // deadline is relative to now
+    template <typename Function>
+    void enqueue(uint64 deadline, Function&& function)
+    {
+        m_scheduler.submit(this, now() + deadline, std::forward<Function>(function));
+    }
+
+    template <typename Function>
+    void enqueue(Function&& function)
+    {
+        m_scheduler.submit(this, now() + m_budget, std::forward<Function>(function));
+    }
+
+    bool runnable() const
+    {
+        return !m_tasks.empty() && (!m_concurrency || m_running < m_concurrency);
+    }
+};
+
+void DeadlineScheduler::submit(Queue* queue, uint64 deadline, std::function<void()> function)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        queue->m_tasks.push({ deadline, m_sequence++, std::move(function) });
+    }
+
+    m_dispatch.enqueue([this] {
+        dispatch();
+    });
+}
+
+void DeadlineScheduler::dispatch()
+{
+    Queue* queue = nullptr;
+    Task task;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // earliest deadline among the queues which are allowed to run;
+        // the number of queues is small so a linear scan is the fastest
+        for (Queue* q : m_queues)
+        {
+            if (q->runnable())
+            {
+                if (!queue || q->m_tasks.top().earlier(queue->m_tasks.top()))
+                    queue = q;
+            }
+        }
+
+        if (!queue)
+        {
+            // everything that is pending is capped
+            ++m_parked;
+            return;
+        }
+
+        task = queue->m_tasks.top();
+        queue->m_tasks.pop();
+        ++queue->m_running;
+    }
+
+    task.function();
+
+    int reissue = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        --queue->m_running;
+
+        // a slot in a capped queue was released; wake up a parked dispatch
+        if (m_parked && queue->m_concurrency)
+        {
+            --m_parked;
+            reissue = 1;
+        }
+    }
+
+    if (reissue)
+    {
+        m_dispatch.enqueue([this] {
+            dispatch();
+        });
+    }
+}
+
+// -----------------------------------------------------------------
+// benchmark
+// -----------------------------------------------------------------
+
+namespace
+{
+
+    std::atomic<uint32> g_sink { 0 };
+
+    void spin(uint64 duration)
+    {
+        const uint64 end = now() + duration;
+        uint32 x = 0;
+        while (now() < end)
+        {
+            x = x * 1664525 + 1013904223;
+        }
+        g_sink += x;
+    }
+
+    struct Latency
+    {
+        std::mutex mutex;
+        std::vector<uint64> samples;
+
+        void add(uint64 value)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            samples.push_back(value);
+        }
+
+        void print(const char* name)
+        {
+            std::sort(samples.begin(), samples.end());
+            auto percentile = [this] (double p) {
+                return samples[std::min(samples.size() - 1, size_t(samples.size() * p))] / 1000.0;
+            };
+            printf("%-28s p50: %8.1f us  p99: %8.1f us  max: %8.1f us\n", name,
+                percentile(0.50), percentile(0.99), samples.back() / 1000.0);
+        }
+    };
+
+    const int batch_tasks = 20000;
+    const uint64 batch_work = 200_us;
+    const int interactive_tasks = 200;
+    const uint64 interactive_work = 100_us;
+    const uint64 interactive_interval = 2_ms;
+    const int background_tasks = 20;
+
+} // namespace
+
+/*
+    Baseline: two plain queues with different Priority. The batch flood is
+    in the pool before the interactive tasks arrive.
+*/
+void test_priority_queues()
+{
+    ConcurrentQueue batch("batch", Priority::LOW);
+    ConcurrentQueue interactive("interactive", Priority::HIGH);
+
+    for (int i = 0; i < batch_tasks; ++i)
+    {
+        batch.enqueue([] {
+            spin(batch_work);
+        });
+    }
+
+    Latency latency;
+
+    for (int i = 0; i < interactive_tasks; ++i)
+    {
+        const uint64 time = now();
+        interactive.enqueue([time, &latency] {
+            latency.add(now() - time);
+            spin(interactive_work);
+        });
+        std::this_thread::sleep_for(std::chrono::nanoseconds(interactive_interval));
+    }
+
+    interactive.wait();
+    latency.print("Priority::HIGH vs LOW");
+    batch.wait();
+}
+
+void test_deadline(const char* name, int batch_concurrency)
+{
+    DeadlineScheduler scheduler;
+    DeadlineScheduler::Queue batch(scheduler, "batch", 1000_ms, batch_concurrency);
+    DeadlineScheduler::Queue interactive(scheduler, "interactive", 1_ms);
+
+    for (int i = 0; i < batch_tasks; ++i)
+    {
+        batch.enqueue([] {
+            spin(batch_work);
+        });
+    }
+
+    Latency latency;
+
+    for (int i = 0; i < interactive_tasks; ++i)
+    {
+        const uint64 time = now();
+        interactive.enqueue([time, &latency] {
+            latency.add(now() - time);
+            spin(interactive_work);
+        });
+        std::this_thread::sleep_for(std::chrono::nanoseconds(interactive_interval));
+    }
+
+    scheduler.wait();
+    latency.print(name);
+}
+
+/*
+    Aging: a stream of batch work which keeps the pool oversubscribed 2x for
+    one second, and a background queue with 3x the budget of the batch
+    queue submitted at the start. Fresh batch work goes first, but the
+    background deadlines do not move; once the batch tasks being picked up
+    were submitted later than 200 ms after the background tasks, the
+    background tasks are the earliest and run while the stream continues.
+    With plain priorities they would wait until the backlog has drained.
+*/
+void test_aging(int workers)
+{
+    DeadlineScheduler scheduler;
+    DeadlineScheduler::Queue batch(scheduler, "batch", 100_ms);
+    DeadlineScheduler::Queue background(scheduler, "background", 300_ms, 1);
+
+    const uint64 time0 = now();
+    std::atomic<uint64> background_end { 0 };
+
+    for (int i = 0; i < background_tasks; ++i)
+    {
+        background.enqueue([&background_end] {
+            spin(batch_work);
+            background_end = now();
+        });
+    }
+
+    // two times the work the pool can do in one interval
+    const int wave = workers * int(interactive_interval / batch_work) * 2;
+    const int waves = 500;
+
+    for (int i = 0; i < waves; ++i)
+    {
+        for (int j = 0; j < wave; ++j)
+        {
+            batch.enqueue([] {
+                spin(batch_work);
+            });
+        }
+        std::this_thread::sleep_for(std::chrono::nanoseconds(interactive_interval));
+    }
+
+    const uint64 time1 = now();
+    scheduler.wait();
+    const uint64 time2 = now();
+
+    printf("aging: %d background tasks done at %d ms, batch stream ended at %d ms, drained at %d ms\n",
+        background_tasks, int((background_end - time0) / 1000000),
+        int((time1 - time0) / 1000000), int((time2 - time0) / 1000000));
+}
+
+// -----------------------------------------------------------------
+// main
+// -----------------------------------------------------------------
+
+int main(int argc, const char* argv[])
+{
+    const int workers = ThreadPool::getHardwareConcurrency();
+    printf("%d workers, %d batch tasks (%d us), %d interactive tasks (%d us)\n\n",
+        workers, batch_tasks, int(batch_work / 1000), interactive_tasks, int(interactive_work / 1000));
+
+    test_priority_queues();
+    test_deadline("EDF", 0);
+    test_deadline("EDF, batch capped to N-1", std::max(1, workers - 1));
+    test_aging(workers);
+}
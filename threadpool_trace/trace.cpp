@@ -0,0 +1,573 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#include <mango/mango.hpp>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+
+using namespace mango;
+
+/*
+    ThreadPool instrumentation. The queue name and Priority are given to the
+    queue "for debugging and instrumenting" (see misc/concurrency.cpp example5);
+    this is how that information can be put to use.
+
+    Every task that goes through a TracedQueue records:
+    - enqueue-to-start latency into a per-queue histogram
+    - a span (begin, end, queue) into the ring buffer of the worker that ran it
+    - per-worker busy time, idle gaps and "foreign" executions: tasks which
+      were enqueued by a task running on another worker
+
+    The spans can be written out as Chrome trace JSON which loads into
+    chrome://tracing and https://ui.perfetto.dev
+
+    Cost control:
+    - compile with -DMANGO_ENABLE_TRACE=0 and TracedQueue is the plain queue
+    - at runtime, trace::enable(false) reduces the overhead to one relaxed
+      atomic load per enqueue
+*/
+
+#ifndef MANGO_ENABLE_TRACE
+#define MANGO_ENABLE_TRACE 1
+#endif
+
+namespace trace
+{
+
+    // -----------------------------------------------------------------
+    // clock
+    // -----------------------------------------------------------------
+
+    inline uint64 now()
+    {
+        using namespace std::chrono;
+        return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    std::atomic<bool> g_enabled { true };
+
+    inline bool enabled()
+    {
+        return g_enabled.load(std::memory_order_relaxed);
+    }
+
+    inline void enable(bool enable)
+    {
+        g_enabled.store(enable, std::memory_order_relaxed);
+    }
+
+    // -----------------------------------------------------------------
+    // Histogram
+    // -----------------------------------------------------------------
+
+    /*
+        Log2 histogram of latencies in nanoseconds. Bucket n counts samples
+        in range [2^n, 2^(n+1)) so the percentiles are accurate to a factor of
+        two which is plenty for spotting scheduling problems.
+    */
+
+    struct Histogram
+    {
+        static constexpr int buckets = 40;
+
+        std::atomic<uint64> count[buckets];
+        std::atomic<uint64> samples { 0 };
+        std::atomic<uint64> total { 0 };
+
+        Histogram()
+        {
+            for (auto& c : count)
+            {
+                c = 0;
+            }
+        }
+
+        void add(uint64 ns)
+        {
+            int index = 0;
+            while (index < buckets - 1 && (ns >> (index + 1)))
+            {
+                ++index;
+            }
+
+            count[index].fetch_add(1, std::memory_order_relaxed);
+            samples.fetch_add(1, std::memory_order_relaxed);
+            total.fetch_add(ns, std::memory_order_relaxed);
+        }
+
+        // upper bound of the bucket containing the given percentile
+        uint64 percentile(double p) const
+        {
+            const uint64 n = samples.load();
+            const uint64 target = uint64(n * p);
+
+            uint64 accumulated = 0;
+            for (int i = 0; i < buckets; ++i)
+            {
+                accumulated += count[i].load();
+                if (accumulated > target)
+                    return uint64(2) << i;
+            }
+
+            return uint64(1) << (buckets - 1);
+        }
+
+        uint64 average() const
+        {
+            const uint64 n = samples.load();
+            return n ? total.load() / n : 0;
+        }
+    };
+
+    // -----------------------------------------------------------------
+    // QueueInfo
+    // -----------------------------------------------------------------
+
+    struct QueueInfo
+    {
+        std::string name;
+        Priority priority;
+        Histogram latency;
+        std::atomic<uint64> tasks { 0 };
+
+        QueueInfo(const std::string& name, Priority priority)
+            : name(name)
+            , priority(priority)
+        {
+        }
+    };
+
+    const char* getPriorityName(Priority priority)
+    {
+        switch (priority)
+        {
+            case Priority::LOW: return "LOW";
+            case Priority::NORMAL: return "NORMAL";
+            case Priority::HIGH: return "HIGH";
+        }
+        return "";
+    }
+
+    // -----------------------------------------------------------------
+    // Worker
+    // -----------------------------------------------------------------
+
+    /*
+        Per-thread ring buffer of completed task spans. Only the owning thread
+        writes into the ring so recording is two stores and an increment. The
+        oldest spans are overwritten when the ring is full; exporting should
+        be done when the queues are idle (after wait()).
+    */
+
+    struct Span
+    {
+        uint64 begin;
+        uint64 end;
+        const QueueInfo* queue;
+    };
+
+    struct Worker
+    {
+        static constexpr size_t capacity = 1 << 16;
+
+        int id;
+        std::vector<Span> ring;
+        uint64 head = 0;
+
+        // counters
+        uint64 tasks = 0;
+        uint64 busy = 0;
+        uint64 idle = 0;
+        uint64 foreign = 0;
+        uint64 last_end = 0;
+
+        Worker(int id)
+            : id(id)
+            , ring(capacity)
+        {
+        }
+
+        void record(const QueueInfo* queue, uint64 begin, uint64 end)
+        {
+            ring[head & (capacity - 1)] = { begin, end, queue };
+            ++head;
+
+            ++tasks;
+            busy += end - begin;
+            if (last_end)
+            {
+                idle += begin - last_end;
+            }
+            last_end = end;
+        }
+    };
+
+    // worker of the traced task which is running on this thread; nullptr
+    // outside of a task (main thread, untraced tasks)
+    thread_local Worker* t_running = nullptr;
+
+    // queue names go into the trace verbatim; escape them for JSON
+    std::string escape(const std::string& text)
+    {
+        std::string result;
+        for (char c : text)
+        {
+            switch (c)
+            {
+                case '"': result += "\\\""; break;
+                case '\\': result += "\\\\"; break;
+                case '\n': result += "\\n"; break;
+                case '\r': result += "\\r"; break;
+                case '\t': result += "\\t"; break;
+                default:
+                    if (uint8(c) < 0x20)
+                    {
+                        char code[8];
+                        snprintf(code, sizeof(code), "\\u%04x", int(c));
+                        result += code;
+                    }
+                    else
+                    {
+                        result += c;
+                    }
+                    break;
+            }
+        }
+        return result;
+    }
+
+    // -----------------------------------------------------------------
+    // Registry
+    // -----------------------------------------------------------------
+
+    /*
+        Process-wide list of queues and workers. The mutex is only taken
+        when a queue is created or a thread records its first span.
+    */
+
+    class Registry
+    {
+    protected:
+        std::mutex m_mutex;
+        std::vector<std::unique_ptr<QueueInfo>> m_queues;
+        std::vector<std::unique_ptr<Worker>> m_workers;
+
+    public:
+        static Registry& instance()
+        {
+            static Registry registry;
+            return registry;
+        }
+
+        QueueInfo* createQueue(const std::string& name, Priority priority)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queues.emplace_back(new QueueInfo(name, priority));
+            return m_queues.back().get();
+        }
+
+        Worker* createWorker()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_workers.emplace_back(new Worker(int(m_workers.size())));
+            return m_workers.back().get();
+        }
+
+        static Worker* getWorker()
+        {
+            thread_local Worker* worker = instance().createWorker();
+            return worker;
+        }
+
+        void report();
+        void writeChromeTrace(const std::string& filename);
+    };
+
+    void Registry::report()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        printf("queue                     priority     tasks   avg us   p50 us   p99 us\n");
+        for (auto& queue : m_queues)
+        {
+            printf("%-24s  %-8s %9llu %8.1f %8.1f %8.1f\n",
+                queue->name.c_str(), getPriorityName(queue->priority),
+                (unsigned long long)queue->tasks.load(),
+                queue->latency.average() / 1000.0,
+                queue->latency.percentile(0.50) / 1000.0,
+                queue->latency.percentile(0.99) / 1000.0);
+        }
+
+        printf("\nworker     tasks   busy ms   idle ms   foreign\n");
+        for (auto& worker : m_workers)
+        {
+            printf("%6d %9llu %9.1f %9.1f %9llu\n", worker->id,
+                (unsigned long long)worker->tasks,
+                worker->busy / 1000000.0,
+                worker->idle / 1000000.0,
+                (unsigned long long)worker->foreign);
+        }
+    }
+
+    void Registry::writeChromeTrace(const std::string& filename)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        FILE* file = fopen(filename.c_str(), "w");
+        if (!file)
+        {
+            printf("can't open %s\n", filename.c_str());
+            return;
+        }
+
+        uint64 origin = ~uint64(0);
+        for (auto& worker : m_workers)
+        {
+            const uint64 count = std::min<uint64>(worker->head, Worker::capacity);
+            for (uint64 i = worker->head - count; i < worker->head; ++i)
+            {
+                origin = std::min(origin, worker->ring[i & (Worker::capacity - 1)].begin);
+            }
+        }
+
+        fprintf(file, "{\"traceEvents\":[\n");
+
+        std::vector<std::string> names;
+        for (auto& queue : m_queues)
+        {
+            names.push_back(escape(queue->name));
+        }
+
+        auto getName = [&] (const QueueInfo* info) -> const std::string&
+        {
+            size_t index = 0;
+            while (m_queues[index].get() != info)
+            {
+                ++index;
+            }
+            return names[index];
+        };
+
+        const char* separator = "";
+        for (auto& worker : m_workers)
+        {
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}",
+                separator, worker->id, worker->id);
+            separator = ",\n";
+
+            // complete ("X") events; timestamps are in microseconds
+            const uint64 count = std::min<uint64>(worker->head, Worker::capacity);
+            for (uint64 i = worker->head - count; i < worker->head; ++i)
+            {
+                const Span& span = worker->ring[i & (Worker::capacity - 1)];
+                fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    separator, getName(span.queue).c_str(), getPriorityName(span.queue->priority),
+                    worker->id, (span.begin - origin) / 1000.0, (span.end - span.begin) / 1000.0);
+            }
+        }
+
+        fprintf(file, "\n]}\n");
+        fclose(file);
+    }
+
+} // namespace trace
+
+// -----------------------------------------------------------------
+// TracedQueue
+// -----------------------------------------------------------------
+
+/*
+    Drop-in replacement for ConcurrentQueue / SerialQueue. The task is
+    wrapped so that the enqueue time is captured and the execution is
+    recorded on the worker which runs it.
+
+    "foreign" counts tasks that were enqueued by a traced task on one
+    worker and executed by another worker; it is the closest observable
+    thing to a steal without instrumenting the pool internals. Tasks
+    enqueued from outside of a task (the main thread) have no producing
+    worker and are never counted.
+*/
+
+#if MANGO_ENABLE_TRACE
+
+template <typename Queue>
+class TracedQueue
+{
+protected:
+    Queue m_queue;
+    trace::QueueInfo* m_info;
+
+public:
+    TracedQueue(const std::string& name, Priority priority = Priority::NORMAL)
+        : m_queue(name, priority)
+        , m_info(trace::Registry::instance().createQueue(name, priority))
+    {
+    }
+
+    template <typename Function>
+    void enqueue(Function&& function)
+    {
+        if (!trace::enabled())
+        {
+            m_queue.enqueue(std::forward<Function>(function));
+            return;
+        }
+
+        const uint64 time = trace::now();
+        const trace::Worker* producer = trace::t_running;
+        trace::QueueInfo* info = m_info;
+
+        m_queue.enqueue([function, time, producer, info] {
+            trace::Worker* worker = trace::Registry::getWorker();
+            trace::Worker* outer = trace::t_running;
+            trace::t_running = worker;
+
+            const uint64 begin = trace::now();
+            function();
+            const uint64 end = trace::now();
+
+            trace::t_running = outer;
+
+            info->latency.add(begin - time);
+            info->tasks.fetch_add(1, std::memory_order_relaxed);
+            worker->record(info, begin, end);
+            worker->foreign += (producer && producer != worker);
+        });
+    }
+
+    void wait()
+    {
+        m_queue.wait();
+    }
+
+    void barrier()
+    {
+        m_queue.barrier();
+    }
+};
+
+#else
+
+template <typename Queue>
+class TracedQueue : public Queue
+{
+public:
+    TracedQueue(const std::string& name, Priority priority = Priority::NORMAL)
+        : Queue(name, priority)
+    {
+    }
+};
+
+#endif
+
+// -----------------------------------------------------------------
+// workload
+// -----------------------------------------------------------------
+
+namespace
+{
+
+    float compute(int iterations)
+    {
+        float x = 1.0f;
+        for (int i = 0; i < iterations; ++i)
+        {
+            x = x * 1.000001f + 0.5f;
+        }
+        return x;
+    }
+
+} // namespace
+
+void test_trace()
+{
+    TracedQueue<ConcurrentQueue> batch("batch", Priority::LOW);
+    TracedQueue<ConcurrentQueue> interactive("interactive", Priority::HIGH);
+    TracedQueue<SerialQueue> io("io serial", Priority::NORMAL);
+    TracedQueue<ConcurrentQueue> followup("batch followup", Priority::LOW);
+
+    std::atomic<float> sink { 0.0f };
+
+    for (int i = 0; i < 20000; ++i)
+    {
+        // every 10th batch task continues in another task: these are the
+        // ones which can show up as foreign executions
+        const bool split = (i % 10) == 0;
+        batch.enqueue([&sink, &followup, split] {
+            sink = compute(20000);
+            if (split)
+            {
+                followup.enqueue([&sink] {
+                    sink = compute(5000);
+                });
+            }
+        });
+
+        if (i % 100 == 0)
+        {
+            interactive.enqueue([&sink] {
+                sink = compute(5000);
+            });
+        }
+
+        if (i % 50 == 0)
+        {
+            io.enqueue([&sink] {
+                sink = compute(1000);
+            });
+        }
+    }
+
+    batch.wait();
+    followup.wait();
+    interactive.wait();
+    io.wait();
+}
+
+// Same workload with the instrumentation disabled at runtime
+// to measure what the hooks cost when they are left in.
+uint64 test_overhead(bool enable)
+{
+    trace::enable(enable);
+
+    TracedQueue<ConcurrentQueue> q("overhead");
+
+    Timer timer;
+    uint64 time0 = timer.us();
+
+    std::atomic<int> counter { 0 };
+    for (int i = 0; i < 1000000; ++i)
+    {
+        q.enqueue([&counter] {
+            ++counter;
+        });
+    }
+    q.wait();
+
+    uint64 time1 = timer.us();
+
+    trace::enable(true);
+    return time1 - time0;
+}
+
+// -----------------------------------------------------------------
+// main
+// -----------------------------------------------------------------
+
+int main(int argc, const char* argv[])
+{
+    const char* filename = argc > 1 ? argv[1] : "trace.json";
+
+    test_trace();
+
+    trace::Registry::instance().report();
+    trace::Registry::instance().writeChromeTrace(filename);
+    printf("\ntrace: %s\n", filename);
+
+    uint64 enabled = test_overhead(true);
+    uint64 disabled = test_overhead(false);
+    printf("1M trivial tasks: %d ms traced, %d ms disabled\n", int(enabled / 1000), int(disabled / 1000));
+}
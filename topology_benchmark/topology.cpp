@@ -0,0 +1,634 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#include <mango/mango.hpp>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <tuple>
+#include <pthread.h>
+#include <sched.h>
+
+using namespace mango;
+
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+/*
+    CPU topology aware worker placement.
+
+    The ThreadPool creates one worker per hardware thread and lets the OS
+    decide where they run. For memory bound work, like the particle
+    transforms in particle_benchmark, two workers on SMT siblings of the same
+    core compete for the same L1/L2 and load ports and the throughput can get
+    worse with more threads.
+
+    This benchmark reads the topology from sysfs, places pinned workers
+    according to a policy and measures the particle and jpeg workloads:
+
+    PHYSICAL:  one worker per physical core
+    COMPACT:   fill SMT siblings and cores of one L3 domain before the next
+    SCATTER:   spread across sockets and L3 domains first, SMT siblings last
+
+    Queues can also be bound to an L3 domain; their tasks prefer workers in
+    that domain so the data they touch stays in one shared cache.
+
+    Linux only; the sysfs layout is documented in
+    Documentation/ABI/testing/sysfs-devices-system-cpu
+*/
+
+// -----------------------------------------------------------------
+// Topology
+// -----------------------------------------------------------------
+
+struct LogicalCPU
+{
+    int id;
+    int socket;
+    int core;     // unique across sockets
+    int smt;      // index among the core's siblings
+    int domain;   // L3 domain index
+};
+
+struct Topology
+{
+    std::vector<LogicalCPU> cpus;
+    int sockets = 0;
+    int cores = 0;
+    int domains = 0;
+
+    Topology();
+    void print() const;
+};
+
+namespace
+{
+
+    std::string readLine(const std::string& filename)
+    {
+        std::ifstream file(filename);
+        std::string line;
+        std::getline(file, line);
+        return line;
+    }
+
+    int readInt(const std::string& filename, int fallback)
+    {
+        std::string line = readLine(filename);
+        return line.empty() ? fallback : std::atoi(line.c_str());
+    }
+
+    // parse "0-3,8-11" into { 0, 1, 2, 3, 8, 9, 10, 11 }
+    std::vector<int> parseList(const std::string& text)
+    {
+        std::vector<int> list;
+        std::stringstream stream(text);
+        std::string range;
+
+        while (std::getline(stream, range, ','))
+        {
+            if (range.empty())
+                continue;
+
+            int first = 0;
+            int last = 0;
+            if (std::sscanf(range.c_str(), "%d-%d", &first, &last) == 2)
+            {
+                for (int i = first; i <= last; ++i)
+                    list.push_back(i);
+            }
+            else
+            {
+                list.push_back(std::atoi(range.c_str()));
+            }
+        }
+
+        return list;
+    }
+
+} // namespace
+
+Topology::Topology()
+{
+    const std::string base = "/sys/devices/system/cpu/";
+    std::vector<int> online = parseList(readLine(base + "online"));
+
+    if (online.empty())
+    {
+        // no sysfs; pretend every hardware thread is a core of its own
+        for (int i = 0; i < int(std::thread::hardware_concurrency()); ++i)
+            online.push_back(i);
+    }
+
+    std::map<std::pair<int, int>, int> core_index;   // (socket, core_id) -> core
+    std::map<std::string, int> domain_index;         // L3 shared_cpu_list -> domain
+    std::map<int, int> socket_index;
+
+    for (int id : online)
+    {
+        const std::string path = base + "cpu" + std::to_string(id) + "/";
+
+        LogicalCPU cpu;
+        cpu.id = id;
+
+        int package = readInt(path + "topology/physical_package_id", 0);
+        int core_id = readInt(path + "topology/core_id", id);
+
+        if (socket_index.find(package) == socket_index.end())
+        {
+            int index = int(socket_index.size());
+            socket_index[package] = index;
+        }
+        cpu.socket = socket_index[package];
+
+        auto key = std::make_pair(package, core_id);
+        if (core_index.find(key) == core_index.end())
+        {
+            int index = int(core_index.size());
+            core_index[key] = index;
+        }
+        cpu.core = core_index[key];
+
+        std::vector<int> siblings = parseList(readLine(path + "topology/thread_siblings_list"));
+        auto it = std::find(siblings.begin(), siblings.end(), id);
+        cpu.smt = it != siblings.end() ? int(it - siblings.begin()) : 0;
+
+        // find the highest level cache; usually L3 but some systems only report L2
+        std::string shared = "socket" + std::to_string(package);
+        int best_level = 0;
+        for (int index = 0; index < 8; ++index)
+        {
+            const std::string cache = path + "cache/index" + std::to_string(index) + "/";
+            int level = readInt(cache + "level", -1);
+            if (level < 0)
+                break;
+
+            if (level > best_level)
+            {
+                best_level = level;
+                shared = readLine(cache + "shared_cpu_list");
+            }
+        }
+
+        if (domain_index.find(shared) == domain_index.end())
+        {
+            int index = int(domain_index.size());
+            domain_index[shared] = index;
+        }
+        cpu.domain = domain_index[shared];
+
+        cpus.push_back(cpu);
+    }
+
+    sockets = int(socket_index.size());
+    cores = int(core_index.size());
+    domains = int(domain_index.size());
+}
+
+void Topology::print() const
+{
+    printf("topology: %d sockets, %d L3 domains, %d cores, %d threads\n",
+        sockets, domains, cores, int(cpus.size()));
+    for (const LogicalCPU& cpu : cpus)
+    {
+        printf("  cpu %3d: socket %d, domain %d, core %3d, smt %d\n",
+            cpu.id, cpu.socket, cpu.domain, cpu.core, cpu.smt);
+    }
+}
+
+// -----------------------------------------------------------------
+// Placement
+// -----------------------------------------------------------------
+
+enum class Placement
+{
+    PHYSICAL,
+    COMPACT,
+    SCATTER,
+};
+
+const char* getPlacementName(Placement placement)
+{
+    switch (placement)
+    {
+        case Placement::PHYSICAL: return "physical";
+        case Placement::COMPACT: return "compact";
+        case Placement::SCATTER: return "scatter";
+    }
+    return "";
+}
+
+// Returns the logical cpus, in the order workers should be placed on them.
+std::vector<LogicalCPU> getPlacement(const Topology& topology, Placement placement)
+{
+    std::vector<LogicalCPU> cpus = topology.cpus;
+
+    switch (placement)
+    {
+        case Placement::PHYSICAL:
+        {
+            cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [] (const LogicalCPU& cpu) {
+                return cpu.smt != 0;
+            }), cpus.end());
+            break;
+        }
+
+        case Placement::COMPACT:
+        {
+            std::sort(cpus.begin(), cpus.end(), [] (const LogicalCPU& a, const LogicalCPU& b) {
+                return std::tie(a.socket, a.domain, a.core, a.smt) < std::tie(b.socket, b.domain, b.core, b.smt);
+            });
+            break;
+        }
+
+        case Placement::SCATTER:
+        {
+            // rank of each cpu inside its domain, counting cores first
+            std::map<int, std::vector<int>> domain_cores;
+            for (const LogicalCPU& cpu : cpus)
+            {
+                auto& list = domain_cores[cpu.domain];
+                if (std::find(list.begin(), list.end(), cpu.core) == list.end())
+                    list.push_back(cpu.core);
+            }
+
+            auto rank = [&] (const LogicalCPU& cpu) {
+                auto& list = domain_cores[cpu.domain];
+                return int(std::find(list.begin(), list.end(), cpu.core) - list.begin());
+            };
+
+            std::sort(cpus.begin(), cpus.end(), [&] (const LogicalCPU& a, const LogicalCPU& b) {
+                return std::make_tuple(a.smt, rank(a), a.domain, a.socket) <
+                       std::make_tuple(b.smt, rank(b), b.domain, b.socket);
+            });
+            break;
+        }
+    }
+
+    return cpus;
+}
+
+// -----------------------------------------------------------------
+// PinnedPool
+// -----------------------------------------------------------------
+
+/*
+    Minimal pool of pinned worker threads used to measure the placement.
+    Each L3 domain has its own task list; a worker takes from its own domain
+    first and only then from the others, so a domain-bound queue runs in
+    its own domain as long as that domain has capacity.
+*/
+
+class PinnedPool
+{
+public:
+    class Queue;
+
+protected:
+    using Task = std::function<void()>;
+
+    struct Domain
+    {
+        std::deque<Task> tasks;
+    };
+
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::vector<Domain> m_domains;
+    std::vector<std::thread> m_threads;
+    bool m_stop = false;
+    size_t m_pending = 0;
+    std::condition_variable m_idle;
+
+    bool pop(int domain, Task& task)
+    {
+        for (size_t i = 0; i < m_domains.size(); ++i)
+        {
+            auto& tasks = m_domains[(domain + i) % m_domains.size()].tasks;
+            if (!tasks.empty())
+            {
+                task = std::move(tasks.front());
+                tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(int domain)
+    {
+        for (;;)
+        {
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_condition.wait(lock, [&] { return m_stop || pop(domain, task); });
+                if (!task)
+                    return;
+            }
+
+            task();
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (--m_pending == 0)
+                m_idle.notify_all();
+        }
+    }
+
+public:
+    PinnedPool(const Topology& topology, const std::vector<LogicalCPU>& cpus, size_t count)
+        : m_domains(std::max(1, topology.domains))
+    {
+        count = std::min(count, cpus.size());
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            const LogicalCPU cpu = cpus[i];
+            m_threads.emplace_back([this, cpu] {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpu.id, &set);
+                pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+                run(cpu.domain);
+            });
+        }
+    }
+
+    ~PinnedPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_condition.notify_all();
+
+        for (auto& thread : m_threads)
+            thread.join();
+    }
+
+    size_t size() const
+    {
+        return m_threads.size();
+    }
+
+    int domains() const
+    {
+        return int(m_domains.size());
+    }
+
+    void enqueue(int domain, Task task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_domains[domain % m_domains.size()].tasks.push_back(std::move(task));
+            ++m_pending;
+        }
+        m_condition.notify_one();
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_idle.wait(lock, [this] { return m_pending == 0; });
+    }
+};
+
+// Queue bound to an L3 domain; -1 spreads the tasks over all domains.
+class PinnedPool::Queue
+{
+protected:
+    PinnedPool& m_pool;
+    int m_domain;
+    int m_next = 0;
+
+public:
+    Queue(PinnedPool& pool, int domain = -1)
+        : m_pool(pool)
+        , m_domain(domain)
+    {
+    }
+
+    template <typename Function>
+    void enqueue(Function&& function)
+    {
+        int domain = m_domain >= 0 ? m_domain : m_next++;
+        m_pool.enqueue(domain, std::forward<Function>(function));
+    }
+};
+
+// -----------------------------------------------------------------
+// particle workload
+// -----------------------------------------------------------------
+
+/*
+    method2 from particle_benchmark: SoA with float4 positions and velocities.
+*/
+
+struct Particles
+{
+    AlignedVector<float4> positions;
+    AlignedVector<float4> velocities;
+
+    Particles(size_t count)
+        : positions(count)
+        , velocities(count)
+    {
+        std::mt19937 mt(1);
+        std::uniform_real_distribution<float> dist(-1.0, 1.0);
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            positions[i] = float4(dist(mt), dist(mt), dist(mt), 1.0f);
+            velocities[i] = float4(dist(mt), dist(mt), dist(mt), 0.0f);
+        }
+    }
+
+    void transform(size_t first, size_t last)
+    {
+        for (size_t i = first; i < last; ++i)
+        {
+            positions[i] += velocities[i];
+        }
+    }
+};
+
+const size_t particle_count = 4 * 1000 * 1000;
+const size_t particle_chunk = 16 * 1024;
+const int particle_frames = 60;
+
+// "affine" binds chunk n always to the same domain so repeated frames
+// find the data in the same L3; otherwise the chunks go round-robin
+uint64 test_particles(PinnedPool& pool, Particles& particles, bool affine)
+{
+    std::vector<std::unique_ptr<PinnedPool::Queue>> queues;
+    for (int domain = 0; domain < pool.domains(); ++domain)
+    {
+        queues.emplace_back(new PinnedPool::Queue(pool, affine ? domain : -1));
+    }
+
+    const size_t chunks = (particle_count + particle_chunk - 1) / particle_chunk;
+    const size_t chunks_per_domain = (chunks + queues.size() - 1) / queues.size();
+
+    Timer timer;
+    uint64 time0 = timer.us();
+
+    for (int frame = 0; frame < particle_frames; ++frame)
+    {
+        for (size_t chunk = 0; chunk < chunks; ++chunk)
+        {
+            const size_t first = chunk * particle_chunk;
+            const size_t last = std::min(first + particle_chunk, particle_count);
+            queues[chunk / chunks_per_domain]->enqueue([&particles, first, last] {
+                particles.transform(first, last);
+            });
+        }
+
+        pool.wait();
+    }
+
+    uint64 time1 = timer.us();
+    return time1 - time0;
+}
+
+uint64 test_particles_threadpool(Particles& particles)
+{
+    const size_t chunks = (particle_count + particle_chunk - 1) / particle_chunk;
+
+    Timer timer;
+    uint64 time0 = timer.us();
+
+    for (int frame = 0; frame < particle_frames; ++frame)
+    {
+        ConcurrentQueue q;
+
+        for (size_t chunk = 0; chunk < chunks; ++chunk)
+        {
+            const size_t first = chunk * particle_chunk;
+            const size_t last = std::min(first + particle_chunk, particle_count);
+            q.enqueue([&particles, first, last] {
+                particles.transform(first, last);
+            });
+        }
+
+        q.wait();
+    }
+
+    uint64 time1 = timer.us();
+    return time1 - time0;
+}
+
+// -----------------------------------------------------------------
+// jpeg workload
+// -----------------------------------------------------------------
+
+uint64 test_jpeg(PinnedPool& pool, const Path& path)
+{
+    PinnedPool::Queue q(pool);
+
+    Timer timer;
+    uint64 time0 = timer.us();
+
+    for (size_t i = 0; i < path.size(); ++i)
+    {
+        const auto& node = path[i];
+        if (!node.isDirectory())
+        {
+            std::string filename = node.name;
+            q.enqueue([&path, filename] {
+                File file(path, filename);
+                Bitmap bitmap(file, filename);
+            });
+        }
+    }
+
+    pool.wait();
+
+    uint64 time1 = timer.us();
+    return time1 - time0;
+}
+
+uint64 test_jpeg_threadpool(const Path& path)
+{
+    ConcurrentQueue q;
+
+    Timer timer;
+    uint64 time0 = timer.us();
+
+    for (size_t i = 0; i < path.size(); ++i)
+    {
+        const auto& node = path[i];
+        if (!node.isDirectory())
+        {
+            std::string filename = node.name;
+            q.enqueue([&path, filename] {
+                File file(path, filename);
+                Bitmap bitmap(file, filename);
+            });
+        }
+    }
+
+    q.wait();
+
+    uint64 time1 = timer.us();
+    return time1 - time0;
+}
+
+// -----------------------------------------------------------------
+// main()
+// -----------------------------------------------------------------
+
+/*
+    usage: topology [jpeg folder]
+
+    The particle test reports the time for all frames; compare the policies
+    with the same number of workers. The "physical" policy decides the worker
+    count for the SMT comparison: N cores vs. N threads packed with compact.
+*/
+
+int main(int argc, const char* argv[])
+{
+    Topology topology;
+    topology.print();
+
+    Particles particles(particle_count);
+
+    printf("\nparticles: %d frames, %d particles\n", particle_frames, int(particle_count));
+    printf("  %-24s %7d ms\n", "ThreadPool", int(test_particles_threadpool(particles) / 1000));
+
+    const Placement placements[] = { Placement::PHYSICAL, Placement::COMPACT, Placement::SCATTER };
+    const size_t workers = getPlacement(topology, Placement::PHYSICAL).size();
+
+    for (Placement placement : placements)
+    {
+        PinnedPool pool(topology, getPlacement(topology, placement), workers);
+
+        std::string name = getPlacementName(placement);
+        printf("  %-24s %7d ms (%d workers)\n", name.c_str(),
+            int(test_particles(pool, particles, false) / 1000), int(pool.size()));
+
+        name += " + L3 affinity";
+        printf("  %-24s %7d ms\n", name.c_str(), int(test_particles(pool, particles, true) / 1000));
+    }
+
+    if (argc > 1)
+    {
+        Path path(argv[1]);
+
+        printf("\njpeg: %s\n", argv[1]);
+        printf("  %-24s %7d ms\n", "ThreadPool", int(test_jpeg_threadpool(path) / 1000));
+
+        for (Placement placement : placements)
+        {
+            PinnedPool pool(topology, getPlacement(topology, placement), topology.cpus.size());
+            printf("  %-24s %7d ms (%d workers)\n", getPlacementName(placement),
+                int(test_jpeg(pool, path) / 1000), int(pool.size()));
+        }
+    }
+}